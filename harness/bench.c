@@ -0,0 +1,237 @@
+/*
+ * harness/bench.c
+ *
+ * Runs write() and read() through udma.c against the mock dmaengine and
+ * reports the time per transfer and where it goes, for a range of sizes,
+ * with the pinned page cache off and on and with completions delivered
+ * inline or through the completion thread.
+ *
+ *   ./udma-bench [-n iterations] [-r MB/s] [-a log2 align] [-o offset] [-s size]... [-v]
+ */
+
+#include "kshim.h"
+#include "kshim_harness.h"
+#include <linux/udma.h>
+
+#include <getopt.h>
+#include <sys/mman.h>
+
+static struct device_node bench_node = { .name = "udma0", .full_name = "/udma0" };
+static struct platform_device bench_pdev = {
+    .name = "udma0",
+    .dev = { .init_name = "udma0", .of_node = &bench_node },
+};
+
+static const char * const phase_names[UDMA_LAT_PHASES] = {
+    "pin", "map", "hw", "wake", "unmap",
+};
+
+struct bench_cfg {
+    const char *name;
+    const char *pin_cache_kb;
+    const char *completion_thread;
+};
+
+static const struct bench_cfg cfgs[] = {
+    { "uncached",        "0",      "0" },
+    { "cached",          "262144", "0" },
+    { "cached+cthread",  "262144", "1" },
+};
+
+static void set_attr(struct udma_drvdata *p_info, const char *attr, const char *val)
+{
+    ssize_t rv = kshim_sysfs_store(p_info->kobj, attr, val);
+
+    if (rv < 0) {
+        fprintf(stderr, "%s/%s = %s: %zd\n", p_info->name, attr, val, rv);
+        exit(1);
+    }
+}
+
+// Median of one phase over all size classes, as a bucket upper bound in ns.
+static u64 phase_p50(struct udma_drvdata *p_info, unsigned int phase)
+{
+    u64 count[UDMA_LAT_BUCKETS] = { 0 };
+    u64 total = 0, seen = 0;
+    unsigned int cls, b;
+
+    for (cls = 0; cls < UDMA_LAT_SIZES; ++cls)
+        for (b = 0; b < UDMA_LAT_BUCKETS; ++b)
+            count[b] += p_info->lat->count[phase][cls][b];
+    for (b = 0; b < UDMA_LAT_BUCKETS; ++b)
+        total += count[b];
+    if (!total)
+        return 0;
+
+    for (b = 0; b < UDMA_LAT_BUCKETS; ++b) {
+        seen += count[b];
+        if (seen * 2 >= total)
+            break;
+    }
+    return b ? 1ULL << b : 0;
+}
+
+// RX must have filled exactly [buf, buf + size) with the mock engine's pattern.
+static void check_rx(const unsigned char *buf, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; ++i) {
+        if (buf[i] != 0xa5) {
+            fprintf(stderr, "rx of %zu bytes at %p: byte %zu not received\n", size, buf, i);
+            exit(1);
+        }
+    }
+    if (buf[-1] != 0x5a || buf[size] != 0x5a) {
+        fprintf(stderr, "rx of %zu bytes at %p: wrote outside the buffer\n", size, buf);
+        exit(1);
+    }
+}
+
+static void run(struct udma_file *p_file, struct udma_drvdata *p_info, const struct bench_cfg *cfg,
+                char *buf, size_t size, unsigned int iterations)
+{
+    const bool rx = p_info->dir == UDMA_DEV_TO_CPU;
+    struct kshim_stats before;
+    unsigned int i, phase;
+    loff_t pos = 0;
+    u64 start, ns;
+
+    set_attr(p_info, "pin_cache_kb", cfg->pin_cache_kb);
+    set_attr(p_info, "completion_thread", cfg->completion_thread);
+    memset(p_info->lat, 0, sizeof(*p_info->lat));
+    memset(buf - 1, 0x5a, size + 2);
+
+    // One untimed round, so the cached runs measure hits.
+    if ((rx ? udma_read(p_file, buf, size, &pos) : udma_write(p_file, buf, size, &pos, 0)) != (ssize_t)size) {
+        fprintf(stderr, "%s of %zu bytes failed\n", rx ? "read" : "write", size);
+        exit(1);
+    }
+    memset(p_info->lat, 0, sizeof(*p_info->lat));
+    before = kshim_stats;
+
+    start = ktime_get_ns();
+    for (i = 0; i < iterations; ++i) {
+        ssize_t rv = rx ? udma_read(p_file, buf, size, &pos) : udma_write(p_file, buf, size, &pos, 0);
+
+        if (rv != (ssize_t)size) {
+            fprintf(stderr, "%s of %zu bytes returned %zd\n", rx ? "read" : "write", size, rv);
+            exit(1);
+        }
+    }
+    ns = ktime_get_ns() - start;
+    if (rx)
+        check_rx((unsigned char *)buf, size);
+
+    printf("%-3s %-15s %8zu %9llu %8.1f %5.2f %5.2f",
+           rx ? "rx" : "tx", cfg->name, size, ns / iterations,
+           (double)size * iterations * 1000 / ns,
+           (double)(kshim_stats.gup_calls - before.gup_calls) / iterations,
+           (double)(kshim_stats.map_calls - before.map_calls) / iterations);
+    for (phase = 0; phase < UDMA_LAT_PHASES; ++phase)
+        printf(" %8llu", phase_p50(p_info, phase));
+    printf("\n");
+
+    // Leave the next configuration a cold cache.
+    set_attr(p_info, "pin_cache_kb", "0");
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: udma-bench [-n iterations] [-r MB/s] [-a log2 align] [-o offset] [-s size]... [-v]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t default_sizes[] = { 4096, 65536, 1 << 20 };
+    size_t sizes[16];
+    unsigned int num_sizes = 0;
+    unsigned int iterations = 0;
+    struct udma_file *p_file;
+    size_t max_size = 0;
+    size_t offset = 0;
+    unsigned int s, c;
+    char *buf;
+    int opt;
+    int rv;
+
+    while ((opt = getopt(argc, argv, "n:r:a:o:s:v")) != -1) {
+        switch (opt) {
+        case 'a':
+            kshim_dma_copy_align = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            offset = strtoul(optarg, NULL, 0) % PAGE_SIZE;
+            break;
+        case 'n':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            kshim_dma_mb_per_s = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            if (num_sizes == ARRAY_SIZE(sizes))
+                usage();
+            sizes[num_sizes++] = strtoul(optarg, NULL, 0);
+            break;
+        case 'v':
+            kshim_loglevel = 8;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (!num_sizes) {
+        memcpy(sizes, default_sizes, sizeof(default_sizes));
+        num_sizes = ARRAY_SIZE(default_sizes);
+    }
+    for (s = 0; s < num_sizes; ++s) {
+        if (!sizes[s])
+            usage();
+        max_size = max(max_size, sizes[s]);
+    }
+
+    if ((rv = check_udma(&bench_pdev)) <= 0) {
+        fprintf(stderr, "check_udma() returned %d\n", rv);
+        return 1;
+    }
+    p_file = udma_open(&bench_pdev.dev);
+    if (IS_ERR_OR_NULL(p_file)) {
+        fprintf(stderr, "udma_open() failed\n");
+        return 1;
+    }
+
+    // Touched, like a buffer a real user would reuse, and page aligned plus
+    // offset, with a guard page in front.
+    buf = mmap(NULL, max_size + 2 * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+        return 1;
+    memset(buf, 0x5a, max_size + 2 * PAGE_SIZE);
+
+    printf("dir config              size  ns/xfer     MB/s   gup   map");
+    for (c = 0; c < UDMA_LAT_PHASES; ++c)
+        printf(" %8s", phase_names[c]);
+    printf("\n");
+
+    for (s = 0; s < num_sizes; ++s) {
+        // Roughly 256 MB per run unless told otherwise, and at least 200 transfers.
+        const unsigned int n = iterations ? iterations : max(200UL, (256UL << 20) / sizes[s]);
+
+        for (c = 0; c < ARRAY_SIZE(cfgs); ++c) {
+            run(p_file, p_file->tx, &cfgs[c], buf + PAGE_SIZE + offset, sizes[s], n);
+            run(p_file, p_file->rx, &cfgs[c], buf + PAGE_SIZE + offset, sizes[s], n);
+        }
+    }
+
+    udma_release(p_file);
+    teardown_udma(&bench_pdev);
+    kshim_devres_release_all(&bench_pdev.dev);
+    munmap(buf, max_size + 2 * PAGE_SIZE);
+
+    if (kshim_stats.pages_live) {
+        fprintf(stderr, "%lu pages still pinned after teardown\n", kshim_stats.pages_live);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,816 @@
+/*
+ * harness/include/kshim.h
+ *
+ * Just enough of the kernel API for udma.c to build as a userspace object.
+ * Every <linux/...> and <asm/...> header udma.c includes resolves to this
+ * file. What the transfer path runs through is implemented in kshim.c
+ * (locks, completions, page pinning, scatterlists, DMA mapping, a mock
+ * dmaengine); the rest is only declared, and whatever of it ends up linked
+ * aborts when called (unimpl.c).
+ */
+
+#ifndef KSHIM_H
+#define KSHIM_H
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <signal.h>
+
+// libc has its own ideas about these
+#define sched_setscheduler kshim_sched_setscheduler
+
+typedef uint8_t u8; typedef uint16_t u16; typedef uint32_t u32; typedef unsigned long long u64;
+typedef int8_t s8; typedef int16_t s16; typedef int32_t s32; typedef long long s64;
+typedef u8 __u8; typedef u16 __u16; typedef u32 __u32; typedef u64 __u64;
+typedef s8 __s8; typedef s16 __s16; typedef s32 __s32; typedef s64 __s64;
+typedef u16 __be16; typedef u32 __be32;
+typedef unsigned int gfp_t;
+typedef u64 dma_addr_t; typedef u64 phys_addr_t; typedef s64 ktime_t;
+typedef int dma_cookie_t; typedef unsigned int fmode_t;
+#define U32_MAX ((u32)~0U)
+#define U64_MAX ((u64)~0ULL)
+#define S32_MAX ((s32)(U32_MAX >> 1))
+#define S32_MIN ((s32)(-S32_MAX - 1))
+typedef struct { unsigned long pgprot; } pgprot_t;
+typedef int irqreturn_t;
+typedef struct { unsigned long bits[1]; } cpumask_t;
+
+#define __user
+#define __iomem
+#define __percpu
+#define __init
+#define __exit
+#define __rcu
+#define __must_check
+#undef __always_inline
+#define __always_inline inline
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define KBUILD_MODNAME "udma"
+#define KERN_EMERG "\0010"
+#define KERN_ALERT "\0011"
+#define KERN_ERR "\0013"
+#define KERN_WARNING "\0014"
+#define KERN_NOTICE "\0015"
+#define KERN_INFO "\0016"
+#define KERN_DEBUG "\0017"
+int printk(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+#define pr_err(...) printk(KERN_ERR __VA_ARGS__)
+#define pr_warn(...) printk(KERN_WARNING __VA_ARGS__)
+#define pr_info(...) printk(KERN_INFO __VA_ARGS__)
+#define pr_debug(...) printk(KERN_DEBUG __VA_ARGS__)
+
+#define LINUX_VERSION_CODE KERNEL_VERSION(4,9,0)
+#define KERNEL_VERSION(a,b,c) (((a) << 16) + ((b) << 8) + (c))
+#define CONFIG_OF 1
+#define CONFIG_MMU_NOTIFIER 1
+#define HZ 1000
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+#define PAGE_MASK (~(PAGE_SIZE-1))
+#define PAGE_ALIGN(x) (((x)+PAGE_SIZE-1)&PAGE_MASK)
+#define offset_in_page(p) ((unsigned long)(p) & ~PAGE_MASK)
+#define ALIGN(x,a) (((x)+(a)-1)&~((typeof(x))(a)-1))
+#define IS_ALIGNED(x,a) (((x) & ((typeof(x))(a) - 1)) == 0)
+#define DIV_ROUND_UP(n,d) (((n) + (d) - 1) / (d))
+#define BUG_ON(x) do { if (x) { fprintf(stderr, "BUG at %s:%d\n", __FILE__, __LINE__); abort(); } } while (0)
+#define BUG() BUG_ON(1)
+#define WARN_ON(x) ({ int __w = !!(x); if (__w) fprintf(stderr, "WARNING at %s:%d\n", __FILE__, __LINE__); __w; })
+#define WARN_ON_ONCE(x) WARN_ON(x)
+#define BUILD_BUG_ON(x) ((void)sizeof(char[1 - 2*!!(x)]))
+#define ARRAY_SIZE(a) (sizeof(a)/sizeof((a)[0]))
+#define min(a,b) ({ typeof(a) __a = (a); typeof(b) __b = (b); __a < __b ? __a : __b; })
+#define max(a,b) ({ typeof(a) __a = (a); typeof(b) __b = (b); __a > __b ? __a : __b; })
+#define min_t(t,a,b) min((t)(a), (t)(b))
+#define max_t(t,a,b) max((t)(a), (t)(b))
+#define clamp_t(t,v,lo,hi) min_t(t, max_t(t, v, lo), hi)
+#define clamp(v,lo,hi) min(max(v,lo),hi)
+#define swap(a,b) do { typeof(a) __t = (a); (a) = (b); (b) = __t; } while (0)
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define READ_ONCE(x) (*(volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x,v) (*(volatile typeof(x) *)&(x) = (v))
+#define ACCESS_ONCE(x) READ_ONCE(x)
+#define __stringify_1(x) #x
+#define __stringify(x) __stringify_1(x)
+
+#define EXPORT_SYMBOL_GPL(x) extern int __kshim_ksym_##x
+#define EXPORT_SYMBOL(x) extern int __kshim_ksym_##x
+#define MODULE_LICENSE(x) extern int __kshim_modinfo
+#define MODULE_AUTHOR(x) extern int __kshim_modinfo
+#define MODULE_DESCRIPTION(x) extern int __kshim_modinfo
+#define MODULE_ALIAS(x) extern int __kshim_modinfo
+#define MODULE_DEVICE_TABLE(a,b) extern int __kshim_modinfo
+#define MODULE_PARM_DESC(a,b) extern int __kshim_modinfo
+#define module_param(n,t,p) extern int __kshim_modinfo
+#define module_param_named(n,v,t,p) extern int __kshim_modinfo
+#define module_init(x) extern int __kshim_modinfo
+#define module_exit(x) extern int __kshim_modinfo
+struct module;
+#define THIS_MODULE ((struct module *)0)
+
+#define S_IRUGO 0444
+#define S_IWUGO 0222
+#ifndef S_IRUSR
+#define S_IRUSR 0400
+#define S_IWUSR 0200
+#endif
+
+// errno values the kernel has and libc doesn't
+#define ERESTARTSYS 512
+#define EPROBE_DEFER 517
+#define MAX_ERRNO 4095
+#define IS_ERR_VALUE(x) ((unsigned long)(void *)(x) >= (unsigned long)-MAX_ERRNO)
+static inline void *ERR_PTR(long e) { return (void *)e; }
+static inline long PTR_ERR(const void *p) { return (long)p; }
+static inline bool IS_ERR(const void *p) { return IS_ERR_VALUE((unsigned long)p); }
+static inline bool IS_ERR_OR_NULL(const void *p) { return !p || IS_ERR(p); }
+
+#define GFP_KERNEL 0x01u
+#define GFP_ATOMIC 0x02u
+#define GFP_NOWAIT 0x04u
+#define GFP_DMA32 0x08u
+#define __GFP_ZERO 0x10u
+#define __GFP_NOWARN 0x20u
+#define __GFP_COMP 0x40u
+
+int scnprintf(char *buf, size_t size, const char *fmt, ...);
+int kstrtouint(const char *s, unsigned int base, unsigned int *res);
+int kstrtoint(const char *s, unsigned int base, int *res);
+int kstrtoul(const char *s, unsigned int base, unsigned long *res);
+int kstrtoull(const char *s, unsigned int base, unsigned long long *res);
+int kstrtobool(const char *s, bool *res);
+int sysfs_streq(const char *s1, const char *s2);
+static inline u64 div_u64(u64 dividend, u32 divisor) { return dividend / divisor; }
+static inline u64 div64_u64(u64 dividend, u64 divisor) { return dividend / divisor; }
+static inline int fls(unsigned int x) { return x ? 32 - __builtin_clz(x) : 0; }
+static inline int fls64(u64 x) { return x ? 64 - __builtin_clzll(x) : 0; }
+static inline int ilog2(unsigned long x) { return 63 - __builtin_clzl(x); }
+static inline bool is_power_of_2(unsigned long n) { return n && !(n & (n - 1)); }
+static inline unsigned long roundup_pow_of_two(unsigned long n) { return n <= 1 ? 1 : 1UL << (ilog2(n - 1) + 1); }
+
+/* ioctl */
+#define _IOC(d,t,n,s) ((unsigned int)(((d)<<30)|((t)<<8)|(n)|((s)<<16)))
+#define _IO(t,n) _IOC(0,t,n,0)
+#define _IOR(t,n,s) _IOC(2,t,n,sizeof(s))
+#define _IOW(t,n,s) _IOC(1,t,n,sizeof(s))
+#define _IOWR(t,n,s) _IOC(3,t,n,sizeof(s))
+
+/* list */
+struct list_head { struct list_head *next, *prev; };
+#define LIST_HEAD_INIT(n) { &(n), &(n) }
+#define LIST_HEAD(n) struct list_head n = LIST_HEAD_INIT(n)
+static inline void INIT_LIST_HEAD(struct list_head *l) { l->next = l; l->prev = l; }
+static inline void __list_add(struct list_head *n, struct list_head *prev, struct list_head *next)
+{ next->prev = n; n->next = next; n->prev = prev; prev->next = n; }
+static inline void list_add(struct list_head *n, struct list_head *h) { __list_add(n, h, h->next); }
+static inline void list_add_tail(struct list_head *n, struct list_head *h) { __list_add(n, h->prev, h); }
+static inline void __list_del(struct list_head *e) { e->next->prev = e->prev; e->prev->next = e->next; }
+static inline void list_del(struct list_head *e) { __list_del(e); e->next = e->prev = NULL; }
+static inline void list_del_init(struct list_head *e) { __list_del(e); INIT_LIST_HEAD(e); }
+static inline void list_move(struct list_head *e, struct list_head *h) { __list_del(e); list_add(e, h); }
+static inline void list_move_tail(struct list_head *e, struct list_head *h) { __list_del(e); list_add_tail(e, h); }
+static inline int list_empty(const struct list_head *h) { return h->next == h; }
+static inline void list_splice_tail_init(struct list_head *l, struct list_head *h)
+{ if (!list_empty(l)) { l->next->prev = h->prev; h->prev->next = l->next; l->prev->next = h; h->prev = l->prev; INIT_LIST_HEAD(l); } }
+static inline void list_splice_init(struct list_head *l, struct list_head *h)
+{ if (!list_empty(l)) { struct list_head *f = l->next, *b = l->prev, *n = h->next; f->prev = h; h->next = f; b->next = n; n->prev = b; INIT_LIST_HEAD(l); } }
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) list_entry((ptr)->next, type, member)
+#define list_last_entry(ptr, type, member) list_entry((ptr)->prev, type, member)
+#define list_first_entry_or_null(ptr, type, member) (list_empty(ptr) ? NULL : list_first_entry(ptr, type, member))
+#define list_next_entry(pos, member) list_entry((pos)->member.next, typeof(*(pos)), member)
+#define list_for_each_entry(pos, head, member) for (pos = list_first_entry(head, typeof(*pos), member); &pos->member != (head); pos = list_next_entry(pos, member))
+#define list_for_each_entry_safe(pos, n, head, member) for (pos = list_first_entry(head, typeof(*pos), member), n = list_next_entry(pos, member); &pos->member != (head); pos = n, n = list_next_entry(n, member))
+#define list_for_each_entry_rcu list_for_each_entry
+struct hlist_node { struct hlist_node *next, **pprev; };
+struct hlist_head { struct hlist_node *first; };
+struct rb_node { unsigned long c; struct rb_node *l, *r; };
+struct rb_root { struct rb_node *rb_node; };
+#define RB_ROOT (struct rb_root) { NULL, }
+
+/* atomics */
+typedef struct { int counter; } atomic_t;
+typedef struct { long counter; } atomic64_t;
+typedef struct { long counter; } atomic_long_t;
+#define ATOMIC_INIT(i) { (i) }
+#define smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_mb__before_atomic() smp_mb()
+#define smp_mb__after_atomic() smp_mb()
+#define smp_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define cmpxchg(p, o, n) __sync_val_compare_and_swap(p, o, n)
+#define xchg(p, n) __atomic_exchange_n(p, n, __ATOMIC_SEQ_CST)
+static inline int atomic_read(const atomic_t *v) { return __atomic_load_n(&v->counter, __ATOMIC_RELAXED); }
+static inline void atomic_set(atomic_t *v, int i) { __atomic_store_n(&v->counter, i, __ATOMIC_RELAXED); }
+static inline int atomic_add_return(int i, atomic_t *v) { return __atomic_add_fetch(&v->counter, i, __ATOMIC_SEQ_CST); }
+static inline int atomic_sub_return(int i, atomic_t *v) { return __atomic_sub_fetch(&v->counter, i, __ATOMIC_SEQ_CST); }
+static inline void atomic_add(int i, atomic_t *v) { atomic_add_return(i, v); }
+static inline void atomic_sub(int i, atomic_t *v) { atomic_sub_return(i, v); }
+static inline void atomic_inc(atomic_t *v) { atomic_add_return(1, v); }
+static inline void atomic_dec(atomic_t *v) { atomic_sub_return(1, v); }
+static inline int atomic_inc_return(atomic_t *v) { return atomic_add_return(1, v); }
+static inline int atomic_dec_return(atomic_t *v) { return atomic_sub_return(1, v); }
+static inline int atomic_dec_and_test(atomic_t *v) { return atomic_sub_return(1, v) == 0; }
+static inline int atomic_cmpxchg(atomic_t *v, int o, int n) { return __sync_val_compare_and_swap(&v->counter, o, n); }
+static inline int atomic_xchg(atomic_t *v, int n) { return __atomic_exchange_n(&v->counter, n, __ATOMIC_SEQ_CST); }
+static inline int atomic_inc_not_zero(atomic_t *v)
+{ int c = atomic_read(v); while (c && !__atomic_compare_exchange_n(&v->counter, &c, c + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) ; return c != 0; }
+static inline long atomic64_read(const atomic64_t *v) { return __atomic_load_n(&v->counter, __ATOMIC_RELAXED); }
+static inline void atomic64_set(atomic64_t *v, long i) { __atomic_store_n(&v->counter, i, __ATOMIC_RELAXED); }
+static inline long atomic64_add_return(long i, atomic64_t *v) { return __atomic_add_fetch(&v->counter, i, __ATOMIC_SEQ_CST); }
+static inline void atomic64_add(long i, atomic64_t *v) { atomic64_add_return(i, v); }
+static inline void atomic64_sub(long i, atomic64_t *v) { atomic64_add_return(-i, v); }
+static inline void atomic64_inc(atomic64_t *v) { atomic64_add_return(1, v); }
+static inline long atomic64_cmpxchg(atomic64_t *v, long o, long n) { return __sync_val_compare_and_swap(&v->counter, o, n); }
+static inline long atomic_long_read(const atomic_long_t *v) { return __atomic_load_n(&v->counter, __ATOMIC_RELAXED); }
+static inline void atomic_long_set(atomic_long_t *v, long i) { __atomic_store_n(&v->counter, i, __ATOMIC_RELAXED); }
+static inline long atomic_long_add_return(long i, atomic_long_t *v) { return __atomic_add_fetch(&v->counter, i, __ATOMIC_SEQ_CST); }
+static inline void atomic_long_add(long i, atomic_long_t *v) { atomic_long_add_return(i, v); }
+static inline void atomic_long_sub(long i, atomic_long_t *v) { atomic_long_add_return(-i, v); }
+
+/* locks: every sleeping or spinning lock is a pthread mutex */
+typedef struct { pthread_mutex_t m; } spinlock_t;
+typedef spinlock_t raw_spinlock_t;
+#define __SPIN_LOCK_UNLOCKED(x) { PTHREAD_MUTEX_INITIALIZER }
+#define DEFINE_SPINLOCK(x) spinlock_t x = __SPIN_LOCK_UNLOCKED(x)
+static inline void spin_lock_init(spinlock_t *l) { pthread_mutex_init(&l->m, NULL); }
+static inline void spin_lock(spinlock_t *l) { pthread_mutex_lock(&l->m); }
+static inline void spin_unlock(spinlock_t *l) { pthread_mutex_unlock(&l->m); }
+#define spin_lock_irq spin_lock
+#define spin_unlock_irq spin_unlock
+#define spin_lock_bh spin_lock
+#define spin_unlock_bh spin_unlock
+#define spin_lock_irqsave(l, f) ((f) = 0, spin_lock(l))
+#define spin_unlock_irqrestore(l, f) ((void)(f), spin_unlock(l))
+#define local_irq_save(f) ((f) = 0)
+#define local_irq_restore(f) ((void)(f))
+
+struct mutex { pthread_mutex_t m; };
+#define DEFINE_MUTEX(n) struct mutex n = { PTHREAD_MUTEX_INITIALIZER }
+static inline void mutex_init(struct mutex *l) { pthread_mutex_init(&l->m, NULL); }
+static inline void mutex_lock(struct mutex *l) { pthread_mutex_lock(&l->m); }
+static inline void mutex_unlock(struct mutex *l) { pthread_mutex_unlock(&l->m); }
+static inline int mutex_lock_interruptible(struct mutex *l) { mutex_lock(l); return 0; }
+static inline int mutex_trylock(struct mutex *l) { return pthread_mutex_trylock(&l->m) == 0; }
+static inline void mutex_destroy(struct mutex *l) { pthread_mutex_destroy(&l->m); }
+
+struct semaphore { pthread_mutex_t m; pthread_cond_t c; int count; };
+void sema_init(struct semaphore *, int);
+#define DEFINE_SEMAPHORE(n) struct semaphore n = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 1 }
+void down(struct semaphore *);
+int down_interruptible(struct semaphore *);
+int down_trylock(struct semaphore *);
+int down_timeout(struct semaphore *, long);
+void up(struct semaphore *);
+
+struct rw_semaphore { pthread_rwlock_t l; };
+static inline void init_rwsem(struct rw_semaphore *s) { pthread_rwlock_init(&s->l, NULL); }
+static inline void down_read(struct rw_semaphore *s) { pthread_rwlock_rdlock(&s->l); }
+static inline void up_read(struct rw_semaphore *s) { pthread_rwlock_unlock(&s->l); }
+static inline void down_write(struct rw_semaphore *s) { pthread_rwlock_wrlock(&s->l); }
+static inline void up_write(struct rw_semaphore *s) { pthread_rwlock_unlock(&s->l); }
+
+struct kref { atomic_t refcount; };
+static inline void kref_init(struct kref *k) { atomic_set(&k->refcount, 1); }
+static inline void kref_get(struct kref *k) { atomic_inc(&k->refcount); }
+static inline int kref_put(struct kref *k, void (*release)(struct kref *))
+{ if (atomic_dec_and_test(&k->refcount)) { release(k); return 1; } return 0; }
+static inline int kref_get_unless_zero(struct kref *k) { return atomic_inc_not_zero(&k->refcount); }
+#define rcu_read_lock() do { } while (0)
+#define rcu_read_unlock() do { } while (0)
+#define synchronize_rcu() do { } while (0)
+#define rcu_dereference(p) READ_ONCE(p)
+#define rcu_assign_pointer(p, v) smp_store_release(&(p), v)
+#define RCU_INIT_POINTER(p, v) ((p) = (v))
+
+/* bits */
+#define BIT(n) (1UL << (n))
+#define BITS_PER_LONG 64
+#define DECLARE_BITMAP(name, bits) unsigned long name[((bits)+BITS_PER_LONG-1)/BITS_PER_LONG]
+static inline void set_bit(long nr, volatile unsigned long *a) { __atomic_or_fetch(&a[nr / BITS_PER_LONG], BIT(nr % BITS_PER_LONG), __ATOMIC_SEQ_CST); }
+static inline void clear_bit(long nr, volatile unsigned long *a) { __atomic_and_fetch(&a[nr / BITS_PER_LONG], ~BIT(nr % BITS_PER_LONG), __ATOMIC_SEQ_CST); }
+static inline int test_bit(long nr, const volatile unsigned long *a) { return (a[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG)) & 1; }
+static inline int test_and_set_bit(long nr, volatile unsigned long *a) { return (__atomic_fetch_or(&a[nr / BITS_PER_LONG], BIT(nr % BITS_PER_LONG), __ATOMIC_SEQ_CST) >> (nr % BITS_PER_LONG)) & 1; }
+static inline int test_and_clear_bit(long nr, volatile unsigned long *a) { return (__atomic_fetch_and(&a[nr / BITS_PER_LONG], ~BIT(nr % BITS_PER_LONG), __ATOMIC_SEQ_CST) >> (nr % BITS_PER_LONG)) & 1; }
+#define __test_and_set_bit test_and_set_bit
+#define __test_and_clear_bit test_and_clear_bit
+
+/* time */
+#define jiffies kshim_jiffies()
+unsigned long kshim_jiffies(void);
+static inline unsigned long msecs_to_jiffies(unsigned int ms) { return ms; }
+static inline unsigned long usecs_to_jiffies(unsigned int us) { return DIV_ROUND_UP(us, 1000); }
+static inline unsigned int jiffies_to_msecs(unsigned long j) { return j; }
+#define MAX_SCHEDULE_TIMEOUT LONG_MAX
+#define time_after(a,b) ((long)((b)-(a)) < 0)
+#define time_before(a,b) time_after(b,a)
+#define NSEC_PER_SEC 1000000000L
+#define NSEC_PER_MSEC 1000000L
+#define NSEC_PER_USEC 1000L
+#define USEC_PER_SEC 1000000L
+#define MSEC_PER_SEC 1000L
+u64 ktime_get_ns(void);
+static inline ktime_t ktime_get(void) { return ktime_get_ns(); }
+static inline s64 ktime_to_ns(ktime_t t) { return t; }
+static inline s64 ktime_to_us(ktime_t t) { return t / 1000; }
+static inline ktime_t ktime_sub(ktime_t a, ktime_t b) { return a - b; }
+static inline ktime_t ktime_add_ns(ktime_t t, u64 ns) { return t + ns; }
+static inline ktime_t ns_to_ktime(u64 ns) { return ns; }
+static inline s64 ktime_us_delta(ktime_t a, ktime_t b) { return (a - b) / 1000; }
+static inline ktime_t ktime_set(s64 s, unsigned long ns) { return s * NSEC_PER_SEC + ns; }
+#define local_clock ktime_get_ns
+void msleep(unsigned int); void usleep_range(unsigned long, unsigned long); void udelay(unsigned long);
+#define cpu_relax() __builtin_ia32_pause_or_nothing()
+static inline void __builtin_ia32_pause_or_nothing(void) { }
+void cond_resched(void);
+
+/* hrtimers fire from a thread of their own, see kshim.c; timer_list is declared only */
+enum hrtimer_restart { HRTIMER_NORESTART, HRTIMER_RESTART };
+enum hrtimer_mode { HRTIMER_MODE_ABS = 0, HRTIMER_MODE_REL = 1, HRTIMER_MODE_PINNED = 2 };
+struct hrtimer { enum hrtimer_restart (*function)(struct hrtimer *); struct list_head node; u64 expires; };
+void hrtimer_init(struct hrtimer *, int clock_id, enum hrtimer_mode);
+void hrtimer_start(struct hrtimer *, ktime_t, const enum hrtimer_mode);
+int hrtimer_cancel(struct hrtimer *); int hrtimer_active(const struct hrtimer *);
+u64 hrtimer_forward_now(struct hrtimer *, ktime_t);
+struct timer_list { unsigned long expires; void (*function)(unsigned long); unsigned long data; };
+void setup_timer(struct timer_list *, void (*fn)(unsigned long), unsigned long);
+int mod_timer(struct timer_list *, unsigned long); int del_timer_sync(struct timer_list *);
+
+/* tasks */
+struct mm_struct { struct rw_semaphore mmap_sem; atomic_t mm_count; };
+struct task_struct { int pid; char comm[16]; struct mm_struct *mm; };
+struct task_struct *kshim_current(void);
+#define current kshim_current()
+static inline int signal_pending(struct task_struct *t) { return 0; }
+static inline int fatal_signal_pending(struct task_struct *t) { return 0; }
+#define TASK_RUNNING 0
+#define TASK_INTERRUPTIBLE 1
+#define TASK_UNINTERRUPTIBLE 2
+void set_current_state(int); void __set_current_state(int);
+void schedule(void); long schedule_timeout(long); long schedule_timeout_interruptible(long);
+int wake_up_process(struct task_struct *);
+#define SCHED_NORMAL 0
+#define MAX_RT_PRIO 100
+#define MAX_USER_RT_PRIO 100
+int kshim_sched_setscheduler(struct task_struct *, int, const struct sched_param *);
+int sched_setscheduler_nocheck(struct task_struct *, int, const struct sched_param *);
+void set_user_nice(struct task_struct *, long);
+static inline int raw_smp_processor_id(void) { return 0; }
+#define smp_processor_id raw_smp_processor_id
+#define get_cpu() 0
+#define put_cpu() do { } while (0)
+#define nr_cpu_ids 1U
+static inline int cpu_online(unsigned int cpu) { return cpu == 0; }
+static inline int cpu_possible(unsigned int cpu) { return cpu == 0; }
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define for_each_online_cpu(cpu) for_each_possible_cpu(cpu)
+#define preempt_disable() do { } while (0)
+#define preempt_enable() do { } while (0)
+#define local_bh_disable() do { } while (0)
+#define local_bh_enable() do { } while (0)
+struct task_struct *kthread_create_on_node(int (*fn)(void *), void *data, int node, const char fmt[], ...);
+struct task_struct *kthread_create(int (*fn)(void *), void *data, const char fmt[], ...);
+#define kthread_run kthread_create
+void kthread_bind(struct task_struct *, unsigned int);
+int kthread_stop(struct task_struct *); bool kthread_should_stop(void);
+int set_cpus_allowed_ptr(struct task_struct *, const cpumask_t *);
+const cpumask_t *cpumask_of(int cpu);
+
+/* kthread workers run on pthreads; workqueues are declared only, there is
+ * no other CPU to queue work on */
+struct kthread_work;
+typedef void (*kthread_work_func_t)(struct kthread_work *);
+struct kthread_worker;
+struct kthread_work { struct list_head node; kthread_work_func_t func; struct kthread_worker *worker; };
+// A worker is a pthread draining a list of works.
+struct kthread_worker { struct task_struct *task; pthread_t thread; pthread_mutex_t m; pthread_cond_t c; struct list_head works; struct kthread_work *current_work; bool stop; };
+static inline void kthread_init_work(struct kthread_work *w, kthread_work_func_t f) { INIT_LIST_HEAD(&w->node); w->func = f; w->worker = NULL; }
+bool kthread_queue_work(struct kthread_worker *, struct kthread_work *);
+void kthread_flush_work(struct kthread_work *); void kthread_flush_worker(struct kthread_worker *);
+bool kthread_cancel_work_sync(struct kthread_work *);
+struct kthread_worker *kthread_create_worker(unsigned int flags, const char namefmt[], ...);
+struct kthread_worker *kthread_create_worker_on_cpu(int cpu, unsigned int flags, const char namefmt[], ...);
+void kthread_destroy_worker(struct kthread_worker *);
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *);
+struct work_struct { work_func_t func; };
+struct delayed_work { struct work_struct work; };
+struct workqueue_struct;
+extern struct workqueue_struct *system_wq, *system_highpri_wq, *system_unbound_wq;
+#define INIT_WORK(w, f) ((w)->func = (f))
+#define INIT_DELAYED_WORK(w, f) ((w)->work.func = (f))
+bool queue_work(struct workqueue_struct *, struct work_struct *);
+bool queue_work_on(int cpu, struct workqueue_struct *, struct work_struct *);
+bool schedule_work(struct work_struct *); bool cancel_work_sync(struct work_struct *);
+static inline bool flush_work(struct work_struct *w) { return false; }
+bool schedule_delayed_work(struct delayed_work *, unsigned long); bool cancel_delayed_work_sync(struct delayed_work *);
+bool mod_delayed_work(struct workqueue_struct *, struct delayed_work *, unsigned long);
+struct workqueue_struct *alloc_workqueue(const char *fmt, unsigned int flags, int max_active, ...);
+void destroy_workqueue(struct workqueue_struct *); void flush_workqueue(struct workqueue_struct *);
+#define WQ_HIGHPRI 1
+#define WQ_UNBOUND 2
+#define WQ_MEM_RECLAIM 4
+struct tasklet_struct { void (*func)(unsigned long); unsigned long data; };
+void tasklet_init(struct tasklet_struct *, void (*)(unsigned long), unsigned long);
+void tasklet_schedule(struct tasklet_struct *); void tasklet_kill(struct tasklet_struct *);
+
+/* wait queues: a mutex, a condition variable and a counter of wakeups.
+ * The wait_event macros note the counter before they test the condition
+ * and only sleep while it hasn't moved, so no wakeup gets lost. */
+typedef struct { pthread_mutex_t m; pthread_cond_t c; unsigned int seq; } wait_queue_head_t;
+typedef struct { int unused; } wait_queue_t;
+#define DECLARE_WAITQUEUE(n, t) wait_queue_t n
+void init_waitqueue_head(wait_queue_head_t *);
+#define DECLARE_WAIT_QUEUE_HEAD(n) wait_queue_head_t n = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 }
+void wake_up_all(wait_queue_head_t *);
+#define wake_up wake_up_all
+#define wake_up_interruptible wake_up_all
+#define wake_up_interruptible_poll(wq, m) wake_up_all(wq)
+static inline int waitqueue_active(wait_queue_head_t *wq) { return 1; }
+void add_wait_queue(wait_queue_head_t *, wait_queue_t *); void remove_wait_queue(wait_queue_head_t *, wait_queue_t *);
+unsigned int kshim_wait_seq(wait_queue_head_t *wq);
+// Sleeps until wq is woken after seq was read, or until deadline_ns (0: none).
+void kshim_wait(wait_queue_head_t *wq, unsigned int seq, u64 deadline_ns);
+#define __kshim_wait_event(wq, cond, t, unlock, relock) ({                  \
+        const bool __forever = (long)(t) == MAX_SCHEDULE_TIMEOUT;           \
+        const u64 __end = __forever ? 0 : ktime_get_ns() + (u64)(t) * NSEC_PER_MSEC; \
+        long __left = (t);                                                  \
+        for (;;) {                                                          \
+            unsigned int __seq = kshim_wait_seq(&(wq));                     \
+            if (cond)                                                       \
+                break;                                                      \
+            if (!__forever && ktime_get_ns() >= __end) { __left = 0; break; } \
+            unlock; kshim_wait(&(wq), __seq, __end); relock;                \
+        }                                                                   \
+        if (__left && !__forever) {                                         \
+            u64 __now = ktime_get_ns();                                     \
+            __left = __now < __end ? (long)DIV_ROUND_UP(__end - __now, NSEC_PER_MSEC) : 1; \
+        }                                                                   \
+        __left; })
+#define wait_event_timeout(wq, cond, t) __kshim_wait_event(wq, cond, t, , )
+#define wait_event(wq, cond) ((void)wait_event_timeout(wq, cond, MAX_SCHEDULE_TIMEOUT))
+#define wait_event_interruptible(wq, cond) (wait_event(wq, cond), 0)
+#define wait_event_interruptible_timeout(wq, cond, t) wait_event_timeout(wq, cond, t)
+#define wait_event_interruptible_lock_irq(wq, cond, lock) \
+        ((void)__kshim_wait_event(wq, cond, MAX_SCHEDULE_TIMEOUT, spin_unlock(&(lock)), spin_lock(&(lock))), 0)
+#define wait_event_interruptible_lock_irq_timeout(wq, cond, lock, t) \
+        __kshim_wait_event(wq, cond, t, spin_unlock(&(lock)), spin_lock(&(lock)))
+
+struct completion { unsigned int done; wait_queue_head_t wait; bool kshim_inited; };
+void init_completion(struct completion *);
+#define reinit_completion(x) ((x)->done = 0)
+void complete(struct completion *); void complete_all(struct completion *);
+void wait_for_completion(struct completion *);
+long wait_for_completion_interruptible(struct completion *);
+long wait_for_completion_interruptible_timeout(struct completion *, unsigned long);
+unsigned long wait_for_completion_timeout(struct completion *, unsigned long);
+bool completion_done(struct completion *); bool try_wait_for_completion(struct completion *);
+
+/* percpu: there is one CPU */
+#define alloc_percpu(type) ((type __percpu *)calloc(1, sizeof(type)))
+#define free_percpu(p) free(p)
+#define per_cpu_ptr(ptr, cpu) ((void)(cpu), (ptr))
+#define this_cpu_ptr(ptr) (ptr)
+#define get_cpu_ptr(ptr) (ptr)
+#define put_cpu_ptr(ptr) ((void)(ptr))
+#define this_cpu_inc(x) ((x)++)
+#define this_cpu_add(x, v) ((x) += (v))
+#define this_cpu_read(x) (x)
+#define DEFINE_PER_CPU(t, n) t n
+#define per_cpu(v, cpu) (v)
+
+/* memory */
+static inline void *kmalloc(size_t n, gfp_t f) { return (f & __GFP_ZERO) ? calloc(1, n) : malloc(n); }
+static inline void *kzalloc(size_t n, gfp_t f) { return calloc(1, n); }
+static inline void *kcalloc(size_t n, size_t s, gfp_t f) { return calloc(n, s); }
+static inline void *kmalloc_array(size_t n, size_t s, gfp_t f) { return calloc(n, s); }
+static inline void kfree(const void *p) { free((void *)p); }
+static inline void *krealloc(const void *p, size_t n, gfp_t f) { return realloc((void *)p, n); }
+#define vmalloc(n) malloc(n)
+#define vzalloc(n) calloc(1, n)
+#define vfree(p) free((void *)(p))
+#define kvmalloc kmalloc
+#define kvfree kfree
+struct kmem_cache;
+
+/* A struct page stands for one page of the process' memory. */
+struct page { void *addr; atomic_t refs; bool dirty; };
+struct address_space;
+struct vm_area_struct { unsigned long vm_start, vm_end, vm_pgoff, vm_flags; pgprot_t vm_page_prot; const struct vm_operations_struct *vm_ops; void *vm_private_data; struct file *vm_file; struct mm_struct *vm_mm; };
+struct vm_fault { unsigned long pgoff; struct page *page; void *virtual_address; unsigned int flags; };
+struct vm_operations_struct { void (*open)(struct vm_area_struct *); void (*close)(struct vm_area_struct *); int (*fault)(struct vm_area_struct *, struct vm_fault *); int (*access)(struct vm_area_struct *, unsigned long, void *, int, int); };
+int generic_access_phys(struct vm_area_struct *, unsigned long, void *, int, int);
+#define VM_DONTEXPAND 1UL
+#define VM_DONTDUMP 2UL
+#define VM_DONTCOPY 4UL
+#define VM_MIXEDMAP 8UL
+#define VM_IO 16UL
+#define VM_PFNMAP 32UL
+#define VM_SHARED 64UL
+#define VM_WRITE 128UL
+#define VM_READ 256UL
+#define VM_MAP 4
+#define VM_FAULT_SIGBUS 2
+#define VM_FAULT_OOM 1
+#define VM_FAULT_NOPAGE 256
+#define PAGE_KERNEL ((pgprot_t){0})
+pgprot_t pgprot_noncached(pgprot_t); pgprot_t pgprot_writecombine(pgprot_t);
+unsigned long vma_pages(struct vm_area_struct *);
+int vm_insert_page(struct vm_area_struct *, unsigned long, struct page *);
+int remap_pfn_range(struct vm_area_struct *, unsigned long, unsigned long, unsigned long, pgprot_t);
+struct page *alloc_page(gfp_t); struct page *alloc_pages(gfp_t, unsigned int);
+void __free_page(struct page *); void __free_pages(struct page *, unsigned int);
+int get_order(unsigned long);
+void get_page(struct page *); void put_page(struct page *);
+int set_page_dirty(struct page *);
+#define set_page_dirty_lock set_page_dirty
+static inline void *page_address(const struct page *p) { return p->addr; }
+struct page *virt_to_page(const void *); struct page *vmalloc_to_page(const void *);
+phys_addr_t page_to_phys(struct page *); unsigned long page_to_pfn(struct page *); struct page *pfn_to_page(unsigned long);
+static inline void *kmap(struct page *p) { return p->addr; }
+static inline void kunmap(struct page *p) { }
+static inline void *kmap_atomic(struct page *p) { return p->addr; }
+#define kunmap_atomic(a) ((void)(a))
+void *vmap(struct page **, unsigned int, unsigned long, pgprot_t); void vunmap(const void *);
+extern unsigned long totalram_pages;
+int get_user_pages_fast(unsigned long start, int nr_pages, int write, struct page **pages);
+#define mmgrab(mm) atomic_inc(&(mm)->mm_count)
+void mmdrop(struct mm_struct *);
+#define flush_dcache_page(p) ((void)(p))
+#define access_ok(t, a, s) true
+#define VERIFY_READ 0
+#define VERIFY_WRITE 1
+static inline unsigned long copy_from_user(void *to, const void __user *from, unsigned long n) { memcpy(to, from, n); return 0; }
+static inline unsigned long copy_to_user(void __user *to, const void *from, unsigned long n) { memcpy(to, from, n); return 0; }
+static inline unsigned long clear_user(void __user *to, unsigned long n) { memset(to, 0, n); return 0; }
+#define get_user(x, p) ((x) = *(p), 0)
+#define put_user(x, p) (*(p) = (x), 0)
+
+/* mmu notifier: registration works, nothing ever invalidates */
+struct mmu_notifier;
+struct mmu_notifier_ops {
+    void (*release)(struct mmu_notifier *mn, struct mm_struct *mm);
+    void (*invalidate_range_start)(struct mmu_notifier *mn, struct mm_struct *mm, unsigned long start, unsigned long end);
+    void (*invalidate_range_end)(struct mmu_notifier *mn, struct mm_struct *mm, unsigned long start, unsigned long end);
+    void (*invalidate_page)(struct mmu_notifier *mn, struct mm_struct *mm, unsigned long address);
+};
+struct mmu_notifier { struct hlist_node hlist; const struct mmu_notifier_ops *ops; };
+int mmu_notifier_register(struct mmu_notifier *, struct mm_struct *);
+void mmu_notifier_unregister(struct mmu_notifier *, struct mm_struct *);
+
+/* scatterlist: no chaining, the end mark is a flag */
+struct scatterlist { struct page *page; unsigned int offset; unsigned int length; dma_addr_t dma_address; unsigned int dma_length; bool end; };
+struct sg_table { struct scatterlist *sgl; unsigned int nents; unsigned int orig_nents; };
+#define sg_dma_address(sg) ((sg)->dma_address)
+#define sg_dma_len(sg) ((sg)->dma_length)
+int sg_alloc_table(struct sg_table *, unsigned int, gfp_t);
+void sg_free_table(struct sg_table *);
+void sg_init_table(struct scatterlist *, unsigned int);
+static inline void sg_set_page(struct scatterlist *sg, struct page *p, unsigned int len, unsigned int off)
+{ sg->page = p; sg->offset = off; sg->length = len; }
+static inline struct page *sg_page(struct scatterlist *sg) { return sg->page; }
+static inline struct scatterlist *sg_next(struct scatterlist *sg) { return sg->end ? NULL : sg + 1; }
+static inline void sg_mark_end(struct scatterlist *sg) { sg->end = true; }
+static inline void *sg_virt(struct scatterlist *sg) { return (char *)sg->page->addr + sg->offset; }
+static inline phys_addr_t sg_phys(struct scatterlist *sg) { return (phys_addr_t)(uintptr_t)sg_virt(sg); }
+void sg_set_buf(struct scatterlist *, const void *, unsigned int);
+void sg_init_one(struct scatterlist *, const void *, unsigned int);
+#define for_each_sg(sglist, sg, nr, __i) for (__i = 0, sg = (sglist); __i < (nr); __i++, sg = sg_next(sg))
+int sg_alloc_table_from_pages(struct sg_table *, struct page **, unsigned int, unsigned long, unsigned long, gfp_t);
+size_t sg_copy_from_buffer(struct scatterlist *, unsigned int, const void *, size_t);
+size_t sg_copy_to_buffer(struct scatterlist *, unsigned int, void *, size_t);
+
+/* DMA mapping: the bus address is the virtual address */
+enum dma_data_direction { DMA_BIDIRECTIONAL = 0, DMA_TO_DEVICE = 1, DMA_FROM_DEVICE = 2, DMA_NONE = 3 };
+#define DMA_BIT_MASK(n) (((n) == 64) ? ~0ULL : ((1ULL<<(n))-1))
+struct device;
+int dma_map_sg(struct device *, struct scatterlist *, int, enum dma_data_direction);
+void dma_unmap_sg(struct device *, struct scatterlist *, int, enum dma_data_direction);
+void dma_sync_sg_for_cpu(struct device *, struct scatterlist *, int, enum dma_data_direction);
+void dma_sync_sg_for_device(struct device *, struct scatterlist *, int, enum dma_data_direction);
+dma_addr_t dma_map_single(struct device *, void *, size_t, enum dma_data_direction);
+void dma_unmap_single(struct device *, dma_addr_t, size_t, enum dma_data_direction);
+dma_addr_t dma_map_page(struct device *, struct page *, size_t, size_t, enum dma_data_direction);
+void dma_unmap_page(struct device *, dma_addr_t, size_t, enum dma_data_direction);
+void dma_sync_single_for_cpu(struct device *, dma_addr_t, size_t, enum dma_data_direction);
+void dma_sync_single_for_device(struct device *, dma_addr_t, size_t, enum dma_data_direction);
+void dma_sync_single_range_for_cpu(struct device *, dma_addr_t, unsigned long, size_t, enum dma_data_direction);
+void dma_sync_single_range_for_device(struct device *, dma_addr_t, unsigned long, size_t, enum dma_data_direction);
+int dma_mapping_error(struct device *, dma_addr_t);
+void *dma_alloc_coherent(struct device *, size_t, dma_addr_t *, gfp_t);
+void dma_free_coherent(struct device *, size_t, void *, dma_addr_t);
+int dma_mmap_coherent(struct device *, struct vm_area_struct *, void *, dma_addr_t, size_t);
+int dma_set_mask_and_coherent(struct device *, u64); int dma_set_mask(struct device *, u64);
+int dma_set_coherent_mask(struct device *, u64); int dma_coerce_mask_and_coherent(struct device *, u64);
+u64 dma_get_mask(struct device *); u64 dma_get_required_mask(struct device *);
+// No dma-ranges: bus addresses are physical, which are virtual here.
+static inline dma_addr_t phys_to_dma(struct device *dev, phys_addr_t paddr) { return (dma_addr_t)paddr; }
+int dma_supported(struct device *, u64);
+
+/* device model: kobjects only keep their release, sysfs files don't exist */
+struct kobj_type;
+struct kobject { const char *name; struct kobject *parent; struct kobj_type *ktype; };
+struct attribute { const char *name; unsigned short mode; };
+struct attribute_group { const char *name; struct attribute **attrs; };
+struct sysfs_ops { ssize_t (*show)(struct kobject *, struct attribute *, char *); ssize_t (*store)(struct kobject *, struct attribute *, const char *, size_t); };
+struct kobj_type { void (*release)(struct kobject *); const struct sysfs_ops *sysfs_ops; struct attribute **default_attrs; };
+#define __ATTR(_name, _mode, _show, _store) { .attr = { .name = #_name, .mode = _mode }, .show = _show, .store = _store }
+#define __ATTR_RO(_name) __ATTR(_name, 0444, _name##_show, NULL)
+#define __ATTR_RW(_name) __ATTR(_name, 0644, _name##_show, _name##_store)
+void kobject_init(struct kobject *, struct kobj_type *);
+int kobject_add(struct kobject *, struct kobject *, const char *, ...);
+int kobject_init_and_add(struct kobject *, struct kobj_type *, struct kobject *, const char *, ...);
+struct kobject *kobject_create_and_add(const char *, struct kobject *);
+void kobject_put(struct kobject *);
+struct kobject *kobject_get(struct kobject *);
+int kobject_uevent(struct kobject *, int);
+#define KOBJ_ADD 0
+int sysfs_create_group(struct kobject *, const struct attribute_group *);
+void sysfs_remove_group(struct kobject *, const struct attribute_group *);
+
+/* Properties of the harness' device node are answered by kshim.c. */
+struct device_node { const char *name; const char *full_name; const char *compatible; };
+struct device_driver { const char *name; const void *pm; const void *of_match_table; int probe_type; struct module *owner; };
+struct device { struct kobject kobj; struct device *parent; struct device_node *of_node; u64 *dma_mask; u64 coherent_dma_mask; struct iommu_group *iommu_group; void *platform_data; struct device_driver *driver; const char *init_name; };
+static inline const char *dev_name(const struct device *d) { return d->init_name; }
+void *dev_get_drvdata(const struct device *); void dev_set_drvdata(struct device *, void *);
+#define dev_err(d, fmt, ...) printk(KERN_ERR "%s: " fmt, dev_name(d), ##__VA_ARGS__)
+#define dev_warn(d, fmt, ...) printk(KERN_WARNING "%s: " fmt, dev_name(d), ##__VA_ARGS__)
+#define dev_info(d, fmt, ...) printk(KERN_INFO "%s: " fmt, dev_name(d), ##__VA_ARGS__)
+#define dev_dbg(d, fmt, ...) printk(KERN_DEBUG "%s: " fmt, dev_name(d), ##__VA_ARGS__)
+void *devm_kzalloc(struct device *, size_t, gfp_t);
+static inline void *devm_kcalloc(struct device *d, size_t n, size_t s, gfp_t f) { return devm_kzalloc(d, n * s, f); }
+void devm_kfree(struct device *, const void *);
+struct device *get_device(struct device *); void put_device(struct device *);
+struct class;
+struct device *device_create(struct class *, struct device *, dev_t, void *, const char *, ...);
+void device_destroy(struct class *, dev_t);
+struct resource { u64 start, end; const char *name; unsigned long flags; };
+struct platform_device { const char *name; int id; struct device dev; u32 num_resources; struct resource *resource; };
+#define to_platform_device(x) container_of((x), struct platform_device, dev)
+void *platform_get_drvdata(const struct platform_device *); void platform_set_drvdata(struct platform_device *, void *);
+int of_property_read_string_index(const struct device_node *, const char *, int, const char **);
+int of_property_count_strings(const struct device_node *, const char *);
+int of_property_read_u32_index(const struct device_node *, const char *, u32, u32 *);
+int of_property_read_u32(const struct device_node *, const char *, u32 *);
+int of_property_count_u32_elems(const struct device_node *, const char *);
+bool of_property_read_bool(const struct device_node *, const char *);
+int of_device_is_compatible(const struct device_node *, const char *);
+#define MINORBITS 20
+#define MKDEV(ma,mi) (((ma) << MINORBITS) | (mi))
+#define MAJOR(d) ((d) >> MINORBITS)
+#define MINOR(d) ((d) & ((1U << MINORBITS) - 1))
+
+/* fs */
+struct inode { dev_t i_rdev; void *i_private; };
+struct file_operations;
+struct file { void *private_data; unsigned int f_flags; fmode_t f_mode; const struct file_operations *f_op; struct inode *f_inode; };
+struct file *fget(unsigned int); void fput(struct file *);
+struct poll_table_struct; typedef struct poll_table_struct poll_table;
+void poll_wait(struct file *, wait_queue_head_t *, poll_table *);
+#define POLLIN 0x1
+#define POLLOUT 0x4
+#define POLLERR 0x8
+#define POLLRDNORM 0x40
+#define POLLWRNORM 0x100
+struct pipe_inode_info;
+struct fasync_struct;
+struct kiocb;
+struct file_operations {
+    struct module *owner; loff_t (*llseek)(struct file *, loff_t, int);
+    ssize_t (*read)(struct file *, char __user *, size_t, loff_t *); ssize_t (*write)(struct file *, const char __user *, size_t, loff_t *);
+    unsigned int (*poll)(struct file *, struct poll_table_struct *);
+    long (*unlocked_ioctl)(struct file *, unsigned int, unsigned long);
+    int (*mmap)(struct file *, struct vm_area_struct *); int (*open)(struct inode *, struct file *);
+    int (*flush)(struct file *, void *id); int (*release)(struct inode *, struct file *);
+    int (*fsync)(struct file *, loff_t, loff_t, int datasync);
+    ssize_t (*splice_write)(struct pipe_inode_info *, struct file *, loff_t *, size_t, unsigned int);
+    ssize_t (*splice_read)(struct file *, loff_t *, struct pipe_inode_info *, size_t, unsigned int);
+};
+int fasync_helper(int, struct file *, int, struct fasync_struct **);
+void kill_fasync(struct fasync_struct **, int, int);
+int get_unused_fd_flags(unsigned flags); void put_unused_fd(unsigned int fd); void fd_install(unsigned int fd, struct file *);
+struct cdev { struct kobject kobj; struct module *owner; const struct file_operations *ops; };
+
+/* pipes and splice, declared only */
+struct pipe_buffer { struct page *page; unsigned int offset, len; const struct pipe_buf_operations *ops; unsigned int flags; unsigned long private; };
+struct pipe_buf_operations { int can_merge; int (*confirm)(struct pipe_inode_info *, struct pipe_buffer *); void (*release)(struct pipe_inode_info *, struct pipe_buffer *); int (*steal)(struct pipe_inode_info *, struct pipe_buffer *); void (*get)(struct pipe_inode_info *, struct pipe_buffer *); };
+struct pipe_inode_info { wait_queue_head_t wait; unsigned int nrbufs, curbuf, buffers; unsigned int readers, writers, waiting_writers; struct fasync_struct *fasync_readers, *fasync_writers; struct pipe_buffer *bufs; };
+static inline int pipe_buf_confirm(struct pipe_inode_info *p, struct pipe_buffer *b) { return b->ops->confirm ? b->ops->confirm(p, b) : 0; }
+static inline void pipe_buf_release(struct pipe_inode_info *p, struct pipe_buffer *b) { const struct pipe_buf_operations *ops = b->ops; b->ops = NULL; ops->release(p, b); }
+void pipe_wait(struct pipe_inode_info *);
+void pipe_lock(struct pipe_inode_info *); void pipe_unlock(struct pipe_inode_info *);
+#define READ 0
+#define WRITE 1
+struct bio_vec { struct page *bv_page; unsigned int bv_len; unsigned int bv_offset; };
+struct iov_iter { int type; size_t iov_offset; size_t count; union { const struct iovec *iov; const struct bio_vec *bvec; struct pipe_inode_info *pipe; }; union { unsigned long nr_segs; int idx; }; };
+enum { ITER_IOVEC = 0, ITER_KVEC = 2, ITER_BVEC = 4, ITER_PIPE = 8 };
+void iov_iter_pipe(struct iov_iter *, int, struct pipe_inode_info *, size_t);
+void iov_iter_bvec(struct iov_iter *, int, const struct bio_vec *, unsigned long, size_t);
+ssize_t iov_iter_get_pages(struct iov_iter *, struct page **, size_t, unsigned, size_t *);
+void iov_iter_advance(struct iov_iter *, size_t);
+static inline size_t iov_iter_count(const struct iov_iter *i) { return i->count; }
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_NONBLOCK 0x02
+#define SPLICE_F_MOVE 0x01
+#endif
+#define PIPE_DEF_BUFFERS 16
+struct splice_desc { size_t total_len; unsigned int len; unsigned int flags; union { void __user *userptr; struct file *file; void *data; } u; loff_t pos; loff_t *opos; size_t num_spliced; bool need_wakeup; };
+int splice_from_pipe_next(struct pipe_inode_info *, struct splice_desc *);
+void splice_from_pipe_begin(struct splice_desc *); void splice_from_pipe_end(struct pipe_inode_info *, struct splice_desc *);
+
+/* debugfs, seq_file: nothing is created */
+struct dentry;
+struct dentry *debugfs_create_dir(const char *, struct dentry *);
+struct dentry *debugfs_create_file(const char *, unsigned short, struct dentry *, void *, const struct file_operations *);
+struct dentry *debugfs_create_u32(const char *, unsigned short, struct dentry *, u32 *);
+struct dentry *debugfs_create_u64(const char *, unsigned short, struct dentry *, u64 *);
+void debugfs_remove_recursive(struct dentry *);
+struct seq_file { void *private; };
+int seq_printf(struct seq_file *, const char *, ...); int seq_puts(struct seq_file *, const char *); void seq_putc(struct seq_file *, char);
+int single_open(struct file *, int (*)(struct seq_file *, void *), void *); int single_release(struct inode *, struct file *);
+ssize_t seq_read(struct file *, char __user *, size_t, loff_t *); loff_t seq_lseek(struct file *, loff_t, int);
+ssize_t simple_read_from_buffer(void __user *, size_t, loff_t *, const void *, size_t);
+int simple_open(struct inode *, struct file *);
+loff_t no_llseek(struct file *, loff_t, int); loff_t default_llseek(struct file *, loff_t, int);
+int kstrtouint_from_user(const char __user *, size_t, unsigned int, unsigned int *);
+
+/* dmaengine: see the mock in kshim.c */
+enum dma_status { DMA_COMPLETE, DMA_IN_PROGRESS, DMA_PAUSED, DMA_ERROR };
+enum dma_transfer_direction { DMA_MEM_TO_MEM, DMA_MEM_TO_DEV, DMA_DEV_TO_MEM, DMA_DEV_TO_DEV, DMA_TRANS_NONE };
+enum dma_residue_granularity { DMA_RESIDUE_GRANULARITY_DESCRIPTOR = 0, DMA_RESIDUE_GRANULARITY_SEGMENT = 1, DMA_RESIDUE_GRANULARITY_BURST = 2 };
+enum dmaengine_tx_result { DMA_TRANS_NOERROR = 0, DMA_TRANS_READ_FAILED, DMA_TRANS_WRITE_FAILED, DMA_TRANS_ABORTED };
+struct dmaengine_result { enum dmaengine_tx_result result; u32 residue; };
+typedef void (*dma_async_tx_callback)(void *);
+typedef void (*dma_async_tx_callback_result)(void *, const struct dmaengine_result *);
+#define DMA_MIN_COOKIE 1
+#define DMA_PREP_INTERRUPT 1UL
+#define DMA_CTRL_ACK 2UL
+struct dma_chan;
+struct dma_device { struct dma_async_tx_descriptor *(*device_prep_slave_sg)(struct dma_chan *, struct scatterlist *, unsigned int, enum dma_transfer_direction, unsigned long, void *); struct device *dev; u8 copy_align; u32 directions; enum dma_residue_granularity residue_granularity; };
+struct dma_chan { struct dma_device *device; int chan_id; void *private; };
+struct dma_async_tx_descriptor { dma_cookie_t cookie; unsigned long flags; struct dma_chan *chan; dma_async_tx_callback callback; dma_async_tx_callback_result callback_result; void *callback_param; };
+struct dma_tx_state { dma_cookie_t last; dma_cookie_t used; u32 residue; };
+struct dma_slave_caps { u32 src_addr_widths; u32 dst_addr_widths; u32 directions; u32 max_burst; bool cmd_pause; bool cmd_terminate; enum dma_residue_granularity residue_granularity; bool descriptor_reuse; };
+struct dma_async_tx_descriptor *dmaengine_prep_slave_sg(struct dma_chan *, struct scatterlist *, unsigned int, enum dma_transfer_direction, unsigned long);
+struct dma_async_tx_descriptor *dmaengine_prep_slave_single(struct dma_chan *, dma_addr_t, size_t, enum dma_transfer_direction, unsigned long);
+dma_cookie_t dmaengine_submit(struct dma_async_tx_descriptor *);
+void dma_async_issue_pending(struct dma_chan *);
+int dmaengine_terminate_all(struct dma_chan *); int dmaengine_terminate_sync(struct dma_chan *);
+int dmaengine_terminate_async(struct dma_chan *); void dmaengine_synchronize(struct dma_chan *);
+int dmaengine_pause(struct dma_chan *); int dmaengine_resume(struct dma_chan *);
+enum dma_status dmaengine_tx_status(struct dma_chan *, dma_cookie_t, struct dma_tx_state *);
+struct dma_chan *dma_request_slave_channel(struct device *, const char *);
+struct dma_chan *dma_request_chan(struct device *, const char *);
+void dma_release_channel(struct dma_chan *);
+int dma_get_slave_caps(struct dma_chan *, struct dma_slave_caps *);
+
+/* dma-buf, declared only */
+struct dma_buf;
+struct dma_buf_attachment { struct dma_buf *dmabuf; struct device *dev; struct list_head node; void *priv; };
+struct dma_buf_ops {
+    int (*attach)(struct dma_buf *, struct device *, struct dma_buf_attachment *);
+    void (*detach)(struct dma_buf *, struct dma_buf_attachment *);
+    struct sg_table *(*map_dma_buf)(struct dma_buf_attachment *, enum dma_data_direction);
+    void (*unmap_dma_buf)(struct dma_buf_attachment *, struct sg_table *, enum dma_data_direction);
+    void (*release)(struct dma_buf *);
+    int (*begin_cpu_access)(struct dma_buf *, enum dma_data_direction);
+    int (*end_cpu_access)(struct dma_buf *, enum dma_data_direction);
+    void *(*kmap_atomic)(struct dma_buf *, unsigned long);
+    void (*kunmap_atomic)(struct dma_buf *, unsigned long, void *);
+    void *(*kmap)(struct dma_buf *, unsigned long);
+    void (*kunmap)(struct dma_buf *, unsigned long, void *);
+    int (*mmap)(struct dma_buf *, struct vm_area_struct *vma);
+    void *(*vmap)(struct dma_buf *);
+    void (*vunmap)(struct dma_buf *, void *vaddr);
+};
+struct dma_buf { size_t size; struct file *file; const struct dma_buf_ops *ops; void *priv; };
+struct dma_buf_export_info { const char *exp_name; struct module *owner; const struct dma_buf_ops *ops; size_t size; int flags; void *resv; void *priv; };
+#define DEFINE_DMA_BUF_EXPORT_INFO(name) struct dma_buf_export_info name = { .exp_name = KBUILD_MODNAME, .owner = THIS_MODULE }
+struct dma_buf *dma_buf_export(const struct dma_buf_export_info *);
+int dma_buf_fd(struct dma_buf *, int); struct dma_buf *dma_buf_get(int); void dma_buf_put(struct dma_buf *);
+struct dma_buf_attachment *dma_buf_attach(struct dma_buf *, struct device *);
+void dma_buf_detach(struct dma_buf *, struct dma_buf_attachment *);
+struct sg_table *dma_buf_map_attachment(struct dma_buf_attachment *, enum dma_data_direction);
+void dma_buf_unmap_attachment(struct dma_buf_attachment *, struct sg_table *, enum dma_data_direction);
+
+/* io */
+#define ioread32(a) (*(volatile u32 *)(a))
+#define iowrite32(v, a) (*(volatile u32 *)(a) = (v))
+
+#endif /* KSHIM_H */
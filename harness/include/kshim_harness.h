@@ -0,0 +1,34 @@
+/*
+ * harness/include/kshim_harness.h
+ *
+ * Knobs and counters of the shims, for the benchmark driver.
+ */
+
+#ifndef KSHIM_HARNESS_H
+#define KSHIM_HARNESS_H
+
+#include "kshim.h"
+
+struct kshim_stats {
+    unsigned long gup_calls;    // get_user_pages_fast()
+    unsigned long gup_pages;
+    unsigned long pages_live;   // struct pages not put yet
+    unsigned long map_calls;    // dma_map_sg()
+    unsigned long unmap_calls;
+    unsigned long sync_calls;   // dma_sync_sg_for_cpu/device()
+};
+
+extern struct kshim_stats kshim_stats;
+extern int kshim_loglevel;              // printk()s below this level are shown, 4 by default
+extern unsigned int kshim_dma_mb_per_s; // mock engine throughput, 0 = as fast as memory allows
+extern unsigned int kshim_dma_copy_align;   // log2 of the alignment the mock engine insists on
+extern const char *kshim_dma_compatible;   // compatible of the mock controller's node, none by default
+extern u32 kshim_dma_app[5];            // app words last passed to device_prep_slave_sg()
+
+// What the driver core does after remove(): frees the devm_ allocations of dev.
+void kshim_devres_release_all(struct device *dev);
+
+ssize_t kshim_sysfs_show(struct kobject *kobj, const char *attr, char *buf);
+ssize_t kshim_sysfs_store(struct kobject *kobj, const char *attr, const char *buf);
+
+#endif /* KSHIM_HARNESS_H */
@@ -0,0 +1 @@
+#include "../../../udma.h"
@@ -0,0 +1 @@
+#include "../../../udma_ioctl.h"
@@ -0,0 +1,1227 @@
+/*
+ * harness/kshim.c
+ *
+ * Userspace implementations of the kernel services udma.c's transfer path
+ * uses, and a mock dmaengine. See include/kshim.h.
+ */
+
+#include "kshim.h"
+#include "kshim_harness.h"
+
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+struct kshim_stats kshim_stats;
+int kshim_loglevel = 4;
+unsigned int kshim_dma_mb_per_s;
+unsigned int kshim_dma_copy_align;
+const char *kshim_dma_compatible;
+u32 kshim_dma_app[5];
+
+static inline void kshim_count(unsigned long *c, long n)
+{
+    __atomic_add_fetch(c, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * printk and string helpers
+ */
+
+int printk(const char *fmt, ...)
+{
+    int level = 4;
+    va_list ap;
+    int rv;
+
+    if (fmt[0] == '\001' && fmt[1] >= '0' && fmt[1] <= '7') {
+        level = fmt[1] - '0';
+        fmt += 2;
+    }
+    if (level >= kshim_loglevel)
+        return 0;
+
+    va_start(ap, fmt);
+    rv = vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    return rv;
+}
+
+int scnprintf(char *buf, size_t size, const char *fmt, ...)
+{
+    va_list ap;
+    int rv;
+
+    if (!size)
+        return 0;
+    va_start(ap, fmt);
+    rv = vsnprintf(buf, size, fmt, ap);
+    va_end(ap);
+    return rv < (int)size ? rv : (int)size - 1;
+}
+
+static int kshim_strtoull(const char *s, unsigned int base, unsigned long long *res)
+{
+    char *end;
+
+    if (!*s || *s == '-')
+        return -EINVAL;
+    errno = 0;
+    *res = strtoull(s, &end, base);
+    if (errno)
+        return -ERANGE;
+    if (*end == '\n')
+        end++;
+    return *end ? -EINVAL : 0;
+}
+
+int kstrtoull(const char *s, unsigned int base, unsigned long long *res)
+{
+    return kshim_strtoull(s, base, res);
+}
+
+int kstrtoul(const char *s, unsigned int base, unsigned long *res)
+{
+    unsigned long long v;
+    int rv = kshim_strtoull(s, base, &v);
+
+    if (!rv)
+        *res = v;
+    return rv;
+}
+
+int kstrtouint(const char *s, unsigned int base, unsigned int *res)
+{
+    unsigned long long v;
+    int rv = kshim_strtoull(s, base, &v);
+
+    if (rv)
+        return rv;
+    if (v > UINT_MAX)
+        return -ERANGE;
+    *res = v;
+    return 0;
+}
+
+int kstrtoint(const char *s, unsigned int base, int *res)
+{
+    unsigned long long v;
+    bool neg = *s == '-';
+    int rv = kshim_strtoull(s + neg, base, &v);
+
+    if (rv)
+        return rv;
+    if (v > (unsigned long long)INT_MAX + neg)
+        return -ERANGE;
+    *res = neg ? -(long long)v : (long long)v;
+    return 0;
+}
+
+int kstrtobool(const char *s, bool *res)
+{
+    switch (s[0]) {
+    case 'y': case 'Y': case '1':
+        *res = true;
+        return 0;
+    case 'n': case 'N': case '0':
+        *res = false;
+        return 0;
+    case 'o': case 'O':
+        if (s[1] == 'n' || s[1] == 'N') { *res = true; return 0; }
+        if (s[1] == 'f' || s[1] == 'F') { *res = false; return 0; }
+        break;
+    }
+    return -EINVAL;
+}
+
+int sysfs_streq(const char *s1, const char *s2)
+{
+    while (*s1 && *s1 == *s2) {
+        s1++;
+        s2++;
+    }
+    if (*s1 == *s2)
+        return 1;
+    if (!*s1 && *s2 == '\n' && !s2[1])
+        return 1;
+    if (*s1 == '\n' && !s1[1] && !*s2)
+        return 1;
+    return 0;
+}
+
+/*
+ * time and tasks
+ */
+
+u64 ktime_get_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+unsigned long kshim_jiffies(void)
+{
+    return ktime_get_ns() / NSEC_PER_MSEC;
+}
+
+void msleep(unsigned int ms) { usleep(ms * 1000); }
+void usleep_range(unsigned long min, unsigned long max) { usleep(min); }
+void udelay(unsigned long us) { u64 end = ktime_get_ns() + us * NSEC_PER_USEC; while (ktime_get_ns() < end) ; }
+void cond_resched(void) { }
+
+static struct mm_struct kshim_mm = { .mm_count = ATOMIC_INIT(1) };
+static __thread struct task_struct kshim_task;
+
+struct task_struct *kshim_current(void)
+{
+    if (!kshim_task.mm) {
+        kshim_task.pid = syscall(SYS_gettid);
+        kshim_task.mm = &kshim_mm;
+        strcpy(kshim_task.comm, "harness");
+    }
+    return &kshim_task;
+}
+
+void mmdrop(struct mm_struct *mm)
+{
+    atomic_dec(&mm->mm_count);
+}
+
+int kshim_sched_setscheduler(struct task_struct *t, int policy, const struct sched_param *p)
+{
+    return 0;   // the harness doesn't need the privileges real priorities take
+}
+
+/*
+ * semaphores, wait queues, completions
+ */
+
+void sema_init(struct semaphore *s, int n)
+{
+    pthread_mutex_init(&s->m, NULL);
+    pthread_cond_init(&s->c, NULL);
+    s->count = n;
+}
+
+void down(struct semaphore *s)
+{
+    pthread_mutex_lock(&s->m);
+    while (s->count <= 0)
+        pthread_cond_wait(&s->c, &s->m);
+    s->count--;
+    pthread_mutex_unlock(&s->m);
+}
+
+int down_interruptible(struct semaphore *s)
+{
+    down(s);
+    return 0;
+}
+
+int down_trylock(struct semaphore *s)
+{
+    int busy;
+
+    pthread_mutex_lock(&s->m);
+    busy = s->count <= 0;
+    if (!busy)
+        s->count--;
+    pthread_mutex_unlock(&s->m);
+    return busy;
+}
+
+void up(struct semaphore *s)
+{
+    pthread_mutex_lock(&s->m);
+    s->count++;
+    pthread_cond_signal(&s->c);
+    pthread_mutex_unlock(&s->m);
+}
+
+static void kshim_abstime(struct timespec *ts, u64 deadline_ns)
+{
+    // pthread_cond_timedwait() defaults to CLOCK_REALTIME
+    struct timespec now;
+    u64 mono = ktime_get_ns();
+    u64 left = deadline_ns > mono ? deadline_ns - mono : 0;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    left += now.tv_nsec;
+    ts->tv_sec = now.tv_sec + left / NSEC_PER_SEC;
+    ts->tv_nsec = left % NSEC_PER_SEC;
+}
+
+void init_waitqueue_head(wait_queue_head_t *wq)
+{
+    pthread_mutex_init(&wq->m, NULL);
+    pthread_cond_init(&wq->c, NULL);
+    wq->seq = 0;
+}
+
+void wake_up_all(wait_queue_head_t *wq)
+{
+    pthread_mutex_lock(&wq->m);
+    wq->seq++;
+    pthread_cond_broadcast(&wq->c);
+    pthread_mutex_unlock(&wq->m);
+}
+
+unsigned int kshim_wait_seq(wait_queue_head_t *wq)
+{
+    unsigned int seq;
+
+    pthread_mutex_lock(&wq->m);
+    seq = wq->seq;
+    pthread_mutex_unlock(&wq->m);
+    return seq;
+}
+
+void kshim_wait(wait_queue_head_t *wq, unsigned int seq, u64 deadline_ns)
+{
+    struct timespec ts;
+
+    if (deadline_ns)
+        kshim_abstime(&ts, deadline_ns);
+
+    pthread_mutex_lock(&wq->m);
+    while (wq->seq == seq) {
+        if (!deadline_ns)
+            pthread_cond_wait(&wq->c, &wq->m);
+        else if (pthread_cond_timedwait(&wq->c, &wq->m, &ts) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&wq->m);
+}
+
+void init_completion(struct completion *x)
+{
+    // udma.c re-inits the same completion for every transfer
+    if (!x->kshim_inited) {
+        init_waitqueue_head(&x->wait);
+        x->kshim_inited = true;
+    }
+    pthread_mutex_lock(&x->wait.m);
+    x->done = 0;
+    pthread_mutex_unlock(&x->wait.m);
+}
+
+void complete(struct completion *x)
+{
+    pthread_mutex_lock(&x->wait.m);
+    if (x->done != UINT_MAX)
+        x->done++;
+    pthread_cond_broadcast(&x->wait.c);
+    pthread_mutex_unlock(&x->wait.m);
+}
+
+void complete_all(struct completion *x)
+{
+    pthread_mutex_lock(&x->wait.m);
+    x->done = UINT_MAX;
+    pthread_cond_broadcast(&x->wait.c);
+    pthread_mutex_unlock(&x->wait.m);
+}
+
+// Returns the jiffies left, at least 1, or 0 on timeout.
+static long kshim_wait_for_completion(struct completion *x, long timeout)
+{
+    const bool forever = timeout == MAX_SCHEDULE_TIMEOUT;
+    const u64 end = forever ? 0 : ktime_get_ns() + (u64)timeout * NSEC_PER_MSEC;
+    struct timespec ts;
+    long left = timeout;
+
+    if (!forever)
+        kshim_abstime(&ts, end);
+
+    pthread_mutex_lock(&x->wait.m);
+    while (!x->done) {
+        if (forever) {
+            pthread_cond_wait(&x->wait.c, &x->wait.m);
+        } else if (pthread_cond_timedwait(&x->wait.c, &x->wait.m, &ts) == ETIMEDOUT) {
+            if (!x->done)
+                left = 0;
+            break;
+        }
+    }
+    if (x->done) {
+        if (x->done != UINT_MAX)
+            x->done--;
+        if (!forever) {
+            u64 now = ktime_get_ns();
+            left = now < end ? (long)DIV_ROUND_UP(end - now, NSEC_PER_MSEC) : 1;
+        }
+    }
+    pthread_mutex_unlock(&x->wait.m);
+    return left;
+}
+
+void wait_for_completion(struct completion *x)
+{
+    kshim_wait_for_completion(x, MAX_SCHEDULE_TIMEOUT);
+}
+
+long wait_for_completion_interruptible(struct completion *x)
+{
+    kshim_wait_for_completion(x, MAX_SCHEDULE_TIMEOUT);
+    return 0;
+}
+
+long wait_for_completion_interruptible_timeout(struct completion *x, unsigned long timeout)
+{
+    return kshim_wait_for_completion(x, timeout);
+}
+
+unsigned long wait_for_completion_timeout(struct completion *x, unsigned long timeout)
+{
+    return kshim_wait_for_completion(x, timeout);
+}
+
+bool completion_done(struct completion *x)
+{
+    bool done;
+
+    pthread_mutex_lock(&x->wait.m);
+    done = x->done != 0;
+    pthread_mutex_unlock(&x->wait.m);
+    return done;
+}
+
+bool try_wait_for_completion(struct completion *x)
+{
+    bool done;
+
+    pthread_mutex_lock(&x->wait.m);
+    done = x->done != 0;
+    if (done && x->done != UINT_MAX)
+        x->done--;
+    pthread_mutex_unlock(&x->wait.m);
+    return done;
+}
+
+/*
+ * kthread workers
+ */
+
+static void *kshim_worker_fn(void *arg)
+{
+    struct kthread_worker *worker = arg;
+
+    pthread_mutex_lock(&worker->m);
+    for (;;) {
+        struct kthread_work *work;
+
+        while (list_empty(&worker->works) && !worker->stop)
+            pthread_cond_wait(&worker->c, &worker->m);
+        if (list_empty(&worker->works))
+            break;
+
+        work = list_first_entry(&worker->works, struct kthread_work, node);
+        list_del_init(&work->node);
+        worker->current_work = work;
+        pthread_mutex_unlock(&worker->m);
+
+        work->func(work);
+
+        pthread_mutex_lock(&worker->m);
+        worker->current_work = NULL;
+        pthread_cond_broadcast(&worker->c);
+    }
+    pthread_mutex_unlock(&worker->m);
+    return NULL;
+}
+
+static struct kthread_worker *kshim_create_worker(void)
+{
+    struct kthread_worker *worker = calloc(1, sizeof(*worker));
+
+    if (!worker)
+        return ERR_PTR(-ENOMEM);
+
+    pthread_mutex_init(&worker->m, NULL);
+    pthread_cond_init(&worker->c, NULL);
+    INIT_LIST_HEAD(&worker->works);
+    worker->task = calloc(1, sizeof(*worker->task));
+    if (!worker->task || pthread_create(&worker->thread, NULL, kshim_worker_fn, worker)) {
+        free(worker->task);
+        free(worker);
+        return ERR_PTR(-ENOMEM);
+    }
+    return worker;
+}
+
+struct kthread_worker *kthread_create_worker(unsigned int flags, const char namefmt[], ...)
+{
+    return kshim_create_worker();
+}
+
+struct kthread_worker *kthread_create_worker_on_cpu(int cpu, unsigned int flags, const char namefmt[], ...)
+{
+    return kshim_create_worker();
+}
+
+bool kthread_queue_work(struct kthread_worker *worker, struct kthread_work *work)
+{
+    bool queued = false;
+
+    pthread_mutex_lock(&worker->m);
+    if (list_empty(&work->node)) {
+        work->worker = worker;
+        list_add_tail(&work->node, &worker->works);
+        pthread_cond_broadcast(&worker->c);
+        queued = true;
+    }
+    pthread_mutex_unlock(&worker->m);
+    return queued;
+}
+
+void kthread_flush_work(struct kthread_work *work)
+{
+    struct kthread_worker *worker = work->worker;
+
+    if (!worker)
+        return;
+
+    pthread_mutex_lock(&worker->m);
+    while (!list_empty(&work->node) || worker->current_work == work)
+        pthread_cond_wait(&worker->c, &worker->m);
+    pthread_mutex_unlock(&worker->m);
+}
+
+void kthread_flush_worker(struct kthread_worker *worker)
+{
+    pthread_mutex_lock(&worker->m);
+    while (!list_empty(&worker->works) || worker->current_work)
+        pthread_cond_wait(&worker->c, &worker->m);
+    pthread_mutex_unlock(&worker->m);
+}
+
+void kthread_destroy_worker(struct kthread_worker *worker)
+{
+    pthread_mutex_lock(&worker->m);
+    worker->stop = true;
+    pthread_cond_broadcast(&worker->c);
+    pthread_mutex_unlock(&worker->m);
+
+    pthread_join(worker->thread, NULL);
+    free(worker->task);
+    free(worker);
+}
+
+/*
+ * hrtimers: one thread fires every armed timer at its expiry, outside
+ * hrtimer_lock, like the timer interrupt would.
+ */
+
+static pthread_mutex_t hrtimer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hrtimer_cond;
+static LIST_HEAD(hrtimer_armed);
+static struct hrtimer *hrtimer_running;
+static pthread_once_t hrtimer_once = PTHREAD_ONCE_INIT;
+
+static void *kshim_hrtimer_fn(void *arg)
+{
+    pthread_mutex_lock(&hrtimer_lock);
+    for (;;) {
+        struct hrtimer *t, *next = NULL;
+        struct timespec ts;
+
+        list_for_each_entry(t, &hrtimer_armed, node) {
+            if (!next || t->expires < next->expires)
+                next = t;
+        }
+        if (!next) {
+            pthread_cond_wait(&hrtimer_cond, &hrtimer_lock);
+            continue;
+        }
+        if (ktime_get_ns() < next->expires) {
+            ts.tv_sec = next->expires / NSEC_PER_SEC;
+            ts.tv_nsec = next->expires % NSEC_PER_SEC;
+            pthread_cond_timedwait(&hrtimer_cond, &hrtimer_lock, &ts);
+            continue;
+        }
+
+        list_del_init(&next->node);
+        hrtimer_running = next;
+        pthread_mutex_unlock(&hrtimer_lock);
+
+        next->function(next);
+
+        pthread_mutex_lock(&hrtimer_lock);
+        hrtimer_running = NULL;
+        pthread_cond_broadcast(&hrtimer_cond);
+    }
+    return NULL;
+}
+
+static void kshim_hrtimer_start_thread(void)
+{
+    pthread_condattr_t attr;
+    pthread_t thread;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&hrtimer_cond, &attr);
+    if (pthread_create(&thread, NULL, kshim_hrtimer_fn, NULL))
+        abort();
+    pthread_detach(thread);
+}
+
+void hrtimer_init(struct hrtimer *t, int clock_id, enum hrtimer_mode mode)
+{
+    pthread_once(&hrtimer_once, kshim_hrtimer_start_thread);
+    INIT_LIST_HEAD(&t->node);
+    t->function = NULL;
+    t->expires = 0;
+}
+
+void hrtimer_start(struct hrtimer *t, ktime_t tim, const enum hrtimer_mode mode)
+{
+    pthread_mutex_lock(&hrtimer_lock);
+    t->expires = (mode & HRTIMER_MODE_REL) ? ktime_get_ns() + tim : tim;
+    if (list_empty(&t->node))
+        list_add_tail(&t->node, &hrtimer_armed);
+    pthread_cond_broadcast(&hrtimer_cond);
+    pthread_mutex_unlock(&hrtimer_lock);
+}
+
+int hrtimer_cancel(struct hrtimer *t)
+{
+    int was_armed;
+
+    pthread_mutex_lock(&hrtimer_lock);
+    was_armed = !list_empty(&t->node);
+    list_del_init(&t->node);
+    while (hrtimer_running == t)
+        pthread_cond_wait(&hrtimer_cond, &hrtimer_lock);
+    pthread_mutex_unlock(&hrtimer_lock);
+    return was_armed;
+}
+
+/*
+ * Pages: get_user_pages_fast() hands out one struct page per page of the
+ * buffer, freed again by the last put_page().
+ */
+
+static struct page *kshim_new_page(void *addr)
+{
+    struct page *page = calloc(1, sizeof(*page));
+
+    if (page) {
+        page->addr = addr;
+        atomic_set(&page->refs, 1);
+        kshim_count(&kshim_stats.pages_live, 1);
+    }
+    return page;
+}
+
+int get_user_pages_fast(unsigned long start, int nr_pages, int write, struct page **pages)
+{
+    int i;
+
+    start &= PAGE_MASK;
+    for (i = 0; i < nr_pages; ++i) {
+        pages[i] = kshim_new_page((void *)(start + i * PAGE_SIZE));
+        if (!pages[i])
+            break;
+    }
+
+    kshim_count(&kshim_stats.gup_calls, 1);
+    kshim_count(&kshim_stats.gup_pages, i);
+    return i ? i : -ENOMEM;
+}
+
+void get_page(struct page *page)
+{
+    atomic_inc(&page->refs);
+}
+
+void put_page(struct page *page)
+{
+    if (atomic_dec_and_test(&page->refs)) {
+        free(page);
+        kshim_count(&kshim_stats.pages_live, -1);
+    }
+}
+
+int set_page_dirty(struct page *page)
+{
+    page->dirty = true;
+    return 1;
+}
+
+int mmu_notifier_register(struct mmu_notifier *mn, struct mm_struct *mm)
+{
+    return 0;
+}
+
+void mmu_notifier_unregister(struct mmu_notifier *mn, struct mm_struct *mm)
+{
+}
+
+/*
+ * Scatterlists and DMA mapping. The bus address of a buffer is its virtual
+ * address, so the mock engine can reach it directly.
+ */
+
+int sg_alloc_table(struct sg_table *table, unsigned int nents, gfp_t gfp)
+{
+    table->sgl = calloc(nents ? nents : 1, sizeof(*table->sgl));
+    if (!table->sgl)
+        return -ENOMEM;
+    table->sgl[nents ? nents - 1 : 0].end = true;
+    table->nents = table->orig_nents = nents;
+    return 0;
+}
+
+void sg_free_table(struct sg_table *table)
+{
+    free(table->sgl);
+    table->sgl = NULL;
+    table->nents = table->orig_nents = 0;
+}
+
+void sg_init_table(struct scatterlist *sgl, unsigned int nents)
+{
+    memset(sgl, 0, nents * sizeof(*sgl));
+    sgl[nents - 1].end = true;
+}
+
+// The DMA mask is the platform bus default of 32 bits until the driver sets one.
+u64 dma_get_mask(struct device *dev)
+{
+    return dev->dma_mask && *dev->dma_mask ? *dev->dma_mask : DMA_BIT_MASK(32);
+}
+
+int dma_coerce_mask_and_coherent(struct device *dev, u64 mask)
+{
+    dev->coherent_dma_mask = mask;
+    dev->dma_mask = &dev->coherent_dma_mask;
+    return 0;
+}
+
+phys_addr_t page_to_phys(struct page *page)
+{
+    return (phys_addr_t)(uintptr_t)page->addr;
+}
+
+int dma_map_sg(struct device *dev, struct scatterlist *sgl, int nents, enum dma_data_direction dir)
+{
+    struct scatterlist *sg;
+    int i;
+
+    for_each_sg(sgl, sg, nents, i) {
+        sg->dma_address = (dma_addr_t)(uintptr_t)sg_virt(sg);
+        sg->dma_length = sg->length;
+    }
+
+    kshim_count(&kshim_stats.map_calls, 1);
+    return nents;
+}
+
+void dma_unmap_sg(struct device *dev, struct scatterlist *sgl, int nents, enum dma_data_direction dir)
+{
+    kshim_count(&kshim_stats.unmap_calls, 1);
+}
+
+void dma_sync_sg_for_cpu(struct device *dev, struct scatterlist *sgl, int nents, enum dma_data_direction dir)
+{
+    kshim_count(&kshim_stats.sync_calls, 1);
+}
+
+void *dma_alloc_coherent(struct device *dev, size_t size, dma_addr_t *handle, gfp_t gfp)
+{
+    void *p = aligned_alloc(PAGE_SIZE, PAGE_ALIGN(size));
+
+    if (p) {
+        memset(p, 0, size);
+        *handle = (dma_addr_t)(uintptr_t)p;
+    }
+    return p;
+}
+
+void dma_free_coherent(struct device *dev, size_t size, void *p, dma_addr_t handle)
+{
+    free(p);
+}
+
+void dma_sync_sg_for_device(struct device *dev, struct scatterlist *sgl, int nents, enum dma_data_direction dir)
+{
+    kshim_count(&kshim_stats.sync_calls, 1);
+}
+
+/*
+ * Device model: a kobject lives until its first kobject_put(), sysfs
+ * attributes are reached through kshim_sysfs_show()/_store().
+ */
+
+void kobject_init(struct kobject *kobj, struct kobj_type *ktype)
+{
+    memset(kobj, 0, sizeof(*kobj));
+    kobj->ktype = ktype;
+}
+
+int kobject_add(struct kobject *kobj, struct kobject *parent, const char *fmt, ...)
+{
+    char *name;
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (vasprintf(&name, fmt, ap) < 0)
+        name = NULL;
+    va_end(ap);
+    if (!name)
+        return -ENOMEM;
+
+    kobj->name = name;
+    kobj->parent = parent;
+    return 0;
+}
+
+static void kshim_dynamic_kobj_release(struct kobject *kobj)
+{
+    free(kobj);
+}
+
+static struct kobj_type kshim_dynamic_kobj_ktype = {
+    .release = kshim_dynamic_kobj_release,
+};
+
+struct kobject *kobject_create_and_add(const char *name, struct kobject *parent)
+{
+    struct kobject *kobj = malloc(sizeof(*kobj));
+
+    if (!kobj)
+        return NULL;
+    kobject_init(kobj, &kshim_dynamic_kobj_ktype);
+    if (kobject_add(kobj, parent, "%s", name)) {
+        free(kobj);
+        return NULL;
+    }
+    return kobj;
+}
+
+void kobject_put(struct kobject *kobj)
+{
+    free((void *)kobj->name);
+    kobj->name = NULL;
+    if (kobj->ktype && kobj->ktype->release)
+        kobj->ktype->release(kobj);
+}
+
+static struct attribute *kshim_find_attr(struct kobject *kobj, const char *name)
+{
+    struct attribute **attr;
+
+    for (attr = kobj->ktype->default_attrs; attr && *attr; ++attr)
+        if (!strcmp((*attr)->name, name))
+            return *attr;
+    return NULL;
+}
+
+ssize_t kshim_sysfs_show(struct kobject *kobj, const char *name, char *buf)
+{
+    struct attribute *attr = kshim_find_attr(kobj, name);
+
+    return attr ? kobj->ktype->sysfs_ops->show(kobj, attr, buf) : -ENOENT;
+}
+
+ssize_t kshim_sysfs_store(struct kobject *kobj, const char *name, const char *buf)
+{
+    struct attribute *attr = kshim_find_attr(kobj, name);
+
+    return attr ? kobj->ktype->sysfs_ops->store(kobj, attr, buf, strlen(buf)) : -ENOENT;
+}
+
+/* devm_ allocations carry their device in a header */
+
+struct kshim_devres {
+    struct list_head node;
+    struct device *dev;
+    max_align_t data[];
+};
+
+static LIST_HEAD(kshim_devres_list);
+static pthread_mutex_t kshim_devres_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *devm_kzalloc(struct device *dev, size_t size, gfp_t gfp)
+{
+    struct kshim_devres *dr = calloc(1, sizeof(*dr) + size);
+
+    if (!dr)
+        return NULL;
+    dr->dev = dev;
+    pthread_mutex_lock(&kshim_devres_lock);
+    list_add_tail(&dr->node, &kshim_devres_list);
+    pthread_mutex_unlock(&kshim_devres_lock);
+    return dr->data;
+}
+
+void devm_kfree(struct device *dev, const void *p)
+{
+    struct kshim_devres *dr = container_of((void *)p, struct kshim_devres, data);
+
+    pthread_mutex_lock(&kshim_devres_lock);
+    list_del(&dr->node);
+    pthread_mutex_unlock(&kshim_devres_lock);
+    free(dr);
+}
+
+void kshim_devres_release_all(struct device *dev)
+{
+    struct kshim_devres *dr, *tmp;
+
+    pthread_mutex_lock(&kshim_devres_lock);
+    list_for_each_entry_safe(dr, tmp, &kshim_devres_list, node) {
+        if (dr->dev == dev) {
+            list_del(&dr->node);
+            free(dr);
+        }
+    }
+    pthread_mutex_unlock(&kshim_devres_lock);
+}
+
+/*
+ * The device node: "dma-names" comes from kshim_of_dma_names, everything
+ * else is absent.
+ */
+
+const char *kshim_of_dma_names[] = { "loop_tx", "loop_rx" };
+
+int of_property_count_strings(const struct device_node *np, const char *prop)
+{
+    return strcmp(prop, "dma-names") ? -EINVAL : (int)ARRAY_SIZE(kshim_of_dma_names);
+}
+
+int of_property_read_string_index(const struct device_node *np, const char *prop, int index, const char **out)
+{
+    if (strcmp(prop, "dma-names"))
+        return -EINVAL;
+    if (index < 0 || index >= (int)ARRAY_SIZE(kshim_of_dma_names))
+        return -ENODATA;
+    *out = kshim_of_dma_names[index];
+    return 0;
+}
+
+int of_property_count_u32_elems(const struct device_node *np, const char *prop)
+{
+    return -EINVAL;
+}
+
+int of_property_read_u32_index(const struct device_node *np, const char *prop, u32 index, u32 *out)
+{
+    return -EINVAL;
+}
+
+int of_property_read_u32(const struct device_node *np, const char *prop, u32 *out)
+{
+    return -EINVAL;
+}
+
+bool of_property_read_bool(const struct device_node *np, const char *prop)
+{
+    return false;
+}
+
+int of_device_is_compatible(const struct device_node *np, const char *compat)
+{
+    return np && np->compatible && !strcmp(np->compatible, compat);
+}
+
+/* debugfs is never there */
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent) { return NULL; }
+struct dentry *debugfs_create_file(const char *name, unsigned short mode, struct dentry *parent, void *data, const struct file_operations *fops) { return NULL; }
+void debugfs_remove_recursive(struct dentry *dentry) { }
+
+/*
+ * Mock dmaengine. Every channel has a thread that works through the issued
+ * descriptors in order: RX fills the buffer with a pattern, TX reads it, and
+ * with kshim_dma_mb_per_s set the thread spins for as long as the transfer
+ * would take at that rate. Then it runs the descriptor's callback, like the
+ * tasklet of a real driver would.
+ */
+
+struct kshim_seg {
+    unsigned char *addr;
+    unsigned int len;
+};
+
+struct kshim_desc {
+    struct dma_async_tx_descriptor tx;
+    struct list_head node;
+    enum dma_transfer_direction dir;
+    unsigned int nsegs;
+    size_t len;
+    struct kshim_seg segs[];
+};
+
+struct kshim_chan {
+    struct dma_chan chan;
+    struct dma_device device;
+    struct device ctrl;             // the controller, which addresses 64 bits
+    struct device_node ctrl_node;
+    u64 ctrl_mask;
+    pthread_t thread;
+    pthread_mutex_t m;
+    pthread_cond_t c;
+    struct list_head submitted;     // by dmaengine_submit()
+    struct list_head issued;        // by dma_async_issue_pending()
+    bool running;                   // a descriptor is between the lists and its callback
+    bool stop;
+    dma_cookie_t next_cookie;
+    dma_cookie_t completed;
+};
+
+#define to_kshim_chan(c) container_of(c, struct kshim_chan, chan)
+
+static void kshim_engine_run(struct kshim_desc *d)
+{
+    u64 end = 0;
+    unsigned int i;
+
+    if (kshim_dma_mb_per_s)
+        end = ktime_get_ns() + d->len * 1000 / kshim_dma_mb_per_s;
+
+    for (i = 0; i < d->nsegs; ++i) {
+        // What an engine without realignment would choke on.
+        if ((uintptr_t)d->segs[i].addr & ((1U << kshim_dma_copy_align) - 1)) {
+            fprintf(stderr, "kshim: segment %u of a descriptor at %p is misaligned\n", i, d->segs[i].addr);
+            abort();
+        }
+        if (d->dir == DMA_DEV_TO_MEM) {
+            memset(d->segs[i].addr, 0xa5, d->segs[i].len);
+        } else {
+            volatile unsigned char sum = 0;
+            unsigned int j;
+
+            for (j = 0; j < d->segs[i].len; j += 64)
+                sum += d->segs[i].addr[j];
+        }
+    }
+
+    while (ktime_get_ns() < end)
+        ;
+}
+
+static void *kshim_engine_fn(void *arg)
+{
+    struct kshim_chan *kc = arg;
+
+    pthread_mutex_lock(&kc->m);
+    for (;;) {
+        struct dmaengine_result result = { DMA_TRANS_NOERROR, 0 };
+        struct kshim_desc *d;
+
+        while (list_empty(&kc->issued) && !kc->stop)
+            pthread_cond_wait(&kc->c, &kc->m);
+        if (kc->stop)
+            break;
+
+        d = list_first_entry(&kc->issued, struct kshim_desc, node);
+        list_del(&d->node);
+        kc->running = true;
+        pthread_mutex_unlock(&kc->m);
+
+        kshim_engine_run(d);
+
+        pthread_mutex_lock(&kc->m);
+        kc->completed = d->tx.cookie;
+        pthread_mutex_unlock(&kc->m);
+
+        if (d->tx.callback_result)
+            d->tx.callback_result(d->tx.callback_param, &result);
+        else if (d->tx.callback)
+            d->tx.callback(d->tx.callback_param);
+        free(d);
+
+        pthread_mutex_lock(&kc->m);
+        kc->running = false;
+        pthread_cond_broadcast(&kc->c);
+    }
+    pthread_mutex_unlock(&kc->m);
+    return NULL;
+}
+
+static struct dma_async_tx_descriptor *kshim_prep_slave_sg(struct dma_chan *, struct scatterlist *,
+        unsigned int, enum dma_transfer_direction, unsigned long, void *);
+
+struct dma_chan *dma_request_chan(struct device *dev, const char *name)
+{
+    struct kshim_chan *kc = calloc(1, sizeof(*kc));
+
+    if (!kc)
+        return ERR_PTR(-ENOMEM);
+
+    kc->ctrl.init_name = "kshim-dma";
+    kc->ctrl_mask = DMA_BIT_MASK(64);
+    kc->ctrl.dma_mask = &kc->ctrl_mask;
+    kc->ctrl_node.name = "kshim-dma";
+    kc->ctrl_node.compatible = kshim_dma_compatible;
+    kc->ctrl.of_node = &kc->ctrl_node;
+    kc->device.dev = &kc->ctrl;
+    kc->device.device_prep_slave_sg = kshim_prep_slave_sg;
+    kc->device.residue_granularity = DMA_RESIDUE_GRANULARITY_BURST;
+    kc->device.copy_align = kshim_dma_copy_align;
+    kc->chan.device = &kc->device;
+    pthread_mutex_init(&kc->m, NULL);
+    pthread_cond_init(&kc->c, NULL);
+    INIT_LIST_HEAD(&kc->submitted);
+    INIT_LIST_HEAD(&kc->issued);
+    kc->next_cookie = DMA_MIN_COOKIE;
+
+    if (pthread_create(&kc->thread, NULL, kshim_engine_fn, kc)) {
+        free(kc);
+        return ERR_PTR(-ENOMEM);
+    }
+    return &kc->chan;
+}
+
+static void kshim_free_descs(struct list_head *list)
+{
+    struct kshim_desc *d, *tmp;
+
+    list_for_each_entry_safe(d, tmp, list, node) {
+        list_del(&d->node);
+        free(d);
+    }
+}
+
+// Drops everything not started yet and waits for the running descriptor.
+int dmaengine_terminate_all(struct dma_chan *chan)
+{
+    struct kshim_chan *kc = to_kshim_chan(chan);
+
+    pthread_mutex_lock(&kc->m);
+    kshim_free_descs(&kc->submitted);
+    kshim_free_descs(&kc->issued);
+    while (kc->running)
+        pthread_cond_wait(&kc->c, &kc->m);
+    pthread_mutex_unlock(&kc->m);
+    return 0;
+}
+
+int dmaengine_terminate_sync(struct dma_chan *chan)
+{
+    return dmaengine_terminate_all(chan);
+}
+
+void dma_release_channel(struct dma_chan *chan)
+{
+    struct kshim_chan *kc = to_kshim_chan(chan);
+
+    dmaengine_terminate_all(chan);
+
+    pthread_mutex_lock(&kc->m);
+    kc->stop = true;
+    pthread_cond_broadcast(&kc->c);
+    pthread_mutex_unlock(&kc->m);
+
+    pthread_join(kc->thread, NULL);
+    free(kc);
+}
+
+int dma_get_slave_caps(struct dma_chan *chan, struct dma_slave_caps *caps)
+{
+    memset(caps, 0, sizeof(*caps));
+    caps->residue_granularity = chan->device->residue_granularity;
+    caps->cmd_terminate = true;
+    return 0;
+}
+
+static struct kshim_desc *kshim_alloc_desc(struct dma_chan *chan, unsigned int nsegs,
+                                           enum dma_transfer_direction dir, unsigned long flags)
+{
+    struct kshim_desc *d = calloc(1, sizeof(*d) + nsegs * sizeof(d->segs[0]));
+
+    if (d) {
+        d->tx.chan = chan;
+        d->tx.flags = flags;
+        d->dir = dir;
+        d->nsegs = nsegs;
+        INIT_LIST_HEAD(&d->node);
+    }
+    return d;
+}
+
+struct dma_async_tx_descriptor *dmaengine_prep_slave_sg(struct dma_chan *chan, struct scatterlist *sgl,
+        unsigned int sg_len, enum dma_transfer_direction dir, unsigned long flags)
+{
+    struct kshim_desc *d = kshim_alloc_desc(chan, sg_len, dir, flags);
+    struct scatterlist *sg;
+    unsigned int i;
+
+    if (!d)
+        return NULL;
+
+    for_each_sg(sgl, sg, sg_len, i) {
+        d->segs[i].addr = (unsigned char *)(uintptr_t)sg_dma_address(sg);
+        d->segs[i].len = sg_dma_len(sg);
+        d->len += sg_dma_len(sg);
+    }
+    return &d->tx;
+}
+
+/* The driver op behind dmaengine_prep_slave_sg(), for callers that pass a
+ * context; it is taken as AXI DMA app words, as xilinx_dma does. */
+static struct dma_async_tx_descriptor *kshim_prep_slave_sg(struct dma_chan *chan, struct scatterlist *sgl,
+        unsigned int sg_len, enum dma_transfer_direction dir, unsigned long flags, void *context)
+{
+    if (context)
+        memcpy(kshim_dma_app, context, sizeof(kshim_dma_app));
+    return dmaengine_prep_slave_sg(chan, sgl, sg_len, dir, flags);
+}
+
+struct dma_async_tx_descriptor *dmaengine_prep_slave_single(struct dma_chan *chan, dma_addr_t buf,
+        size_t len, enum dma_transfer_direction dir, unsigned long flags)
+{
+    struct kshim_desc *d = kshim_alloc_desc(chan, 1, dir, flags);
+
+    if (!d)
+        return NULL;
+
+    d->segs[0].addr = (unsigned char *)(uintptr_t)buf;
+    d->segs[0].len = len;
+    d->len = len;
+    return &d->tx;
+}
+
+dma_cookie_t dmaengine_submit(struct dma_async_tx_descriptor *tx)
+{
+    struct kshim_chan *kc = to_kshim_chan(tx->chan);
+    struct kshim_desc *d = container_of(tx, struct kshim_desc, tx);
+
+    pthread_mutex_lock(&kc->m);
+    tx->cookie = kc->next_cookie++;
+    list_add_tail(&d->node, &kc->submitted);
+    pthread_mutex_unlock(&kc->m);
+    return tx->cookie;
+}
+
+void dma_async_issue_pending(struct dma_chan *chan)
+{
+    struct kshim_chan *kc = to_kshim_chan(chan);
+
+    pthread_mutex_lock(&kc->m);
+    list_splice_tail_init(&kc->submitted, &kc->issued);
+    pthread_cond_broadcast(&kc->c);
+    pthread_mutex_unlock(&kc->m);
+}
+
+enum dma_status dmaengine_tx_status(struct dma_chan *chan, dma_cookie_t cookie, struct dma_tx_state *state)
+{
+    struct kshim_chan *kc = to_kshim_chan(chan);
+    enum dma_status status;
+
+    pthread_mutex_lock(&kc->m);
+    status = cookie <= kc->completed ? DMA_COMPLETE : DMA_IN_PROGRESS;
+    if (state) {
+        state->last = kc->completed;
+        state->used = kc->next_cookie - 1;
+        state->residue = 0;
+    }
+    pthread_mutex_unlock(&kc->m);
+    return status;
+}
@@ -0,0 +1,444 @@
+/*
+ * harness/replay.c
+ *
+ * Replays a transfer trace read from debugfs udma/<device>/trace: every
+ * recorded call is issued again at its original time relative to the first
+ * one, from one thread per recorded channel, and the latencies are compared
+ * with the recorded ones. Built twice:
+ *
+ *   udma-replay       against a udma device, e.g. on the board
+ *   udma-replay-loop  against udma.c on the mock dmaengine, like udma-bench
+ *
+ *   ./udma-replay [-d /dev/uioX] [-t rx timeout ms] [-x speed] [-v] trace
+ *   ./udma-replay-loop [-r MB/s] [-a log2 align] [-x speed] [-v] trace
+ *
+ * Splice and dma-buf calls are replayed as read()/write() of the same size
+ * and page offset. A speed above 1 compresses the gaps between calls.
+ */
+
+#ifdef REPLAY_LOOPBACK
+#include "kshim.h"
+#include "kshim_harness.h"
+#include <linux/udma.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include "../udma_ioctl.h"
+#endif
+
+#include <getopt.h>
+#include <time.h>
+
+#define REPLAY_MAX_CHANS    32
+
+struct replay_chan {
+    unsigned int index;             // in "dma-names" of the recorded device
+    unsigned int dir;
+    struct udma_trace_rec *recs;    // this channel's calls in arrival order
+    unsigned int num_recs;
+    uint64_t *lat_ns;               // of each replayed call
+    uint64_t *late_ns;              // how far behind its due time each call started
+    uint64_t bytes;
+    unsigned int errors;
+    char *buf;
+    pthread_t thread;
+#ifndef REPLAY_LOOPBACK
+    int fd;
+#endif
+};
+
+static struct replay_chan chans[REPLAY_MAX_CHANS];
+static uint64_t first_ts_ns;
+static uint64_t start_ns;
+static double speed = 1.0;
+static long page_size;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t t)
+{
+    struct timespec ts = { .tv_sec = t / 1000000000ULL, .tv_nsec = t % 1000000000ULL };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+#ifdef REPLAY_LOOPBACK
+
+/* Every channel of a direction runs on the one mock channel of it. */
+
+static struct device_node replay_node = { .name = "udma0", .full_name = "/udma0" };
+static struct platform_device replay_pdev = {
+    .name = "udma0",
+    .dev = { .init_name = "udma0", .of_node = &replay_node },
+};
+static struct udma_file *replay_file;
+
+static int backend_init(const char *dev)
+{
+    int rv;
+
+    if ((rv = check_udma(&replay_pdev)) <= 0) {
+        fprintf(stderr, "check_udma() returned %d\n", rv);
+        return -1;
+    }
+    replay_file = udma_open(&replay_pdev.dev);
+    if (IS_ERR_OR_NULL(replay_file)) {
+        fprintf(stderr, "udma_open() failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int backend_open(struct replay_chan *c)
+{
+    return 0;
+}
+
+static ssize_t backend_xfer(struct replay_chan *c, char *buf, size_t len)
+{
+    loff_t pos = 0;
+
+    return c->dir == UDMA_DEV_TO_CPU ? udma_read(replay_file, buf, len, &pos)
+                                     : udma_write(replay_file, buf, len, &pos, 0);
+}
+
+static void backend_close(struct replay_chan *c)
+{
+}
+
+static void backend_exit(void)
+{
+    udma_release(replay_file);
+    teardown_udma(&replay_pdev);
+    kshim_devres_release_all(&replay_pdev.dev);
+}
+
+#else
+
+/* One fd per channel, bound to it with UDMA_IOC_BIND. */
+
+static const char *replay_dev = "/dev/uio0";
+static int rx_timeout_ms = -1;
+
+static int backend_init(const char *dev)
+{
+    if (dev)
+        replay_dev = dev;
+    return 0;
+}
+
+static int backend_open(struct replay_chan *c)
+{
+    struct udma_bind bind = { .rx = -1, .tx = -1 };
+
+    c->fd = open(replay_dev, O_RDWR | O_CLOEXEC);
+    if (c->fd < 0) {
+        perror(replay_dev);
+        return -1;
+    }
+
+    if (c->dir == 1)
+        bind.rx = c->index;
+    else
+        bind.tx = c->index;
+    if (ioctl(c->fd, UDMA_IOC_BIND, &bind)) {
+        fprintf(stderr, "%s: binding channel %u: %s\n", replay_dev, c->index, strerror(errno));
+        return -1;
+    }
+    if (rx_timeout_ms >= 0 && ioctl(c->fd, UDMA_IOC_SET_RX_TIMEOUT, &rx_timeout_ms)) {
+        fprintf(stderr, "%s: setting the RX timeout: %s\n", replay_dev, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static ssize_t backend_xfer(struct replay_chan *c, char *buf, size_t len)
+{
+    ssize_t rv = c->dir == 1 ? read(c->fd, buf, len) : write(c->fd, buf, len);
+
+    return rv < 0 ? -errno : rv;
+}
+
+static void backend_close(struct replay_chan *c)
+{
+    close(c->fd);
+}
+
+static void backend_exit(void)
+{
+}
+
+#endif
+
+static int cmp_rec(const void *a, const void *b)
+{
+    const struct udma_trace_rec *ra = a, *rb = b;
+
+    return ra->ts_ns < rb->ts_ns ? -1 : ra->ts_ns > rb->ts_ns;
+}
+
+static int cmp_chan_rec(const void *a, const void *b)
+{
+    const struct udma_trace_rec *ra = a, *rb = b;
+
+    if (ra->chan != rb->chan)
+        return ra->chan < rb->chan ? -1 : 1;
+    return cmp_rec(a, b);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    const uint64_t va = *(const uint64_t *)a, vb = *(const uint64_t *)b;
+
+    return va < vb ? -1 : va > vb;
+}
+
+// Sorts v.
+static uint64_t percentile(uint64_t *v, unsigned int n, unsigned int permille)
+{
+    if (!n)
+        return 0;
+    qsort(v, n, sizeof(*v), cmp_u64);
+    return v[(uint64_t)(n - 1) * permille / 1000];
+}
+
+static void *replay_fn(void *arg)
+{
+    struct replay_chan *c = arg;
+    unsigned int i;
+
+    for (i = 0; i < c->num_recs; ++i) {
+        const struct udma_trace_rec *r = &c->recs[i];
+        const uint64_t due = start_ns + (uint64_t)((r->ts_ns - first_ts_ns) / speed);
+        uint64_t t;
+        ssize_t rv;
+
+        if (now_ns() < due)
+            sleep_until_ns(due);
+        t = now_ns();
+        c->late_ns[i] = t - due;
+
+        rv = backend_xfer(c, c->buf + r->page_off, r->len);
+        c->lat_ns[i] = now_ns() - t;
+        if (rv < 0)
+            ++c->errors;
+        else
+            c->bytes += rv;
+    }
+    return NULL;
+}
+
+static void report(struct replay_chan *c)
+{
+    uint64_t *rec_lat = malloc(c->num_recs * sizeof(*rec_lat));
+    uint64_t rec_bytes = 0;
+    unsigned int rec_errors = 0;
+    unsigned int i;
+
+    if (!rec_lat)
+        exit(1);
+    for (i = 0; i < c->num_recs; ++i) {
+        rec_lat[i] = c->recs[i].lat_ns;
+        if (c->recs[i].result < 0)
+            ++rec_errors;
+        else
+            rec_bytes += c->recs[i].result;
+    }
+
+    printf("%4u %-3s %7u %12llu %12llu %6u %6u %9llu %9llu %9llu %9llu %10llu\n",
+           c->index, c->dir == 1 ? "rx" : "tx", c->num_recs,
+           (unsigned long long)rec_bytes, (unsigned long long)c->bytes, rec_errors, c->errors,
+           (unsigned long long)percentile(rec_lat, c->num_recs, 500),
+           (unsigned long long)percentile(rec_lat, c->num_recs, 990),
+           (unsigned long long)percentile(c->lat_ns, c->num_recs, 500),
+           (unsigned long long)percentile(c->lat_ns, c->num_recs, 990),
+           (unsigned long long)percentile(c->late_ns, c->num_recs, 990));
+    free(rec_lat);
+}
+
+static void usage(void)
+{
+#ifdef REPLAY_LOOPBACK
+    fprintf(stderr, "usage: udma-replay-loop [-r MB/s] [-a log2 align] [-x speed] [-v] trace\n");
+#else
+    fprintf(stderr, "usage: udma-replay [-d /dev/uioX] [-t rx timeout ms] [-x speed] [-v] trace\n");
+#endif
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dev = NULL;
+    struct udma_trace_rec *recs;
+    unsigned int num_recs, n, i;
+    uint64_t span_ns, replay_ns;
+    bool verbose = false;
+    FILE *f;
+    long size;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:t:r:a:x:v")) != -1) {
+        switch (opt) {
+#ifdef REPLAY_LOOPBACK
+        case 'r':
+            kshim_dma_mb_per_s = strtoul(optarg, NULL, 0);
+            break;
+        case 'a':
+            kshim_dma_copy_align = strtoul(optarg, NULL, 0);
+            break;
+#else
+        case 'd':
+            dev = optarg;
+            break;
+        case 't':
+            rx_timeout_ms = strtol(optarg, NULL, 0);
+            break;
+#endif
+        case 'x':
+            speed = strtod(optarg, NULL);
+            if (!(speed > 0))
+                usage();
+            break;
+        case 'v':
+            verbose = true;
+#ifdef REPLAY_LOOPBACK
+            kshim_loglevel = 8;
+#endif
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1)
+        usage();
+    page_size = sysconf(_SC_PAGESIZE);
+
+    f = fopen(argv[optind], "rb");
+    if (!f || fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET)) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (size % sizeof(*recs))
+        fprintf(stderr, "%s: ignoring %ld trailing bytes\n", argv[optind], size % (long)sizeof(*recs));
+    num_recs = size / sizeof(*recs);
+    if (!num_recs) {
+        fprintf(stderr, "%s: no records\n", argv[optind]);
+        return 1;
+    }
+    recs = malloc(num_recs * sizeof(*recs));
+    if (!recs || fread(recs, sizeof(*recs), num_recs, f) != num_recs) {
+        perror(argv[optind]);
+        return 1;
+    }
+    fclose(f);
+
+    // The trace is in completion order, the replay goes by arrival.
+    qsort(recs, num_recs, sizeof(*recs), cmp_rec);
+    first_ts_ns = recs[0].ts_ns;
+    span_ns = recs[num_recs - 1].ts_ns - first_ts_ns;
+
+    // Split by channel, each in arrival order.
+    for (i = n = 0; i < num_recs; ++i) {
+        const struct udma_trace_rec *r = &recs[i];
+
+        if (r->chan >= REPLAY_MAX_CHANS || (r->dir != 1 && r->dir != 2) || r->page_off >= page_size) {
+            fprintf(stderr, "record %u: bad channel %u, direction %u or offset %u\n",
+                    i, r->chan, r->dir, r->page_off);
+            return 1;
+        }
+        if (!r->len)
+            continue;
+        recs[n++] = *r;
+    }
+    num_recs = n;
+
+    qsort(recs, num_recs, sizeof(*recs), cmp_chan_rec);
+    for (i = 0; i < num_recs; ++i) {
+        struct replay_chan *c = &chans[recs[i].chan];
+
+        if (!c->num_recs) {
+            c->recs = &recs[i];
+            c->index = recs[i].chan;
+            c->dir = recs[i].dir;
+        }
+        ++c->num_recs;
+    }
+
+    if (backend_init(dev))
+        return 1;
+
+    for (n = 0; n < REPLAY_MAX_CHANS; ++n) {
+        struct replay_chan *c = &chans[n];
+        size_t max_len = 0;
+
+        if (!c->num_recs)
+            continue;
+        for (i = 0; i < c->num_recs; ++i) {
+            if (c->recs[i].dir != c->dir) {
+                fprintf(stderr, "channel %u is recorded as both rx and tx\n", c->index);
+                return 1;
+            }
+            if (c->recs[i].len > max_len)
+                max_len = c->recs[i].len;
+        }
+
+        // Touched, like a buffer a real user would reuse.
+        c->lat_ns = calloc(c->num_recs, sizeof(*c->lat_ns));
+        c->late_ns = calloc(c->num_recs, sizeof(*c->late_ns));
+        if (!c->lat_ns || !c->late_ns || posix_memalign((void **)&c->buf, page_size, max_len + page_size))
+            return 1;
+        memset(c->buf, 0x5a, max_len + page_size);
+
+        if (backend_open(c))
+            return 1;
+        if (verbose)
+            fprintf(stderr, "channel %u %s: %u calls, up to %zu bytes\n",
+                    c->index, c->dir == 1 ? "rx" : "tx", c->num_recs, max_len);
+    }
+
+    // Give every thread time to get to its first call.
+    start_ns = now_ns() + 10000000;
+    for (n = 0; n < REPLAY_MAX_CHANS; ++n) {
+        if (chans[n].num_recs && pthread_create(&chans[n].thread, NULL, replay_fn, &chans[n])) {
+            fprintf(stderr, "pthread_create() failed\n");
+            return 1;
+        }
+    }
+    for (n = 0; n < REPLAY_MAX_CHANS; ++n) {
+        if (chans[n].num_recs)
+            pthread_join(chans[n].thread, NULL);
+    }
+    replay_ns = now_ns() - start_ns;
+
+    printf("%u calls over %.3f s recorded, replayed at %.2fx in %.3f s\n",
+           num_recs, span_ns / 1e9, speed, replay_ns / 1e9);
+    printf("chan dir   calls    rec_bytes        bytes rec_er errors rec_p50ns rec_p99ns    p50_ns    p99_ns late_p99ns\n");
+    for (n = 0; n < REPLAY_MAX_CHANS; ++n) {
+        if (!chans[n].num_recs)
+            continue;
+        report(&chans[n]);
+        backend_close(&chans[n]);
+        free(chans[n].lat_ns);
+        free(chans[n].late_ns);
+        free(chans[n].buf);
+    }
+    backend_exit();
+    free(recs);
+
+    return 0;
+}
@@ -17,526 +17,6224 @@
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/wait.h>
+#include <linux/highmem.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+#include <linux/sched.h>
+#include <linux/cpumask.h>
+#include <linux/uio.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/mmu_notifier.h>
+#include <linux/version.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include <linux/udma.h>
 
-static struct udma_drvdata *udma_rx_drvdata, *udma_tx_drvdata;
+static void udma_init_completion( struct udma_drvdata * p_info );
+static void udma_init_shape( struct udma_drvdata * p_info );
+static void udma_init_submit( struct udma_drvdata * p_info );
+static void udma_init_sched( struct udma_sched * sched );
+static void udma_teardown_channel( struct udma_drvdata * p_info );
+static int udma_sysfs_init( struct udma_pdev_drvdata * p_udma );
+static void udma_sysfs_teardown( struct udma_pdev_drvdata * p_udma );
+static void udma_debugfs_init( struct udma_pdev_drvdata * p_udma );
+static void udma_debugfs_teardown( struct udma_pdev_drvdata * p_udma );
 
+/* All udma instances, one per "generic-uio" node with a "dma-names" property */
+static LIST_HEAD(udma_instances);
+static DEFINE_MUTEX(udma_instances_lock);   // protects udma_instances, chain links, packet mode and udma_stripes
 
 
-static inline int udma_init(struct platform_device *pdev)
+/* Limits the DMA mask of pdev, which maps the buffers of all its channels,
+ * to what p_info's engine can address: "udma,addr-width" bits if the node
+ * has it, else the mask of the DMA controller. The first channel replaces
+ * the default mask, later ones can only narrow it.
+ */
+static int udma_set_dma_mask( struct platform_device *pdev, struct udma_drvdata * p_info )
+{
+	struct device * const dev = &pdev->dev;
+	u64 mask = dma_get_mask( p_info->chan->device->dev );
+	u32 bits;
+	int rv;
+
+	if ( !of_property_read_u32( dev->of_node, "udma,addr-width", &bits ) )
+	{
+		if ( bits < 24 || bits > 64 )
+		{
+			printk( KERN_ERR KBUILD_MODNAME ": %s: bad \"udma,addr-width\" %u\n", dev_name(dev), bits );
+			return -EINVAL;
+		}
+		mask = DMA_BIT_MASK(bits);
+	}
+
+	if ( p_info->index )
+		mask = min( mask, dma_get_mask( dev ) );
+
+	if ( (rv = dma_coerce_mask_and_coherent( dev, mask )) )
+	{
+		printk( KERN_ERR KBUILD_MODNAME ": %s: can't set a %d bit DMA mask: %d\n",
+		        dev_name(dev), fls64(mask), rv );
+		return rv;
+	}
+
+	printk( KERN_DEBUG KBUILD_MODNAME ": %s: %s: %d bit DMA mask\n",
+	        dev_name(dev), p_info->name, fls64(mask) );
+	return 0;
+}
+
+static inline int udma_init_channel(
+        struct platform_device *pdev,
+        struct udma_drvdata * p_info,
+        unsigned int index,
+        u32 dir )
 {
-	printk( KERN_WARNING KBUILD_MODNAME ": udma_init enter\n");
-	udma_tx_drvdata = devm_kzalloc( &pdev->dev, sizeof(*udma_tx_drvdata), GFP_KERNEL );
-	udma_rx_drvdata = devm_kzalloc( &pdev->dev, sizeof(*udma_tx_drvdata), GFP_KERNEL );
 	const char * p_dma_name;
 	int rv;
 
-	udma_tx_drvdata->pdev = pdev;
-	udma_tx_drvdata->in_use = 0;
-	udma_tx_drvdata->state = DMA_IDLE;
-    spin_lock_init( &udma_tx_drvdata->state_lock );
-    sema_init( &udma_tx_drvdata->sem, 1 );
-    init_waitqueue_head( &udma_tx_drvdata->wq );
-    atomic_set( &udma_tx_drvdata->packets_sent, 0 );
-    atomic_set( &udma_tx_drvdata->packets_rcvd, 0 );
+	p_info->pdev = pdev;
+	p_info->index = index;
+	p_info->in_use = 0;
+	atomic_set( &p_info->state, DMA_IDLE );
+    udma_init_sched( &p_info->sched );
+    sema_init( &p_info->sem, 1 );
+    init_waitqueue_head( &p_info->wq );
+    udma_init_completion( p_info );
+    udma_init_submit( p_info );
+    udma_init_shape( p_info );
+    atomic_set( &p_info->packets_sent, 0 );
+    atomic_set( &p_info->packets_rcvd, 0 );
+    p_info->rx_timeout_ms = 0;
+    INIT_LIST_HEAD( &p_info->pcache.lru );
+
+    rv = of_property_read_string_index( pdev->dev.of_node, "dma-names", index, &p_dma_name);
+    if ( rv )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": couldn't read \"dma-names\"[%u]: %d\n", index, rv);
+        return rv;
+    }
+    strncpy( p_info->name, p_dma_name, UDMA_DEV_NAME_MAX_CHARS-1 );
+    p_info->name[UDMA_DEV_NAME_MAX_CHARS-1] = '\0';
+
+    p_info->dir = dir;
+    p_info->chan = dma_request_chan( &pdev->dev, p_info->name );
+
+	if ( IS_ERR(p_info->chan) )
+	{
+		rv = PTR_ERR(p_info->chan);
+		p_info->chan = NULL;
+
+		// The DMA controller hasn't probed yet; the driver core retries us.
+		if ( -EPROBE_DEFER == rv )
+			printk( KERN_DEBUG KBUILD_MODNAME ": dma channel %s not ready, deferring\n",
+			        p_info->name );
+		else
+			printk( KERN_ERR KBUILD_MODNAME ": couldn't get dma channel %s: %d\n",
+			        p_info->name, rv );
+		return rv;
+	}
+
+	// Partial transfers can only be accounted for if the engine reports
+	// a residue finer than whole descriptors.
+	{
+		struct dma_slave_caps caps;
+
+		if ( dma_get_slave_caps( p_info->chan, &caps ) )
+			p_info->residue_granularity = DMA_RESIDUE_GRANULARITY_DESCRIPTOR;
+		else
+			p_info->residue_granularity = caps.residue_granularity;
+	}
+
+	// Before anything is allocated or mapped for the device.
+	if ( (rv = udma_set_dma_mask( pdev, p_info )) )
+		goto err_release;
+
+	// Engines without a realignment unit need aligned buffers; copy_align
+	// says so as log2, "udma,align" can ask for more.
+	{
+		u32 align = 1;
+
+		of_property_read_u32( pdev->dev.of_node, "udma,align", &align );
+		p_info->align = max_t( u32, align, 1U << p_info->chan->device->copy_align );
+	}
+
+	if ( !is_power_of_2( p_info->align ) || p_info->align > PAGE_SIZE )
+	{
+		printk( KERN_ERR KBUILD_MODNAME ": %s: alignment %u not supported\n",
+		        p_info->name, p_info->align );
+		rv = -EINVAL;
+		goto err_release;
+	}
+
+	if ( p_info->align > 1 )
+	{
+		p_info->bounce = dma_alloc_coherent( &pdev->dev, 2 * p_info->align,
+		                                     &p_info->bounce_dma, GFP_KERNEL );
+		if ( !p_info->bounce )
+		{
+			rv = -ENOMEM;
+			goto err_release;
+		}
+	}
+
+	p_info->lat = alloc_percpu( struct udma_lat_hist );
+	if ( !p_info->lat )
+	{
+		rv = -ENOMEM;
+		goto err_free_bounce;
+	}
+
+	p_info->init_done = true;
+	atomic_set(&p_info->accepting, 1);
+	printk( KERN_DEBUG KBUILD_MODNAME ": %s (%s) available\n", 
+							p_info->name,
+							p_info->dir == UDMA_DEV_TO_CPU ? "RX" : "TX");
+
+	return 0;
+
+	err_free_bounce:
+	if ( p_info->bounce )
+		dma_free_coherent( &pdev->dev, 2 * p_info->align, p_info->bounce, p_info->bounce_dma );
+	p_info->bounce = NULL;
+	err_release:
+	dma_release_channel( p_info->chan );
+	p_info->chan = NULL;
+	return rv;
+}
+
+/* Sets up one channel per "dma-names" entry. "udma,dirs" gives the direction
+ * of each (1 = RX, 2 = TX); without it the original two channel layout,
+ * TX first and RX second, is assumed.
+ */
+static inline int udma_init(struct platform_device *pdev, int num_chans)
+{
+	struct device_node * const np = pdev->dev.of_node;
+	struct udma_pdev_drvdata * p_udma;
+	int num_dirs;
+	int i;
+	int rv;
+
+	if ( num_chans > UDMA_MAX_CHANNELS )
+	{
+		printk( KERN_ERR KBUILD_MODNAME ": %d channels in \"dma-names\", at most %d are supported\n",
+		        num_chans, UDMA_MAX_CHANNELS );
+		return -EINVAL;
+	}
+
+	num_dirs = of_property_count_u32_elems( np, "udma,dirs" );
+	if ( num_dirs < 0 && num_chans != 2 )
+	{
+		printk( KERN_ERR KBUILD_MODNAME ": \"udma,dirs\" is required for %d channels\n", num_chans );
+		return -EINVAL;
+	}
+	if ( num_dirs >= 0 && num_dirs != num_chans )
+	{
+		printk( KERN_ERR KBUILD_MODNAME ": \"udma,dirs\" has %d entries, \"dma-names\" %d\n",
+		        num_dirs, num_chans );
+		return -EINVAL;
+	}
+
+	p_udma = devm_kzalloc( &pdev->dev, sizeof(*p_udma), GFP_KERNEL );
+	if ( !p_udma )
+		return -ENOMEM;
+
+	p_udma->pdev = pdev;
+	spin_lock_init( &p_udma->trace_lock );
+
+	for ( i = 0; i < num_chans; ++i )
+	{
+		struct udma_drvdata * p_info;
+		u32 dir;
+
+		if ( num_dirs < 0 )
+			dir = (0 == i) ? UDMA_CPU_TO_DEV : UDMA_DEV_TO_CPU;
+		else if ( (rv = of_property_read_u32_index( np, "udma,dirs", i, &dir )) )
+			goto err_out;
+
+		if ( dir != UDMA_DEV_TO_CPU && dir != UDMA_CPU_TO_DEV )
+		{
+			printk( KERN_ERR KBUILD_MODNAME ": bad direction %u for channel %d\n", dir, i );
+			rv = -EINVAL;
+			goto err_out;
+		}
+
+		p_info = devm_kzalloc( &pdev->dev, sizeof(*p_info), GFP_KERNEL );
+		if ( !p_info )
+		{
+			rv = -ENOMEM;
+			goto err_out;
+		}
+
+		p_udma->chans[i] = p_info;
+		p_udma->num_chans = i + 1;
+
+		if ( (rv = udma_init_channel( pdev, p_info, i, dir )) )
+			goto err_out;
+
+		// The first channel of each direction serves fds that didn't UDMA_IOC_BIND.
+		if ( dir == UDMA_DEV_TO_CPU && !p_udma->rx )
+			p_udma->rx = p_info;
+		if ( dir == UDMA_CPU_TO_DEV && !p_udma->tx )
+			p_udma->tx = p_info;
+	}
+
+	if ( udma_sysfs_init( p_udma ) )
+		printk( KERN_WARNING KBUILD_MODNAME ": %s: couldn't create sysfs entries\n",
+		        dev_name(&pdev->dev) );
+
+	mutex_lock( &udma_instances_lock );
+	udma_debugfs_init( p_udma );
+	list_add_tail( &p_udma->node, &udma_instances );
+	mutex_unlock( &udma_instances_lock );
+
+	return num_chans;
+
+	err_out:
+	for ( i = 0; i < p_udma->num_chans; ++i )
+		udma_teardown_channel( p_udma->chans[i] );
+
+	return rv;
+}
+
+// caller must hold udma_instances_lock
+static struct udma_pdev_drvdata *udma_find_instance( struct device *dev )
+{
+	struct udma_pdev_drvdata * p_udma;
+
+	list_for_each_entry( p_udma, &udma_instances, node )
+	{
+		if ( &p_udma->pdev->dev == dev )
+			return p_udma;
+	}
+
+	return NULL;
+}
+
+// Looks an instance up by its device name or its device tree node name.
+// caller must hold udma_instances_lock
+static struct udma_pdev_drvdata *udma_find_instance_by_name( const char *name )
+{
+	struct udma_pdev_drvdata * p_udma;
+
+	list_for_each_entry( p_udma, &udma_instances, node )
+	{
+		struct device * const dev = &p_udma->pdev->dev;
+
+		if ( !strcmp( dev_name(dev), name ) ||
+		     (dev->of_node && !strcmp( dev->of_node->name, name )) )
+			return p_udma;
+	}
+
+	return NULL;
+}
+
+bool is_udma(struct device *parent)
+{
+	struct udma_pdev_drvdata * p_udma;
+	bool rv;
+
+	mutex_lock( &udma_instances_lock );
+	p_udma = udma_find_instance( parent );
+	rv = p_udma != NULL;   // only fully initialized instances are listed
+	mutex_unlock( &udma_instances_lock );
+
+	return rv;
+}
+EXPORT_SYMBOL_GPL(is_udma);
+
+/* Sets up the udma instance of pdev if its node has "dma-names". Returns
+ * the number of channels, 0 for a plain uio device, or -errno, which is
+ * -EPROBE_DEFER as long as one of the DMA controllers hasn't probed.
+ */
+int check_udma(struct platform_device *pdev)
+{
+	int num_dma_names = of_property_count_strings(pdev->dev.of_node, "dma-names");
+
+    if ( -EINVAL == num_dma_names || 0 == num_dma_names )  // no udma
+    {
+        return 0;
+    }
+    else if ( num_dma_names < 0 )  // udma information error
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": got %d when trying to count the elements of \"dma-names\" property\n", num_dma_names);
+        return num_dma_names;   // contains error code
+    }
+
+
+    return udma_init(pdev, num_dma_names);
+}
+EXPORT_SYMBOL_GPL(check_udma);
+
+
+static void udma_unprepare_after_dma( struct udma_drvdata * p_info );
+
+/* Whoever moves the state out of DMA_IN_FLIGHT owns the end of the
+ * transfer: the completion here, or udma_stop_partial() on timeout/signal.
+ */
+static void udma_complete( struct udma_drvdata * p_info )
+{
+    if ( DMA_IN_FLIGHT == atomic_cmpxchg( &p_info->state, DMA_IN_FLIGHT, DMA_COMPLETING ) )
+        complete( &p_info->inflight.done );
+}
+
+static void udma_complete_kwork( struct kthread_work *work )
+{
+    udma_complete( container_of( work, struct udma_drvdata, complete_kwork ) );
+}
+
+static void udma_complete_work( struct work_struct *work )
+{
+    udma_complete( container_of( work, struct udma_drvdata, complete_work ) );
+}
+
+/*
+ * Sideband app words
+ *
+ * AXI DMA buffer descriptors carry five user application words, which the
+ * engine puts out on its control stream ahead of a TX frame; the stream IP
+ * takes TUSER/TDEST and the like from there. xilinx_dma fills them into the
+ * first descriptor of a TX transfer from the context argument of
+ * device_prep_slave_sg(). dmaengine_prep_slave_sg() always passes NULL, so
+ * UDMA_IOC_META_XFER transfers call the driver's op directly. The drivers
+ * of the kernels this builds against hand nothing back for RX.
+ */
+
+#define UDMA_AXIDMA_COMPATIBLE  "xlnx,axi-dma-1.00.a"
+#define UDMA_AXIDMA_APP_WORDS   (5)     // UDMA_META_MAX bytes
+
+// Whether transfers on p_info can carry app words.
+static bool udma_meta_supported( struct udma_drvdata * p_info )
+{
+    return UDMA_CPU_TO_DEV == p_info->dir &&
+           of_device_is_compatible( p_info->chan->device->dev->of_node, UDMA_AXIDMA_COMPATIBLE );
+}
+
+/* Runs in whatever context the DMA driver completes in (usually its
+ * tasklet). Completion processing is moved to the channel's kthread or
+ * to completion_cpu if the channel asks for it, so the waiter can be
+ * woken on the core it runs on.
+ */
+static void udma_dmaengine_callback_func(void *data, const struct dmaengine_result *result)
+{
+    struct udma_drvdata * p_info = (struct udma_drvdata*)data;
+    const int cpu = p_info->completion_cpu;
+    struct kthread_worker * const worker = READ_ONCE( p_info->worker );
+
+    // Published to the waiter by complete(), see udma_complete().
+    p_info->inflight.ts[UDMA_LAT_WAKE] = ktime_get_ns();
+    if ( result && result->residue <= p_info->inflight.len )
+        p_info->inflight.residue = result->residue;
+
+    if ( worker )
+        kthread_queue_work( worker, &p_info->complete_kwork );
+    else if ( cpu >= 0 && cpu != raw_smp_processor_id() )
+        queue_work_on( cpu, system_highpri_wq, &p_info->complete_work );
+    else
+        udma_complete( p_info );
+}
+
+// Waits for completion work queued by a callback that has already run.
+static void udma_flush_completion( struct udma_drvdata * p_info )
+{
+    if ( p_info->worker )
+        kthread_flush_work( &p_info->complete_kwork );
+    flush_work( &p_info->complete_work );
+}
+
+static void udma_init_completion( struct udma_drvdata * p_info )
+{
+    p_info->completion_cpu = -1;
+    p_info->completion_prio = 0;
+    p_info->completion_thread = false;
+    p_info->worker = NULL;
+    kthread_init_work( &p_info->complete_kwork, udma_complete_kwork );
+    INIT_WORK( &p_info->complete_work, udma_complete_work );
+}
+
+// Applies priority to the completion thread.
+static int udma_set_worker_prio( struct kthread_worker * worker, int prio )
+{
+    struct sched_param param = { .sched_priority = prio };
+
+    return sched_setscheduler( worker->task, prio ? SCHED_FIFO : SCHED_NORMAL, &param );
+}
+
+/* Reconfigures completion delivery of p_info. Only done while the channel
+ * is idle (sem free), so no callback can be queued on a worker that goes away.
+ */
+static int udma_set_completion( struct udma_drvdata * p_info, int cpu, bool thread, int prio )
+{
+    struct kthread_worker * old_worker;
+    struct kthread_worker * new_worker = NULL;
+    int rv = 0;
+
+    if ( cpu < -1 || (cpu >= 0 && (cpu >= nr_cpu_ids || !cpu_online(cpu))) )
+        return -EINVAL;
+    if ( prio < 0 || prio >= MAX_USER_RT_PRIO )
+        return -EINVAL;
+
+    // Transfers hold sem from start to end.
+    if ( down_trylock( &p_info->sem ) )
+        return -EBUSY;
+
+    old_worker = p_info->worker;
+
+    // Keep the running thread if only its priority changes.
+    if ( thread && old_worker && cpu == p_info->completion_cpu )
+    {
+        rv = udma_set_worker_prio( old_worker, prio );
+        if ( !rv )
+            p_info->completion_prio = prio;
+        goto out;
+    }
+
+    if ( thread )
+    {
+        if ( cpu >= 0 )
+            new_worker = kthread_create_worker_on_cpu( cpu, 0, "udma/%s", p_info->name );
+        else
+            new_worker = kthread_create_worker( 0, "udma/%s", p_info->name );
+
+        if ( IS_ERR(new_worker) )
+        {
+            rv = PTR_ERR(new_worker);
+            goto out;
+        }
+
+        if ( (rv = udma_set_worker_prio( new_worker, prio )) )
+        {
+            kthread_destroy_worker( new_worker );
+            goto out;
+        }
+    }
+
+    WRITE_ONCE( p_info->worker, new_worker );
+    p_info->completion_cpu = cpu;
+    p_info->completion_thread = thread;
+    p_info->completion_prio = prio;
+
+    // Anything queued before the switch is flushed here.
+    if ( old_worker )
+        kthread_destroy_worker( old_worker );
+    flush_work( &p_info->complete_work );
+
+    out:
+    up( &p_info->sem );
+    return rv;
+}
+
+static void udma_teardown_completion( struct udma_drvdata * p_info )
+{
+    struct kthread_worker * const worker = p_info->worker;
+
+    WRITE_ONCE( p_info->worker, NULL );
+
+    if ( worker )
+        kthread_destroy_worker( worker );
+    flush_work( &p_info->complete_work );
+}
+
+
+/* Hands inflight.table to the dmaengine; the caller unprepares on failure.
+ * The state is DMA_IN_FLIGHT already, the callback may run before we return.
+ */
+static int udma_submit_dma_now( struct udma_drvdata * p_info )
+{
+    struct dma_async_tx_descriptor * txn_desc;
+    struct scatterlist * const sgl = p_info->inflight.table.sgl;
+    u32 app[UDMA_AXIDMA_APP_WORDS] = { 0 };     // the driver copies all of them
+    dma_cookie_t cookie;
+
+    if ( p_info->meta )
+    {
+        memcpy( app, p_info->meta->meta, p_info->meta->meta_len );
+        txn_desc = p_info->chan->device->device_prep_slave_sg(
+                p_info->chan,
+                sgl,
+                p_info->inflight.nents,
+                DMA_MEM_TO_DEV,
+                DMA_PREP_INTERRUPT,
+                app );
+    }
+    else
+    {
+        txn_desc = dmaengine_prep_slave_sg(
+                p_info->chan,
+                sgl,
+                p_info->inflight.nents,
+                p_info->dir == UDMA_DEV_TO_CPU ? DMA_DEV_TO_MEM : DMA_MEM_TO_DEV,
+                DMA_PREP_INTERRUPT);    // run callback after this one
+    }
+
+    if ( !txn_desc )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: dmaengine_prep_slave_sg() failed\n", p_info->name);
+        return -ENOMEM;
+    }
+
+    txn_desc->callback_result = udma_dmaengine_callback_func;
+    txn_desc->callback_param = p_info;
+
+    cookie = dmaengine_submit(txn_desc);
+
+    if ( cookie < DMA_MIN_COOKIE )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: dmaengine_submit() returned %d\n", p_info->name, cookie);
+        return cookie;
+    }
+
+    p_info->inflight.cookie = cookie;
+    p_info->inflight.dma_started = 1;
+    dma_async_issue_pending( p_info->chan );    // Bam!
+
+    return 0;
+}
+
+
+/*
+ * Submission
+ *
+ * A channel with submit_cpu set has its own kthread bound to that CPU, and
+ * prep + submit + issue_pending of its transfers run there instead of in the
+ * caller. Different channels of one multichannel DMA can so be serviced by
+ * different cores. Pinning and mapping stay in the caller, which owns the mm.
+ */
+
+static void udma_submit_kwork( struct kthread_work *work )
+{
+    struct udma_drvdata * p_info = container_of( work, struct udma_drvdata, submit_kwork );
+    int rv;
+
+    // Already given up on by the waiter, see udma_stop_partial().
+    if ( DMA_IN_FLIGHT != atomic_read( &p_info->state ) )
+        return;
+
+    // On failure the waiter is completed like for a finished transfer and
+    // picks the reason up from submit_rv.
+    if ( (rv = udma_submit_dma_now( p_info )) )
+    {
+        p_info->inflight.submit_rv = rv;
+        udma_complete( p_info );
+    }
+}
+
+/*
+ * Rate shaping
+ *
+ * A channel can be limited in bytes per second through sysfs, and an fd's
+ * TX transfers through UDMA_IOC_SET_TX_RATE. Both are token buckets that a
+ * transfer draws its length from at submission. If either runs short, the
+ * transfer is mapped already but held back on shape_timer until the tokens
+ * are there, instead of letting the caller sleep on it.
+ */
+
+// Soft hrtimers run their callback from softirq context like the tasklets of
+// most dmaengine drivers, older kernels only have the hardirq kind.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,16,0)
+#define UDMA_SHAPE_TIMER_MODE   HRTIMER_MODE_REL_SOFT
+#else
+#define UDMA_SHAPE_TIMER_MODE   HRTIMER_MODE_REL
+#endif
+
+static void udma_bucket_init( struct udma_bucket * b )
+{
+    spin_lock_init( &b->lock );
+    b->rate = 0;
+    b->burst = 0;
+    b->tokens = 0;
+    b->last_ns = 0;
+}
+
+static void udma_bucket_set( struct udma_bucket * b, u64 rate, u32 burst )
+{
+    unsigned long flags;
+
+    spin_lock_irqsave( &b->lock, flags );
+    b->rate = rate;
+    b->burst = burst;
+    b->tokens = burst;      // start full
+    b->last_ns = ktime_get_ns();
+    spin_unlock_irqrestore( &b->lock, flags );
+}
+
+/* Draws cost bytes from b and returns how many ns the transfer has to wait
+ * until the bucket would have held min(cost, burst) of them. The rest is
+ * taken on credit and paid off by whoever comes next, so a transfer larger
+ * than the burst is not held back forever.
+ */
+static u64 udma_bucket_take( struct udma_bucket * b, size_t cost, u64 now )
+{
+    unsigned long flags;
+    u64 wait = 0;
+    u64 full_ns;
+    s64 need;
+
+    spin_lock_irqsave( &b->lock, flags );
+    if ( b->rate )
+    {
+        // Refilling for longer than full_ns overflows the burst anyway, and
+        // stopping there keeps the product below from overflowing.
+        full_ns = div64_u64( (u64)(b->burst - b->tokens) * NSEC_PER_SEC, b->rate );
+        if ( now - b->last_ns >= full_ns )
+            b->tokens = b->burst;
+        else
+            b->tokens = min_t( s64, b->burst,
+                               b->tokens + (s64)div64_u64( (now - b->last_ns) * b->rate, NSEC_PER_SEC ) );
+        b->last_ns = now;
+
+        need = min_t( s64, cost, b->burst );
+        if ( b->tokens < need )
+            wait = div64_u64( (u64)(need - b->tokens) * NSEC_PER_SEC, b->rate );
+        b->tokens -= cost;
+    }
+    spin_unlock_irqrestore( &b->lock, flags );
+
+    return wait;
+}
+
+/* Returns how long the transfer prepared in inflight has to be held back,
+ * in ns. Its length is drawn from both buckets, the longer wait counts.
+ */
+static u64 udma_shape_delay( struct udma_drvdata * p_info )
+{
+    const u64 now = ktime_get_ns();
+    u64 wait;
+
+    wait = udma_bucket_take( &p_info->shape, p_info->inflight.len, now );
+    if ( p_info->shape_fd )
+        wait = max( wait, udma_bucket_take( p_info->shape_fd, p_info->inflight.len, now ) );
+
+    if ( wait )
+    {
+        ++p_info->shape_delayed;
+        p_info->shape_wait_ns += wait;
+    }
+    return wait;
+}
+
+static enum hrtimer_restart udma_shape_timer_fn( struct hrtimer * timer )
+{
+    struct udma_drvdata * p_info = container_of( timer, struct udma_drvdata, shape_timer );
+    int rv;
+
+    // Already given up on by the waiter, see udma_stop_partial().
+    if ( DMA_IN_FLIGHT != atomic_read( &p_info->state ) )
+        return HRTIMER_NORESTART;
+
+    if ( p_info->submit_worker )
+        kthread_queue_work( p_info->submit_worker, &p_info->submit_kwork );
+    else if ( (rv = udma_submit_dma_now( p_info )) )
+    {
+        p_info->inflight.submit_rv = rv;
+        udma_complete( p_info );
+    }
+
+    return HRTIMER_NORESTART;
+}
+
+static void udma_init_shape( struct udma_drvdata * p_info )
+{
+    udma_bucket_init( &p_info->shape );
+    p_info->shape_fd = NULL;
+    p_info->shape_delayed = 0;
+    p_info->shape_wait_ns = 0;
+    hrtimer_init( &p_info->shape_timer, CLOCK_MONOTONIC, UDMA_SHAPE_TIMER_MODE );
+    p_info->shape_timer.function = udma_shape_timer_fn;
+}
+
+static int udma_submit_dma( struct udma_drvdata * p_info )
+{
+    u64 delay;
+    int rv;
+
+    p_info->inflight.ts[UDMA_LAT_HW] = ktime_get_ns();
+
+    if ( DMA_IDLE != atomic_cmpxchg( &p_info->state, DMA_IDLE, DMA_IN_FLIGHT ) )
+        return -EBUSY;
+
+    // The wait counts into the hw phase of the latency histogram.
+    if ( (delay = udma_shape_delay( p_info )) )
+    {
+        hrtimer_start( &p_info->shape_timer, ns_to_ktime( delay ), UDMA_SHAPE_TIMER_MODE );
+        return 0;
+    }
+
+    if ( p_info->submit_worker )
+    {
+        kthread_queue_work( p_info->submit_worker, &p_info->submit_kwork );
+        return 0;
+    }
+
+    if ( (rv = udma_submit_dma_now( p_info )) )
+        atomic_set( &p_info->state, DMA_IDLE );
+
+    return rv;
+}
+
+static void udma_init_submit( struct udma_drvdata * p_info )
+{
+    p_info->submit_cpu = -1;
+    p_info->submit_worker = NULL;
+    kthread_init_work( &p_info->submit_kwork, udma_submit_kwork );
+}
+
+static int udma_set_submit_cpu( struct udma_drvdata * p_info, int cpu )
+{
+    struct kthread_worker * old_worker;
+    struct kthread_worker * new_worker = NULL;
+    int rv = 0;
+
+    if ( cpu < -1 || (cpu >= 0 && (cpu >= nr_cpu_ids || !cpu_online(cpu))) )
+        return -EINVAL;
+
+    if ( down_trylock( &p_info->sem ) )
+        return -EBUSY;
+
+    if ( cpu >= 0 )
+    {
+        new_worker = kthread_create_worker_on_cpu( cpu, 0, "udma-sq/%s", p_info->name );
+        if ( IS_ERR(new_worker) )
+        {
+            rv = PTR_ERR(new_worker);
+            goto out;
+        }
+    }
+
+    old_worker = p_info->submit_worker;
+    p_info->submit_worker = new_worker;
+    p_info->submit_cpu = cpu;
+
+    if ( old_worker )
+        kthread_destroy_worker( old_worker );
+
+    out:
+    up( &p_info->sem );
+    return rv;
+}
+
+static void udma_teardown_submit( struct udma_drvdata * p_info )
+{
+    if ( p_info->submit_worker )
+        kthread_destroy_worker( p_info->submit_worker );
+    p_info->submit_worker = NULL;
+}
+
+/* Returns how many bytes of the mapped entries dma_map_sg() bounced
+ * through swiotlb, which doubles the memory traffic of the transfer. Without
+ * an IOMMU a mapping is the page's own bus address unless it was bounced.
+ * is_swiotlb_buffer() would tell for sure but isn't exported to modules.
+ */
+static size_t udma_count_swiotlb( struct udma_drvdata * p_info, struct scatterlist * sgl, unsigned int nents )
+{
+    struct device * const dev = &p_info->pdev->dev;
+    struct scatterlist * sg;
+    size_t bytes = 0;
+    int i;
+
+    if ( dev->iommu_group )
+        return 0;
+
+    for_each_sg( sgl, sg, nents, i )
+    {
+        if ( sg_dma_address(sg) != phys_to_dma( dev, sg_phys(sg) ) )
+            bytes += sg->length;
+    }
+
+    return bytes;
+}
+
+// should be called with p_info->sem held
+static void udma_account_swiotlb( struct udma_drvdata * p_info, size_t bytes )
+{
+    if ( !bytes )
+        return;
+
+    ++p_info->swiotlb_xfers;
+    p_info->swiotlb_bytes += bytes;
+}
+
+/* Maps the map_nents pinned page entries of inflight.table starting at
+ * map_sgl and submits all nents entries. Bounce entries around them carry
+ * their DMA address already.
+ */
+static int udma_map_and_submit( struct udma_drvdata * p_info )
+{
+    int rv;
+
+    // dma_map_sg =>  if        DMA_TO_DEVICE : The memory must be flushed from the cache to memory before a DMA transfer is started.
+    //			      else if   DEVICE_TO_DMA : The cache must be invalidated after the transfer and before the CPU accesses memory.
+    if ( p_info->inflight.map_nents )
+    {
+        rv = dma_map_sg(&p_info->pdev->dev,
+                    p_info->inflight.map_sgl,
+                    p_info->inflight.map_nents,
+                    p_info->dir == UDMA_DEV_TO_CPU ? DMA_FROM_DEVICE : DMA_TO_DEVICE);
+
+        if ( rv != p_info->inflight.map_nents )
+        {
+            printk( KERN_ERR KBUILD_MODNAME ": %s: dma_map_sg() returned %d, expected %d\n", 
+                    p_info->name, rv, p_info->inflight.map_nents);
+            return -ENOMEM;
+        }
+
+        p_info->inflight.dma_mapped = 1;
+        p_info->inflight.swiotlb_bytes = udma_count_swiotlb( p_info, p_info->inflight.map_sgl,
+                                                             p_info->inflight.map_nents );
+        udma_account_swiotlb( p_info, p_info->inflight.swiotlb_bytes );
+    }
+
+    return udma_submit_dma( p_info );
+}
+
+/*
+ * Pinned page cache
+ *
+ * Programs that read()/write() the same few buffers over and over pay for
+ * get_user_pages_fast() and dma_map_sg() on every call. Once a channel has
+ * a pin_cache_kb budget, it keeps the pages of recent buffers pinned and
+ * mapped, keyed by fd, address and length, and a repeated transfer only
+ * syncs the CPU caches. An MMU notifier on the process drops entries whose
+ * range gets unmapped, remapped or write protected for COW after fork();
+ * past the budget the least recently used ones go.
+ */
+
+static DEFINE_SPINLOCK(udma_pcache_lock);   // protects every udma_pcache, udma_pcache_ctx and their entries
+
+static void udma_pcache_free_entry( struct udma_pcache_entry * e )
+{
+    struct udma_drvdata * const p_info = e->p_info;
+    unsigned int i;
+
+    dma_unmap_sg( &p_info->pdev->dev, e->table.sgl, e->num_pages,
+                  p_info->dir == UDMA_DEV_TO_CPU ? DMA_FROM_DEVICE : DMA_TO_DEVICE );
+    for ( i = 0; i < e->num_pages; ++i )
+        put_page( e->pages[i] );
+    sg_free_table( &e->table );
+    kfree( e->pages );
+    kfree( e );
+}
+
+static void udma_pcache_free_list( struct list_head * free_list )
+{
+    struct udma_pcache_entry * e, * tmp;
+
+    list_for_each_entry_safe( e, tmp, free_list, lru )
+    {
+        list_del( &e->lru );
+        udma_pcache_free_entry( e );
+    }
+}
+
+/* Takes e out of the cache. Idle entries are moved to free_list, to be
+ * freed once the lock is dropped; a busy one is freed by its transfer.
+ * should be called with udma_pcache_lock held
+ */
+static void udma_pcache_unlink( struct udma_pcache_entry * e, struct list_head * free_list )
+{
+    list_del_init( &e->ctx_node );
+    e->p_info->pcache.pinned -= (size_t)e->num_pages << PAGE_SHIFT;
+
+    if ( e->busy )
+    {
+        e->dead = true;
+        list_del_init( &e->lru );
+    }
+    else
+    {
+        list_move_tail( &e->lru, free_list );
+    }
+}
+
+// should be called with udma_pcache_lock held
+static void udma_pcache_trim( struct udma_drvdata * p_info, size_t budget, struct list_head * free_list )
+{
+    struct udma_pcache_entry * e, * tmp;
+
+    list_for_each_entry_safe( e, tmp, &p_info->pcache.lru, lru )
+    {
+        if ( p_info->pcache.pinned <= budget )
+            break;
+        if ( e->busy )
+            continue;
+
+        udma_pcache_unlink( e, free_list );
+        ++p_info->pcache.evicted;
+    }
+}
+
+// Shrinks the cache of p_info to budget bytes, 0 drops every idle entry.
+static void udma_pcache_shrink( struct udma_drvdata * p_info, size_t budget )
+{
+    LIST_HEAD(free_list);
+
+    spin_lock( &udma_pcache_lock );
+    udma_pcache_trim( p_info, budget, &free_list );
+    spin_unlock( &udma_pcache_lock );
+
+    udma_pcache_free_list( &free_list );
+}
+
+#ifdef CONFIG_MMU_NOTIFIER
+
+// Drops the entries of ctx that have pages in [start, end).
+static void udma_pcache_invalidate( struct udma_pcache_ctx * ctx, unsigned long start, unsigned long end )
+{
+    struct udma_pcache_entry * e, * tmp;
+    LIST_HEAD(free_list);
+
+    spin_lock( &udma_pcache_lock );
+    ++ctx->invalidate_seq;
+    list_for_each_entry_safe( e, tmp, &ctx->entries, ctx_node )
+    {
+        if ( (e->start & PAGE_MASK) < end && start < PAGE_ALIGN(e->start + e->len) )
+        {
+            udma_pcache_unlink( e, &free_list );
+            ++e->p_info->pcache.invalidated;
+        }
+    }
+    spin_unlock( &udma_pcache_lock );
+
+    udma_pcache_free_list( &free_list );
+}
+
+static void udma_pcache_mn_release( struct mmu_notifier *mn, struct mm_struct *mm )
+{
+    udma_pcache_invalidate( container_of( mn, struct udma_pcache_ctx, mn ), 0, ULONG_MAX );
+}
+
+static void udma_pcache_mn_range_start( struct mmu_notifier *mn, struct mm_struct *mm,
+                                        unsigned long start, unsigned long end )
+{
+    struct udma_pcache_ctx * const ctx = container_of( mn, struct udma_pcache_ctx, mn );
+
+    // Keeps a lookup racing with this from caching pages about to go.
+    spin_lock( &udma_pcache_lock );
+    ++ctx->invalidating;
+    spin_unlock( &udma_pcache_lock );
+
+    udma_pcache_invalidate( ctx, start, end );
+}
+
+static void udma_pcache_mn_range_end( struct mmu_notifier *mn, struct mm_struct *mm,
+                                      unsigned long start, unsigned long end )
+{
+    struct udma_pcache_ctx * const ctx = container_of( mn, struct udma_pcache_ctx, mn );
+
+    spin_lock( &udma_pcache_lock );
+    --ctx->invalidating;
+    spin_unlock( &udma_pcache_lock );
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,13,0)
+static void udma_pcache_mn_page( struct mmu_notifier *mn, struct mm_struct *mm, unsigned long address )
+{
+    udma_pcache_invalidate( container_of( mn, struct udma_pcache_ctx, mn ),
+                            address, address + PAGE_SIZE );
+}
+#endif
+
+static const struct mmu_notifier_ops udma_pcache_mn_ops = {
+    .release                = udma_pcache_mn_release,
+    .invalidate_range_start = udma_pcache_mn_range_start,
+    .invalidate_range_end   = udma_pcache_mn_range_end,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,13,0)
+    .invalidate_page        = udma_pcache_mn_page,
+#endif
+};
+
+/* The cache context of p_file, set up on first use. Only the process that
+ * first used the fd gets its buffers cached; anyone it shares the fd with
+ * (a child after fork()) takes the uncached path.
+ */
+static struct udma_pcache_ctx *udma_pcache_ctx( struct udma_file * p_file )
+{
+    struct udma_pcache_ctx * ctx;
+
+    mutex_lock( &p_file->lock );
+    ctx = p_file->pcache;
+    if ( !ctx && current->mm )
+    {
+        ctx = kzalloc( sizeof(*ctx), GFP_KERNEL );
+        if ( ctx )
+        {
+            INIT_LIST_HEAD( &ctx->entries );
+            ctx->mn.ops = &udma_pcache_mn_ops;
+            ctx->mm = current->mm;
+
+            if ( mmu_notifier_register( &ctx->mn, ctx->mm ) )
+            {
+                kfree( ctx );
+                ctx = NULL;
+            }
+            else
+            {
+                atomic_inc( &ctx->mm->mm_count );  // for the unregister in udma_pcache_release()
+                p_file->pcache = ctx;
+            }
+        }
+    }
+    mutex_unlock( &p_file->lock );
+
+    return ( ctx && ctx->mm == current->mm ) ? ctx : NULL;
+}
+
+// Drops every entry of p_file; called on close.
+static void udma_pcache_release( struct udma_file * p_file )
+{
+    struct udma_pcache_ctx * const ctx = p_file->pcache;
+    struct udma_pcache_entry * e, * tmp;
+    LIST_HEAD(free_list);
+
+    if ( !ctx )
+        return;
+
+    mmu_notifier_unregister( &ctx->mn, ctx->mm );
+
+    // No transfer of the fd is left, so none of these is busy.
+    spin_lock( &udma_pcache_lock );
+    list_for_each_entry_safe( e, tmp, &ctx->entries, ctx_node )
+        udma_pcache_unlink( e, &free_list );
+    spin_unlock( &udma_pcache_lock );
+
+    udma_pcache_free_list( &free_list );
+
+    mmdrop( ctx->mm );
+    kfree( ctx );
+    p_file->pcache = NULL;
+}
+
+#else
+
+static struct udma_pcache_ctx *udma_pcache_ctx( struct udma_file * p_file )
+{
+    return NULL;
+}
+
+static void udma_pcache_release( struct udma_file * p_file )
+{
+}
+
+#endif /* CONFIG_MMU_NOTIFIER */
+
+/* Looks [userbuf, userbuf+count) up in the cache of p_info. On a hit the
+ * transfer is set up on the cached table, synced for the device, and true
+ * is returned. On a miss *seq is what udma_pcache_insert() needs to tell
+ * whether the range was invalidated while the pages were being pinned.
+ */
+static bool udma_pcache_lookup(
+        struct udma_drvdata * p_info,
+        struct udma_pcache_ctx * ctx,
+        char __user *userbuf,
+        size_t count,
+        unsigned long * seq )
+{
+    struct udma_pcache_entry * e;
+    struct udma_pcache_entry * hit = NULL;
+
+    spin_lock( &udma_pcache_lock );
+    list_for_each_entry( e, &ctx->entries, ctx_node )
+    {
+        if ( e->p_info == p_info && e->start == (unsigned long)userbuf && e->len == count )
+        {
+            hit = e;
+            break;
+        }
+    }
+
+    if ( hit )
+    {
+        hit->busy = true;
+        list_move_tail( &hit->lru, &p_info->pcache.lru );
+        ++p_info->pcache.hits;
+    }
+    else
+    {
+        *seq = ctx->invalidate_seq;
+        ++p_info->pcache.misses;
+    }
+    spin_unlock( &udma_pcache_lock );
+
+    if ( !hit )
+        return false;
+
+    p_info->inflight.ts[UDMA_LAT_MAP] = ktime_get_ns();
+    p_info->inflight.cached = hit;
+    p_info->inflight.table = hit->table;
+    p_info->inflight.num_pages = hit->num_pages;
+    p_info->inflight.nents = hit->num_pages;
+    p_info->inflight.map_sgl = hit->table.sgl;
+    p_info->inflight.map_nents = hit->num_pages;
+
+    dma_sync_sg_for_device( &p_info->pdev->dev, hit->table.sgl, hit->num_pages,
+                            p_info->dir == UDMA_DEV_TO_CPU ? DMA_FROM_DEVICE : DMA_TO_DEVICE );
+    udma_account_swiotlb( p_info, hit->swiotlb_bytes );     // every sync copies them again
+    return true;
+}
+
+/* Hands the pages, table and mapping of the transfer just submitted over to
+ * a new cache entry, unless the budget is too small or the range has been
+ * invalidated since udma_pcache_lookup().
+ */
+static void udma_pcache_insert(
+        struct udma_drvdata * p_info,
+        struct udma_pcache_ctx * ctx,
+        char __user *userbuf,
+        size_t count,
+        unsigned long seq )
+{
+    const size_t size = (size_t)p_info->inflight.num_pages << PAGE_SHIFT;
+    struct udma_pcache_entry * e;
+    LIST_HEAD(free_list);
+
+    if ( size > READ_ONCE( p_info->pcache.budget ) )
+        return;
+
+    e = kzalloc( sizeof(*e), GFP_KERNEL );
+    if ( !e )
+        return;
+
+    spin_lock( &udma_pcache_lock );
+    if ( seq != ctx->invalidate_seq || ctx->invalidating )
+    {
+        spin_unlock( &udma_pcache_lock );
+        kfree( e );
+        return;
+    }
+
+    e->p_info = p_info;
+    e->start = (unsigned long)userbuf;
+    e->len = count;
+    e->pages = p_info->inflight.pinned_pages;
+    e->num_pages = p_info->inflight.num_pages;
+    e->table = p_info->inflight.table;
+    e->swiotlb_bytes = p_info->inflight.swiotlb_bytes;
+    e->busy = true;
+    list_add_tail( &e->ctx_node, &ctx->entries );
+    list_add_tail( &e->lru, &p_info->pcache.lru );
+    p_info->pcache.pinned += size;
+    udma_pcache_trim( p_info, p_info->pcache.budget, &free_list );
+    spin_unlock( &udma_pcache_lock );
+
+    p_info->inflight.cached = e;
+    p_info->inflight.pinned_pages = NULL;
+    p_info->inflight.pages_pinned = 0;
+    p_info->inflight.table_allocated = 0;
+    p_info->inflight.dma_mapped = 0;
+
+    udma_pcache_free_list( &free_list );
+}
+
+// Ends the transfer's use of its cache entry, from udma_unprepare_after_dma().
+static void udma_pcache_done( struct udma_drvdata * p_info )
+{
+    struct udma_pcache_entry * const e = p_info->inflight.cached;
+    bool dead;
+
+    if ( p_info->dir == UDMA_DEV_TO_CPU )
+    {
+        unsigned int i;
+
+        dma_sync_sg_for_cpu( &p_info->pdev->dev, e->table.sgl, e->num_pages, DMA_FROM_DEVICE );
+        if ( p_info->inflight.dma_started )
+        {
+            for ( i = 0; i < e->num_pages; ++i )
+                set_page_dirty( e->pages[i] );
+        }
+    }
+
+    spin_lock( &udma_pcache_lock );
+    e->busy = false;
+    dead = e->dead;
+    spin_unlock( &udma_pcache_lock );
+
+    if ( dead )
+        udma_pcache_free_entry( e );
+
+    p_info->inflight.cached = NULL;
+}
+
+/*
+ * Unaligned user buffers
+ *
+ * A channel with an align above 1 can only start buffers on that boundary.
+ * The head of a user buffer up to the first boundary and the tail after the
+ * last one are moved through the channel's bounce area, head at bounce and
+ * tail at bounce + align, as extra entries of the same descriptor; the body
+ * in between is DMAed in place. Neither edge crosses a page, so they are
+ * copied through the pinned pages and not through the user mapping.
+ */
+
+// Points sg at len bytes of the bounce area, which is mapped for good.
+static void udma_bounce_entry( struct udma_drvdata * p_info, struct scatterlist * sg,
+                               unsigned int boff, unsigned int len )
+{
+    sg->length = len;
+    sg_dma_address( sg ) = p_info->bounce_dma + boff;
+    sg_dma_len( sg ) = len;
+}
+
+// Copies len bytes between the bounce area at boff and the buffer at uoff.
+static void udma_bounce_copy( struct udma_drvdata * p_info, unsigned int boff,
+                              size_t uoff, size_t len, bool to_user )
+{
+    const size_t pos = p_info->inflight.page_offset + uoff;
+    struct page * const page = p_info->inflight.pinned_pages[pos >> PAGE_SHIFT];
+    char * const vaddr = kmap_atomic( page );
+
+    if ( to_user )
+    {
+        memcpy( vaddr + offset_in_page(pos), (char *)p_info->bounce + boff, len );
+        flush_dcache_page( page );
+    }
+    else
+    {
+        memcpy( (char *)p_info->bounce + boff, vaddr + offset_in_page(pos), len );
+    }
+
+    kunmap_atomic( vaddr );
+}
+
+// TX: fills the bounce area before submission.
+static void udma_bounce_out( struct udma_drvdata * p_info )
+{
+    if ( p_info->inflight.head )
+        udma_bounce_copy( p_info, 0, 0, p_info->inflight.head, false );
+    if ( p_info->inflight.tail )
+        udma_bounce_copy( p_info, p_info->align, p_info->inflight.len - p_info->inflight.tail,
+                          p_info->inflight.tail, false );
+}
+
+// RX: copies back the edges that are part of the done bytes received.
+static void udma_bounce_in( struct udma_drvdata * p_info, size_t done )
+{
+    const size_t tail_start = p_info->inflight.len - p_info->inflight.tail;
+
+    if ( p_info->inflight.head )
+        udma_bounce_copy( p_info, 0, 0, min_t( size_t, done, p_info->inflight.head ), true );
+    if ( p_info->inflight.tail && done > tail_start )
+        udma_bounce_copy( p_info, p_info->align, tail_start, done - tail_start, true );
+}
+
+static int udma_prepare_for_dma(
+        struct udma_file * p_file,
+        struct udma_drvdata * p_info, 
+        char __user *userbuf,
+        size_t count
+)
+{
+    const u32 align_mask = p_info->align - 1;
+    struct udma_pcache_ctx * ctx = NULL;
+    unsigned long seq = 0;
+    size_t body;
+    int rv;
+
+    BUG_ON( p_info->inflight.pinned_pages ); // should be NULL
+    memset( &p_info->inflight, 0, sizeof( struct udma_inflight_info ) );
+    init_completion( &p_info->inflight.done );
+    p_info->inflight.len = count;
+    p_info->inflight.ts[UDMA_LAT_PIN] = ktime_get_ns();
+
+    // Everything short of the first and after the last align boundary is bounced.
+    p_info->inflight.head = min_t( size_t, count, -(unsigned long)userbuf & align_mask );
+    p_info->inflight.tail = (count - p_info->inflight.head) & align_mask;
+    body = count - p_info->inflight.head - p_info->inflight.tail;
+
+    // Cached entries are mapped as a whole, so bounced buffers stay out.
+    if ( READ_ONCE( p_info->pcache.budget ) && !p_info->inflight.head && !p_info->inflight.tail )
+        ctx = udma_pcache_ctx( p_file );
+
+    if ( ctx && udma_pcache_lookup( p_info, ctx, userbuf, count, &seq ) )
+    {
+        if ( (rv = udma_submit_dma( p_info )) )
+            goto err_out;
+        return 0;
+    }
+    
+    p_info->inflight.page_offset = offset_in_page(userbuf);
+    p_info->inflight.num_pages = (offset_in_page(userbuf) + count + PAGE_SIZE-1) / PAGE_SIZE;
+    p_info->inflight.pinned_pages = kmalloc( 
+        p_info->inflight.num_pages * sizeof(struct page*),
+        GFP_KERNEL);
+
+    if ( !p_info->inflight.pinned_pages )
+    {
+        rv = -ENOMEM;
+        goto err_out;
+    }
+
+    // One entry per page of the body, plus one for each bounced edge.
+    {
+        const size_t body_pos = p_info->inflight.page_offset + p_info->inflight.head;
+
+        if ( body )
+            p_info->inflight.map_nents = ((body_pos + body - 1) >> PAGE_SHIFT) - (body_pos >> PAGE_SHIFT) + 1;
+        p_info->inflight.nents = p_info->inflight.map_nents +
+            !!p_info->inflight.head + !!p_info->inflight.tail;
+    }
+
+    if ( (rv = sg_alloc_table(
+                    &p_info->inflight.table, 
+                    p_info->inflight.nents,
+                    GFP_KERNEL )) )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: sg_alloc_table() returned %d\n", 
+                p_info->name, rv);
+        goto err_out;
+    }
+    else
+    {
+        p_info->inflight.table_allocated = 1;
+    }
+
+    rv = get_user_pages_fast(
+            (unsigned long)userbuf,             // start
+            p_info->inflight.num_pages,
+            p_info->dir == UDMA_DEV_TO_CPU,    // write
+            p_info->inflight.pinned_pages);
+
+    if ( rv != p_info->inflight.num_pages )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: get_user_pages_fast() returned %d, expected %d\n",
+                p_info->name, rv, p_info->inflight.num_pages);
+
+        // Release the pages we did get.
+        p_info->inflight.num_pages = rv > 0 ? rv : 0;
+        p_info->inflight.pages_pinned = 1;
+        rv = rv < 0 ? rv : -EFAULT;
+        goto err_out;
+    }
+    else
+    {
+        p_info->inflight.pages_pinned = 1;
+        p_info->inflight.user_pages = 1;
+        p_info->inflight.ts[UDMA_LAT_MAP] = ktime_get_ns();
+    }
+
+    // Build scatterlist.
+    {
+        struct scatterlist * sg = p_info->inflight.table.sgl;
+        size_t pos = p_info->inflight.page_offset + p_info->inflight.head;
+        size_t left_to_map = body;
+
+        if ( p_info->inflight.head )
+        {
+            udma_bounce_entry( p_info, sg, 0, p_info->inflight.head );
+            sg = sg_next( sg );
+        }
+
+        p_info->inflight.map_sgl = sg;
+
+        while ( left_to_map )
+        {
+            const unsigned int offset = offset_in_page(pos);
+            const unsigned int len = min_t( size_t, left_to_map, PAGE_SIZE - offset );
+
+            sg_set_page( sg, p_info->inflight.pinned_pages[pos >> PAGE_SHIFT], len, offset );
+            pos += len;
+            left_to_map -= len;
+            sg = sg_next( sg );
+        }
+
+        if ( p_info->inflight.tail )
+            udma_bounce_entry( p_info, sg, p_info->align, p_info->inflight.tail );
+    }
+
+    if ( p_info->dir == UDMA_CPU_TO_DEV )
+        udma_bounce_out( p_info );
+
+    if ( (rv = udma_map_and_submit( p_info )) )
+        goto err_out;
+
+    if ( ctx )
+        udma_pcache_insert( p_info, ctx, userbuf, count, seq );
+
+    return 0;
+
+    err_out:
+    udma_unprepare_after_dma( p_info );
+    return rv;
+}
+
+/* Like udma_prepare_for_dma(), for the pages behind a bvec or pipe iov_iter
+ * (splice). Each segment may start anywhere in its page, so every page gets
+ * its own scatterlist entry; segments the channel can't start a buffer at
+ * fail the transfer with -EINVAL, there is no bouncing here. A pipe can hold
+ * less than count; the transfer is shortened to what fits. The iterator
+ * itself is not advanced.
+ */
+static int udma_prepare_iter(
+        struct udma_drvdata * p_info,
+        struct iov_iter * iter,
+        size_t count )
+{
+    const bool is_pipe = iter->type & ITER_PIPE;
+    struct iov_iter it = *iter;
+    struct scatterlist * sg;
+    struct scatterlist * last = NULL;
+    unsigned int max_pages;
+    bool misaligned = false;
+    size_t total = 0;
+    int rv;
+
+    BUG_ON( p_info->inflight.pinned_pages ); // should be NULL
+    memset( &p_info->inflight, 0, sizeof( struct udma_inflight_info ) );
+    init_completion( &p_info->inflight.done );
+    p_info->inflight.ts[UDMA_LAT_PIN] = ktime_get_ns();
+
+    max_pages = DIV_ROUND_UP( count, PAGE_SIZE ) + (is_pipe ? 1 : it.nr_segs);
+    p_info->inflight.pinned_pages = kcalloc( max_pages, sizeof(struct page*), GFP_KERNEL );
+    if ( !p_info->inflight.pinned_pages )
+    {
+        rv = -ENOMEM;
+        goto err_out;
+    }
+
+    if ( (rv = sg_alloc_table( &p_info->inflight.table, max_pages, GFP_KERNEL )) )
+        goto err_out;
+    p_info->inflight.table_allocated = 1;
+    p_info->inflight.pages_pinned = 1;     // num_pages counts the references taken so far
+
+    sg = p_info->inflight.table.sgl;
+
+    while ( total < count && p_info->inflight.num_pages < max_pages )
+    {
+        struct page ** const pages = p_info->inflight.pinned_pages + p_info->inflight.num_pages;
+        size_t start;
+        ssize_t got;
+        size_t left;
+        unsigned int i;
+
+        // For a pipe this allocates the pages and puts them in the pipe.
+        got = iov_iter_get_pages( is_pipe ? iter : &it, pages, count - total,
+                                  max_pages - p_info->inflight.num_pages, &start );
+        if ( got <= 0 )
+            break;
+
+        for ( i = 0, left = got; left; ++i )
+        {
+            const unsigned int len = min_t( size_t, left, PAGE_SIZE - start );
+
+            misaligned |= start & (p_info->align - 1);
+            sg_set_page( sg, pages[i], len, start );
+            last = sg;
+            sg = sg_next( sg );
+            start = 0;
+            left -= len;
+        }
+
+        p_info->inflight.num_pages += i;
+        total += got;
+
+        // The pipe hands out everything it has room for in one go.
+        if ( is_pipe )
+            break;
+        iov_iter_advance( &it, got );
+    }
+
+    if ( !total )
+    {
+        rv = is_pipe ? -EAGAIN : -EFAULT;
+        goto err_out;
+    }
+    sg_mark_end( last );
+
+    if ( misaligned )
+    {
+        rv = -EINVAL;
+        goto err_out;
+    }
+
+    p_info->inflight.len = total;
+    p_info->inflight.map_sgl = p_info->inflight.table.sgl;
+    p_info->inflight.map_nents = p_info->inflight.num_pages;
+    p_info->inflight.nents = p_info->inflight.num_pages;
+    p_info->inflight.ts[UDMA_LAT_MAP] = ktime_get_ns();
+
+    if ( (rv = udma_map_and_submit( p_info )) )
+        goto err_out;
+
+    return 0;
+
+    err_out:
+    udma_unprepare_after_dma( p_info );
+    return rv;
+}
+
+// should be called with p_info->sem held, once nothing can complete the transfer any more
+static void udma_unprepare_after_dma( struct udma_drvdata * p_info )
+{
+    if ( p_info->inflight.cached )
+        udma_pcache_done( p_info );
+
+    if ( p_info->inflight.dma_mapped )
+    {
+        dma_unmap_sg(&p_info->pdev->dev,
+                p_info->inflight.map_sgl,
+                p_info->inflight.map_nents,
+                p_info->dir == UDMA_DEV_TO_CPU ? DMA_FROM_DEVICE : DMA_TO_DEVICE);
+    }
+    p_info->inflight.dma_mapped = 0;
+
+    if ( p_info->inflight.pages_pinned )
+    {
+        int i;
+
+        for (i = 0; i < p_info->inflight.num_pages; ++i)
+        {
+            struct page * const page = p_info->inflight.pinned_pages[i];
+
+            /* Mark all pages dirty for now (not sure how to do this more
+             * efficiently yet -- dmaengine API doesn't seem to return any
+             * notion of how much data was actually transferred).
+             */
+            if ( p_info->inflight.dma_started && p_info->dir == UDMA_DEV_TO_CPU &&
+                 p_info->inflight.user_pages )
+                set_page_dirty( page );
+            put_page( page );
+        }
+    }
+    p_info->inflight.pages_pinned = 0;
+
+    if ( p_info->inflight.table_allocated )
+        sg_free_table( &p_info->inflight.table );
+    p_info->inflight.table_allocated = 0;
+
+    if ( p_info->inflight.pinned_pages )
+    {
+        kfree(p_info->inflight.pinned_pages);
+        p_info->inflight.pinned_pages = NULL;
+    }
+
+    atomic_set( &p_info->state, DMA_IDLE );
+}
+
+
+static int udma_prepare_dmabuf(
+        struct udma_drvdata * p_info,
+        struct udma_dmabuf_attachment * import,
+        u64 offset,
+        size_t count );
+
+/* Stops the transfer in flight on p_info and returns how many bytes of it
+ * made it, or 0 if the engine can't tell. Pausing first keeps the residue
+ * from moving between reading it and tearing the descriptor down. Called
+ * with sem held, after moving the state to DMA_STOPPING.
+ */
+static size_t udma_stop_partial( struct udma_drvdata * p_info )
+{
+    struct dma_tx_state tx_state;
+    enum dma_status status;
+    size_t done = 0;
+
+    // A queued submission sees DMA_STOPPING and backs off; one that is
+    // already running gets terminated below. The shape timer may queue one.
+    hrtimer_cancel( &p_info->shape_timer );
+    if ( p_info->submit_worker )
+        kthread_flush_work( &p_info->submit_kwork );
+
+    if ( !p_info->inflight.dma_started )
+        return 0;
+
+    dmaengine_pause( p_info->chan );    // not every engine can, then the residue is a snapshot
+    status = dmaengine_tx_status( p_info->chan, p_info->inflight.cookie, &tx_state );
+    dmaengine_terminate_sync( p_info->chan );
+
+    // The callback may have queued udma_complete() before the terminate;
+    // it must not run into the next transfer.
+    udma_flush_completion( p_info );
+
+    if ( DMA_COMPLETE == status )
+        done = p_info->inflight.len - p_info->inflight.residue;
+    else if ( p_info->residue_granularity != DMA_RESIDUE_GRANULARITY_DESCRIPTOR &&
+              tx_state.residue <= p_info->inflight.len )
+        done = p_info->inflight.len - tx_state.residue;
+
+    return done - (done % UDMA_ALIGN_BYTES);
+}
+
+/*
+ * Fair queuing
+ *
+ * Transfers ask the channel's scheduler for their turn before they take
+ * sem, so with several fds on one channel the order is deficit round robin
+ * by bytes and weight instead of whoever wakes up first. A lone client is
+ * granted right away. High priority transfers skip the round robin and go
+ * next in arrival order.
+ */
+
+#define UDMA_SCHED_DEF_QUANTUM  (64 << 10)
+
+static void udma_init_sched( struct udma_sched * sched )
+{
+    spin_lock_init( &sched->lock );
+    INIT_LIST_HEAD( &sched->clients );
+    INIT_LIST_HEAD( &sched->active );
+    INIT_LIST_HEAD( &sched->high );
+    sched->busy = false;
+    sched->quantum = UDMA_SCHED_DEF_QUANTUM;
+    sched->chunk = 0;
+}
+
+// Bytes c is credited per round.
+static u64 udma_sched_quantum( struct udma_sched * sched, struct udma_sched_client * c )
+{
+    return (u64)sched->quantum * READ_ONCE( c->owner->weight );
+}
+
+// Rounds c has to wait until its deficit covers its first request.
+static u64 udma_sched_rounds( struct udma_sched * sched, struct udma_sched_client * c )
+{
+    const struct udma_sched_req * req = list_first_entry( &c->reqs, struct udma_sched_req, node );
+    const u64 quantum = udma_sched_quantum( sched, c );
+
+    if ( c->deficit >= (s64)req->cost )
+        return 0;
+    return div64_u64( (u64)((s64)req->cost - c->deficit) + quantum - 1, quantum );
+}
+
+/* Grants the channel to the next request if it is free. The round robin is
+ * not walked one quantum at a time, which would take tens of thousands of
+ * passes for a single large write: the client that gets through after the
+ * fewest rounds (the earlier one on a tie) is picked, and every client is
+ * credited the rounds it would have seen by then.
+ */
+// should be called with sched->lock held
+static void udma_sched_dispatch( struct udma_sched * sched )
+{
+    struct udma_sched_client * first = NULL;
+    struct udma_sched_client * c;
+    struct udma_sched_req * req;
+    u64 min_rounds = U64_MAX;
+    bool ahead = true;
+
+    if ( sched->busy )
+        return;
+
+    if ( !list_empty( &sched->high ) )
+    {
+        req = list_first_entry( &sched->high, struct udma_sched_req, node );
+        list_del( &req->node );
+        goto grant;
+    }
+
+    if ( list_empty( &sched->active ) )
+        return;
+
+    list_for_each_entry( c, &sched->active, active_node )
+    {
+        const u64 rounds = udma_sched_rounds( sched, c );
+
+        if ( rounds < min_rounds )
+        {
+            min_rounds = rounds;
+            first = c;
+        }
+    }
+
+    // Those ahead of first were looked at once more in its round.
+    list_for_each_entry( c, &sched->active, active_node )
+    {
+        if ( c == first )
+            ahead = false;
+        c->deficit += (s64)((min_rounds + ahead) * udma_sched_quantum( sched, c ));
+    }
+    while ( list_first_entry( &sched->active, struct udma_sched_client, active_node ) != first )
+        list_move_tail( sched->active.next, &sched->active );
+
+    req = list_first_entry( &first->reqs, struct udma_sched_req, node );
+    first->deficit -= req->cost;
+    first->bytes += req->cost;
+    list_del( &req->node );
+    if ( list_empty( &first->reqs ) )
+    {
+        // Idle clients don't bank credit.
+        first->deficit = 0;
+        list_del_init( &first->active_node );
+    }
+
+    grant:
+    req->granted = true;
+    sched->busy = true;
+    complete( &req->done );     // under sched->lock, see udma_sched_acquire()
+}
+
+// should be called with sched->lock held
+static struct udma_sched_client *udma_sched_client( struct udma_sched * sched,
+        struct udma_file * p_file, struct udma_sched_client * spare )
+{
+    struct udma_sched_client * c;
+
+    list_for_each_entry( c, &sched->clients, node )
+    {
+        if ( c->owner == p_file )
+            return c;
+    }
+
+    if ( !spare )
+        return NULL;
+
+    INIT_LIST_HEAD( &spare->reqs );
+    INIT_LIST_HEAD( &spare->active_node );
+    spare->owner = p_file;
+    spare->deficit = 0;
+    spare->bytes = 0;
+    list_add_tail( &spare->node, &sched->clients );
+    return spare;
+}
+
+#define UDMA_ABORT_POLL     (HZ / 10)
+
+/* wait_for_completion_interruptible_timeout() that also gives up with
+ * -ENODEV once *abort is set, which it looks at every UDMA_ABORT_POLL.
+ * abort may be NULL. Returns -ETIMEDOUT rather than 0 on timeout.
+ */
+static long udma_wait_abortable( struct completion * done, unsigned long timeout, const bool * abort )
+{
+    unsigned long slice;
+    long rv;
+
+    if ( !abort )
+    {
+        rv = wait_for_completion_interruptible_timeout( done, timeout );
+        return rv ? rv : -ETIMEDOUT;
+    }
+
+    for ( ;; )
+    {
+        if ( READ_ONCE( *abort ) )
+            return -ENODEV;
+
+        slice = min( timeout, (unsigned long)UDMA_ABORT_POLL );
+        if ( (rv = wait_for_completion_interruptible_timeout( done, slice )) )
+            return rv;
+
+        if ( MAX_SCHEDULE_TIMEOUT != timeout && 0 == (timeout -= slice) )
+            return -ETIMEDOUT;
+    }
+}
+
+/* Waits until the scheduler gives p_file the channel for a transfer of
+ * cost bytes, or until *abort is set (abort may be NULL). Every successful
+ * call is paired with udma_sched_release().
+ */
+static int udma_sched_acquire( struct udma_drvdata * p_info, struct udma_file * p_file,
+                               u32 prio, size_t cost, const bool * abort )
+{
+    struct udma_sched * const sched = &p_info->sched;
+    struct udma_sched_client * spare = NULL;
+    struct udma_sched_client * c = NULL;
+    struct udma_sched_req req = { .cost = cost, .prio = prio, .granted = false };
+    long rv;
+
+    // Only the granted waiter is woken. req lives on our stack; the grant
+    // completes it under sched->lock, which the signal path below takes.
+    init_completion( &req.done );
+
+    spin_lock( &sched->lock );
+    if ( UDMA_PRIO_HIGH == prio )
+    {
+        list_add_tail( &req.node, &sched->high );
+        goto queued;
+    }
+
+    while ( !(c = udma_sched_client( sched, p_file, spare )) )
+    {
+        spin_unlock( &sched->lock );
+        spare = kzalloc( sizeof(*spare), GFP_KERNEL );
+        if ( !spare )
+            return -ENOMEM;
+        spin_lock( &sched->lock );
+    }
+    if ( spare && c != spare )
+    {
+        kfree( spare );     // another thread of this fd got there first
+        spare = NULL;
+    }
+
+    list_add_tail( &req.node, &c->reqs );
+    if ( list_empty( &c->active_node ) )
+        list_add_tail( &c->active_node, &sched->active );
+
+    queued:
+    udma_sched_dispatch( sched );
+    spin_unlock( &sched->lock );
+
+    rv = udma_wait_abortable( &req.done, MAX_SCHEDULE_TIMEOUT, abort );
+    if ( rv > 0 )
+        return 0;
+
+    spin_lock( &sched->lock );
+    if ( req.granted )
+    {
+        // Granted as the signal or the abort came in; hand the channel on.
+        sched->busy = false;
+    }
+    else
+    {
+        list_del( &req.node );
+        if ( c && list_empty( &c->reqs ) )
+        {
+            c->deficit = 0;
+            list_del_init( &c->active_node );
+        }
+    }
+    udma_sched_dispatch( sched );
+    spin_unlock( &sched->lock );
+
+    return rv;
+}
+
+static void udma_sched_release( struct udma_drvdata * p_info )
+{
+    struct udma_sched * const sched = &p_info->sched;
+
+    spin_lock( &sched->lock );
+    sched->busy = false;
+    udma_sched_dispatch( sched );
+    spin_unlock( &sched->lock );
+}
+
+// Called on close, when none of p_file's transfers can be queued any more.
+static void udma_sched_forget( struct udma_drvdata * p_info, struct udma_file * p_file )
+{
+    struct udma_sched * const sched = &p_info->sched;
+    struct udma_sched_client * c;
+
+    spin_lock( &sched->lock );
+    c = udma_sched_client( sched, p_file, NULL );
+    if ( c )
+        list_del( &c->node );
+    spin_unlock( &sched->lock );
+
+    kfree( c );
+}
+
+/*
+ * Latency histograms
+ *
+ * Every transfer through udma_transfer() that completes records the time
+ * of each of its phases (enum udma_lat_phase) in a log2 histogram per
+ * phase and size class. The counters are per CPU, so recording is a few
+ * increments without any shared cache line; readers add the CPUs up.
+ */
+
+static unsigned int udma_lat_size_class( size_t len )
+{
+    if ( len <= (4 << 10) )
+        return 0;
+    if ( len <= (64 << 10) )
+        return 1;
+    if ( len <= (1 << 20) )
+        return 2;
+    return 3;
+}
+
+// Called with sem held, after the transfer has been torn down.
+static void udma_lat_record( struct udma_drvdata * p_info )
+{
+    const u64 * const ts = p_info->inflight.ts;
+    const unsigned int cls = udma_lat_size_class( p_info->inflight.len );
+    unsigned int phase;
+
+    // Stopped transfers never saw their callback, and don't say much.
+    for ( phase = 0; phase <= UDMA_LAT_PHASES; ++phase )
+    {
+        if ( !ts[phase] )
+            return;
+    }
+
+    for ( phase = 0; phase < UDMA_LAT_PHASES; ++phase )
+    {
+        const u64 ns = ts[phase + 1] > ts[phase] ? ts[phase + 1] - ts[phase] : 0;
+        const unsigned int bucket = min( fls64( ns ), UDMA_LAT_BUCKETS - 1 );
+
+        this_cpu_inc( p_info->lat->count[phase][cls][bucket] );
+    }
+}
+
+/*
+ * Transfer trace
+ *
+ * Off unless debugfs trace_ctl sets a ring size; then every udma_transfer()
+ * leaves a struct udma_trace_rec, for udma-replay to reproduce the traffic
+ * later. The lock is per device, as the records of all channels share one
+ * ring to keep their order.
+ */
+
+#define UDMA_TRACE_MAX_ENTRIES  (1 << 20)
+
+static void udma_trace_record(
+        struct udma_pdev_drvdata * p_udma,
+        struct udma_drvdata * p_info,
+        u64 start,
+        u8 kind,
+        u16 page_off,
+        size_t count,
+        ssize_t rv )
+{
+    struct udma_trace * t;
+    struct udma_trace_rec * rec;
+    u64 end;
+
+    if ( !READ_ONCE( p_udma->trace ) )
+        return;
+
+    end = ktime_get_ns();
+
+    spin_lock( &p_udma->trace_lock );
+    t = p_udma->trace;
+    if ( t )
+    {
+        if ( t->head - t->tail > t->mask )
+        {
+            ++t->tail;
+            ++t->dropped;
+        }
+
+        rec = &t->recs[t->head++ & t->mask];
+        rec->ts_ns = start;
+        rec->lat_ns = end - start;
+        rec->len = min_t( size_t, count, U32_MAX );
+        rec->result = clamp_t( ssize_t, rv, S32_MIN, S32_MAX );
+        rec->chan = p_info->index;
+        rec->dir = p_info->dir;
+        rec->kind = kind;
+        rec->page_off = page_off;
+        rec->reserved = 0;
+    }
+    spin_unlock( &p_udma->trace_lock );
+}
+
+// Replaces the device's trace by an empty one of entries records, 0 stops tracing.
+static int udma_trace_reset( struct udma_pdev_drvdata * p_udma, unsigned int entries )
+{
+    struct udma_trace * t = NULL;
+    struct udma_trace * old;
+
+    if ( entries > UDMA_TRACE_MAX_ENTRIES )
+        return -EINVAL;
+
+    if ( entries )
+    {
+        entries = roundup_pow_of_two( entries );
+        t = vzalloc( sizeof(*t) + entries * sizeof(struct udma_trace_rec) );
+        if ( !t )
+            return -ENOMEM;
+        t->mask = entries - 1;
+    }
+
+    spin_lock( &p_udma->trace_lock );
+    old = p_udma->trace;
+    p_udma->trace = t;
+    spin_unlock( &p_udma->trace_lock );
+
+    vfree( old );
+    return 0;
+}
+
+/* Whether a chain, packet mode, a ring, the send buffer or an in-kernel
+ * client owns the channel, which then refuses anything else that would
+ * transfer on it. A new ownership mode has to be added here.
+ */
+// should be called with p_info->sem held
+static bool udma_chan_owned( const struct udma_drvdata * p_info )
+{
+    return p_info->chain || p_info->pktq || p_info->ring || p_info->sndbuf || p_info->kchan;
+}
+
+/* First half of udma_transfer_one(): waits for the channel's turn, takes
+ * sem and starts the transfer. On success sem stays held and the transfer
+ * is in flight until udma_transfer_end(); on failure nothing is held. The
+ * wait for the turn gives up with -ENODEV once *abort is set.
+ */
+static int udma_transfer_begin(
+        struct udma_file * p_file,
+        struct udma_drvdata * p_info,
+        u32 prio,
+        char __user *userbuf,
+        struct iov_iter * iter,
+        size_t count,
+        struct udma_dmabuf_attachment * import,
+        u64 offset,
+        struct udma_meta_xfer * meta,
+        const bool * abort )
+{
+    int rv;
+
+    if ( (rv = udma_sched_acquire( p_info, p_file, prio, count, abort )) )
+        return rv;
+
+    // Held for the whole transfer; the wait in udma_transfer_end() is on inflight.done only.
+    // Uncontended unless sysfs or a link request holds it for a moment.
+    if ( down_interruptible( &p_info->sem ) )
+    {
+        udma_sched_release( p_info );
+        return -ERESTARTSYS;
+    }
+
+    // The fd's own limit is drawn from when prepare submits the transfer.
+    p_info->shape_fd = UDMA_CPU_TO_DEV == p_info->dir ? &p_file->tx_bucket : NULL;
+    p_info->meta = meta;
+
+    if ( !atomic_read(&p_info->accepting ) )
+        rv = -EBADF;
+    else if ( udma_chan_owned( p_info ) )
+        rv = -EBUSY;
+    else if ( import )
+        rv = udma_prepare_dmabuf( p_info, import, offset, count );
+    else if ( iter )
+        rv = udma_prepare_iter( p_info, iter, count );
+    else
+        rv = udma_prepare_for_dma( p_file, p_info, userbuf, count );
+
+    p_info->shape_fd = NULL;
+
+    if ( rv )
+    {
+        p_info->meta = NULL;
+        up( &p_info->sem );
+        udma_sched_release( p_info );
+    }
+    return rv;
+}
+
+/* Second half: waits for the transfer udma_transfer_begin() started and
+ * gives the channel back.
+ *
+ * With timeout_ms set the wait is bounded. A transfer cut short by the
+ * timeout or by a signal is stopped, and whatever was transferred up to
+ * then is returned like a short read()/write(). Complete transfers return
+ * count minus the residue the engine reported, so a frame that ends
+ * (TLAST) before the buffer does comes back with its real length.
+ * Setting *abort (abort may be NULL) stops it the same way.
+ */
+static ssize_t udma_transfer_end( struct udma_drvdata * p_info, unsigned int timeout_ms, const bool * abort )
+{
+    ssize_t rv;
+    long wait_rv;
+
+    wait_rv = udma_wait_abortable( &p_info->inflight.done,
+                                   timeout_ms ? msecs_to_jiffies(timeout_ms) : MAX_SCHEDULE_TIMEOUT, abort );
+    p_info->inflight.ts[UDMA_LAT_UNMAP] = ktime_get_ns();
+
+    if ( wait_rv < 0 &&
+         DMA_IN_FLIGHT == atomic_cmpxchg( &p_info->state, DMA_IN_FLIGHT, DMA_STOPPING ) )
+    {
+        size_t done = udma_stop_partial( p_info );
+
+        if ( done )
+            rv = done;
+        else
+            rv = -ETIMEDOUT == wait_rv ? -EAGAIN : wait_rv;
+    }
+    else
+    {
+        // Lost the race against the completion, which is past its cmpxchg.
+        if ( wait_rv < 0 )
+            wait_for_completion( &p_info->inflight.done );
+
+        if ( p_info->inflight.submit_rv )
+            rv = p_info->inflight.submit_rv;
+        else
+            rv = p_info->inflight.len - p_info->inflight.residue;
+    }
+
+    // The bounced edges of what was received, while the pages are still pinned.
+    if ( rv > 0 && p_info->dir == UDMA_DEV_TO_CPU )
+        udma_bounce_in( p_info, rv );
+
+    udma_unprepare_after_dma( p_info );    // sets us back to DMA_IDLE
+    p_info->inflight.ts[UDMA_LAT_PHASES] = ktime_get_ns();
+    udma_lat_record( p_info );
+    p_info->meta = NULL;
+
+    up( &p_info->sem );
+    udma_sched_release( p_info );
+    return rv;
+}
+
+/* One DMA transfer on p_info, either from/to a user buffer, the pages of
+ * iter (splice) or, if import is set, from/to [offset, offset+count) of an
+ * imported dma-buf. See udma_transfer_end() for what it returns.
+ */
+static ssize_t udma_transfer_one(
+        struct udma_file * p_file,
+        struct udma_drvdata * p_info,
+        u32 prio,
+        char __user *userbuf,
+        struct iov_iter * iter,
+        size_t count,
+        struct udma_dmabuf_attachment * import,
+        u64 offset,
+        unsigned int timeout_ms )
+{
+    int rv;
+
+    if ( (rv = udma_transfer_begin( p_file, p_info, prio, userbuf, iter, count, import, offset, NULL, NULL )) )
+        return rv;
+
+    return udma_transfer_end( p_info, timeout_ms, NULL );
+}
+
+/* Bulk TX larger than the channel's sched_chunk goes out as several
+ * transfers, each one queued on its own, so high priority transfers get in
+ * between. Splice transfers are bounded by the pipe already and RX isn't
+ * split, as a frame can't span two transfers. Stops at the first short
+ * chunk and returns what got through.
+ */
+static ssize_t udma_transfer_split(
+        struct udma_file * p_file,
+        struct udma_drvdata * p_info,
+        u32 prio,
+        char __user *userbuf,
+        struct iov_iter * iter,
+        size_t count,
+        struct udma_dmabuf_attachment * import,
+        u64 offset,
+        unsigned int timeout_ms )
+{
+    const size_t chunk = READ_ONCE( p_info->sched.chunk );
+    size_t done = 0;
+    ssize_t rv;
+
+    if ( UDMA_PRIO_HIGH == prio || iter || UDMA_CPU_TO_DEV != p_info->dir ||
+         !chunk || count <= chunk )
+        return udma_transfer_one( p_file, p_info, prio, userbuf, iter, count,
+                                  import, offset, timeout_ms );
+
+    while ( done < count )
+    {
+        const size_t len = min( count - done, chunk );
+
+        rv = udma_transfer_one( p_file, p_info, prio, userbuf ? userbuf + done : NULL,
+                                NULL, len, import, offset + done, timeout_ms );
+        if ( rv < 0 )
+            return done ? done : rv;
+
+        done += rv;
+        if ( rv < len )
+            break;
+    }
+
+    return done;
+}
+
+// A blocking read()/write()-like transfer, see udma_transfer_split().
+static ssize_t udma_transfer(
+        struct udma_file * p_file,
+        struct udma_drvdata * p_info,
+        u32 prio,
+        char __user *userbuf,
+        struct iov_iter * iter,
+        size_t count,
+        struct udma_dmabuf_attachment * import,
+        u64 offset,
+        unsigned int timeout_ms )
+{
+    const u64 start = ktime_get_ns();
+    ssize_t rv;
+
+    rv = udma_transfer_split( p_file, p_info, prio, userbuf, iter, count, import, offset, timeout_ms );
+
+    if ( import )
+        udma_trace_record( p_file->udma, p_info, start, UDMA_TRACE_DMABUF, offset & ~PAGE_MASK, count, rv );
+    else if ( iter )
+        udma_trace_record( p_file->udma, p_info, start, UDMA_TRACE_SPLICE, 0, count, rv );
+    else
+        udma_trace_record( p_file->udma, p_info, start, UDMA_TRACE_USER,
+                           (unsigned long)userbuf & ~PAGE_MASK, count, rv );
+    return rv;
+}
+
+// 
+static unsigned int udma_rx_timeout( struct udma_file * p_file, struct udma_drvdata * p_info )
+{
+    if ( p_info->dir != UDMA_DEV_TO_CPU )
+        return 0;
+
+    return p_file->rx_timeout_ms < 0 ? p_info->rx_timeout_ms : p_file->rx_timeout_ms;
+}
+
+/*
+ * Packet mode RX
+ *
+ * The channel is kept armed with every buffer of the pool that doesn't hold
+ * an unread frame, so the stream never sees TREADY drop between reads.
+ * The RX callback only queues the frame; read() copies it out and reposts
+ * the buffer right away.
+ */
+
+#define UDMA_PKT_MAX_BUFS       (1024)
+#define UDMA_PKT_MAX_BUF_SIZE   (4 << 20)
+
+static void udma_pkt_rx_done( void *data, const struct dmaengine_result *result );
+
+// should be called with pktq->lock held
+static int udma_pkt_post_rx( struct udma_pkt_buf * buf )
+{
+    struct udma_pktq * const pktq = buf->pktq;
+    struct dma_async_tx_descriptor * desc;
+
+    desc = dmaengine_prep_slave_single( pktq->rx->chan, buf->dma_addr,
+            pktq->buf_size, DMA_DEV_TO_MEM, DMA_PREP_INTERRUPT );
+    if ( !desc )
+        return -ENOMEM;
+
+    desc->callback_result = udma_pkt_rx_done;
+    desc->callback_param = buf;
+
+    if ( dmaengine_submit( desc ) < DMA_MIN_COOKIE )
+        return -EIO;
+
+    ++pktq->rx_posted;
+    dma_async_issue_pending( pktq->rx->chan );
+    return 0;
+}
+
+// should be called with pktq->lock held
+static void udma_pkt_repost( struct udma_pkt_buf * buf )
+{
+    if ( udma_pkt_post_rx( buf ) )
+    {
+        ++buf->pktq->lost;
+        printk( KERN_ERR KBUILD_MODNAME ": %s: packet pool lost a buffer, couldn't repost it\n",
+                buf->pktq->rx->name );
+    }
+}
+
+static void udma_pkt_rx_done( void *data, const struct dmaengine_result *result )
+{
+    struct udma_pkt_buf * const buf = data;
+    struct udma_pktq * const pktq = buf->pktq;
+    unsigned long iflags;
+
+    spin_lock_irqsave( &pktq->lock, iflags );
+
+    --pktq->rx_posted;
+
+    if ( pktq->stopping )
+        goto out;
+
+    if ( result->result != DMA_TRANS_NOERROR )
+    {
+        ++pktq->rx_errors;
+        udma_pkt_repost( buf );
+        goto out;
+    }
+
+    // TLAST ends the descriptor early; the residue tells by how much.
+    buf->len = pktq->buf_size - result->residue;
+    if ( !buf->len )
+    {
+        udma_pkt_repost( buf );
+        goto out;
+    }
+
+    list_add_tail( &buf->node, &pktq->done );
+    ++pktq->queued;
+    ++pktq->frames;
+    pktq->bytes += buf->len;
+    wake_up_interruptible( &pktq->rx->wq );
+
+    out:
+    spin_unlock_irqrestore( &pktq->lock, iflags );
+}
+
+static bool udma_pkt_ready( struct udma_pktq * pktq )
+{
+    bool rv;
+
+    spin_lock_irq( &pktq->lock );
+    rv = pktq->stopping || !list_empty( &pktq->done );
+    spin_unlock_irq( &pktq->lock );
+
+    return rv;
+}
+
+static void udma_pkt_free_bufs( struct udma_pktq * pktq )
+{
+    unsigned int i;
+
+    for ( i = 0; i < pktq->num_bufs; ++i )
+    {
+        struct udma_pkt_buf * const buf = &pktq->bufs[i];
+
+        if ( !buf->cpu_addr )
+            continue;
+
+        if ( buf->dma_addr )
+            dma_unmap_single( &pktq->rx->pdev->dev, buf->dma_addr,
+                    pktq->buf_size, DMA_FROM_DEVICE );
+        kfree( buf->cpu_addr );
+    }
+
+    kfree( pktq->bufs );
+    kfree( pktq );
+}
+
+// should be called with udma_instances_lock held
+static void udma_pkt_stop( struct udma_pktq * pktq )
+{
+    struct udma_drvdata * const p_info = pktq->rx;
+
+    // Kick out a reader waiting in udma_pkt_read(), it holds sem.
+    spin_lock_irq( &pktq->lock );
+    pktq->stopping = true;
+    spin_unlock_irq( &pktq->lock );
+    wake_up_interruptible( &p_info->wq );
+
+    dmaengine_terminate_sync( p_info->chan );
+
+    down( &p_info->sem );
+    p_info->pktq = NULL;
+    up( &p_info->sem );
+
+    printk( KERN_DEBUG KBUILD_MODNAME ": %s: packet mode stopped after %llu frames\n",
+            p_info->name, pktq->frames );
+
+    udma_pkt_free_bufs( pktq );
+}
+
+// should be called with udma_instances_lock held
+static int udma_pkt_start( struct udma_drvdata * p_info, const struct udma_pkt_mode * req )
+{
+    struct udma_pktq * pktq;
+    unsigned int i;
+    int rv = 0;
+
+    if ( req->num_bufs > UDMA_PKT_MAX_BUFS ||
+         0 == req->buf_size || req->buf_size > UDMA_PKT_MAX_BUF_SIZE ||
+         0 != (req->buf_size % UDMA_ALIGN_BYTES) )
+        return -EINVAL;
+
+    pktq = kzalloc( sizeof(*pktq), GFP_KERNEL );
+    if ( !pktq )
+        return -ENOMEM;
+
+    pktq->rx = p_info;
+    pktq->num_bufs = req->num_bufs;
+    pktq->buf_size = req->buf_size;
+    spin_lock_init( &pktq->lock );
+    INIT_LIST_HEAD( &pktq->done );
+
+    pktq->bufs = kcalloc( pktq->num_bufs, sizeof(struct udma_pkt_buf), GFP_KERNEL );
+    if ( !pktq->bufs )
+    {
+        kfree( pktq );
+        return -ENOMEM;
+    }
+
+    for ( i = 0; i < pktq->num_bufs; ++i )
+    {
+        struct udma_pkt_buf * const buf = &pktq->bufs[i];
+        dma_addr_t addr;
+
+        buf->pktq = pktq;
+        buf->cpu_addr = kmalloc( pktq->buf_size, GFP_KERNEL );
+        if ( !buf->cpu_addr )
+        {
+            rv = -ENOMEM;
+            goto err_free;
+        }
+
+        addr = dma_map_single( &p_info->pdev->dev, buf->cpu_addr,
+                pktq->buf_size, DMA_FROM_DEVICE );
+        if ( dma_mapping_error( &p_info->pdev->dev, addr ) )
+        {
+            rv = -ENOMEM;
+            goto err_free;
+        }
+        buf->dma_addr = addr;
+    }
+
+    if ( down_trylock( &p_info->sem ) )
+    {
+        rv = -EBUSY;
+        goto err_free;
+    }
+
+    if ( !atomic_read( &p_info->accepting ) )
+        rv = -EBADF;
+    else if ( udma_chan_owned( p_info ) )
+        rv = -EBUSY;
+    else
+        p_info->pktq = pktq;
+
+    up( &p_info->sem );
+
+    if ( rv )
+        goto err_free;
+
+    spin_lock_irq( &pktq->lock );
+    for ( i = 0; i < pktq->num_bufs && !rv; ++i )
+        rv = udma_pkt_post_rx( &pktq->bufs[i] );
+    spin_unlock_irq( &pktq->lock );
+
+    if ( rv )
+    {
+        udma_pkt_stop( pktq );
+        return rv;
+    }
+
+    printk( KERN_DEBUG KBUILD_MODNAME ": %s: packet mode with %u x %u byte buffers\n",
+            p_info->name, pktq->num_bufs, pktq->buf_size );
+    return 0;
+
+    err_free:
+    udma_pkt_free_bufs( pktq );
+    return rv;
+}
+
+/* Hands out the oldest received frame. Holds sem across the wait, which
+ * serialises readers the same way udma_transfer() does.
+ */
+static ssize_t udma_pkt_read(
+        struct udma_file * p_file,
+        struct udma_drvdata * p_info,
+        char __user *userbuf,
+        size_t count,
+        unsigned int timeout_ms )
+{
+    struct udma_pktq * pktq;
+    struct udma_pkt_buf * buf;
+    size_t len;
+    long wait_rv;
+    ssize_t rv;
+
+    if ( down_interruptible( &p_info->sem ) )
+        return -ERESTARTSYS;
+
+    pktq = p_info->pktq;
+    if ( !pktq )
+    {
+        // Left packet mode since udma_read() looked.
+        up( &p_info->sem );
+        return udma_transfer( p_file, p_info, READ_ONCE( p_file->prio ), userbuf, NULL, count, NULL, 0, timeout_ms );
+    }
+
+    if ( timeout_ms )
+    {
+        wait_rv = wait_event_interruptible_timeout( p_info->wq, udma_pkt_ready(pktq),
+                                                    msecs_to_jiffies(timeout_ms) );
+        if ( 0 == wait_rv )
+        {
+            rv = -EAGAIN;
+            goto out;
+        }
+    }
+    else
+    {
+        wait_rv = wait_event_interruptible( p_info->wq, udma_pkt_ready(pktq) );
+    }
+
+    if ( wait_rv < 0 )
+    {
+        rv = wait_rv;
+        goto out;
+    }
+
+    spin_lock_irq( &pktq->lock );
+    if ( pktq->stopping || list_empty( &pktq->done ) )
+    {
+        spin_unlock_irq( &pktq->lock );
+        rv = -EBADF;
+        goto out;
+    }
+    buf = list_first_entry( &pktq->done, struct udma_pkt_buf, node );
+    list_del( &buf->node );
+    --pktq->queued;
+    spin_unlock_irq( &pktq->lock );
+
+    len = min_t( size_t, buf->len, count );
+
+    dma_sync_single_for_cpu( &p_info->pdev->dev, buf->dma_addr, buf->len, DMA_FROM_DEVICE );
+    rv = copy_to_user( userbuf, buf->cpu_addr, len ) ? -EFAULT : len;
+    dma_sync_single_for_device( &p_info->pdev->dev, buf->dma_addr, pktq->buf_size, DMA_FROM_DEVICE );
+
+    spin_lock_irq( &pktq->lock );
+    if ( buf->len > count )
+        ++pktq->truncated;
+    if ( !pktq->stopping )
+        udma_pkt_repost( buf );
+    spin_unlock_irq( &pktq->lock );
+
+    if ( rv > 0 )
+        atomic_inc( &p_info->packets_rcvd );
+
+    out:
+    up( &p_info->sem );
+    return rv;
+}
+
+static int udma_ioctl_pkt_mode( struct udma_file * p_file, void __user *argp )
+{
+    struct udma_drvdata * const p_info = p_file->rx;
+    struct udma_pkt_mode req;
+    int rv = 0;
+
+    if ( copy_from_user( &req, argp, sizeof(req) ) )
+        return -EFAULT;
+
+    if ( !p_info )
+        return -EINVAL;
+
+    mutex_lock( &udma_instances_lock );
+
+    if ( p_info->pktq )
+        udma_pkt_stop( p_info->pktq );
+    if ( req.num_bufs )
+        rv = udma_pkt_start( p_info, &req );
+
+    mutex_unlock( &udma_instances_lock );
+
+    return rv;
+}
+
+static int udma_ioctl_pkt_stats( struct udma_file * p_file, void __user *argp )
+{
+    struct udma_drvdata * const p_info = p_file->rx;
+    struct udma_pktq * pktq;
+    struct udma_pkt_stats stats;
+
+    if ( !p_info )
+        return -ENOENT;
+
+    mutex_lock( &udma_instances_lock );
+
+    pktq = p_info->pktq;
+    if ( !pktq )
+    {
+        mutex_unlock( &udma_instances_lock );
+        return -ENOENT;
+    }
+
+    spin_lock_irq( &pktq->lock );
+    stats.frames = pktq->frames;
+    stats.bytes = pktq->bytes;
+    stats.rx_errors = pktq->rx_errors;
+    stats.truncated = pktq->truncated;
+    stats.lost = pktq->lost;
+    stats.rx_posted = pktq->rx_posted;
+    stats.queued = pktq->queued;
+    spin_unlock_irq( &pktq->lock );
+
+    mutex_unlock( &udma_instances_lock );
+
+    return copy_to_user( argp, &stats, sizeof(stats) ) ? -EFAULT : 0;
+}
+
+/*
+ * Send buffer mode TX
+ *
+ * write() copies into free buffers of a kernel pool, queues them on the
+ * channel and returns; the TX callback puts each buffer back. A producer
+ * only waits for the DMA when the pool is full, so it can prepare the next
+ * data while the last goes out. Failures of transfers whose write() has
+ * returned are kept in err and reported by the next call, like a socket.
+ */
+
+#define UDMA_SNDBUF_MAX_BUFS        (1024)
+#define UDMA_SNDBUF_MAX_BUF_SIZE    (4 << 20)
+
+static void udma_sndbuf_tx_done( void *data, const struct dmaengine_result *result )
+{
+    struct udma_sndbuf_buf * const buf = data;
+    struct udma_sndbuf * const sb = buf->sb;
+    unsigned long iflags;
+
+    spin_lock_irqsave( &sb->lock, iflags );
+
+    --sb->inflight;
+    list_add_tail( &buf->node, &sb->free );
+
+    if ( result->result != DMA_TRANS_NOERROR )
+    {
+        ++sb->tx_errors;
+        if ( !sb->err )
+            sb->err = -EIO;
+    }
+    else
+    {
+        ++sb->frames;
+        sb->bytes += buf->len;
+    }
+
+    wake_up_interruptible( &sb->tx->wq );
+    spin_unlock_irqrestore( &sb->lock, iflags );
+}
+
+// should be called with sb->lock held
+static int udma_sndbuf_post_tx( struct udma_sndbuf_buf * buf )
+{
+    struct udma_sndbuf * const sb = buf->sb;
+    struct dma_async_tx_descriptor * desc;
+
+    desc = dmaengine_prep_slave_single( sb->tx->chan, buf->dma_addr,
+            buf->len, DMA_MEM_TO_DEV, DMA_PREP_INTERRUPT );
+    if ( !desc )
+        return -ENOMEM;
+
+    desc->callback_result = udma_sndbuf_tx_done;
+    desc->callback_param = buf;
+
+    if ( dmaengine_submit( desc ) < DMA_MIN_COOKIE )
+        return -EIO;
+
+    ++sb->inflight;
+    dma_async_issue_pending( sb->tx->chan );
+    return 0;
+}
+
+static bool udma_sndbuf_writable( struct udma_sndbuf * sb )
+{
+    bool rv;
+
+    spin_lock_irq( &sb->lock );
+    rv = sb->stopping || sb->err || !list_empty( &sb->free );
+    spin_unlock_irq( &sb->lock );
+
+    return rv;
+}
+
+static bool udma_sndbuf_idle( struct udma_sndbuf * sb )
+{
+    bool rv;
+
+    spin_lock_irq( &sb->lock );
+    rv = sb->stopping || !sb->inflight;
+    spin_unlock_irq( &sb->lock );
+
+    return rv;
+}
+
+// Returns the deferred error, if any, and forgets it.
+static int udma_sndbuf_take_err( struct udma_sndbuf * sb )
+{
+    int rv;
+
+    spin_lock_irq( &sb->lock );
+    rv = sb->err;
+    sb->err = 0;
+    spin_unlock_irq( &sb->lock );
+
+    return rv;
+}
+
+static void udma_sndbuf_free_bufs( struct udma_sndbuf * sb )
+{
+    unsigned int i;
+
+    for ( i = 0; i < sb->num_bufs; ++i )
+    {
+        struct udma_sndbuf_buf * const buf = &sb->bufs[i];
+
+        if ( !buf->cpu_addr )
+            continue;
+
+        if ( buf->dma_addr )
+            dma_unmap_single( &sb->tx->pdev->dev, buf->dma_addr,
+                    sb->buf_size, DMA_TO_DEVICE );
+        kfree( buf->cpu_addr );
+    }
+
+    kfree( sb->bufs );
+    kfree( sb );
+}
+
+/* Drops whatever is still queued, after giving it a second to go out.
+ * should be called with udma_instances_lock held
+ */
+static void udma_sndbuf_stop( struct udma_sndbuf * sb )
+{
+    struct udma_drvdata * const p_info = sb->tx;
+
+    // Waits for a writer blocked on a full pool to give up sem.
+    spin_lock_irq( &sb->lock );
+    sb->stopping = true;
+    spin_unlock_irq( &sb->lock );
+    wake_up_interruptible( &p_info->wq );
+
+    down( &p_info->sem );
+
+    if ( !wait_event_timeout( p_info->wq, !READ_ONCE( sb->inflight ), HZ ) )
+        printk( KERN_WARNING KBUILD_MODNAME ": %s: send buffer didn't drain, dropping it\n",
+                p_info->name );
+    dmaengine_terminate_sync( p_info->chan );
+
+    p_info->sndbuf = NULL;
+    up( &p_info->sem );
+
+    printk( KERN_DEBUG KBUILD_MODNAME ": %s: send buffer mode stopped after %llu frames\n",
+            p_info->name, sb->frames );
+
+    udma_sndbuf_free_bufs( sb );
+}
+
+// should be called with udma_instances_lock held
+static int udma_sndbuf_start( struct udma_drvdata * p_info, const struct udma_sndbuf_mode * req )
+{
+    struct udma_sndbuf * sb;
+    unsigned int i;
+    int rv = 0;
+
+    if ( req->num_bufs > UDMA_SNDBUF_MAX_BUFS ||
+         0 == req->buf_size || req->buf_size > UDMA_SNDBUF_MAX_BUF_SIZE ||
+         0 != (req->buf_size % UDMA_ALIGN_BYTES) )
+        return -EINVAL;
+
+    sb = kzalloc( sizeof(*sb), GFP_KERNEL );
+    if ( !sb )
+        return -ENOMEM;
+
+    sb->tx = p_info;
+    sb->num_bufs = req->num_bufs;
+    sb->buf_size = req->buf_size;
+    spin_lock_init( &sb->lock );
+    INIT_LIST_HEAD( &sb->free );
+
+    sb->bufs = kcalloc( sb->num_bufs, sizeof(struct udma_sndbuf_buf), GFP_KERNEL );
+    if ( !sb->bufs )
+    {
+        kfree( sb );
+        return -ENOMEM;
+    }
+
+    for ( i = 0; i < sb->num_bufs; ++i )
+    {
+        struct udma_sndbuf_buf * const buf = &sb->bufs[i];
+        dma_addr_t addr;
+
+        buf->sb = sb;
+        buf->cpu_addr = kmalloc( sb->buf_size, GFP_KERNEL );
+        if ( !buf->cpu_addr )
+        {
+            rv = -ENOMEM;
+            goto err_free;
+        }
+
+        addr = dma_map_single( &p_info->pdev->dev, buf->cpu_addr,
+                sb->buf_size, DMA_TO_DEVICE );
+        if ( dma_mapping_error( &p_info->pdev->dev, addr ) )
+        {
+            rv = -ENOMEM;
+            goto err_free;
+        }
+        buf->dma_addr = addr;
+        list_add_tail( &buf->node, &sb->free );
+    }
+
+    if ( down_trylock( &p_info->sem ) )
+    {
+        rv = -EBUSY;
+        goto err_free;
+    }
+
+    if ( !atomic_read( &p_info->accepting ) )
+        rv = -EBADF;
+    else if ( udma_chan_owned( p_info ) )
+        rv = -EBUSY;
+    else
+        p_info->sndbuf = sb;
+
+    up( &p_info->sem );
+
+    if ( rv )
+        goto err_free;
+
+    printk( KERN_DEBUG KBUILD_MODNAME ": %s: send buffer mode with %u x %u byte buffers\n",
+            p_info->name, sb->num_bufs, sb->buf_size );
+    return 0;
+
+    err_free:
+    udma_sndbuf_free_bufs( sb );
+    return rv;
+}
+
+/* Queues userbuf in as many buffers as it takes and returns the bytes
+ * queued. Holds sem throughout, so the buffers of concurrent writers don't
+ * interleave.
+ */
+static ssize_t udma_sndbuf_write(
+        struct udma_file * p_file,
+        struct udma_drvdata * p_info,
+        const char __user *userbuf,
+        size_t count,
+        bool nonblock )
+{
+    struct udma_sndbuf * sb;
+    size_t done = 0;
+    ssize_t rv = 0;
+
+    if ( down_interruptible( &p_info->sem ) )
+        return -ERESTARTSYS;
+
+    sb = p_info->sndbuf;
+    if ( !sb )
+    {
+        // Left send buffer mode since udma_write() looked.
+        up( &p_info->sem );
+        return udma_transfer( p_file, p_info, READ_ONCE( p_file->prio ), (char __user *)userbuf,
+                              NULL, count, NULL, 0, 0 );
+    }
+
+    if ( (rv = udma_sndbuf_take_err( sb )) )
+        goto out;
+
+    while ( done < count )
+    {
+        struct udma_sndbuf_buf * buf;
+        const u32 len = min_t( size_t, count - done, sb->buf_size );
+
+        if ( !nonblock &&
+             (rv = wait_event_interruptible( p_info->wq, udma_sndbuf_writable(sb) )) )
+            break;
+
+        spin_lock_irq( &sb->lock );
+        if ( sb->stopping || sb->err )
+        {
+            spin_unlock_irq( &sb->lock );
+            rv = -EBADF;
+            if ( !done && !sb->stopping )
+                rv = udma_sndbuf_take_err( sb );
+            break;
+        }
+        if ( list_empty( &sb->free ) )
+        {
+            spin_unlock_irq( &sb->lock );
+            rv = -EAGAIN;
+            break;
+        }
+        buf = list_first_entry( &sb->free, struct udma_sndbuf_buf, node );
+        list_del( &buf->node );
+        spin_unlock_irq( &sb->lock );
+
+        buf->len = len;
+        if ( copy_from_user( buf->cpu_addr, userbuf + done, len ) )
+            rv = -EFAULT;
+        else
+            dma_sync_single_for_device( &p_info->pdev->dev, buf->dma_addr, len, DMA_TO_DEVICE );
+
+        spin_lock_irq( &sb->lock );
+        if ( !rv )
+            rv = udma_sndbuf_post_tx( buf );
+        if ( rv )
+            list_add( &buf->node, &sb->free );
+        spin_unlock_irq( &sb->lock );
+
+        if ( rv )
+            break;
+        done += len;
+    }
+
+    out:
+    up( &p_info->sem );
+    return done ? done : rv;
+}
+
+/* Waits until the channel has sent everything written so far and returns
+ * the first error since the last report. Returns 0 right away outside
+ * send buffer mode, where write() doesn't return early.
+ */
+static int udma_sndbuf_flush( struct udma_drvdata * p_info )
+{
+    struct udma_sndbuf * sb;
+    int rv;
+
+    if ( down_interruptible( &p_info->sem ) )
+        return -ERESTARTSYS;
+
+    sb = p_info->sndbuf;
+    if ( !sb )
+    {
+        up( &p_info->sem );
+        return 0;
+    }
+
+    rv = wait_event_interruptible( p_info->wq, udma_sndbuf_idle(sb) );
+    if ( !rv )
+        rv = udma_sndbuf_take_err( sb );
+
+    up( &p_info->sem );
+    return rv;
+}
+
+static int udma_ioctl_sndbuf_mode( struct udma_file * p_file, void __user *argp )
+{
+    struct udma_drvdata * const p_info = p_file->tx;
+    struct udma_sndbuf_mode req;
+    int rv = 0;
+
+    if ( copy_from_user( &req, argp, sizeof(req) ) )
+        return -EFAULT;
+
+    if ( !p_info )
+        return -EINVAL;
+
+    // What was written goes out first, and its error is reported here. That
+    // can take as long as the channel likes, so not under the global lock.
+    rv = udma_sndbuf_flush( p_info );
+    if ( -ERESTARTSYS == rv )
+        return rv;
+
+    mutex_lock( &udma_instances_lock );
+
+    // Whatever got written since the flush has a second to go out.
+    if ( p_info->sndbuf )
+        udma_sndbuf_stop( p_info->sndbuf );
+    if ( !rv && req.num_bufs )
+        rv = udma_sndbuf_start( p_info, &req );
+
+    mutex_unlock( &udma_instances_lock );
+
+    return rv;
+}
+
+static int udma_ioctl_sndbuf_stats( struct udma_file * p_file, void __user *argp )
+{
+    struct udma_drvdata * const p_info = p_file->tx;
+    struct udma_sndbuf_stats stats;
+    struct udma_sndbuf * sb;
+
+    if ( !p_info )
+        return -ENOENT;
+
+    mutex_lock( &udma_instances_lock );
+
+    sb = p_info->sndbuf;
+    if ( !sb )
+    {
+        mutex_unlock( &udma_instances_lock );
+        return -ENOENT;
+    }
+
+    spin_lock_irq( &sb->lock );
+    stats.frames = sb->frames;
+    stats.bytes = sb->bytes;
+    stats.tx_errors = sb->tx_errors;
+    stats.inflight = sb->inflight;
+    stats.free = sb->num_bufs - sb->inflight;
+    spin_unlock_irq( &sb->lock );
+
+    mutex_unlock( &udma_instances_lock );
+
+    return copy_to_user( argp, &stats, sizeof(stats) ) ? -EFAULT : 0;
+}
+
+/*
+ * Striping
+ *
+ * One engine and its HP port can't keep up with DDR, so an fd may spread
+ * its transfers over the channels of several identical stream IPs. A
+ * transfer is dealt out in stripes, round robin, and every round starts one
+ * stripe on each member before it waits for any, so the members run in
+ * parallel. Members are taken in address order, not in stripe order, so
+ * two fds striping over the same channels can't deadlock on their sems.
+ */
+
+static LIST_HEAD(udma_stripes);     // every udma_stripe, protected by udma_instances_lock
+
+// Picks channel index of p_udma for dir like UDMA_IOC_BIND does; negative: the first one.
+static struct udma_drvdata *udma_stripe_chan( struct udma_pdev_drvdata * p_udma, s32 index, u32 dir )
+{
+    struct udma_drvdata * p_info;
+
+    if ( index < 0 )
+        return UDMA_DEV_TO_CPU == dir ? p_udma->rx : p_udma->tx;
+    if ( index >= p_udma->num_chans )
+        return ERR_PTR(-EINVAL);
+
+    p_info = p_udma->chans[index];
+    return p_info->dir == dir ? p_info : ERR_PTR(-EINVAL);
+}
+
+/* Drops p_file's scheduler entries on member channels of other devices.
+ * Those of its own device are dropped on close, and may be in use by
+ * splice or dma-buf transfers meanwhile.
+ * should be called with st->rwsem held for writing
+ */
+static void udma_stripe_forget( struct udma_file * p_file, struct udma_stripe * st )
+{
+    unsigned int i;
+
+    for ( i = 0; i < st->num_members; ++i )
+    {
+        struct udma_stripe_member * const m = &st->members[i];
+
+        if ( m->rx && m->rx->pdev != p_file->udma->pdev )
+            udma_sched_forget( m->rx, p_file );
+        if ( m->tx && m->tx->pdev != p_file->udma->pdev )
+            udma_sched_forget( m->tx, p_file );
+    }
+}
+
+static ssize_t udma_stripe_transfer(
+        struct udma_file * p_file,
+        struct udma_stripe * st,
+        u32 dir,
+        char __user *userbuf,
+        size_t count )
+{
+    struct udma_drvdata * chans[UDMA_STRIPE_MAX];
+    unsigned int order[UDMA_STRIPE_MAX];
+    size_t len[UDMA_STRIPE_MAX];
+    ssize_t res[UDMA_STRIPE_MAX];
+    bool started[UDMA_STRIPE_MAX];
+    const u32 prio = READ_ONCE( p_file->prio );
+    const u64 start = ktime_get_ns();
+    const size_t size = st->stripe_size;
+    const unsigned int n = st->num_members;
+    bool stop = false;
+    size_t done = 0;
+    ssize_t rv = 0;
+    unsigned int i, j;
+
+    for ( i = 0; i < n; ++i )
+    {
+        chans[i] = UDMA_DEV_TO_CPU == dir ? st->members[i].rx : st->members[i].tx;
+        if ( !chans[i] )
+            return -EINVAL;
+
+        order[i] = i;
+        for ( j = i; j > 0 && chans[order[j - 1]] > chans[order[j]]; --j )
+            swap( order[j - 1], order[j] );
+    }
+
+    while ( done < count && !stop )
+    {
+        for ( i = 0; i < n; ++i )
+        {
+            const size_t off = done + i * size;
+
+            len[i] = off < count ? min( size, count - off ) : 0;
+            started[i] = false;
+        }
+
+        for ( j = 0; j < n; ++j )
+        {
+            i = order[j];
+            if ( !len[i] )
+                continue;
+
+            res[i] = udma_transfer_begin( p_file, chans[i], prio, userbuf + done + i * size,
+                                          NULL, len[i], NULL, 0, NULL, &st->broken );
+            started[i] = !res[i];
+        }
+
+        for ( i = 0; i < n; ++i )
+        {
+            if ( started[i] )
+                res[i] = udma_transfer_end( chans[i], udma_rx_timeout( p_file, chans[i] ), &st->broken );
+        }
+
+        spin_lock( &st->lock );
+        for ( i = 0; i < n && len[i]; ++i )
+        {
+            struct udma_stripe_member * const m = &st->members[i];
+
+            if ( res[i] < 0 )
+            {
+                ++m->errors;
+            }
+            else if ( UDMA_DEV_TO_CPU == dir )
+            {
+                ++m->rx_stripes;
+                m->rx_bytes += res[i];
+            }
+            else
+            {
+                ++m->tx_stripes;
+                m->tx_bytes += res[i];
+            }
+        }
+        spin_unlock( &st->lock );
+
+        // Only what precedes the first short or failed stripe is contiguous.
+        for ( i = 0; i < n && len[i]; ++i )
+        {
+            if ( res[i] < 0 )
+            {
+                rv = res[i];
+                stop = true;
+                break;
+            }
+
+            done += res[i];
+            if ( res[i] < len[i] )
+            {
+                stop = true;
+                break;
+            }
+        }
+    }
+
+    if ( done )
+        rv = done;
+    udma_trace_record( p_file->udma, chans[0], start, UDMA_TRACE_USER,
+                       (unsigned long)userbuf & ~PAGE_MASK, count, rv );
+    return rv;
+}
+
+/* Runs the read()/write() through p_file's stripe set if it has one.
+ * Returns false, leaving *rv alone, if striping is off.
+ */
+static bool udma_stripe_rw( struct udma_file * p_file, u32 dir, char __user *userbuf,
+                            size_t count, ssize_t * rv )
+{
+    struct udma_stripe * const st = READ_ONCE( p_file->stripe );
+    bool striped = false;
+
+    if ( !st )
+        return false;
+
+    down_read( &st->rwsem );
+    if ( READ_ONCE( st->broken ) )
+    {
+        *rv = -ENODEV;
+        striped = true;
+    }
+    else if ( st->num_members )
+    {
+        *rv = udma_stripe_transfer( p_file, st, dir, userbuf, count );
+        striped = true;
+    }
+    up_read( &st->rwsem );
+
+    return striped;
+}
+
+static int udma_ioctl_stripe_setup( struct udma_file * p_file, void __user *argp )
+{
+    struct udma_stripe_setup req;
+    struct udma_drvdata * rx[UDMA_STRIPE_MAX];
+    struct udma_drvdata * tx[UDMA_STRIPE_MAX];
+    struct udma_stripe * st;
+    unsigned int i, j;
+    int rv = 0;
+
+    if ( copy_from_user( &req, argp, sizeof(req) ) )
+        return -EFAULT;
+
+    if ( req.num_members >= UDMA_STRIPE_MAX )
+        return -EINVAL;
+    if ( req.num_members &&
+         (0 == req.stripe_size || 0 != (req.stripe_size % UDMA_ALIGN_BYTES)) )
+        return -EINVAL;
+
+    mutex_lock( &udma_instances_lock );
+
+    rx[0] = p_file->rx;
+    tx[0] = p_file->tx;
+    for ( i = 0; i < req.num_members; ++i )
+    {
+        struct udma_stripe_dev * const d = &req.members[i];
+        struct udma_pdev_drvdata * p_udma;
+
+        d->name[UDMA_NAME_MAX - 1] = '\0';
+        p_udma = udma_find_instance_by_name( d->name );
+        if ( !p_udma )
+        {
+            rv = -ENODEV;
+            goto out;
+        }
+
+        rx[i + 1] = udma_stripe_chan( p_udma, d->rx, UDMA_DEV_TO_CPU );
+        tx[i + 1] = udma_stripe_chan( p_udma, d->tx, UDMA_CPU_TO_DEV );
+        if ( IS_ERR( rx[i + 1] ) || IS_ERR( tx[i + 1] ) )
+        {
+            rv = -EINVAL;
+            goto out;
+        }
+    }
+
+    // A channel twice in one round would wait for itself.
+    for ( i = 0; i <= req.num_members; ++i )
+    {
+        for ( j = 0; j < i; ++j )
+        {
+            if ( (rx[i] && rx[i] == rx[j]) || (tx[i] && tx[i] == tx[j]) )
+            {
+                rv = -EINVAL;
+                goto out;
+            }
+        }
+    }
+
+    st = p_file->stripe;
+    if ( !st )
+    {
+        if ( !req.num_members )
+            goto out;
+
+        st = kzalloc( sizeof(*st), GFP_KERNEL );
+        if ( !st )
+        {
+            rv = -ENOMEM;
+            goto out;
+        }
+        st->owner = p_file;
+        kref_init( &st->ref );
+        init_rwsem( &st->rwsem );
+        spin_lock_init( &st->lock );
+        list_add_tail( &st->node, &udma_stripes );
+        WRITE_ONCE( p_file->stripe, st );
+    }
+
+    // Waits for the striped transfers of the fd that are under way.
+    down_write( &st->rwsem );
+    udma_stripe_forget( p_file, st );
+    memset( st->members, 0, sizeof(st->members) );
+    st->broken = false;
+    st->stripe_size = req.stripe_size;
+    st->num_members = req.num_members ? req.num_members + 1 : 0;
+    for ( i = 0; i < st->num_members; ++i )
+    {
+        st->members[i].rx = rx[i];
+        st->members[i].tx = tx[i];
+    }
+    up_write( &st->rwsem );
+
+    out:
+    mutex_unlock( &udma_instances_lock );
+    return rv;
+}
+
+static int udma_ioctl_stripe_stats( struct udma_file * p_file, void __user *argp )
+{
+    struct udma_stripe * const st = READ_ONCE( p_file->stripe );
+    struct udma_stripe_stats stats;
+    unsigned int i;
+
+    if ( !st )
+        return -ENOENT;
+
+    memset( &stats, 0, sizeof(stats) );
+
+    down_read( &st->rwsem );
+    spin_lock( &st->lock );
+    stats.num_members = st->num_members;
+    stats.stripe_size = st->stripe_size;
+    for ( i = 0; i < st->num_members; ++i )
+    {
+        stats.members[i].rx_bytes = st->members[i].rx_bytes;
+        stats.members[i].tx_bytes = st->members[i].tx_bytes;
+        stats.members[i].rx_stripes = st->members[i].rx_stripes;
+        stats.members[i].tx_stripes = st->members[i].tx_stripes;
+        stats.members[i].errors = st->members[i].errors;
+    }
+    spin_unlock( &st->lock );
+    up_read( &st->rwsem );
+
+    if ( !stats.num_members )
+        return -ENOENT;
+
+    return copy_to_user( argp, &stats, sizeof(stats) ) ? -EFAULT : 0;
+}
+
+static void udma_stripe_free( struct kref * ref )
+{
+    kfree( container_of( ref, struct udma_stripe, ref ) );
+}
+
+// Whether a member of st has a channel of p_udma.
+static bool udma_stripe_uses( struct udma_stripe * st, struct udma_pdev_drvdata * p_udma )
+{
+    unsigned int i;
+
+    for ( i = 0; i < st->num_members; ++i )
+    {
+        const struct udma_stripe_member * const m = &st->members[i];
+
+        if ( (m->rx && m->rx->pdev == p_udma->pdev) || (m->tx && m->tx->pdev == p_udma->pdev) )
+            return true;
+    }
+
+    return false;
+}
+
+/* Breaks every stripe set with a channel of p_udma, which is going away.
+ * Their fds get ENODEV until they set up striping again, and transfers
+ * under way give up within UDMA_ABORT_POLL, see udma_stripe_detach_wait().
+ * should be called with udma_instances_lock held
+ */
+static void udma_stripe_detach( struct udma_pdev_drvdata * p_udma )
+{
+    struct udma_stripe * st;
+
+    list_for_each_entry( st, &udma_stripes, node )
+    {
+        if ( udma_stripe_uses( st, p_udma ) )
+            WRITE_ONCE( st->broken, true );
+    }
+}
+
+/* Waits for the striped transfers still running on the sets
+ * udma_stripe_detach() broke, one set at a time and without
+ * udma_instances_lock held, then drops the set's members. A set that
+ * another teardown or a new UDMA_IOC_STRIPE_SETUP got to first has no
+ * channel of p_udma left.
+ */
+static void udma_stripe_detach_wait( struct udma_pdev_drvdata * p_udma )
+{
+    struct udma_stripe * st;
+    unsigned int i;
+    bool found;
+
+    do
+    {
+        found = false;
+
+        mutex_lock( &udma_instances_lock );
+        list_for_each_entry( st, &udma_stripes, node )
+        {
+            if ( udma_stripe_uses( st, p_udma ) )
+            {
+                kref_get( &st->ref );
+                found = true;
+                break;
+            }
+        }
+        mutex_unlock( &udma_instances_lock );
+
+        if ( !found )
+            break;
+
+        // New transfers see broken and leave at once.
+        down_write( &st->rwsem );
+        up_write( &st->rwsem );
+
+        mutex_lock( &udma_instances_lock );
+        if ( st->owner && READ_ONCE( st->broken ) )
+        {
+            down_write( &st->rwsem );
+            udma_stripe_forget( st->owner, st );
+            for ( i = 0; i < st->num_members; ++i )
+                st->members[i].rx = st->members[i].tx = NULL;
+            up_write( &st->rwsem );
+        }
+        mutex_unlock( &udma_instances_lock );
+
+        kref_put( &st->ref, udma_stripe_free );
+    }
+    while ( found );
+}
+
+// should be called with udma_instances_lock held
+static void udma_stripe_release( struct udma_file * p_file )
+{
+    struct udma_stripe * const st = p_file->stripe;
+
+    if ( !st )
+        return;
+
+    udma_stripe_forget( p_file, st );
+    list_del( &st->node );
+    st->owner = NULL;
+    p_file->stripe = NULL;
+    kref_put( &st->ref, udma_stripe_free );
+}
+
+ssize_t udma_read(struct udma_file *p_file, char __user *userbuf, size_t count, loff_t *f_pos)
+{
+    ssize_t rv;
+
+    if ( 0 != (count % UDMA_ALIGN_BYTES) )
+    {
+        return -EINVAL;
+    }
+
+    if ( !p_file->rx )
+        return -EINVAL;
+
+    if ( udma_stripe_rw( p_file, UDMA_DEV_TO_CPU, userbuf, count, &rv ) )
+        return rv;
+
+    if ( READ_ONCE( p_file->rx->pktq ) )
+        return udma_pkt_read( p_file, p_file->rx, userbuf, count,
+                              udma_rx_timeout( p_file, p_file->rx ) );
+
+    return udma_transfer( p_file, p_file->rx, READ_ONCE( p_file->prio ), userbuf, NULL, count, NULL, 0,
+                          udma_rx_timeout( p_file, p_file->rx ) );
+}
+EXPORT_SYMBOL_GPL(udma_read);
+
+ssize_t udma_write(struct udma_file *p_file, const char __user *userbuf, size_t count, loff_t *f_pos,
+                   unsigned int f_flags)
+{
+    struct udma_drvdata * const p_info = p_file->tx;
+    ssize_t rv;
+
+    if ( !p_info )
+        return -EINVAL;
+
+    if ( 0 != (count % UDMA_ALIGN_BYTES) )
+    {
+        printk( KERN_WARNING KBUILD_MODNAME ": %s: unaligned write of %zu bytes requested\n", p_info->name, count);
+        return -EINVAL;
+    }
+
+    if ( udma_stripe_rw( p_file, UDMA_CPU_TO_DEV, (char __user *)userbuf, count, &rv ) )
+        return rv;
+
+    if ( READ_ONCE( p_info->sndbuf ) )
+        return udma_sndbuf_write( p_file, p_info, userbuf, count, f_flags & O_NONBLOCK );
+
+    return udma_transfer( p_file, p_info, READ_ONCE( p_file->prio ), (char __user*)userbuf, NULL, count, NULL, 0, 0 );
+}
+EXPORT_SYMBOL_GPL(udma_write);
+
+// Flushes the send buffer of the TX channel, see udma_sndbuf_flush().
+int udma_fsync(struct udma_file *p_file)
+{
+    if ( !p_file->tx )
+        return 0;
+
+    return udma_sndbuf_flush( p_file->tx );
+}
+EXPORT_SYMBOL_GPL(udma_fsync);
+
+/*
+ * splice
+ *
+ * RX lands directly in freshly allocated pipe pages, TX is fed straight from
+ * the pages sitting in the pipe (page cache for sendfile()/splice() from a
+ * file, socket buffers, ...). Either way the data is never copied by the CPU.
+ */
+
+ssize_t udma_splice_read(struct udma_file *p_file, loff_t *ppos,
+        struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+    struct udma_drvdata * const p_info = p_file->rx;
+    struct iov_iter to;
+    ssize_t rv;
+    int idx;
+
+    if ( !p_info )
+        return -EINVAL;
+
+    // Mirrors generic_file_splice_read(); the caller holds the pipe lock.
+    iov_iter_pipe( &to, ITER_PIPE | READ, pipe, len );
+    idx = to.idx;
+
+    rv = udma_transfer( p_file, p_info, READ_ONCE( p_file->prio ), NULL, &to, len, NULL, 0, udma_rx_timeout( p_file, p_info ) );
+
+    if ( rv > 0 )
+    {
+        iov_iter_advance( &to, rv );    // drops the pages past the end of the data
+    }
+    else
+    {
+        to.idx = idx;
+        to.iov_offset = 0;
+        iov_iter_advance( &to, 0 );     // drops everything we put in the pipe
+    }
+
+    return rv;
+}
+EXPORT_SYMBOL_GPL(udma_splice_read);
+
+static void udma_pipe_wakeup_writers( struct pipe_inode_info *pipe )
+{
+    smp_mb();
+    if ( waitqueue_active( &pipe->wait ) )
+        wake_up_interruptible( &pipe->wait );
+    kill_fasync( &pipe->fasync_writers, SIGIO, POLL_OUT );
+}
+
+// Waits for data in the pipe like splice_from_pipe_next(); 0 means EOF.
+static int udma_pipe_wait_data( struct pipe_inode_info *pipe, size_t spliced,
+        unsigned int flags, bool *need_wakeup )
+{
+    while ( !pipe->nrbufs )
+    {
+        if ( !pipe->writers )
+            return 0;
+        if ( !pipe->waiting_writers && spliced )
+            return 0;
+        if ( flags & SPLICE_F_NONBLOCK )
+            return -EAGAIN;
+        if ( signal_pending( current ) )
+            return -ERESTARTSYS;
+
+        if ( *need_wakeup )
+        {
+            udma_pipe_wakeup_writers( pipe );
+            *need_wakeup = false;
+        }
+
+        pipe_wait( pipe );
+    }
+
+    return 1;
+}
+
+/* Mirrors iter_file_splice_write(): each round sends everything the pipe
+ * holds (up to len) as one DMA transfer, then consumes what was sent.
+ */
+ssize_t udma_splice_write(struct udma_file *p_file, struct pipe_inode_info *pipe,
+        loff_t *ppos, size_t len, unsigned int flags)
+{
+    struct udma_drvdata * const p_info = p_file->tx;
+    struct bio_vec * array;
+    bool need_wakeup = false;
+    size_t spliced = 0;
+    ssize_t rv = 0;
+
+    if ( !p_info )
+        return -EINVAL;
+
+    array = kcalloc( pipe->buffers, sizeof(struct bio_vec), GFP_KERNEL );
+    if ( !array )
+        return -ENOMEM;
+
+    pipe_lock( pipe );
+
+    while ( len )
+    {
+        struct iov_iter from;
+        unsigned int idx = pipe->curbuf;
+        size_t left = len;
+        int n;
+
+        if ( (rv = udma_pipe_wait_data( pipe, spliced, flags, &need_wakeup )) <= 0 )
+            break;
+
+        for ( n = 0; left && n < pipe->nrbufs; ++n, idx = (idx + 1) & (pipe->buffers - 1) )
+        {
+            struct pipe_buffer * const buf = pipe->bufs + idx;
+            const size_t this_len = min_t( size_t, buf->len, left );
+
+            if ( (rv = pipe_buf_confirm( pipe, buf )) )
+                break;
+
+            array[n].bv_page = buf->page;
+            array[n].bv_len = this_len;
+            array[n].bv_offset = buf->offset;
+            left -= this_len;
+        }
+
+        if ( !n )
+            break;
+
+        iov_iter_bvec( &from, ITER_BVEC | WRITE, array, n, len - left );
+        rv = udma_transfer( p_file, p_info, READ_ONCE( p_file->prio ), NULL, &from, len - left, NULL, 0, 0 );
+        if ( rv <= 0 )
+            break;
+
+        spliced += rv;
+        len -= rv;
+
+        // Release the buffers that went out completely, trim a partial one.
+        while ( rv )
+        {
+            struct pipe_buffer * const buf = pipe->bufs + pipe->curbuf;
+
+            if ( rv >= buf->len )
+            {
+                rv -= buf->len;
+                buf->len = 0;
+                pipe_buf_release( pipe, buf );
+                pipe->curbuf = (pipe->curbuf + 1) & (pipe->buffers - 1);
+                pipe->nrbufs--;
+                need_wakeup = true;
+            }
+            else
+            {
+                buf->offset += rv;
+                buf->len -= rv;
+                rv = 0;
+            }
+        }
+    }
+
+    if ( need_wakeup )
+        udma_pipe_wakeup_writers( pipe );
+
+    pipe_unlock( pipe );
+    kfree( array );
+
+    if ( spliced )
+        atomic_inc( &p_info->packets_sent );
+
+    return spliced ? spliced : rv;
+}
+EXPORT_SYMBOL_GPL(udma_splice_write);
+
+/*
+ * dma-buf support
+ *
+ * Exported buffers are plain (cacheable) pages owned by the driver. Every
+ * importer gets its own sg_table mapped for its device, so data can move
+ * between the stream IP and V4L2/DRM/other accelerators without a CPU copy.
+ * CPU access goes through DMA_BUF_IOCTL_SYNC on the dma-buf fd.
+ *
+ * Imported buffers are attached and mapped once, at import time, for the
+ * device of the channel they were imported for. Transfers on them skip
+ * get_user_pages_fast() and dma_map_sg() altogether.
+ */
+
+struct udma_export_buf {
+    size_t              size;
+    unsigned int        num_pages;
+    struct page **      pages;
+
+    struct mutex        lock;           // protects attachments
+    struct list_head    attachments;    // struct udma_export_attachment
+};
+
+struct udma_export_attachment {
+    struct list_head        node;
+    struct device *         dev;
+    struct sg_table         sgt;
+    enum dma_data_direction dir;
+    bool                    mapped;
+};
+
+static int udma_export_attach( struct dma_buf *dmabuf, struct device *dev,
+        struct dma_buf_attachment *attach )
+{
+    struct udma_export_buf * buf = dmabuf->priv;
+    struct udma_export_attachment * a;
+    int rv;
+
+    a = kzalloc( sizeof(*a), GFP_KERNEL );
+    if ( !a )
+        return -ENOMEM;
+
+    rv = sg_alloc_table_from_pages( &a->sgt, buf->pages, buf->num_pages,
+            0, buf->size, GFP_KERNEL );
+    if ( rv )
+    {
+        kfree( a );
+        return rv;
+    }
+
+    a->dev = dev;
+    a->dir = DMA_NONE;
+    attach->priv = a;
+
+    mutex_lock( &buf->lock );
+    list_add( &a->node, &buf->attachments );
+    mutex_unlock( &buf->lock );
+
+    return 0;
+}
+
+static void udma_export_detach( struct dma_buf *dmabuf,
+        struct dma_buf_attachment *attach )
+{
+    struct udma_export_buf * buf = dmabuf->priv;
+    struct udma_export_attachment * a = attach->priv;
+
+    mutex_lock( &buf->lock );
+    list_del( &a->node );
+    mutex_unlock( &buf->lock );
+
+    sg_free_table( &a->sgt );
+    kfree( a );
+}
+
+static struct sg_table *udma_export_map( struct dma_buf_attachment *attach,
+        enum dma_data_direction dir )
+{
+    struct udma_export_buf * buf = attach->dmabuf->priv;
+    struct udma_export_attachment * a = attach->priv;
+    int nents;
+
+    nents = dma_map_sg( attach->dev, a->sgt.sgl, a->sgt.orig_nents, dir );
+    if ( !nents )
+        return ERR_PTR(-ENOMEM);
+
+    mutex_lock( &buf->lock );
+    a->sgt.nents = nents;
+    a->dir = dir;
+    a->mapped = true;
+    mutex_unlock( &buf->lock );
+
+    return &a->sgt;
+}
+
+static void udma_export_unmap( struct dma_buf_attachment *attach,
+        struct sg_table *sgt, enum dma_data_direction dir )
+{
+    struct udma_export_buf * buf = attach->dmabuf->priv;
+    struct udma_export_attachment * a = attach->priv;
+
+    mutex_lock( &buf->lock );
+    a->mapped = false;
+    mutex_unlock( &buf->lock );
+
+    dma_unmap_sg( attach->dev, sgt->sgl, sgt->orig_nents, dir );
+}
+
+static void udma_export_release( struct dma_buf *dmabuf )
+{
+    struct udma_export_buf * buf = dmabuf->priv;
+    unsigned int i;
+
+    for ( i = 0; i < buf->num_pages; ++i )
+        __free_page( buf->pages[i] );
+
+    kfree( buf->pages );
+    kfree( buf );
+}
+
+static int udma_export_begin_cpu_access( struct dma_buf *dmabuf,
+        enum dma_data_direction dir )
+{
+    struct udma_export_buf * buf = dmabuf->priv;
+    struct udma_export_attachment * a;
+
+    mutex_lock( &buf->lock );
+    list_for_each_entry( a, &buf->attachments, node )
+    {
+        if ( a->mapped )
+            dma_sync_sg_for_cpu( a->dev, a->sgt.sgl, a->sgt.orig_nents, a->dir );
+    }
+    mutex_unlock( &buf->lock );
+
+    return 0;
+}
+
+static int udma_export_end_cpu_access( struct dma_buf *dmabuf,
+        enum dma_data_direction dir )
+{
+    struct udma_export_buf * buf = dmabuf->priv;
+    struct udma_export_attachment * a;
+
+    mutex_lock( &buf->lock );
+    list_for_each_entry( a, &buf->attachments, node )
+    {
+        if ( a->mapped )
+            dma_sync_sg_for_device( a->dev, a->sgt.sgl, a->sgt.orig_nents, a->dir );
+    }
+    mutex_unlock( &buf->lock );
+
+    return 0;
+}
+
+static void *udma_export_kmap( struct dma_buf *dmabuf, unsigned long pgnum )
+{
+    struct udma_export_buf * buf = dmabuf->priv;
+
+    return kmap( buf->pages[pgnum] );
+}
+
+static void udma_export_kunmap( struct dma_buf *dmabuf, unsigned long pgnum,
+        void *vaddr )
+{
+    struct udma_export_buf * buf = dmabuf->priv;
+
+    kunmap( buf->pages[pgnum] );
+}
+
+static void *udma_export_kmap_atomic( struct dma_buf *dmabuf, unsigned long pgnum )
+{
+    struct udma_export_buf * buf = dmabuf->priv;
+
+    return kmap_atomic( buf->pages[pgnum] );
+}
+
+static void udma_export_kunmap_atomic( struct dma_buf *dmabuf, unsigned long pgnum,
+        void *vaddr )
+{
+    kunmap_atomic( vaddr );
+}
+
+static void *udma_export_vmap( struct dma_buf *dmabuf )
+{
+    struct udma_export_buf * buf = dmabuf->priv;
+
+    return vmap( buf->pages, buf->num_pages, VM_MAP, PAGE_KERNEL );
+}
+
+static void udma_export_vunmap( struct dma_buf *dmabuf, void *vaddr )
+{
+    vunmap( vaddr );
+}
+
+static int udma_export_mmap( struct dma_buf *dmabuf, struct vm_area_struct *vma )
+{
+    struct udma_export_buf * buf = dmabuf->priv;
+    unsigned long addr = vma->vm_start;
+    unsigned long pgoff = vma->vm_pgoff;
+    int rv;
+
+    if ( pgoff + vma_pages(vma) > buf->num_pages )
+        return -EINVAL;
+
+    // Regular cacheable mapping; coherency is the job of DMA_BUF_IOCTL_SYNC.
+    for ( ; addr < vma->vm_end; addr += PAGE_SIZE, ++pgoff )
+    {
+        if ( (rv = vm_insert_page( vma, addr, buf->pages[pgoff] )) )
+            return rv;
+    }
+
+    return 0;
+}
+
+static const struct dma_buf_ops udma_export_ops = {
+    .attach             = udma_export_attach,
+    .detach             = udma_export_detach,
+    .map_dma_buf        = udma_export_map,
+    .unmap_dma_buf      = udma_export_unmap,
+    .release            = udma_export_release,
+    .begin_cpu_access   = udma_export_begin_cpu_access,
+    .end_cpu_access     = udma_export_end_cpu_access,
+    .kmap               = udma_export_kmap,
+    .kunmap             = udma_export_kunmap,
+    .kmap_atomic        = udma_export_kmap_atomic,
+    .kunmap_atomic      = udma_export_kunmap_atomic,
+    .vmap               = udma_export_vmap,
+    .vunmap             = udma_export_vunmap,
+    .mmap               = udma_export_mmap,
+};
+
+static int udma_ioctl_dmabuf_export( struct udma_file * p_file, void __user *argp )
+{
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+    struct udma_dmabuf_export req;
+    struct udma_export_buf * buf;
+    struct dma_buf * dmabuf;
+    unsigned int i;
+    int rv;
+
+    if ( copy_from_user( &req, argp, sizeof(req) ) )
+        return -EFAULT;
+
+    if ( 0 == req.size || req.size > (u64)totalram_pages << PAGE_SHIFT )
+        return -EINVAL;
+
+    buf = kzalloc( sizeof(*buf), GFP_KERNEL );
+    if ( !buf )
+        return -ENOMEM;
+
+    mutex_init( &buf->lock );
+    INIT_LIST_HEAD( &buf->attachments );
+    buf->size = PAGE_ALIGN( req.size );
+    buf->num_pages = buf->size >> PAGE_SHIFT;
+
+    buf->pages = kcalloc( buf->num_pages, sizeof(struct page*), GFP_KERNEL );
+    if ( !buf->pages )
+    {
+        rv = -ENOMEM;
+        goto err_free_buf;
+    }
+
+    for ( i = 0; i < buf->num_pages; ++i )
+    {
+        buf->pages[i] = alloc_page( GFP_KERNEL | __GFP_ZERO );
+        if ( !buf->pages[i] )
+        {
+            rv = -ENOMEM;
+            goto err_free_pages;
+        }
+    }
+
+    exp_info.ops = &udma_export_ops;
+    exp_info.size = buf->size;
+    exp_info.flags = O_RDWR;
+    exp_info.priv = buf;
+
+    dmabuf = dma_buf_export( &exp_info );
+    if ( IS_ERR(dmabuf) )
+    {
+        rv = PTR_ERR(dmabuf);
+        goto err_free_pages;
+    }
+
+    // From here on the dma-buf owns buf, udma_export_release() frees it.
+    rv = dma_buf_fd( dmabuf, req.flags & O_CLOEXEC );
+    if ( rv < 0 )
+    {
+        dma_buf_put( dmabuf );
+        return rv;
+    }
+
+    req.fd = rv;
+    if ( copy_to_user( argp, &req, sizeof(req) ) )
+    {
+        // The fd is already installed, userspace owns it now.
+        return -EFAULT;
+    }
+
+    return 0;
+
+    err_free_pages:
+    while ( i-- )
+        __free_page( buf->pages[i] );
+    kfree( buf->pages );
+
+    err_free_buf:
+    kfree( buf );
+    return rv;
+}
+
+static void udma_dmabuf_attachment_free( struct kref * ref )
+{
+    struct udma_dmabuf_attachment * import =
+        container_of( ref, struct udma_dmabuf_attachment, ref );
+
+    dma_buf_unmap_attachment( import->attach, import->sgt,
+            import->p_info->dir == UDMA_DEV_TO_CPU ? DMA_FROM_DEVICE : DMA_TO_DEVICE );
+    dma_buf_detach( import->dmabuf, import->attach );
+    dma_buf_put( import->dmabuf );
+    kfree( import );
+}
+
+static int udma_ioctl_dmabuf_import( struct udma_file * p_file, void __user *argp )
+{
+    struct udma_dmabuf_import req;
+    struct udma_dmabuf_attachment * import;
+    struct udma_drvdata * p_info;
+    int rv;
+
+    if ( copy_from_user( &req, argp, sizeof(req) ) )
+        return -EFAULT;
+
+    if ( UDMA_DEV_TO_CPU == req.dir )
+        p_info = p_file->rx;
+    else if ( UDMA_CPU_TO_DEV == req.dir )
+        p_info = p_file->tx;
+    else
+        return -EINVAL;
+
+    if ( !p_info )
+        return -EINVAL;
+
+    import = kzalloc( sizeof(*import), GFP_KERNEL );
+    if ( !import )
+        return -ENOMEM;
+
+    kref_init( &import->ref );
+    import->p_info = p_info;
+
+    import->dmabuf = dma_buf_get( req.fd );
+    if ( IS_ERR(import->dmabuf) )
+    {
+        rv = PTR_ERR(import->dmabuf);
+        goto err_free;
+    }
+
+    import->attach = dma_buf_attach( import->dmabuf, &p_info->pdev->dev );
+    if ( IS_ERR(import->attach) )
+    {
+        rv = PTR_ERR(import->attach);
+        goto err_put;
+    }
+
+    import->sgt = dma_buf_map_attachment( import->attach,
+            UDMA_DEV_TO_CPU == req.dir ? DMA_FROM_DEVICE : DMA_TO_DEVICE );
+    if ( IS_ERR(import->sgt) )
+    {
+        rv = PTR_ERR(import->sgt);
+        goto err_detach;
+    }
+
+    mutex_lock( &p_file->lock );
+    import->handle = ++p_file->next_handle;
+    list_add_tail( &import->node, &p_file->imports );
+    mutex_unlock( &p_file->lock );
+
+    req.size = import->dmabuf->size;
+    req.handle = import->handle;
+    if ( copy_to_user( argp, &req, sizeof(req) ) )
+        return -EFAULT;     // still imported, released on close()
+
+    return 0;
+
+    err_detach:
+    dma_buf_detach( import->dmabuf, import->attach );
+
+    err_put:
+    dma_buf_put( import->dmabuf );
+
+    err_free:
+    kfree( import );
+    return rv;
+}
+
+// Looks up handle and takes a reference; NULL if there is no such import.
+static struct udma_dmabuf_attachment *udma_dmabuf_lookup(
+        struct udma_file * p_file, u32 handle, bool unlink )
+{
+    struct udma_dmabuf_attachment * import;
+
+    mutex_lock( &p_file->lock );
+    list_for_each_entry( import, &p_file->imports, node )
+    {
+        if ( import->handle == handle )
+        {
+            if ( unlink )
+                list_del( &import->node );
+            else
+                kref_get( &import->ref );
+            mutex_unlock( &p_file->lock );
+            return import;
+        }
+    }
+    mutex_unlock( &p_file->lock );
+
+    return NULL;
+}
+
+static int udma_ioctl_dmabuf_release( struct udma_file * p_file, void __user *argp )
+{
+    struct udma_dmabuf_attachment * import;
+    u32 handle;
+
+    if ( get_user( handle, (u32 __user *)argp ) )
+        return -EFAULT;
+
+    // Drops the list's reference, transfers still running keep theirs.
+    import = udma_dmabuf_lookup( p_file, handle, true );
+    if ( !import )
+        return -ENOENT;
+
+    kref_put( &import->ref, udma_dmabuf_attachment_free );
+    return 0;
+}
+
+static ssize_t udma_ioctl_dmabuf_xfer( struct udma_file * p_file, void __user *argp )
+{
+    struct udma_dmabuf_xfer req;
+    struct udma_dmabuf_attachment * import;
+    ssize_t rv;
+
+    if ( copy_from_user( &req, argp, sizeof(req) ) )
+        return -EFAULT;
+
+    if ( 0 != (req.length % UDMA_ALIGN_BYTES) || (req.flags & ~UDMA_XFER_HIGH_PRIO) )
+        return -EINVAL;
+
+    import = udma_dmabuf_lookup( p_file, req.handle, false );
+    if ( !import )
+        return -ENOENT;
+
+    if ( 0 == req.length ||
+         req.offset >= import->dmabuf->size ||
+         req.length > import->dmabuf->size - req.offset )
+    {
+        rv = -EINVAL;
+    }
+    else
+    {
+        const u32 prio = (req.flags & UDMA_XFER_HIGH_PRIO) ? UDMA_PRIO_HIGH : READ_ONCE( p_file->prio );
+
+        rv = udma_transfer( p_file, import->p_info, prio, NULL, NULL, req.length, import, req.offset,
+                            udma_rx_timeout( p_file, import->p_info ) );
+    }
+
+    kref_put( &import->ref, udma_dmabuf_attachment_free );
+    return rv;
+}
+
+/* Syncs only the part of the import's mapping that [offset, offset+length)
+ * covers, in the direction it was mapped for: on non-coherent systems RX
+ * data is invalidated at START and TX data cleaned at END, so post-processing
+ * a few lines of a large cached buffer doesn't pay for all of it.
+ *
+ * dma_sync_sg_*() is handed a copy of the covered page entries, trimmed to
+ * the range. IOMMU dma ops sync by CPU address; the DMA addresses of the
+ * copy only matter where the mapping is one entry per page entry.
+ */
+static int udma_ioctl_dmabuf_sync( struct udma_file * p_file, void __user *argp )
+{
+    struct udma_dmabuf_sync req;
+    struct udma_dmabuf_attachment * import;
+    struct sg_table * sgt;
+    struct scatterlist * sgl = NULL;
+    struct scatterlist * sg;
+    struct scatterlist * part;
+    enum dma_data_direction dir;
+    unsigned int nparts = 0;
+    u64 offset;
+    u64 left;
+    int rv = 0;
+    int i;
+
+    if ( copy_from_user( &req, argp, sizeof(req) ) )
+        return -EFAULT;
+
+    if ( !(req.flags & UDMA_SYNC_RW) || (req.flags & ~(UDMA_SYNC_RW | UDMA_SYNC_END)) )
+        return -EINVAL;
+
+    import = udma_dmabuf_lookup( p_file, req.handle, false );
+    if ( !import )
+        return -ENOENT;
+
+    if ( 0 == req.length ||
+         req.offset >= import->dmabuf->size ||
+         req.length > import->dmabuf->size - req.offset )
+    {
+        rv = -EINVAL;
+        goto out;
+    }
+
+    sgt = import->sgt;
+
+    // count the entries the range touches
+    offset = req.offset;
+    left = req.length;
+    for_each_sg( sgt->sgl, sg, sgt->orig_nents, i )
+    {
+        if ( offset >= sg->length )
+        {
+            offset -= sg->length;
+            continue;
+        }
+
+        ++nparts;
+        left -= min_t( u64, sg->length - offset, left );
+        offset = 0;
+        if ( !left )
+            break;
+    }
+
+    if ( !nparts )
+        goto out;
+
+    sgl = kmalloc_array( nparts, sizeof(*sgl), GFP_KERNEL );
+    if ( !sgl )
+    {
+        rv = -ENOMEM;
+        goto out;
+    }
+    sg_init_table( sgl, nparts );
+
+    part = sgl;
+    offset = req.offset;
+    left = req.length;
+    for_each_sg( sgt->sgl, sg, sgt->orig_nents, i )
+    {
+        unsigned int len;
+
+        if ( offset >= sg->length )
+        {
+            offset -= sg->length;
+            continue;
+        }
+
+        len = min_t( u64, sg->length - offset, left );
+        sg_set_page( part, sg_page( sg ), len, sg->offset + offset );
+        if ( sgt->nents == sgt->orig_nents )
+        {
+            sg_dma_address( part ) = sg_dma_address( sg ) + offset;
+            sg_dma_len( part ) = len;
+        }
+
+        offset = 0;
+        left -= len;
+        if ( !left )
+            break;
+        part = sg_next( part );
+    }
+
+    dir = import->p_info->dir == UDMA_DEV_TO_CPU ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
+    if ( req.flags & UDMA_SYNC_END )
+        dma_sync_sg_for_device( &import->p_info->pdev->dev, sgl, nparts, dir );
+    else
+        dma_sync_sg_for_cpu( &import->p_info->pdev->dev, sgl, nparts, dir );
+
+    out:
+    kfree( sgl );
+    kref_put( &import->ref, udma_dmabuf_attachment_free );
+    return rv;
+}
+
+/* Builds inflight.table as the [offset, offset+count) slice of the imported
+ * buffer's mapping. Only DMA addresses are filled in, there is nothing to
+ * pin or map here. The slice has to start on the channel's alignment.
+ */
+static int udma_prepare_dmabuf(
+        struct udma_drvdata * p_info,
+        struct udma_dmabuf_attachment * import,
+        u64 offset,
+        size_t count )
+{
+    struct sg_table * const src = import->sgt;
+    struct scatterlist * sg;
+    struct scatterlist * dst;
+    size_t left_to_map = count;
+    int i;
+    int rv;
+
+    BUG_ON( p_info->inflight.pinned_pages ); // should be NULL
+    memset( &p_info->inflight, 0, sizeof( struct udma_inflight_info ) );
+    init_completion( &p_info->inflight.done );
+    p_info->inflight.len = count;
+    p_info->inflight.ts[UDMA_LAT_PIN] = ktime_get_ns();
+    p_info->inflight.ts[UDMA_LAT_MAP] = p_info->inflight.ts[UDMA_LAT_PIN];    // nothing to pin
+
+    if ( (rv = sg_alloc_table( &p_info->inflight.table, src->nents, GFP_KERNEL )) )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: sg_alloc_table() returned %d\n",
+                p_info->name, rv);
+        return rv;
+    }
+    p_info->inflight.table_allocated = 1;
+
+    dst = p_info->inflight.table.sgl;
+
+    for_each_sg( src->sgl, sg, src->nents, i )
+    {
+        dma_addr_t addr = sg_dma_address( sg );
+        unsigned int len = sg_dma_len( sg );
+
+        if ( offset >= len )
+        {
+            offset -= len;
+            continue;
+        }
+
+        addr += offset;
+        len -= offset;
+        offset = 0;
+
+        if ( addr & (p_info->align - 1) )
+        {
+            rv = -EINVAL;
+            goto err_out;
+        }
+
+        if ( len > left_to_map )
+            len = left_to_map;
+
+        sg_dma_address( dst ) = addr;
+        sg_dma_len( dst ) = len;
+        ++p_info->inflight.nents;
+
+        left_to_map -= len;
+        if ( !left_to_map )
+            break;
+
+        dst = sg_next( dst );
+    }
+
+    if ( (rv = udma_submit_dma( p_info )) )
+        goto err_out;
+
+    return 0;
+
+    err_out:
+    udma_unprepare_after_dma( p_info );
+    return rv;
+}
+
+/*
+ * Device-to-device chaining
+ *
+ * The RX channel of one instance is kept armed with every free buffer of
+ * the ring. Each RX completion queues the received bytes on the TX channel
+ * of the other instance, and each TX completion posts its buffer back to RX,
+ * all from the dmaengine callbacks. The CPU never touches the data, so the
+ * buffers are mapped once for both devices and never synced.
+ */
+
+#define UDMA_CHAIN_MAX_BUFS     (256)
+#define UDMA_CHAIN_MAX_BUF_SIZE (4 << 20)
+
+static void udma_chain_rx_done( void *data, const struct dmaengine_result *result );
+static void udma_chain_tx_done( void *data, const struct dmaengine_result *result );
+
+// should be called with chain->lock held
+static int udma_chain_post_rx( struct udma_chain_buf * buf )
+{
+    struct udma_chain * const chain = buf->chain;
+    struct dma_async_tx_descriptor * desc;
+
+    desc = dmaengine_prep_slave_single( chain->rx->chan, buf->rx_addr,
+            chain->buf_size, DMA_DEV_TO_MEM, DMA_PREP_INTERRUPT );
+    if ( !desc )
+        return -ENOMEM;
+
+    desc->callback_result = udma_chain_rx_done;
+    desc->callback_param = buf;
+
+    if ( dmaengine_submit( desc ) < DMA_MIN_COOKIE )
+        return -EIO;
+
+    ++chain->rx_posted;
+    dma_async_issue_pending( chain->rx->chan );
+    return 0;
+}
+
+static void udma_chain_rx_done( void *data, const struct dmaengine_result *result )
+{
+    struct udma_chain_buf * const buf = data;
+    struct udma_chain * const chain = buf->chain;
+    struct dma_async_tx_descriptor * desc;
+    unsigned long iflags;
+
+    spin_lock_irqsave( &chain->lock, iflags );
+
+    --chain->rx_posted;
+
+    if ( chain->stopping )
+        goto out;
+
+    if ( result->result != DMA_TRANS_NOERROR )
+    {
+        ++chain->rx_errors;
+        goto repost;
+    }
+
+    // Engines without residue reporting always forward the full buffer.
+    buf->len = chain->buf_size - result->residue;
+    if ( !buf->len )
+        goto repost;
+
+    desc = dmaengine_prep_slave_single( chain->tx->chan, buf->tx_addr,
+            buf->len, DMA_MEM_TO_DEV, DMA_PREP_INTERRUPT );
+    if ( !desc )
+    {
+        ++chain->dropped;
+        goto repost;
+    }
+
+    desc->callback_result = udma_chain_tx_done;
+    desc->callback_param = buf;
+
+    if ( dmaengine_submit( desc ) < DMA_MIN_COOKIE )
+    {
+        ++chain->dropped;
+        goto repost;
+    }
+
+    ++chain->tx_inflight;
+    dma_async_issue_pending( chain->tx->chan );
+    goto out;
+
+    repost:
+    if ( udma_chain_post_rx( buf ) )
+        printk( KERN_ERR KBUILD_MODNAME ": %s: chain lost a buffer, couldn't repost it\n",
+                chain->rx->name );
+
+    out:
+    spin_unlock_irqrestore( &chain->lock, iflags );
+}
+
+static void udma_chain_tx_done( void *data, const struct dmaengine_result *result )
+{
+    struct udma_chain_buf * const buf = data;
+    struct udma_chain * const chain = buf->chain;
+    unsigned long iflags;
+
+    spin_lock_irqsave( &chain->lock, iflags );
+
+    --chain->tx_inflight;
+
+    if ( result->result != DMA_TRANS_NOERROR )
+    {
+        ++chain->tx_errors;
+    }
+    else
+    {
+        ++chain->frames;
+        chain->bytes += buf->len;
+    }
+
+    if ( chain->stopping )
+    {
+        if ( !chain->tx_inflight )
+            wake_up( &chain->wq );
+    }
+    else if ( udma_chain_post_rx( buf ) )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: chain lost a buffer, couldn't repost it\n",
+                chain->rx->name );
+    }
+
+    spin_unlock_irqrestore( &chain->lock, iflags );
+}
+
+static bool udma_chain_tx_idle( struct udma_chain * chain )
+{
+    bool rv;
+
+    spin_lock_irq( &chain->lock );
+    rv = !chain->tx_inflight;
+    spin_unlock_irq( &chain->lock );
+
+    return rv;
+}
+
+static void udma_chain_free_bufs( struct udma_chain * chain )
+{
+    unsigned int i;
+
+    for ( i = 0; i < chain->num_bufs; ++i )
+    {
+        struct udma_chain_buf * const buf = &chain->bufs[i];
+
+        if ( !buf->cpu_addr )
+            continue;
+
+        if ( buf->rx_addr )
+            dma_unmap_single( &chain->rx->pdev->dev, buf->rx_addr,
+                    chain->buf_size, DMA_FROM_DEVICE );
+        if ( buf->tx_addr )
+            dma_unmap_single( &chain->tx->pdev->dev, buf->tx_addr,
+                    chain->buf_size, DMA_TO_DEVICE );
+        kfree( buf->cpu_addr );
+    }
+
+    kfree( chain->bufs );
+    kfree( chain );
+}
+
+// Takes p_info for the chain; fails if a transfer is running or it is already chained.
+static int udma_chain_claim( struct udma_drvdata * p_info, struct udma_chain * chain )
+{
+    int rv = 0;
+
+    if ( down_trylock( &p_info->sem ) )
+        return -EBUSY;
+
+    if ( !atomic_read( &p_info->accepting ) )
+        rv = -EBADF;
+    else if ( udma_chan_owned( p_info ) )
+        rv = -EBUSY;
+    else
+        p_info->chain = chain;
+
+    up( &p_info->sem );
+    return rv;
+}
+
+static void udma_chain_release( struct udma_drvdata * p_info )
+{
+    down( &p_info->sem );
+    p_info->chain = NULL;
+    up( &p_info->sem );
+}
+
+// should be called with udma_instances_lock held
+static void udma_chain_stop( struct udma_chain * chain )
+{
+    spin_lock_irq( &chain->lock );
+    chain->stopping = true;
+    spin_unlock_irq( &chain->lock );
+
+    // No RX callback runs past this point, so nothing new reaches TX.
+    dmaengine_terminate_sync( chain->rx->chan );
+
+    if ( !wait_event_timeout( chain->wq, udma_chain_tx_idle(chain), HZ ) )
+        printk( KERN_WARNING KBUILD_MODNAME ": %s: chain TX didn't drain, dropping it\n",
+                chain->tx->name );
+    dmaengine_terminate_sync( chain->tx->chan );
+
+    udma_chain_release( chain->rx );
+    udma_chain_release( chain->tx );
+
+    printk( KERN_DEBUG KBUILD_MODNAME ": %s -> %s: chain stopped after %llu frames\n",
+            chain->rx->name, chain->tx->name, chain->frames );
+
+    udma_chain_free_bufs( chain );
+}
+
+// should be called with udma_instances_lock held
+static int udma_chain_start( struct udma_drvdata * p_rx, const struct udma_chain_link * req )
+{
+    struct udma_pdev_drvdata * p_target;
+    struct udma_chain * chain;
+    unsigned int i;
+    int rv;
+
+    if ( 0 == req->num_bufs || req->num_bufs > UDMA_CHAIN_MAX_BUFS ||
+         0 == req->buf_size || req->buf_size > UDMA_CHAIN_MAX_BUF_SIZE ||
+         0 != (req->buf_size % UDMA_ALIGN_BYTES) )
+        return -EINVAL;
+
+    p_target = udma_find_instance_by_name( req->target );
+    if ( !p_target || !p_target->tx )
+        return -ENODEV;
+
+    chain = kzalloc( sizeof(*chain), GFP_KERNEL );
+    if ( !chain )
+        return -ENOMEM;
+
+    chain->rx = p_rx;
+    chain->tx = p_target->tx;
+    chain->num_bufs = req->num_bufs;
+    chain->buf_size = req->buf_size;
+    spin_lock_init( &chain->lock );
+    init_waitqueue_head( &chain->wq );
+
+    chain->bufs = kcalloc( chain->num_bufs, sizeof(struct udma_chain_buf), GFP_KERNEL );
+    if ( !chain->bufs )
+    {
+        kfree( chain );
+        return -ENOMEM;
+    }
+
+    for ( i = 0; i < chain->num_bufs; ++i )
+    {
+        struct udma_chain_buf * const buf = &chain->bufs[i];
+        dma_addr_t addr;
+
+        buf->chain = chain;
+        buf->cpu_addr = kmalloc( chain->buf_size, GFP_KERNEL );
+        if ( !buf->cpu_addr )
+        {
+            rv = -ENOMEM;
+            goto err_free;
+        }
+
+        // TX first: cleaning before the RX invalidate leaves no dirty lines behind.
+        addr = dma_map_single( &chain->tx->pdev->dev, buf->cpu_addr,
+                chain->buf_size, DMA_TO_DEVICE );
+        if ( dma_mapping_error( &chain->tx->pdev->dev, addr ) )
+        {
+            rv = -ENOMEM;
+            goto err_free;
+        }
+        buf->tx_addr = addr;
+
+        addr = dma_map_single( &chain->rx->pdev->dev, buf->cpu_addr,
+                chain->buf_size, DMA_FROM_DEVICE );
+        if ( dma_mapping_error( &chain->rx->pdev->dev, addr ) )
+        {
+            rv = -ENOMEM;
+            goto err_free;
+        }
+        buf->rx_addr = addr;
+    }
+
+    if ( (rv = udma_chain_claim( chain->rx, chain )) )
+        goto err_free;
+
+    if ( (rv = udma_chain_claim( chain->tx, chain )) )
+    {
+        udma_chain_release( chain->rx );
+        goto err_free;
+    }
+
+    spin_lock_irq( &chain->lock );
+    for ( i = 0; i < chain->num_bufs && !rv; ++i )
+        rv = udma_chain_post_rx( &chain->bufs[i] );
+    spin_unlock_irq( &chain->lock );
+
+    if ( rv )
+    {
+        udma_chain_stop( chain );
+        return rv;
+    }
+
+    printk( KERN_DEBUG KBUILD_MODNAME ": %s -> %s: chained with %u x %u byte buffers\n",
+            chain->rx->name, chain->tx->name, chain->num_bufs, chain->buf_size );
+    return 0;
+
+    err_free:
+    udma_chain_free_bufs( chain );
+    return rv;
+}
+
+static int udma_ioctl_chain_link( struct udma_file * p_file, void __user *argp )
+{
+    struct udma_chain_link req;
+    int rv;
+
+    if ( copy_from_user( &req, argp, sizeof(req) ) )
+        return -EFAULT;
+
+    req.target[UDMA_NAME_MAX-1] = '\0';
+
+    if ( !p_file->rx )
+        return -EINVAL;
+
+    mutex_lock( &udma_instances_lock );
+    rv = udma_chain_start( p_file->rx, &req );
+    mutex_unlock( &udma_instances_lock );
+
+    return rv;
+}
+
+static int udma_ioctl_chain_unlink( struct udma_file * p_file )
+{
+    struct udma_drvdata * const p_info = p_file->rx;
+    int rv = 0;
+
+    mutex_lock( &udma_instances_lock );
+    if ( p_info && p_info->chain && p_info->chain->rx == p_info )
+        udma_chain_stop( p_info->chain );
+    else
+        rv = -ENOENT;
+    mutex_unlock( &udma_instances_lock );
+
+    return rv;
+}
+
+static int udma_ioctl_chain_stats( struct udma_file * p_file, void __user *argp )
+{
+    struct udma_drvdata * const p_info = p_file->rx;
+    struct udma_chain * chain;
+    struct udma_chain_stats stats;
+
+    if ( !p_info )
+        return -ENOENT;
+
+    mutex_lock( &udma_instances_lock );
+
+    chain = p_info->chain;
+    if ( !chain || chain->rx != p_info )
+    {
+        mutex_unlock( &udma_instances_lock );
+        return -ENOENT;
+    }
+
+    spin_lock_irq( &chain->lock );
+    stats.frames = chain->frames;
+    stats.bytes = chain->bytes;
+    stats.rx_errors = chain->rx_errors;
+    stats.tx_errors = chain->tx_errors;
+    stats.dropped = chain->dropped;
+    stats.rx_posted = chain->rx_posted;
+    stats.tx_inflight = chain->tx_inflight;
+    spin_unlock_irq( &chain->lock );
+
+    mutex_unlock( &udma_instances_lock );
+
+    if ( copy_to_user( argp, &stats, sizeof(stats) ) )
+        return -EFAULT;
+
+    return 0;
+}
+
+static int udma_ioctl_bind( struct udma_file * p_file, void __user *argp )
+{
+    struct udma_pdev_drvdata * const p_udma = p_file->udma;
+    struct udma_bind req;
+
+    if ( copy_from_user( &req, argp, sizeof(req) ) )
+        return -EFAULT;
+
+    if ( req.rx >= (s32)p_udma->num_chans || req.tx >= (s32)p_udma->num_chans )
+        return -EINVAL;
+    if ( req.rx >= 0 && p_udma->chans[req.rx]->dir != UDMA_DEV_TO_CPU )
+        return -EINVAL;
+    if ( req.tx >= 0 && p_udma->chans[req.tx]->dir != UDMA_CPU_TO_DEV )
+        return -EINVAL;
+
+    if ( req.rx >= 0 )
+        p_file->rx = p_udma->chans[req.rx];
+    if ( req.tx >= 0 )
+        p_file->tx = p_udma->chans[req.tx];
+
+    return 0;
+}
+
+/*
+ * Kernel-bypass ring
+ *
+ * Submission and completion queues live in one coherent allocation that is
+ * mapped into the process next to the data area they point into. A kthread
+ * per ring polls sq_head and feeds new entries to the channel; the dmaengine
+ * callbacks write completions straight into the cq. In steady state neither
+ * direction needs a syscall. The poller spins for idle_us after the last
+ * entry, then flags UDMA_RING_NEED_WAKEUP and sleeps until kicked.
+ */
+
+#define UDMA_RING_MAX_ENTRIES   (4096)
+#define UDMA_RING_MAX_DATA      (64 << 20)
+#define UDMA_RING_DEF_IDLE_US   (1000)
+#define UDMA_RING_MAX_IDLE_US   (10000)     // any process that can open the node may spin a CPU this long
+
+static void udma_ring_free( struct kref * ref )
+{
+    struct udma_ring * const ring = container_of( ref, struct udma_ring, ref );
+
+    dma_free_coherent( ring->dev, ring->size, ring->cpu_addr, ring->dma_addr );
+    put_device( ring->dev );
+    kfree( ring->slots );
+    kfree( ring );
+}
+
+// should be called with ring->lock held
+static void udma_ring_post_cqe( struct udma_ring * ring, u32 user_data, u32 len, int status )
+{
+    struct udma_ring_cqe * const cqe = &ring->cq[ring->cq_head & (ring->entries - 1)];
+
+    cqe->user_data = user_data;
+    cqe->len = len;
+    cqe->status = status;
+    smp_store_release( &ring->hdr->cq_head, ++ring->cq_head );
+}
+
+static void udma_ring_done( void *data, const struct dmaengine_result *result )
+{
+    struct udma_ring_slot * const slot = data;
+    struct udma_ring * const ring = slot->ring;
+    unsigned long iflags;
+    u32 len = slot->len;
+    int status = 0;
+
+    if ( result->result != DMA_TRANS_NOERROR )
+        status = -EIO;
+    else if ( result->residue <= len )
+        len -= result->residue;
+
+    spin_lock_irqsave( &ring->lock, iflags );
+    udma_ring_post_cqe( ring, slot->user_data, len, status );
+    --ring->inflight;
+    spin_unlock_irqrestore( &ring->lock, iflags );
+}
+
+/* Hands every new sq entry to the dmaengine, as long as there is room for
+ * its completion. Returns the number of entries taken.
+ */
+static unsigned int udma_ring_consume( struct udma_ring * ring )
+{
+    struct udma_drvdata * const p_info = ring->p_info;
+    const u32 mask = ring->entries - 1;
+    const u32 head = smp_load_acquire( &ring->hdr->sq_head );
+    const u64 data_size = ring->data_size;
+    const dma_addr_t data_addr = ring->dma_addr + ring->data_off;
+    unsigned int taken = 0;
+
+    // Everything in the shared page may change under us; only copies are trusted.
+    while ( ring->sq_tail != head )
+    {
+        struct udma_ring_sqe * const p_sqe = &ring->sq[ring->sq_tail & mask];
+        struct udma_ring_slot * const slot = &ring->slots[ring->sq_tail & mask];
+        struct dma_async_tx_descriptor * desc;
+        struct udma_ring_sqe sqe;
+        u32 inflight;
+        u32 used;
+        int err = 0;
+
+        spin_lock_irq( &ring->lock );
+        inflight = ring->inflight;
+        used = inflight + (ring->cq_head - READ_ONCE( ring->hdr->cq_tail ));
+        spin_unlock_irq( &ring->lock );
+        if ( inflight >= ring->entries || used >= ring->entries )
+            break;
+
+        sqe.offset = READ_ONCE( p_sqe->offset );
+        sqe.len = READ_ONCE( p_sqe->len );
+        sqe.user_data = READ_ONCE( p_sqe->user_data );
+
+        if ( 0 == sqe.len || sqe.offset >= data_size || sqe.len > data_size - sqe.offset ||
+             (sqe.offset & (p_info->align - 1)) )
+        {
+            err = -EINVAL;
+        }
+        else
+        {
+            desc = dmaengine_prep_slave_single( p_info->chan, data_addr + sqe.offset, sqe.len,
+                    p_info->dir == UDMA_DEV_TO_CPU ? DMA_DEV_TO_MEM : DMA_MEM_TO_DEV,
+                    DMA_PREP_INTERRUPT );
+            if ( !desc )
+            {
+                err = -ENOMEM;
+            }
+            else
+            {
+                slot->user_data = sqe.user_data;
+                slot->len = sqe.len;
+                desc->callback_result = udma_ring_done;
+                desc->callback_param = slot;
+
+                spin_lock_irq( &ring->lock );
+                ++ring->inflight;
+                spin_unlock_irq( &ring->lock );
+
+                if ( dmaengine_submit( desc ) < DMA_MIN_COOKIE )
+                {
+                    spin_lock_irq( &ring->lock );
+                    --ring->inflight;
+                    spin_unlock_irq( &ring->lock );
+                    err = -EIO;
+                }
+            }
+        }
+
+        if ( err )
+        {
+            spin_lock_irq( &ring->lock );
+            udma_ring_post_cqe( ring, sqe.user_data, 0, err );
+            spin_unlock_irq( &ring->lock );
+        }
+
+        ++ring->sq_tail;
+        ++taken;
+    }
+
+    if ( taken )
+    {
+        smp_store_release( &ring->hdr->sq_tail, ring->sq_tail );
+        dma_async_issue_pending( p_info->chan );
+    }
+
+    return taken;
+}
+
+static bool udma_ring_should_wake( struct udma_ring * ring )
+{
+    return kthread_should_stop() || READ_ONCE( ring->kicked );
+}
+
+static int udma_ring_poll( void *data )
+{
+    struct udma_ring * const ring = data;
+    ktime_t last_work = ktime_get();
+
+    while ( !kthread_should_stop() )
+    {
+        if ( udma_ring_consume( ring ) )
+        {
+            last_work = ktime_get();
+            cond_resched();
+            continue;
+        }
+
+        if ( ktime_us_delta( ktime_get(), last_work ) < ring->idle_us )
+        {
+            cond_resched();
+            continue;
+        }
+
+        // Going to sleep, with the sq empty or the cq full: tell the process,
+        // then try once more so an entry it queued or cq room it made before
+        // seeing the flag isn't missed. Only a kick wakes us up after that.
+        WRITE_ONCE( ring->kicked, false );
+        WRITE_ONCE( ring->hdr->flags, ring->hdr->flags | UDMA_RING_NEED_WAKEUP );
+        smp_mb();
+
+        if ( !udma_ring_consume( ring ) )
+            wait_event_interruptible_timeout( ring->wq, udma_ring_should_wake(ring), HZ );
+
+        WRITE_ONCE( ring->hdr->flags, ring->hdr->flags & ~UDMA_RING_NEED_WAKEUP );
+        last_work = ktime_get();
+    }
+
+    return 0;
+}
+
+// should be called with udma_instances_lock held
+static void udma_ring_stop( struct udma_ring * ring )
+{
+    struct udma_drvdata * const p_info = ring->p_info;
+
+    kthread_stop( ring->poller );
+    dmaengine_terminate_sync( p_info->chan );
+
+    down( &p_info->sem );
+    p_info->ring = NULL;
+    up( &p_info->sem );
+
+    ring->p_info = NULL;
+    ring->owner = NULL;
+    kref_put( &ring->ref, udma_ring_free );
+}
+
+// should be called with udma_instances_lock held
+static int udma_ring_start( struct udma_file * p_file, struct udma_drvdata * p_info,
+        struct udma_ring_setup * req )
+{
+    struct device * const dev = &p_info->pdev->dev;
+    struct udma_ring * ring;
+    size_t sq_off, cq_off, data_off;
+    int rv = 0;
+
+    if ( req->entries < 2 || req->entries > UDMA_RING_MAX_ENTRIES || !is_power_of_2( req->entries ) ||
+         0 == req->data_size || req->data_size > UDMA_RING_MAX_DATA ||
+         req->idle_us > UDMA_RING_MAX_IDLE_US )
+        return -EINVAL;
+
+    sq_off = PAGE_ALIGN( sizeof(struct udma_ring_hdr) );
+    cq_off = sq_off + PAGE_ALIGN( req->entries * sizeof(struct udma_ring_sqe) );
+    data_off = cq_off + PAGE_ALIGN( req->entries * sizeof(struct udma_ring_cqe) );
+
+    ring = kzalloc( sizeof(*ring), GFP_KERNEL );
+    if ( !ring )
+        return -ENOMEM;
+
+    kref_init( &ring->ref );
+    init_waitqueue_head( &ring->wq );
+    spin_lock_init( &ring->lock );
+    ring->p_info = p_info;
+    ring->owner = p_file;
+    ring->dev = get_device( dev );
+    ring->entries = req->entries;
+    ring->idle_us = req->idle_us ? req->idle_us : UDMA_RING_DEF_IDLE_US;
+    ring->size = data_off + PAGE_ALIGN( req->data_size );
+
+    ring->slots = kcalloc( ring->entries, sizeof(struct udma_ring_slot), GFP_KERNEL );
+    ring->cpu_addr = dma_alloc_coherent( dev, ring->size, &ring->dma_addr, GFP_KERNEL );
+    if ( !ring->slots || !ring->cpu_addr )
+    {
+        kfree( ring->slots );
+        if ( ring->cpu_addr )
+            dma_free_coherent( dev, ring->size, ring->cpu_addr, ring->dma_addr );
+        put_device( dev );
+        kfree( ring );
+        return -ENOMEM;
+    }
+
+    memset( ring->cpu_addr, 0, ring->size );
+    ring->hdr = ring->cpu_addr;
+    ring->sq = ring->cpu_addr + sq_off;
+    ring->cq = ring->cpu_addr + cq_off;
+    ring->hdr->entries = ring->entries;
+    ring->hdr->sq_off = sq_off;
+    ring->hdr->cq_off = cq_off;
+    ring->data_off = data_off;
+    ring->data_size = ring->size - data_off;
+    ring->hdr->data_off = ring->data_off;
+    ring->hdr->data_size = ring->data_size;
+
+    {
+        unsigned int i;
+
+        for ( i = 0; i < ring->entries; ++i )
+            ring->slots[i].ring = ring;
+    }
+
+    if ( down_trylock( &p_info->sem ) )
+    {
+        rv = -EBUSY;
+        goto err_free;
+    }
+
+    if ( !atomic_read( &p_info->accepting ) )
+        rv = -EBADF;
+    else if ( udma_chan_owned( p_info ) )
+        rv = -EBUSY;
+    else
+        p_info->ring = ring;
+
+    up( &p_info->sem );
+
+    if ( rv )
+        goto err_free;
+
+    ring->poller = kthread_create( udma_ring_poll, ring, "udma-ring/%s", p_info->name );
+    if ( IS_ERR(ring->poller) )
+    {
+        rv = PTR_ERR(ring->poller);
+        down( &p_info->sem );
+        p_info->ring = NULL;
+        up( &p_info->sem );
+        goto err_free;
+    }
+
+    // Poll where the channel is told to submit from, if anywhere.
+    if ( p_info->submit_cpu >= 0 )
+        kthread_bind( ring->poller, p_info->submit_cpu );
+    wake_up_process( ring->poller );
+
+    req->mmap_offset = (u64)(UDMA_MMAP_RING_PGOFF + p_info->index) << PAGE_SHIFT;
+    req->mmap_size = ring->size;
+
+    printk( KERN_DEBUG KBUILD_MODNAME ": %s: ring with %u entries, %zu data bytes\n",
+            p_info->name, ring->entries, ring->data_size );
+    return 0;
+
+    err_free:
+    kref_put( &ring->ref, udma_ring_free );
+    return rv;
+}
+
+static struct udma_drvdata * udma_file_chan( struct udma_file * p_file, u32 dir )
+{
+    if ( UDMA_DEV_TO_CPU == dir )
+        return p_file->rx;
+    if ( UDMA_CPU_TO_DEV == dir )
+        return p_file->tx;
+    return NULL;
+}
+
+static int udma_ioctl_ring_setup( struct udma_file * p_file, void __user *argp )
+{
+    struct udma_ring_setup req;
+    struct udma_drvdata * p_info;
+    int rv;
+
+    if ( copy_from_user( &req, argp, sizeof(req) ) )
+        return -EFAULT;
+
+    if ( !(p_info = udma_file_chan( p_file, req.dir )) )
+        return -EINVAL;
+
+    mutex_lock( &udma_instances_lock );
+    rv = udma_ring_start( p_file, p_info, &req );
+    mutex_unlock( &udma_instances_lock );
+
+    if ( !rv && copy_to_user( argp, &req, sizeof(req) ) )
+        rv = -EFAULT;
+
+    return rv;
+}
+
+static int udma_ioctl_ring_teardown( struct udma_file * p_file, void __user *argp )
+{
+    struct udma_drvdata * p_info;
+    u32 dir;
+    int rv = 0;
+
+    if ( get_user( dir, (u32 __user *)argp ) )
+        return -EFAULT;
+
+    if ( !(p_info = udma_file_chan( p_file, dir )) )
+        return -EINVAL;
+
+    mutex_lock( &udma_instances_lock );
+    if ( p_info->ring && p_info->ring->owner == p_file )
+        udma_ring_stop( p_info->ring );
+    else
+        rv = -ENOENT;
+    mutex_unlock( &udma_instances_lock );
+
+    return rv;
+}
+
+// The only syscall of the bypass mode, and only needed after UDMA_RING_NEED_WAKEUP.
+static int udma_ioctl_ring_kick( struct udma_file * p_file, void __user *argp )
+{
+    struct udma_drvdata * p_info;
+    struct udma_ring * ring;
+    u32 dir;
+
+    if ( get_user( dir, (u32 __user *)argp ) )
+        return -EFAULT;
+
+    if ( !(p_info = udma_file_chan( p_file, dir )) )
+        return -EINVAL;
+
+    mutex_lock( &udma_instances_lock );
+
+    ring = p_info->ring;
+    if ( !ring || ring->owner != p_file )
+    {
+        mutex_unlock( &udma_instances_lock );
+        return -ENOENT;
+    }
+
+    WRITE_ONCE( ring->kicked, true );
+    wake_up( &ring->wq );
+
+    mutex_unlock( &udma_instances_lock );
+    return 0;
+}
+
+static void udma_ring_vm_open( struct vm_area_struct *vma )
+{
+    struct udma_ring * const ring = vma->vm_private_data;
+
+    kref_get( &ring->ref );
+}
+
+static void udma_ring_vm_close( struct vm_area_struct *vma )
+{
+    struct udma_ring * const ring = vma->vm_private_data;
+
+    kref_put( &ring->ref, udma_ring_free );
+}
+
+static const struct vm_operations_struct udma_ring_vm_ops = {
+    .open = udma_ring_vm_open,
+    .close = udma_ring_vm_close,
+};
+
+static int udma_ring_mmap( struct udma_file * p_file, unsigned int index, struct vm_area_struct *vma )
+{
+    struct udma_pdev_drvdata * const p_udma = p_file->udma;
+    struct udma_ring * ring = NULL;
+    int rv;
+
+    if ( index >= p_udma->num_chans )
+        return -EINVAL;
+
+    mutex_lock( &udma_instances_lock );
+
+    ring = p_udma->chans[index]->ring;
+    if ( !ring || ring->owner != p_file )
+    {
+        rv = -ENOENT;
+        goto out;
+    }
+    if ( vma->vm_end - vma->vm_start > ring->size )
+    {
+        rv = -EINVAL;
+        goto out;
+    }
+
+    // dma_mmap_coherent() takes vm_pgoff as the offset into the buffer.
+    vma->vm_pgoff = 0;
+    rv = dma_mmap_coherent( ring->dev, vma, ring->cpu_addr, ring->dma_addr, ring->size );
+    if ( rv )
+        goto out;
+
+    vma->vm_private_data = ring;
+    vma->vm_ops = &udma_ring_vm_ops;
+    udma_ring_vm_open( vma );
+
+    out:
+    mutex_unlock( &udma_instances_lock );
+    return rv;
+}
+
+int udma_mmap(struct udma_file *p_file, struct vm_area_struct *vma)
+{
+    if ( vma->vm_pgoff >= UDMA_MMAP_RING_PGOFF &&
+         vma->vm_pgoff < UDMA_MMAP_RING_PGOFF + UDMA_MAX_CHANNELS )
+        return udma_ring_mmap( p_file, vma->vm_pgoff - UDMA_MMAP_RING_PGOFF, vma );
+
+    return -EINVAL;
+}
+EXPORT_SYMBOL_GPL(udma_mmap);
+
+static int udma_ioctl_set_weight( struct udma_file * p_file, void __user *argp )
+{
+    u32 weight;
+
+    if ( get_user( weight, (u32 __user *)argp ) )
+        return -EFAULT;
+    if ( weight < 1 || weight > UDMA_WEIGHT_MAX )
+        return -EINVAL;
+
+    // Read by the schedulers on each new round.
+    WRITE_ONCE( p_file->weight, weight );
+    return 0;
+}
+
+static int udma_ioctl_set_prio( struct udma_file * p_file, void __user *argp )
+{
+    u32 prio;
+
+    if ( get_user( prio, (u32 __user *)argp ) )
+        return -EFAULT;
+    if ( UDMA_PRIO_BULK != prio && UDMA_PRIO_HIGH != prio )
+        return -EINVAL;
+
+    WRITE_ONCE( p_file->prio, prio );
+    return 0;
+}
+
+static int udma_ioctl_set_tx_rate( struct udma_file * p_file, void __user *argp )
+{
+    struct udma_rate req;
+
+    if ( copy_from_user( &req, argp, sizeof(req) ) )
+        return -EFAULT;
+    if ( req.reserved )
+        return -EINVAL;
+
+    udma_bucket_set( &p_file->tx_bucket, req.rate, req.burst );
+    return 0;
+}
+
+/* A write()-like transfer with app words, see udma_meta_supported(). Not
+ * split by sched_chunk nor striped, the app words belong to one frame.
+ */
+static ssize_t udma_ioctl_meta_xfer( struct udma_file * p_file, void __user *argp )
+{
+    const u64 start = ktime_get_ns();
+    struct udma_meta_xfer req;
+    struct udma_drvdata * p_info;
+    char __user * userbuf;
+    u32 prio;
+    ssize_t rv;
+
+    if ( copy_from_user( &req, argp, sizeof(req) ) )
+        return -EFAULT;
+
+    if ( !(p_info = udma_file_chan( p_file, req.dir )) )
+        return -EINVAL;
+    if ( 0 == req.len || 0 != (req.len % UDMA_ALIGN_BYTES) ||
+         (req.flags & ~UDMA_XFER_HIGH_PRIO) || req.meta_len > UDMA_META_MAX || req.reserved )
+        return -EINVAL;
+    if ( !udma_meta_supported( p_info ) )
+        return -EOPNOTSUPP;
+
+    userbuf = (char __user *)(uintptr_t)req.buf;
+    prio = (req.flags & UDMA_XFER_HIGH_PRIO) ? UDMA_PRIO_HIGH : READ_ONCE( p_file->prio );
+
+    rv = udma_transfer_begin( p_file, p_info, prio, userbuf, NULL, req.len, NULL, 0, &req, NULL );
+    if ( !rv )
+        rv = udma_transfer_end( p_info, 0, NULL );
+
+    udma_trace_record( p_file->udma, p_info, start, UDMA_TRACE_USER,
+                       (unsigned long)userbuf & ~PAGE_MASK, req.len, rv );
+    return rv;
+}
+
+static int udma_ioctl_set_rx_timeout( struct udma_file * p_file, void __user *argp )
+{
+    s32 timeout_ms;
+
+    if ( get_user( timeout_ms, (s32 __user *)argp ) )
+        return -EFAULT;
+    if ( timeout_ms < -1 )
+        return -EINVAL;
+
+    p_file->rx_timeout_ms = timeout_ms;
+    return 0;
+}
+
+struct udma_file *udma_open(struct device *parent)
+{
+    struct udma_pdev_drvdata * p_udma;
+    struct udma_file * p_file;
+
+    mutex_lock( &udma_instances_lock );
+    p_udma = udma_find_instance( parent );
+    mutex_unlock( &udma_instances_lock );
+
+    if ( !p_udma )
+        return ERR_PTR(-ENODEV);
+
+    p_file = kzalloc( sizeof(*p_file), GFP_KERNEL );
+    if ( !p_file )
+        return ERR_PTR(-ENOMEM);
+
+    p_file->udma = p_udma;
+    p_file->rx = p_udma->rx;
+    p_file->tx = p_udma->tx;
+    p_file->rx_timeout_ms = -1;
+    p_file->weight = 1;
+    p_file->prio = UDMA_PRIO_BULK;
+    udma_bucket_init( &p_file->tx_bucket );
+    mutex_init( &p_file->lock );
+    INIT_LIST_HEAD( &p_file->imports );
+
+    return p_file;
+}
+EXPORT_SYMBOL_GPL(udma_open);
+
+void udma_release(struct udma_file *p_file)
+{
+    struct udma_dmabuf_attachment * import, * tmp;
+    unsigned int i;
+
+    // Rings stop with their fd; the memory stays until the last munmap().
+    mutex_lock( &udma_instances_lock );
+    for ( i = 0; i < p_file->udma->num_chans; ++i )
+    {
+        struct udma_ring * const ring = p_file->udma->chans[i]->ring;
+
+        if ( ring && ring->owner == p_file )
+            udma_ring_stop( ring );
+
+        udma_sched_forget( p_file->udma->chans[i], p_file );
+    }
+    udma_stripe_release( p_file );
+    mutex_unlock( &udma_instances_lock );
+
+    list_for_each_entry_safe( import, tmp, &p_file->imports, node )
+    {
+        list_del( &import->node );
+        kref_put( &import->ref, udma_dmabuf_attachment_free );
+    }
+
+    udma_pcache_release( p_file );
+    kfree( p_file );
+}
+EXPORT_SYMBOL_GPL(udma_release);
+
+long udma_ioctl(struct udma_file *p_file, unsigned int cmd, unsigned long arg)
+{
+    void __user * argp = (void __user *)arg;
+
+    switch ( cmd )
+    {
+        case UDMA_IOC_DMABUF_EXPORT:
+            return udma_ioctl_dmabuf_export( p_file, argp );
+        case UDMA_IOC_DMABUF_IMPORT:
+            return udma_ioctl_dmabuf_import( p_file, argp );
+        case UDMA_IOC_DMABUF_RELEASE:
+            return udma_ioctl_dmabuf_release( p_file, argp );
+        case UDMA_IOC_DMABUF_XFER:
+            return udma_ioctl_dmabuf_xfer( p_file, argp );
+        case UDMA_IOC_DMABUF_SYNC:
+            return udma_ioctl_dmabuf_sync( p_file, argp );
+        case UDMA_IOC_CHAIN_LINK:
+            return udma_ioctl_chain_link( p_file, argp );
+        case UDMA_IOC_CHAIN_UNLINK:
+            return udma_ioctl_chain_unlink( p_file );
+        case UDMA_IOC_CHAIN_STATS:
+            return udma_ioctl_chain_stats( p_file, argp );
+        case UDMA_IOC_BIND:
+            return udma_ioctl_bind( p_file, argp );
+        case UDMA_IOC_SET_RX_TIMEOUT:
+            return udma_ioctl_set_rx_timeout( p_file, argp );
+        case UDMA_IOC_PKT_MODE:
+            return udma_ioctl_pkt_mode( p_file, argp );
+        case UDMA_IOC_PKT_STATS:
+            return udma_ioctl_pkt_stats( p_file, argp );
+        case UDMA_IOC_RING_SETUP:
+            return udma_ioctl_ring_setup( p_file, argp );
+        case UDMA_IOC_RING_TEARDOWN:
+            return udma_ioctl_ring_teardown( p_file, argp );
+        case UDMA_IOC_RING_KICK:
+            return udma_ioctl_ring_kick( p_file, argp );
+        case UDMA_IOC_SET_WEIGHT:
+            return udma_ioctl_set_weight( p_file, argp );
+        case UDMA_IOC_SET_PRIO:
+            return udma_ioctl_set_prio( p_file, argp );
+        case UDMA_IOC_SNDBUF_MODE:
+            return udma_ioctl_sndbuf_mode( p_file, argp );
+        case UDMA_IOC_SNDBUF_FLUSH:
+            return udma_fsync( p_file );
+        case UDMA_IOC_SNDBUF_STATS:
+            return udma_ioctl_sndbuf_stats( p_file, argp );
+        case UDMA_IOC_STRIPE_SETUP:
+            return udma_ioctl_stripe_setup( p_file, argp );
+        case UDMA_IOC_STRIPE_STATS:
+            return udma_ioctl_stripe_stats( p_file, argp );
+        case UDMA_IOC_SET_TX_RATE:
+            return udma_ioctl_set_tx_rate( p_file, argp );
+        case UDMA_IOC_META_XFER:
+            return udma_ioctl_meta_xfer( p_file, argp );
+        default:
+            return -ENOTTY;
+    }
+}
+EXPORT_SYMBOL_GPL(udma_ioctl);
+
+
+/*
+ * sysfs: one directory per channel below <platform device>/udma/
+ */
+
+struct udma_chan_kobj {
+    struct kobject          kobj;
+    struct udma_drvdata *   p_info;
+};
+#define to_udma_chan_kobj(x) container_of(x, struct udma_chan_kobj, kobj)
+
+struct udma_sysfs_entry {
+    struct attribute attr;
+    ssize_t (*show)(struct udma_drvdata *, char *);
+    ssize_t (*store)(struct udma_drvdata *, const char *, size_t);
+};
+
+static ssize_t dir_show( struct udma_drvdata * p_info, char *buf )
+{
+    return sprintf( buf, "%s\n", p_info->dir == UDMA_DEV_TO_CPU ? "rx" : "tx" );
+}
+
+static ssize_t index_show( struct udma_drvdata * p_info, char *buf )
+{
+    return sprintf( buf, "%u\n", p_info->index );
+}
+
+static ssize_t align_show( struct udma_drvdata * p_info, char *buf )
+{
+    return sprintf( buf, "%u\n", p_info->align );
+}
+
+static ssize_t submit_cpu_show( struct udma_drvdata * p_info, char *buf )
+{
+    return sprintf( buf, "%d\n", p_info->submit_cpu );
+}
+
+static ssize_t submit_cpu_store( struct udma_drvdata * p_info, const char *buf, size_t count )
+{
+    int cpu;
+    int rv;
+
+    if ( (rv = kstrtoint( buf, 0, &cpu )) )
+        return rv;
+
+    rv = udma_set_submit_cpu( p_info, cpu );
+    return rv ? rv : count;
+}
+
+static ssize_t rx_timeout_ms_show( struct udma_drvdata * p_info, char *buf )
+{
+    return sprintf( buf, "%u\n", p_info->rx_timeout_ms );
+}
+
+static ssize_t rx_timeout_ms_store( struct udma_drvdata * p_info, const char *buf, size_t count )
+{
+    unsigned int timeout_ms;
+    int rv;
+
+    if ( (rv = kstrtouint( buf, 0, &timeout_ms )) )
+        return rv;
+
+    // Only read by transfers starting after this, no lock needed.
+    WRITE_ONCE( p_info->rx_timeout_ms, timeout_ms );
+    return count;
+}
+
+static ssize_t pin_cache_kb_show( struct udma_drvdata * p_info, char *buf )
+{
+    return sprintf( buf, "%zu\n", READ_ONCE( p_info->pcache.budget ) >> 10 );
+}
+
+static ssize_t pin_cache_kb_store( struct udma_drvdata * p_info, const char *buf, size_t count )
+{
+    unsigned long kb;
+    int rv;
+
+    if ( (rv = kstrtoul( buf, 0, &kb )) )
+        return rv;
+#ifndef CONFIG_MMU_NOTIFIER
+    // Without invalidation the cache could hand stale pages to the device.
+    if ( kb )
+        return -EOPNOTSUPP;
+#endif
+    if ( kb > (SIZE_MAX >> 10) )
+        return -EINVAL;
+
+    WRITE_ONCE( p_info->pcache.budget, (size_t)kb << 10 );
+    udma_pcache_shrink( p_info, (size_t)kb << 10 );
+    return count;
+}
+
+static ssize_t pin_cache_stats_show( struct udma_drvdata * p_info, char *buf )
+{
+    ssize_t len;
+
+    spin_lock( &udma_pcache_lock );
+    len = sprintf( buf, "hits %llu\nmisses %llu\ninvalidated %llu\nevicted %llu\npinned_kb %zu\n",
+                   p_info->pcache.hits, p_info->pcache.misses, p_info->pcache.invalidated,
+                   p_info->pcache.evicted, p_info->pcache.pinned >> 10 );
+    spin_unlock( &udma_pcache_lock );
+
+    return len;
+}
+
+// Transfers and bytes that went through swiotlb since the channel came up.
+static ssize_t swiotlb_stats_show( struct udma_drvdata * p_info, char *buf )
+{
+    return sprintf( buf, "mask_bits %d\ntransfers %llu\nbytes %llu\n",
+                    fls64( dma_get_mask( &p_info->pdev->dev ) ),
+                    READ_ONCE( p_info->swiotlb_xfers ), READ_ONCE( p_info->swiotlb_bytes ) );
+}
+
+static ssize_t shape_rate_kb_show( struct udma_drvdata * p_info, char *buf )
+{
+    return sprintf( buf, "%llu\n", READ_ONCE( p_info->shape.rate ) >> 10 );
+}
+
+// KiB per second, 0 turns shaping off. Refills the bucket.
+static ssize_t shape_rate_kb_store( struct udma_drvdata * p_info, const char *buf, size_t count )
+{
+    unsigned long long kb;
+    int rv;
+
+    if ( (rv = kstrtoull( buf, 0, &kb )) )
+        return rv;
+    if ( kb > (U64_MAX >> 10) )
+        return -EINVAL;
+
+    udma_bucket_set( &p_info->shape, kb << 10, READ_ONCE( p_info->shape.burst ) );
+    return count;
+}
+
+static ssize_t shape_burst_kb_show( struct udma_drvdata * p_info, char *buf )
+{
+    return sprintf( buf, "%u\n", READ_ONCE( p_info->shape.burst ) >> 10 );
+}
+
+static ssize_t shape_burst_kb_store( struct udma_drvdata * p_info, const char *buf, size_t count )
+{
+    unsigned int kb;
+    int rv;
+
+    if ( (rv = kstrtouint( buf, 0, &kb )) )
+        return rv;
+    if ( kb > (U32_MAX >> 10) )
+        return -EINVAL;
+
+    udma_bucket_set( &p_info->shape, READ_ONCE( p_info->shape.rate ), kb << 10 );
+    return count;
+}
+
+// Transfers held back for tokens since the channel came up, and for how long.
+static ssize_t shape_stats_show( struct udma_drvdata * p_info, char *buf )
+{
+    return sprintf( buf, "delayed %llu\nwait_us %llu\n",
+                    READ_ONCE( p_info->shape_delayed ),
+                    div_u64( READ_ONCE( p_info->shape_wait_ns ), NSEC_PER_USEC ) );
+}
+
+static ssize_t sched_quantum_show( struct udma_drvdata * p_info, char *buf )
+{
+    return sprintf( buf, "%u\n", p_info->sched.quantum );
+}
+
+static ssize_t sched_quantum_store( struct udma_drvdata * p_info, const char *buf, size_t count )
+{
+    unsigned int quantum;
+    int rv;
+
+    if ( (rv = kstrtouint( buf, 0, &quantum )) )
+        return rv;
+    if ( quantum < PAGE_SIZE )
+        return -EINVAL;
+
+    spin_lock( &p_info->sched.lock );
+    p_info->sched.quantum = quantum;
+    spin_unlock( &p_info->sched.lock );
+    return count;
+}
+
+static ssize_t sched_chunk_show( struct udma_drvdata * p_info, char *buf )
+{
+    return sprintf( buf, "%u\n", p_info->sched.chunk );
+}
+
+static ssize_t sched_chunk_store( struct udma_drvdata * p_info, const char *buf, size_t count )
+{
+    unsigned int chunk;
+    int rv;
+
+    if ( (rv = kstrtouint( buf, 0, &chunk )) )
+        return rv;
+    if ( chunk % PAGE_SIZE )
+        return -EINVAL;
+
+    // Taken up by the next write(); one already being split keeps its size.
+    WRITE_ONCE( p_info->sched.chunk, chunk );
+    return count;
+}
+
+// One line per fd that has used the channel: weight, bytes granted, queued transfers.
+static ssize_t sched_clients_show( struct udma_drvdata * p_info, char *buf )
+{
+    struct udma_sched_client * c;
+    ssize_t len = 0;
+
+    spin_lock( &p_info->sched.lock );
+    list_for_each_entry( c, &p_info->sched.clients, node )
+    {
+        struct udma_sched_req * req;
+        unsigned int queued = 0;
+
+        list_for_each_entry( req, &c->reqs, node )
+            ++queued;
+
+        len += scnprintf( buf + len, PAGE_SIZE - len, "%u %llu %u\n",
+                          c->owner->weight, c->bytes, queued );
+    }
+    spin_unlock( &p_info->sched.lock );
+
+    return len;
+}
+
+static ssize_t completion_cpu_show( struct udma_drvdata * p_info, char *buf )
+{
+    return sprintf( buf, "%d\n", p_info->completion_cpu );
+}
+
+static ssize_t completion_cpu_store( struct udma_drvdata * p_info, const char *buf, size_t count )
+{
+    int cpu;
+    int rv;
+
+    if ( (rv = kstrtoint( buf, 0, &cpu )) )
+        return rv;
 
-    rv = of_property_read_string_index( pdev->dev.of_node, "dma-names", 0 , &p_dma_name);
-    strncpy( udma_tx_drvdata->name, p_dma_name, UDMA_DEV_NAME_MAX_CHARS-1 );
-    udma_tx_drvdata->name[UDMA_DEV_NAME_MAX_CHARS-1] = '\0';
+    rv = udma_set_completion( p_info, cpu, p_info->completion_thread, p_info->completion_prio );
+    return rv ? rv : count;
+}
 
-    udma_tx_drvdata->dir = 2;	
-    udma_tx_drvdata->chan = dma_request_slave_channel(&pdev->dev, udma_tx_drvdata->name);
+static ssize_t completion_thread_show( struct udma_drvdata * p_info, char *buf )
+{
+    return sprintf( buf, "%d\n", p_info->completion_thread );
+}
 
-	if ( !udma_tx_drvdata->chan )
-	{
-		printk( KERN_WARNING KBUILD_MODNAME 
-		": couldn't find dma channel: %s, deferring...\n",
-		udma_tx_drvdata->name);
-		return -1;
-	}
+static ssize_t completion_thread_store( struct udma_drvdata * p_info, const char *buf, size_t count )
+{
+    bool thread;
+    int rv;
 
-	udma_tx_drvdata->init_done = true;
-	atomic_set(&udma_tx_drvdata->accepting, 1);
-	printk( KERN_ALERT KBUILD_MODNAME ": %s (%s) available\n", 
-							udma_tx_drvdata->name,
-							udma_tx_drvdata->dir == UDMA_DEV_TO_CPU ? "RX" : "TX");
+    if ( (rv = kstrtobool( buf, &thread )) )
+        return rv;
 
-    
-    // rx channel init
-    udma_rx_drvdata->pdev = pdev;
-	udma_rx_drvdata->in_use = 0;
-	udma_rx_drvdata->state = DMA_IDLE;
-    spin_lock_init( &udma_rx_drvdata->state_lock );
-    sema_init( &udma_rx_drvdata->sem, 1 );
-    init_waitqueue_head( &udma_rx_drvdata->wq );
-    atomic_set( &udma_rx_drvdata->packets_sent, 0 );
-    atomic_set( &udma_rx_drvdata->packets_rcvd, 0 );
-
-    rv = of_property_read_string_index( pdev->dev.of_node, "dma-names", 1 , &p_dma_name);
-    strncpy( udma_rx_drvdata->name, p_dma_name, UDMA_DEV_NAME_MAX_CHARS-1 );
-    udma_rx_drvdata->name[UDMA_DEV_NAME_MAX_CHARS-1] = '\0';	
-    udma_rx_drvdata->dir = 1;
-
-    udma_rx_drvdata->chan = dma_request_slave_channel(&pdev->dev, "loop_rx");
-
-	if ( !udma_rx_drvdata->chan )
-	{
-		printk( KERN_WARNING KBUILD_MODNAME 
-		": couldn't find dma channel: %s, deferring...\n",
-		udma_rx_drvdata->name);
+    rv = udma_set_completion( p_info, p_info->completion_cpu, thread, p_info->completion_prio );
+    return rv ? rv : count;
+}
 
-		return -1;
-	}
-	udma_rx_drvdata->init_done = true;
-	atomic_set(&udma_rx_drvdata->accepting, 1);
-	printk( KERN_ALERT KBUILD_MODNAME ": %s (%s) available\n", 
-							udma_rx_drvdata->name,
-							udma_rx_drvdata->dir == UDMA_DEV_TO_CPU ? "RX" : "TX");
+static ssize_t completion_prio_show( struct udma_drvdata * p_info, char *buf )
+{
+    return sprintf( buf, "%d\n", p_info->completion_prio );
+}
+
+static ssize_t completion_prio_store( struct udma_drvdata * p_info, const char *buf, size_t count )
+{
+    int prio;
+    int rv;
 
+    if ( (rv = kstrtoint( buf, 0, &prio )) )
+        return rv;
 
-	return 2;
-  	
+    rv = udma_set_completion( p_info, p_info->completion_cpu, p_info->completion_thread, prio );
+    return rv ? rv : count;
 }
 
+static struct udma_sysfs_entry dir_attribute =
+    __ATTR(dir, S_IRUGO, dir_show, NULL);
+static struct udma_sysfs_entry index_attribute =
+    __ATTR(index, S_IRUGO, index_show, NULL);
+static struct udma_sysfs_entry align_attribute =
+    __ATTR(align, S_IRUGO, align_show, NULL);
+static struct udma_sysfs_entry submit_cpu_attribute =
+    __ATTR(submit_cpu, S_IRUGO | S_IWUSR, submit_cpu_show, submit_cpu_store);
+static struct udma_sysfs_entry rx_timeout_ms_attribute =
+    __ATTR(rx_timeout_ms, S_IRUGO | S_IWUSR, rx_timeout_ms_show, rx_timeout_ms_store);
+static struct udma_sysfs_entry pin_cache_kb_attribute =
+    __ATTR(pin_cache_kb, S_IRUGO | S_IWUSR, pin_cache_kb_show, pin_cache_kb_store);
+static struct udma_sysfs_entry pin_cache_stats_attribute =
+    __ATTR(pin_cache_stats, S_IRUGO, pin_cache_stats_show, NULL);
+static struct udma_sysfs_entry swiotlb_stats_attribute =
+    __ATTR(swiotlb_stats, S_IRUGO, swiotlb_stats_show, NULL);
+static struct udma_sysfs_entry shape_rate_kb_attribute =
+    __ATTR(shape_rate_kb, S_IRUGO | S_IWUSR, shape_rate_kb_show, shape_rate_kb_store);
+static struct udma_sysfs_entry shape_burst_kb_attribute =
+    __ATTR(shape_burst_kb, S_IRUGO | S_IWUSR, shape_burst_kb_show, shape_burst_kb_store);
+static struct udma_sysfs_entry shape_stats_attribute =
+    __ATTR(shape_stats, S_IRUGO, shape_stats_show, NULL);
+static struct udma_sysfs_entry sched_quantum_attribute =
+    __ATTR(sched_quantum, S_IRUGO | S_IWUSR, sched_quantum_show, sched_quantum_store);
+static struct udma_sysfs_entry sched_chunk_attribute =
+    __ATTR(sched_chunk, S_IRUGO | S_IWUSR, sched_chunk_show, sched_chunk_store);
+static struct udma_sysfs_entry sched_clients_attribute =
+    __ATTR(sched_clients, S_IRUGO, sched_clients_show, NULL);
+static struct udma_sysfs_entry completion_cpu_attribute =
+    __ATTR(completion_cpu, S_IRUGO | S_IWUSR, completion_cpu_show, completion_cpu_store);
+static struct udma_sysfs_entry completion_thread_attribute =
+    __ATTR(completion_thread, S_IRUGO | S_IWUSR, completion_thread_show, completion_thread_store);
+static struct udma_sysfs_entry completion_prio_attribute =
+    __ATTR(completion_prio, S_IRUGO | S_IWUSR, completion_prio_show, completion_prio_store);
 
-bool is_udma(void)    
+static struct attribute *udma_chan_attrs[] = {
+    &dir_attribute.attr,
+    &index_attribute.attr,
+    &align_attribute.attr,
+    &submit_cpu_attribute.attr,
+    &rx_timeout_ms_attribute.attr,
+    &sched_quantum_attribute.attr,
+    &sched_chunk_attribute.attr,
+    &sched_clients_attribute.attr,
+    &pin_cache_kb_attribute.attr,
+    &pin_cache_stats_attribute.attr,
+    &swiotlb_stats_attribute.attr,
+    &shape_rate_kb_attribute.attr,
+    &shape_burst_kb_attribute.attr,
+    &shape_stats_attribute.attr,
+    &completion_cpu_attribute.attr,
+    &completion_thread_attribute.attr,
+    &completion_prio_attribute.attr,
+    NULL,   /* need to NULL terminate the list of attributes */
+};
+
+static void udma_chan_kobj_release( struct kobject *kobj )
 {
-	bool rv = udma_rx_drvdata->init_done && udma_tx_drvdata->init_done; 
-	return rv;
+    kfree( to_udma_chan_kobj(kobj) );
 }
-EXPORT_SYMBOL_GPL(is_udma);
 
-int check_udma(struct platform_device *pdev)
+static ssize_t udma_chan_attr_show( struct kobject *kobj, struct attribute *attr, char *buf )
 {
-	printk( KERN_WARNING KBUILD_MODNAME ": check_udma enter\n");
+    struct udma_sysfs_entry * entry = container_of( attr, struct udma_sysfs_entry, attr );
 
-	int num_dma_names = of_property_count_strings(pdev->dev.of_node, "dma-names");
+    if ( !entry->show )
+        return -EIO;
 
-    if ( 0 == num_dma_names )  // no udma
-    {
-        printk( KERN_ERR KBUILD_MODNAME ": no DMAs specified in udma \"dma-names\" property\n");
-        return num_dma_names;
-    }
-    else if ( num_dma_names < 0 )  // udma information error
-    {
-        printk( KERN_ERR KBUILD_MODNAME ": got %d when trying to count the elements of \"dma-names\" property\n", num_dma_names);
-        return num_dma_names;   // contains error code
-    }
+    return entry->show( to_udma_chan_kobj(kobj)->p_info, buf );
+}
+
+static ssize_t udma_chan_attr_store( struct kobject *kobj, struct attribute *attr,
+        const char *buf, size_t count )
+{
+    struct udma_sysfs_entry * entry = container_of( attr, struct udma_sysfs_entry, attr );
 
+    if ( !entry->store )
+        return -EIO;
 
-    return udma_init(pdev);
+    return entry->store( to_udma_chan_kobj(kobj)->p_info, buf, count );
 }
-EXPORT_SYMBOL_GPL(check_udma);
 
+static const struct sysfs_ops udma_chan_sysfs_ops = {
+    .show   = udma_chan_attr_show,
+    .store  = udma_chan_attr_store,
+};
 
-static void udma_unprepare_after_dma( struct udma_drvdata * p_info );
+static struct kobj_type udma_chan_attr_type = {
+    .release        = udma_chan_kobj_release,
+    .sysfs_ops      = &udma_chan_sysfs_ops,
+    .default_attrs  = udma_chan_attrs,
+};
 
-static void udma_dmaengine_callback_func(void *data)
+static int udma_sysfs_add_chan( struct udma_pdev_drvdata * p_udma, struct udma_drvdata * p_info )
 {
-    struct udma_drvdata * p_info = (struct udma_drvdata*)data;
-    unsigned long iflags;
+    struct udma_chan_kobj * c;
+    int rv;
 
-    spin_lock_irqsave(&p_info->state_lock, iflags);
+    c = kzalloc( sizeof(*c), GFP_KERNEL );
+    if ( !c )
+        return -ENOMEM;
 
-    if ( DMA_IN_FLIGHT == p_info->state )
-    {	
-        p_info->state = DMA_COMPLETING;
-        wake_up_interruptible( &p_info->wq );
-    }
-    
-    spin_unlock_irqrestore(&p_info->state_lock, iflags);
-}
+    c->p_info = p_info;
+    kobject_init( &c->kobj, &udma_chan_attr_type );
 
+    if ( (rv = kobject_add( &c->kobj, p_udma->sysfs_dir, "%s", p_info->name )) )
+    {
+        kobject_put( &c->kobj );
+        return rv;
+    }
 
+    p_info->kobj = &c->kobj;
+    return 0;
+}
 
-static int udma_prepare_for_dma(
-        struct udma_drvdata * p_info, 
-        char __user *userbuf,
-        size_t count
-)
+static int udma_sysfs_init( struct udma_pdev_drvdata * p_udma )
 {
+    unsigned int i;
     int rv;
 
-    BUG_ON( p_info->inflight.pinned_pages ); // should be NULL
-    memset( &p_info->inflight, 0, sizeof( struct udma_inflight_info ) );
-    
-    p_info->inflight.num_pages = (offset_in_page(userbuf) + count + PAGE_SIZE-1) / PAGE_SIZE;
-    p_info->inflight.pinned_pages = kmalloc( 
-        p_info->inflight.num_pages * sizeof(struct page*),
-        GFP_KERNEL);
+    p_udma->sysfs_dir = kobject_create_and_add( "udma", &p_udma->pdev->dev.kobj );
+    if ( !p_udma->sysfs_dir )
+        return -ENOMEM;
 
-    if ( !p_info->inflight.pinned_pages )
+    for ( i = 0; i < p_udma->num_chans; ++i )
     {
-        rv = -ENOMEM;
-        goto err_out;
+        if ( (rv = udma_sysfs_add_chan( p_udma, p_udma->chans[i] )) )
+        {
+            udma_sysfs_teardown( p_udma );
+            return rv;
+        }
     }
 
-    if ( (rv = sg_alloc_table(
-                    &p_info->inflight.table, 
-                    p_info->inflight.num_pages,
-                    GFP_KERNEL )) )
-    {
-        printk( KERN_ERR KBUILD_MODNAME ": %s: sg_alloc_table() returned %d\n", 
-                p_info->name, rv);
-        goto err_out;
-    }
-    else
-    {
-        p_info->inflight.table_allocated = 1;
-    }
+    return 0;
+}
 
-    rv = get_user_pages_fast(
-            (unsigned long)userbuf,             // start
-            p_info->inflight.num_pages,
-            p_info->dir == UDMA_DEV_TO_CPU,    // write
-            p_info->inflight.pinned_pages);
+static void udma_sysfs_teardown( struct udma_pdev_drvdata * p_udma )
+{
+    unsigned int i;
 
-    if ( rv != p_info->inflight.num_pages )
-    {
-        printk( KERN_ERR KBUILD_MODNAME ": %s: get_user_pages_fast() returned %d, expected %d\n",
-                p_info->name, rv, p_info->inflight.num_pages);
-        goto err_out;
-    }
-    else
+    for ( i = 0; i < p_udma->num_chans; ++i )
     {
-        p_info->inflight.pages_pinned = 1;
+        if ( p_udma->chans[i]->kobj )
+            kobject_put( p_udma->chans[i]->kobj );
+        p_udma->chans[i]->kobj = NULL;
     }
 
-    // Build scatterlist.
-    {
-        int i;
-        struct scatterlist * sg;
-        struct scatterlist * const sgl = p_info->inflight.table.sgl;
-        const unsigned int num_pages = p_info->inflight.num_pages;
-
-        size_t left_to_map = count;
+    if ( p_udma->sysfs_dir )
+        kobject_put( p_udma->sysfs_dir );
+    p_udma->sysfs_dir = NULL;
+}
 
-        for_each_sg( sgl, sg, num_pages, i )
-        {
-            unsigned int len;
-            unsigned int offset;
+/*
+ * In-kernel clients
+ *
+ * Modules such as udma_bench and udma_net borrow a channel and drive its
+ * dmaengine channel directly. Like a chain, the claim owns the channel:
+ * read()/write() and everything else that transfers on it fail with
+ * -EBUSY until the release. If the udma device goes away first, its
+ * teardown calls the client's revoke() and waits for the release before
+ * the channel goes.
+ */
 
-            len = left_to_map > PAGE_SIZE ? PAGE_SIZE : left_to_map;
+static DECLARE_WAIT_QUEUE_HEAD(udma_kchan_wq);  // woken by udma_release_chan()
 
-            if ( 0 == i )
-            {
-                offset = offset_in_page(userbuf);
-                if ( (offset + len) > PAGE_SIZE )
-                    len = PAGE_SIZE - offset;
-            }
-            else
-            {
-                offset = 0;
-            }
+/* Claims channel index ("dma-names" order) of the instance with the given
+ * device or device tree node name. Fails with -EBUSY rather than waiting
+ * for a transfer in flight, or if a chain, packet mode, ring or another
+ * client owns it. kc->revoke has to be set up before.
+ */
+int udma_claim_chan( const char *name, unsigned int index, struct udma_kchan * kc )
+{
+    struct udma_pdev_drvdata * p_udma;
+    struct udma_drvdata * p_info;
+    int rv = 0;
 
-            //printk( KERN_DEBUG KBUILD_MODNAME ": %s: sgl[%d]: page: %p, len: %d, offset: %d\n",
-            //        p_info->name, i, p_info->inflight.pinned_pages[i], len, offset );
+    mutex_lock( &udma_instances_lock );
 
-            //sg_set_page( sgl, p_info->inflight.pinned_pages[i], len, offset );
-            sg_set_page( sg, p_info->inflight.pinned_pages[i], len, offset );
-            left_to_map -= len;
-        }
+    p_udma = udma_find_instance_by_name( name );
+    if ( !p_udma || index >= p_udma->num_chans )
+    {
+        rv = -ENODEV;
+        goto out;
     }
 
-    // Map the scatterlist 
-
-    // dma_map_sg =>  if        DMA_TO_DEVICE : The memory must be flushed from the cache to memory before a DMA transfer is started.
-    //			      else if   DEVICE_TO_DMA : The cache must be invalidated after the transfer and before the CPU accesses memory.
-    rv = dma_map_sg(&p_info->pdev->dev,
-                p_info->inflight.table.sgl,
-                p_info->inflight.num_pages,
-                p_info->dir == UDMA_DEV_TO_CPU ? DMA_FROM_DEVICE : DMA_TO_DEVICE);
-
-    if ( rv != p_info->inflight.num_pages )
+    p_info = p_udma->chans[index];
+    if ( down_trylock( &p_info->sem ) )
     {
-        printk( KERN_ERR KBUILD_MODNAME ": %s: dma_map_sg() returned %d, expected %d\n", 
-                p_info->name, rv, p_info->inflight.num_pages);
-        goto err_out;
+        rv = -EBUSY;
+        goto out;
     }
+
+    if ( !atomic_read( &p_info->accepting ) )
+        rv = -EBADF;
+    else if ( udma_chan_owned( p_info ) )
+        rv = -EBUSY;
     else
+        p_info->kchan = kc;
+
+    up( &p_info->sem );
+
+    if ( !rv )
     {
-        p_info->inflight.dma_mapped = 1;
+        kc->p_info = p_info;
+        kc->chan = p_info->chan;
+        kc->dev = &p_info->pdev->dev;
+        kc->dir = p_info->dir;
+        kc->align = p_info->align;
     }
 
-    // Issue DMA request here
-    {
-        struct dma_async_tx_descriptor * txn_desc;
-        struct scatterlist * const sgl = p_info->inflight.table.sgl;
-        dma_cookie_t cookie;
+    out:
+    mutex_unlock( &udma_instances_lock );
+    return rv;
+}
+EXPORT_SYMBOL_GPL(udma_claim_chan);
 
-        txn_desc = dmaengine_prep_slave_sg(
-                p_info->chan,
-                sgl,
-                p_info->inflight.num_pages,
-                p_info->dir == UDMA_DEV_TO_CPU ? DMA_FROM_DEVICE : DMA_TO_DEVICE,
-                DMA_PREP_INTERRUPT);    // run callback after this one
+// Everything submitted on kc->chan must have completed or been terminated.
+void udma_release_chan( struct udma_kchan * kc )
+{
+    down( &kc->p_info->sem );
+    kc->p_info->kchan = NULL;
+    up( &kc->p_info->sem );
 
-        if ( !txn_desc )
-        {
-            printk( KERN_ERR KBUILD_MODNAME ": %s: dmaengine_prep_slave_sg() failed\n", p_info->name);
-            rv = -ENOMEM;
-            goto err_out;
-        }
+    kc->p_info = NULL;
+    kc->chan = NULL;
+    wake_up_all( &udma_kchan_wq );
+}
+EXPORT_SYMBOL_GPL(udma_release_chan);
 
-        txn_desc->callback = udma_dmaengine_callback_func;
-        txn_desc->callback_param = p_info;
+/* Called by teardown_udma() once the instance is out of udma_instances, so
+ * no new claim can come in, and without udma_instances_lock held. sem keeps
+ * the release, and so the client's kc, from going away during revoke().
+ */
+static void udma_revoke_kchan( struct udma_drvdata * p_info )
+{
+    struct udma_kchan * kc;
 
-        spin_lock_irq( &p_info->state_lock );
+    if ( !READ_ONCE( p_info->kchan ) )
+        return;
 
-        p_info->state = DMA_IN_FLIGHT;
+    down( &p_info->sem );
+    kc = p_info->kchan;
+    if ( kc && kc->revoke )
+    {
+        printk( KERN_INFO KBUILD_MODNAME ": %s: revoking in-kernel claim\n", p_info->name );
+        kc->revoke( kc );
+    }
+    up( &p_info->sem );
 
-        cookie = dmaengine_submit(txn_desc);
+    wait_event( udma_kchan_wq, !READ_ONCE( p_info->kchan ) );
+}
 
-        if ( cookie < DMA_MIN_COOKIE )
-        {
-            printk( KERN_ERR KBUILD_MODNAME ": %s: dmaengine_submit() returned %d\n", p_info->name, cookie);
-            rv = cookie;
-            p_info->state = DMA_IDLE;
-        }
-        else
-        {
-            p_info->inflight.dma_started = 1;
-            dma_async_issue_pending( p_info->chan );    // Bam!
-            //printk( KERN_ERR KBUILD_MODNAME ": %s: issued pending for %s\n",
-            //        p_info->name,
-            //        p_info->dir == EZDMA_DEV_TO_CPU ? "RX" : "TX" );
-        }
+/*
+ * debugfs: udma/<device>/<channel>/latency, udma/<device>/trace{,_ctl}
+ */
 
-        spin_unlock_irq( &p_info->state_lock );
+static struct dentry *udma_debugfs_root;   // created with the first instance, protected by udma_instances_lock
 
-        if ( cookie < DMA_MIN_COOKIE )
-            goto err_out;
-    }
+static const char * const udma_lat_phase_names[UDMA_LAT_PHASES] = {
+    "pin", "map", "hw", "wake", "unmap",
+};
 
-    return 0;
+static const char * const udma_lat_size_names[UDMA_LAT_SIZES] = {
+    "4K", "64K", "1M", "large",
+};
 
-    err_out:
+// Upper bound in ns of the bucket holding the given fraction (per mille) of total.
+static u64 udma_lat_percentile( const u64 * count, u64 total, unsigned int permille )
+{
+    const u64 want = div_u64( total * permille + 999, 1000 );
+    u64 seen = 0;
+    unsigned int b;
 
-    spin_lock_irq( &p_info->state_lock );
-    udma_unprepare_after_dma( p_info );
-    spin_unlock_irq( &p_info->state_lock );
+    for ( b = 0; b < UDMA_LAT_BUCKETS; ++b )
+    {
+        seen += count[b];
+        if ( seen >= want )
+            break;
+    }
 
-    return rv;
+    return b ? 1ULL << b : 0;
 }
 
-// should be called with p_info->sem held, and with p_info_state_lock
-static void udma_unprepare_after_dma( struct udma_drvdata * p_info )
+/* One line per phase and size class that has seen transfers: the count,
+ * p50/p99/p99.9 as bucket upper bounds in ns, then every non-empty bucket
+ * as upper bound:count.
+ */
+static int udma_lat_show( struct seq_file *m, void *unused )
 {
-    p_info->state = DMA_IDLE;
+    struct udma_drvdata * const p_info = m->private;
+    unsigned int phase, cls, b;
+    int cpu;
 
-    if ( p_info->inflight.dma_mapped )
-    {
-        dma_unmap_sg(p_info->udma_dev,
-                p_info->inflight.table.sgl,
-                p_info->inflight.num_pages,
-                p_info->dir == UDMA_DEV_TO_CPU ? DMA_FROM_DEVICE : DMA_TO_DEVICE);
-    }
-    p_info->inflight.dma_mapped = 0;
+    seq_puts( m, "phase size  count p50_ns p99_ns p999_ns buckets\n" );
 
-    if ( p_info->inflight.pages_pinned )
+    for ( phase = 0; phase < UDMA_LAT_PHASES; ++phase )
     {
-        if ( p_info->inflight.dma_started && p_info->dir == UDMA_DEV_TO_CPU )
+        for ( cls = 0; cls < UDMA_LAT_SIZES; ++cls )
         {
-            /* Mark all pages dirty for now (not sure how to do this more
-             * efficiently yet -- dmaengine API doesn't seem to return any
-             * notion of how much data was actually transferred).
-             */
-
-            int i;
+            u64 count[UDMA_LAT_BUCKETS] = { 0 };
+            u64 total = 0;
 
-            for (i = 0; i < p_info->inflight.num_pages; ++i)
+            for_each_possible_cpu( cpu )
             {
-                struct page * const page = p_info->inflight.pinned_pages[i];
+                const struct udma_lat_hist * const h = per_cpu_ptr( p_info->lat, cpu );
 
-                set_page_dirty( page );
-                put_page( page );
+                for ( b = 0; b < UDMA_LAT_BUCKETS; ++b )
+                    count[b] += h->count[phase][cls][b];
             }
-        }
-    }
-    p_info->inflight.pages_pinned = 0;
+            for ( b = 0; b < UDMA_LAT_BUCKETS; ++b )
+                total += count[b];
 
-    if ( p_info->inflight.table_allocated )
-        sg_free_table( &p_info->inflight.table );
-    p_info->inflight.table_allocated = 0;
+            if ( !total )
+                continue;
 
-    if ( p_info->inflight.pinned_pages )
-    {
-        kfree(p_info->inflight.pinned_pages);
-        p_info->inflight.pinned_pages = NULL;
+            seq_printf( m, "%s %s %llu %llu %llu %llu", udma_lat_phase_names[phase],
+                        udma_lat_size_names[cls], total,
+                        udma_lat_percentile( count, total, 500 ),
+                        udma_lat_percentile( count, total, 990 ),
+                        udma_lat_percentile( count, total, 999 ) );
+            for ( b = 0; b < UDMA_LAT_BUCKETS; ++b )
+            {
+                if ( count[b] )
+                    seq_printf( m, " %llu:%llu", b ? 1ULL << b : 0ULL, count[b] );
+            }
+            seq_putc( m, '\n' );
+        }
     }
 
+    return 0;
 }
 
-static int check_not_in_flight( struct udma_drvdata * p_info )
+static int udma_lat_open( struct inode *inode, struct file *filp )
 {
-    int rv;
-    spin_lock_irq(&p_info->state_lock);
-    
-    rv = (p_info->state != DMA_IN_FLIGHT);
-    
-    spin_unlock_irq(&p_info->state_lock);
+    return single_open( filp, udma_lat_show, inode->i_private );
+}
 
-    return rv;
+// Any write clears the histograms.
+static ssize_t udma_lat_write( struct file *filp, const char __user *buf, size_t count, loff_t *ppos )
+{
+    struct udma_drvdata * const p_info = ((struct seq_file *)filp->private_data)->private;
+    int cpu;
+
+    for_each_possible_cpu( cpu )
+        memset( per_cpu_ptr( p_info->lat, cpu ), 0, sizeof(struct udma_lat_hist) );
+
+    return count;
 }
 
+static const struct file_operations udma_lat_fops = {
+    .owner      = THIS_MODULE,
+    .open       = udma_lat_open,
+    .read       = seq_read,
+    .write      = udma_lat_write,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
 
-// 
-ssize_t udma_read(struct file *filp, char __user *userbuf, size_t count, loff_t *f_pos)
+/* Hands out whole records, oldest first, and frees their slots. Returns 0
+ * when there are none, so `cat trace > file` collects what was recorded up
+ * to then.
+ */
+static ssize_t udma_trace_read( struct file *filp, char __user *buf, size_t count, loff_t *ppos )
 {
-    int rv = count;
-    if ( 0 != (count % UDMA_ALIGN_BYTES) )
-    {
+    struct udma_pdev_drvdata * const p_udma = filp->private_data;
+    struct udma_trace_rec rec;
+    struct udma_trace * t;
+    size_t done = 0;
+
+    if ( count < sizeof(rec) )
         return -EINVAL;
-    }
-    if ( down_interruptible( &udma_rx_drvdata->sem ) )
-        return -ERESTARTSYS;
-    if ( !atomic_read(&udma_rx_drvdata->accepting ) )
-    {
-        rv = -EBADF;
-        goto out;
-    } 
-    else
-    {
-        int prep_rv;
-        int wait_rv;
 
-        prep_rv = udma_prepare_for_dma( udma_rx_drvdata , userbuf, count );
-		
-        if (prep_rv)
+    while ( count - done >= sizeof(rec) )
+    {
+        spin_lock( &p_udma->trace_lock );
+        t = p_udma->trace;
+        if ( !t || t->tail == t->head )
         {
-            rv = prep_rv;
-            goto out;
+            spin_unlock( &p_udma->trace_lock );
+            break;
         }
-        up( &udma_rx_drvdata->sem );
+        rec = t->recs[t->tail++ & t->mask];
+        spin_unlock( &p_udma->trace_lock );
 
-        wait_rv = wait_event_interruptible( udma_rx_drvdata->wq, check_not_in_flight(udma_rx_drvdata) );
-        if ( down_timeout( &udma_rx_drvdata->sem, SEM_TAKE_TIMEOUT ) )
-        {
-            printk( KERN_ALERT KBUILD_MODNAME 
-                    ": %s: read sem take stalled for %d seconds -- probably broken\n",
-                    udma_rx_drvdata->name, 
-                    SEM_TAKE_TIMEOUT);
-            goto noup_out;
-        }
+        if ( copy_to_user( buf + done, &rec, sizeof(rec) ) )
+            return done ? done : -EFAULT;
+        done += sizeof(rec);
 
-        spin_lock_irq(&udma_rx_drvdata->state_lock);
+        cond_resched();
+    }
 
-        if ( udma_rx_drvdata->state == DMA_IN_FLIGHT && -ERESTARTSYS == wait_rv )
-        {
-            dmaengine_terminate_all( udma_rx_drvdata->chan );
-            rv = wait_rv;
-        }
+    *ppos += done;
+    return done;
+}
 
-        udma_unprepare_after_dma( udma_rx_drvdata );    // sets us back to DMA_IDLE
-        spin_unlock_irq(&udma_rx_drvdata->state_lock);
+static const struct file_operations udma_trace_fops = {
+    .owner      = THIS_MODULE,
+    .open       = simple_open,
+    .read       = udma_trace_read,
+    .llseek     = no_llseek,
+};
+
+static ssize_t udma_trace_ctl_read( struct file *filp, char __user *buf, size_t count, loff_t *ppos )
+{
+    struct udma_pdev_drvdata * const p_udma = filp->private_data;
+    u64 entries = 0, queued = 0, dropped = 0;
+    struct udma_trace * t;
+    char tmp[96];
+    int len;
+
+    spin_lock( &p_udma->trace_lock );
+    t = p_udma->trace;
+    if ( t )
+    {
+        entries = t->mask + 1ULL;
+        queued = t->head - t->tail;
+        dropped = t->dropped;
     }
+    spin_unlock( &p_udma->trace_lock );
 
-    out:
-    up( &udma_rx_drvdata->sem );
+    len = scnprintf( tmp, sizeof(tmp), "entries %llu\nqueued %llu\ndropped %llu\n",
+                     entries, queued, dropped );
+    return simple_read_from_buffer( buf, count, ppos, tmp, len );
+}
+
+// Writing a number of entries starts a new, empty trace; 0 stops tracing.
+static ssize_t udma_trace_ctl_write( struct file *filp, const char __user *buf, size_t count, loff_t *ppos )
+{
+    struct udma_pdev_drvdata * const p_udma = filp->private_data;
+    unsigned int entries;
+    int rv;
+
+    if ( (rv = kstrtouint_from_user( buf, count, 0, &entries )) )
+        return rv;
 
-    noup_out:
-    return rv;   
+    if ( (rv = udma_trace_reset( p_udma, entries )) )
+        return rv;
+
+    return count;
 }
-EXPORT_SYMBOL_GPL(udma_read);
 
-ssize_t udma_write(struct file *filp, const char __user *userbuf, size_t count, loff_t *f_pos)
+static const struct file_operations udma_trace_ctl_fops = {
+    .owner      = THIS_MODULE,
+    .open       = simple_open,
+    .read       = udma_trace_ctl_read,
+    .write      = udma_trace_ctl_write,
+    .llseek     = default_llseek,
+};
+
+// Debugging aids only, so failures are ignored. Called with udma_instances_lock held.
+static void udma_debugfs_init( struct udma_pdev_drvdata * p_udma )
 {
-    ssize_t rv = count;
+    unsigned int i;
 
-    if ( 0 != (count % UDMA_ALIGN_BYTES) )
+    if ( !udma_debugfs_root )
+        udma_debugfs_root = debugfs_create_dir( "udma", NULL );
+    if ( IS_ERR_OR_NULL(udma_debugfs_root) )
     {
-        printk( KERN_WARNING KBUILD_MODNAME ": %s: unaligned write of %u bytes requested\n", udma_tx_drvdata->name, count);
-        return -EINVAL;
+        udma_debugfs_root = NULL;
+        return;
     }
 
-    if ( down_interruptible( &udma_tx_drvdata->sem ) )
-        return -ERESTARTSYS;
-
-    if ( !atomic_read(&udma_tx_drvdata->accepting ) )
+    p_udma->debugfs_dir = debugfs_create_dir( dev_name(&p_udma->pdev->dev), udma_debugfs_root );
+    if ( IS_ERR_OR_NULL(p_udma->debugfs_dir) )
     {
-        rv = -EBADF;
-        goto out;
+        p_udma->debugfs_dir = NULL;
+        return;
     }
-    else
-    {
-        int prep_rv;
-        int wait_rv;
-
-        prep_rv = udma_prepare_for_dma( udma_tx_drvdata, (char __user*)userbuf, count );
-
-        if (prep_rv)
-        {
-            rv = prep_rv;
-            goto out;
-        }
 
-        up( &udma_tx_drvdata->sem );
+    debugfs_create_file( "trace", S_IRUSR, p_udma->debugfs_dir, p_udma, &udma_trace_fops );
+    debugfs_create_file( "trace_ctl", S_IRUSR | S_IWUSR, p_udma->debugfs_dir, p_udma, &udma_trace_ctl_fops );
 
-        wait_rv = wait_event_interruptible( udma_tx_drvdata->wq, check_not_in_flight(udma_tx_drvdata) );
-
-        if ( down_timeout( &udma_tx_drvdata->sem, SEM_TAKE_TIMEOUT ) )
-        {
-            printk( KERN_ALERT KBUILD_MODNAME 
-                    ": %s: write sem take stalled for %d seconds -- probably broken\n",
-                    udma_tx_drvdata->name,
-                    SEM_TAKE_TIMEOUT);
-            goto noup_out;
-        }
+    for ( i = 0; i < p_udma->num_chans; ++i )
+    {
+        struct udma_drvdata * const p_info = p_udma->chans[i];
+        struct dentry * const dir = debugfs_create_dir( p_info->name, p_udma->debugfs_dir );
 
-        spin_lock_irq(&udma_tx_drvdata->state_lock);
-   
-        if ( udma_tx_drvdata->state == DMA_IN_FLIGHT && -ERESTARTSYS == wait_rv )
-        {
-        	
-            dmaengine_terminate_all( udma_tx_drvdata->chan );
-  
-            rv = wait_rv;
-        }
+        if ( IS_ERR_OR_NULL(dir) )
+            continue;
+        debugfs_create_file( "latency", S_IRUSR | S_IWUSR, dir, p_info, &udma_lat_fops );
+    }
+}
 
-        udma_unprepare_after_dma( udma_tx_drvdata );    // sets us back to DMA_IDLE
-        spin_unlock_irq(&udma_tx_drvdata->state_lock);
+// Called with udma_instances_lock held, after p_udma left udma_instances.
+static void udma_debugfs_teardown( struct udma_pdev_drvdata * p_udma )
+{
+    debugfs_remove_recursive( p_udma->debugfs_dir );
+    p_udma->debugfs_dir = NULL;
 
+    if ( list_empty( &udma_instances ) )
+    {
+        debugfs_remove_recursive( udma_debugfs_root );
+        udma_debugfs_root = NULL;
     }
+}
 
-    out:
-    up( &udma_tx_drvdata->sem );
+static void udma_teardown_channel( struct udma_drvdata * p_info )
+{
+	if (p_info->init_done){
+		printk( KERN_DEBUG KBUILD_MODNAME ": tearing down %s\n",
+		        p_info->name );    // name can only be all null-bytes or a valid string
 
-    noup_out:
-    return rv;
-    
+		// A transfer held back by shaping or queued for the submit worker
+		// would prep on the channel; both go before it is released.
+		hrtimer_cancel( &p_info->shape_timer );
+		udma_teardown_submit( p_info );
+
+		if ( p_info->chan )
+		{
+			dmaengine_terminate_all(p_info->chan);
+			dma_release_channel(p_info->chan);
+		}
+		udma_pcache_shrink( p_info, 0 );
+		if ( p_info->bounce )
+			dma_free_coherent( &p_info->pdev->dev, 2 * p_info->align,
+			                   p_info->bounce, p_info->bounce_dma );
+		p_info->bounce = NULL;
+		free_percpu( p_info->lat );
+		p_info->lat = NULL;
+		udma_teardown_completion( p_info );
+		p_info->init_done = false;
+	}
 }
-EXPORT_SYMBOL_GPL(udma_write);
 
 void teardown_udma( struct platform_device *pdev)
 {
-	if (udma_tx_drvdata->init_done){
-		// teardown udma_tx_drvdata channel
-	    printk( KERN_DEBUG KBUILD_MODNAME ": tearing down %s\n",
-	                udma_tx_drvdata->name );    // name can only be all null-bytes or a valid string
-
-	    if ( udma_tx_drvdata->chan )
-	    {
-	        dmaengine_terminate_all(udma_tx_drvdata->chan);
-	        dma_release_channel(udma_tx_drvdata->chan);
-	    }
-	    udma_tx_drvdata->init_done = false;
+	struct udma_pdev_drvdata * p_udma;
+	unsigned int i;
+
+	mutex_lock( &udma_instances_lock );
+
+	p_udma = udma_find_instance( &pdev->dev );
+	if ( !p_udma )
+	{
+		mutex_unlock( &udma_instances_lock );
+		return;
 	}
 
-	if (udma_rx_drvdata->init_done) {
-		// teardown udma_rx_drvdata channel
-    	printk( KERN_DEBUG KBUILD_MODNAME ": tearing down %s\n",
-                udma_rx_drvdata->name );    // name can only be all null-bytes or a valid string
-
-    	if ( udma_rx_drvdata->chan )
-    	{
-        	dmaengine_terminate_all(udma_rx_drvdata->chan);
-        	dma_release_channel(udma_rx_drvdata->chan);
-    	}  
-    	udma_rx_drvdata->init_done = false;
+	// Chains, packet pools, send buffers and rings have to go before the channels they run on.
+	for ( i = 0; i < p_udma->num_chans; ++i )
+	{
+		if ( p_udma->chans[i]->chain )
+			udma_chain_stop( p_udma->chans[i]->chain );
+		if ( p_udma->chans[i]->pktq )
+			udma_pkt_stop( p_udma->chans[i]->pktq );
+		if ( p_udma->chans[i]->sndbuf )
+			udma_sndbuf_stop( p_udma->chans[i]->sndbuf );
+		if ( p_udma->chans[i]->ring )
+			udma_ring_stop( p_udma->chans[i]->ring );
 	}
 
-  
+	udma_stripe_detach( p_udma );
+	list_del( &p_udma->node );
+	udma_debugfs_teardown( p_udma );
+	mutex_unlock( &udma_instances_lock );
+
+	udma_stripe_detach_wait( p_udma );
+
+	// In-kernel clients stop using the channels before they are released.
+	for ( i = 0; i < p_udma->num_chans; ++i )
+		udma_revoke_kchan( p_udma->chans[i] );
+
+	udma_sysfs_teardown( p_udma );
+
+	for ( i = 0; i < p_udma->num_chans; ++i )
+		udma_teardown_channel( p_udma->chans[i] );
 
+	udma_trace_reset( p_udma, 0 );
 }
 EXPORT_SYMBOL_GPL(teardown_udma);
@@ -9,47 +9,198 @@
 #include <asm/io.h>
 #include <asm/param.h>  /* HZ */
 #include <linux/semaphore.h>
+#include <linux/rwsem.h>
 #include <linux/mutex.h>
 #include <linux/mm.h>
 
 #include <linux/dmaengine.h>
 #include <linux/dma-mapping.h>
+#include <linux/dma-buf.h>
+#include <linux/kref.h>
+#include <linux/hrtimer.h>
 
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/wait.h>
+#include <linux/completion.h>
+#include <linux/kthread.h>
+#include <linux/workqueue.h>
+#include <linux/kobject.h>
+#include <linux/mmu_notifier.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+
+#include <linux/udma_ioctl.h>
 
 #define UDMA_DEV_NAME_MAX_CHARS (16)
 
+// One per TDEST of a multichannel DMA, plus room for the other direction.
+#define UDMA_MAX_CHANNELS (16)
+
+// mmap() offsets (in pages) served by udma_mmap(); uio's own maps sit at 0..MAX_UIO_MAPS-1.
+#define UDMA_MMAP_RING_PGOFF (0x10000)  // + channel index
+
 // Assume that reads/writes have to be multiples of this.
 #define UDMA_ALIGN_BYTES (1)
 
-#define SEM_TAKE_TIMEOUT (5)
-
 enum udma_dir {
     UDMA_DEV_TO_CPU = 1,   // RX
     UDMA_CPU_TO_DEV = 2,   // TX
 };
 
-/* Right now the I/O concept is very simple -- all reads and writes
- * are blocking, and concurrent reads and writes are not allowed.
- * Concurrent open is also disallowed.
+/* Right now the I/O concept is very simple -- reads and writes block
+ * until their transfer is done, and a channel runs one transfer at a time.
+ * The exception is a TX channel in send buffer mode (struct udma_sndbuf):
+ * write() returns once its data is copied into the pool, and the pool's
+ * buffers go out outside the states below. Any number of
+ * fds may share a channel; who goes next is decided by the channel's
+ * deficit round robin scheduler (struct udma_sched), not by whoever wins sem.
+ *
+ * IDLE -> IN_FLIGHT is taken by the submitter with sem held. The way out of
+ * IN_FLIGHT is an atomic_cmpxchg: the completion takes it to COMPLETING,
+ * a waiter giving up (timeout, signal) to STOPPING, and only the winner
+ * finishes the transfer. Back to IDLE once the buffers are released.
  */
 enum dma_fsm_state {
     DMA_IDLE = 0,
     DMA_IN_FLIGHT = 1,
+    DMA_STOPPING = 2,
     DMA_COMPLETING = 3,
 };
 
+/* Phases of a transfer timed by the latency histograms, see udma_lat_record().
+ * inflight.ts[p] is taken when phase p starts, ts[p + 1] when it ends.
+ */
+enum udma_lat_phase {
+    UDMA_LAT_PIN,       // pinning or collecting the pages
+    UDMA_LAT_MAP,       // scatterlist and dma_map_sg(), or the cache sync of a cached buffer
+    UDMA_LAT_HW,        // submission to the DMA callback
+    UDMA_LAT_WAKE,      // DMA callback to the waiter running again
+    UDMA_LAT_UNMAP,     // dma_unmap_sg() and unpinning
+    UDMA_LAT_PHASES,
+};
+
+#define UDMA_LAT_SIZES      (4)     // transfers up to 4 KiB, 64 KiB, 1 MiB, and larger
+#define UDMA_LAT_BUCKETS    (32)    // bucket b counts [2^(b-1), 2^b) ns, the last one everything above
+
+struct udma_lat_hist {
+    u32 count[UDMA_LAT_PHASES][UDMA_LAT_SIZES][UDMA_LAT_BUCKETS];
+};
+
+/* Transfer trace of a device, a ring of mask + 1 records. head and tail
+ * count records ever written and read; the writer pushes tail ahead when
+ * the ring is full.
+ */
+struct udma_trace {
+    u32                     mask;
+    u64                     head;
+    u64                     tail;
+    u64                     dropped;    // overwritten before they were read
+    struct udma_trace_rec   recs[];
+};
+
+/* Token bucket, see udma_bucket_take(). */
+struct udma_bucket {
+    spinlock_t      lock;       // protects everything below
+    u64             rate;       // bytes per second, 0: unlimited
+    u32             burst;      // bytes that may go out back to back
+    s64             tokens;     // bytes, negative while paying off a transfer
+    u64             last_ns;    // ktime_get_ns() of the last refill
+};
+
 // These fields should only be valid during an ongoing read/write call.
 struct udma_inflight_info {
     struct page **  pinned_pages;
     struct sg_table table;
     unsigned int    num_pages;
+    unsigned int    nents;      // entries of table handed to the dmaengine
+    struct scatterlist * map_sgl;   // entries of table mapped by dma_map_sg()
+    unsigned int    map_nents;
+    unsigned int    page_offset;    // of the user buffer in pinned_pages[0]
+    u32             head;       // unaligned bytes at the start and end of the user
+    u32             tail;       //   buffer, DMAed through the bounce area
+    size_t          swiotlb_bytes;  // bounced by dma_map_sg(), see udma_count_swiotlb()
     bool            table_allocated;
     bool            pages_pinned;
     bool            dma_mapped;
     bool            dma_started;
+    bool            user_pages; // pinned from a user mapping, dirtied after RX
+    int             submit_rv;  // set by the submit worker if submission failed
+    size_t          len;        // bytes requested
+    dma_cookie_t    cookie;
+    u32             residue;    // bytes not transferred, as reported on completion
+    struct completion done;     // completed on leaving DMA_IN_FLIGHT for DMA_COMPLETING
+    struct udma_pcache_entry * cached;  // pages and table belong to this entry, see udma_pcache_lookup()
+    u64             ts[UDMA_LAT_PHASES + 1];    // ktime_get_ns() at each phase boundary, 0: not reached
+};
+
+/* Pinned page cache, see udma_pcache_lookup(). Everything below is
+ * protected by udma_pcache_lock.
+ */
+struct udma_pcache_entry {
+    struct list_head    lru;        // on udma_pcache.lru, oldest first
+    struct list_head    ctx_node;   // on udma_pcache_ctx.entries
+    struct udma_drvdata * p_info;
+    unsigned long       start;      // user address and length of the buffer
+    size_t              len;
+    struct page **      pages;
+    unsigned int        num_pages;
+    struct sg_table     table;      // DMA mapped for p_info's direction
+    bool                busy;       // used by the transfer in flight
+    bool                dead;       // invalidated while busy, freed when the transfer ends
+    size_t              swiotlb_bytes;  // of the mapping that went through swiotlb
+};
+
+struct udma_pcache {
+    struct list_head    lru;
+    size_t              budget;     // bytes that may stay pinned, 0: cache off
+    size_t              pinned;
+    u64                 hits;
+    u64                 misses;
+    u64                 invalidated;
+    u64                 evicted;
+};
+
+// Cached buffers of one fd, all in the address space of the process that first used it.
+struct udma_pcache_ctx {
+#ifdef CONFIG_MMU_NOTIFIER
+    struct mmu_notifier mn;
+#endif
+    struct mm_struct *  mm;
+    struct list_head    entries;
+    unsigned long       invalidate_seq; // bumped by every invalidation
+    int                 invalidating;   // invalidate_range_start() without the _end() yet
+};
+
+/* Deficit round robin over the fds waiting for a channel. Each round a
+ * client with pending transfers is credited quantum * weight bytes and may
+ * run transfers while its credit covers their size.
+ */
+struct udma_sched_req {
+    struct list_head    node;       // on udma_sched_client.reqs, or udma_sched.high
+    size_t              cost;       // bytes
+    u32                 prio;       // UDMA_PRIO_*
+    bool                granted;
+    struct completion   done;       // completed on the grant
+};
+
+struct udma_sched_client {
+    struct list_head    node;       // on udma_sched.clients
+    struct list_head    active_node;// on udma_sched.active while reqs isn't empty
+    struct list_head    reqs;
+    struct udma_file *  owner;
+    s64                 deficit;
+    u64                 bytes;      // granted so far
+};
+
+struct udma_sched {
+    spinlock_t          lock;       // protects everything below
+    struct list_head    clients;
+    struct list_head    active;     // round robin order
+    struct list_head    high;       // UDMA_PRIO_HIGH requests, served first
+    bool                busy;       // a granted transfer owns the channel
+    u32                 quantum;    // bytes per round at weight 1
+    u32                 chunk;      // bulk TX is split into transfers of this size, 0: never
 };
 
 struct udma_drvdata {
@@ -57,20 +208,62 @@ struct udma_drvdata {
 
     char name[UDMA_DEV_NAME_MAX_CHARS];
     uint32_t dir;   // udma_dir
+    unsigned int index;     // position in "dma-names"
 
-    struct semaphore sem;   /* protects mutable data below */
+    struct semaphore sem;   /* protects mutable data below, held for a whole transfer */
 
     bool        in_use;
     atomic_t    accepting;
 
-    spinlock_t state_lock;  // protects state below, may be taken from interrupt (tasklet) context
-    enum dma_fsm_state state;
+    struct udma_sched sched;        // decides who takes sem next, see udma_sched_acquire()
+    atomic_t state;         // enum dma_fsm_state, changes from the callback too
     struct udma_inflight_info inflight;
 
-    wait_queue_head_t    wq;
+    wait_queue_head_t    wq;    // packet mode readers and send buffer writers, see udma_pkt_read()
+
+    /* Completion steering, see udma_dmaengine_callback_func().
+     * Changed only under sem while no transfer is in flight.
+     */
+    int                     completion_cpu;     // -1: wherever the dmaengine calls back
+    int                     completion_prio;    // 0: SCHED_NORMAL, else SCHED_FIFO priority
+    bool                    completion_thread;
+    struct kthread_worker * worker;             // set while completion_thread
+    struct kthread_work     complete_kwork;
+    struct work_struct      complete_work;      // completion_cpu without a thread
+
+    /* Submission queue, see udma_submit_dma(). Changed only under sem while idle. */
+    int                     submit_cpu;         // -1: submit from the calling thread
+    struct kthread_worker * submit_worker;
+    struct kthread_work     submit_kwork;
+
+    struct udma_meta_xfer * meta;   // app words of the transfer in flight, see udma_submit_dma_now(); under sem
+
+    /* Rate shaping, see udma_shape_delay() */
+    struct udma_bucket      shape;
+    struct udma_bucket *    shape_fd;           // of the fd starting a transfer, see udma_transfer_begin()
+    struct hrtimer          shape_timer;        // submits a transfer held back for tokens
+    u64                     shape_delayed;      // transfers held back, updated under sem
+    u64                     shape_wait_ns;
 
     /* dmaengine */
     struct dma_chan *chan;
+    enum dma_residue_granularity residue_granularity;
+    u32             align;          // buffers handed to the engine start on this boundary
+    void *          bounce;         // 2 * align bytes for unaligned edges, NULL if align is 1
+    dma_addr_t      bounce_dma;
+    u64             swiotlb_xfers;  // transfers with swiotlb bounced bytes, updated under sem
+    u64             swiotlb_bytes;
+
+    unsigned int rx_timeout_ms;     // 0: RX transfers wait forever, see udma_transfer()
+
+    struct udma_pcache pcache;      // read()/write() buffers kept pinned and mapped
+    struct udma_lat_hist __percpu * lat;    // debugfs <dev>/<name>/latency
+
+    struct udma_chain *chain;   // non-NULL while owned by a chain, see udma_chain_start()
+    struct udma_pktq *pktq;     // non-NULL in packet mode, see udma_pkt_start()
+    struct udma_ring *ring;     // non-NULL in kernel-bypass mode, see udma_ring_start()
+    struct udma_sndbuf *sndbuf; // non-NULL in send buffer mode, see udma_sndbuf_start()
+    struct udma_kchan *kchan;   // non-NULL while an in-kernel client owns it, see udma_claim_chan()
 
     /* device accounting */
     dev_t           udma_devt;
@@ -82,30 +275,256 @@ struct udma_drvdata {
     atomic_t    packets_rcvd;
 
     struct list_head node;
+    struct kobject *kobj;   // /sys/.../udma/<name>, see udma_sysfs_init()
     bool init_done;
 };
 
-/* LOCK ORDERING:  if taking both sem and state_lock, must always take sem first */
-//struct udma_pdev_drvdata {
-//    struct list_head udma_list;    // list of udma_drvdata instances created in
-                                    // relation to this platform device
-//};  currently not used
+/* An imported dma-buf, attached and mapped for the device of one channel.
+ * Lives on udma_file.imports until released; transfers hold a reference.
+ */
+struct udma_dmabuf_attachment {
+    struct list_head            node;
+    struct kref                 ref;
+    u32                         handle;
+
+    struct udma_drvdata *       p_info;     // channel the buffer was imported for
+    struct dma_buf *            dmabuf;
+    struct dma_buf_attachment * attach;
+    struct sg_table *           sgt;
+};
+
+/* A channel borrowed by in-kernel code, see udma_claim_chan(). */
+struct udma_kchan {
+    struct udma_drvdata *   p_info;
+    struct dma_chan *       chan;
+    struct device *         dev;        // to allocate and map buffers for
+    u32                     dir;        // udma_dir
+    u32                     align;
+
+    /* Set by the client. Called when the udma device is torn down while
+     * the claim stands, with the channel's sem held, so it can't release
+     * the claim itself: it makes the client stop using chan and call
+     * udma_release_chan() soon, e.g. from a work item. May be NULL if the
+     * client releases within bounded time anyway. Teardown waits for the
+     * release either way.
+     */
+    void                    (*revoke)(struct udma_kchan *kc);
+};
+
+/* Striped transfers of one fd, see udma_stripe_transfer(). Allocated on
+ * the first UDMA_IOC_STRIPE_SETUP and kept until close.
+ */
+struct udma_stripe_member {
+    struct udma_drvdata *   rx;
+    struct udma_drvdata *   tx;
+
+    /* Statistics, protected by udma_stripe.lock */
+    u64                     rx_bytes;
+    u64                     tx_bytes;
+    u64                     rx_stripes;
+    u64                     tx_stripes;
+    u64                     errors;
+};
+
+struct udma_stripe {
+    struct list_head        node;       // on udma_stripes
+    struct kref             ref;        // the fd's, and a detaching teardown's
+    struct udma_file *      owner;      // NULL once the fd is closed
+    struct rw_semaphore     rwsem;      // read: transfers, write: changing the members
+    u32                     stripe_size;
+    unsigned int            num_members;    // including the fd's own pair, 0: off
+    bool                    broken;     // a member's device went away, stops the transfers under way
+    struct udma_stripe_member members[UDMA_STRIPE_MAX];
+    spinlock_t              lock;       // protects the members' statistics
+};
+
+/* Per-open state of a udma device, owned by the uio listener. */
+struct udma_file {
+    struct udma_pdev_drvdata * udma;
+    struct udma_drvdata *   rx;     // channels used by read()/write(), see UDMA_IOC_BIND
+    struct udma_drvdata *   tx;
+    s32                     rx_timeout_ms;  // -1: use the channel's rx_timeout_ms
+    u32                     weight;         // share in the channel schedulers, 1 by default
+    u32                     prio;           // UDMA_PRIO_*
+    struct udma_bucket      tx_bucket;      // see UDMA_IOC_SET_TX_RATE
+    struct mutex        lock;       // protects imports, next_handle and pcache
+    struct list_head    imports;
+    u32                 next_handle;
+    struct udma_pcache_ctx * pcache;    // created on the first cached transfer
+    struct udma_stripe *    stripe;     // see UDMA_IOC_STRIPE_SETUP
+};
+
+struct udma_pdev_drvdata {
+    struct platform_device *pdev;
+
+    struct udma_drvdata *chans[UDMA_MAX_CHANNELS];  // in "dma-names" order
+    unsigned int num_chans;
+
+    struct udma_drvdata *tx;    // first TX channel, NULL if there is none
+    struct udma_drvdata *rx;    // first RX channel, NULL if there is none
+
+    struct kobject *sysfs_dir;  // "udma" below the platform device
+    struct dentry *debugfs_dir; // udma/<dev> in debugfs
+
+    spinlock_t trace_lock;      // protects trace and its contents
+    struct udma_trace *trace;   // non-NULL while recording, see udma_trace_record()
+
+    struct list_head node;  // on udma_instances
+};
+
+/* Device-to-device chain: every buffer of a kernel-owned ring is either
+ * posted to the RX channel of one instance or queued on the TX channel of
+ * another. Completions move buffers between the two without waking anyone.
+ */
+struct udma_chain_buf {
+    struct udma_chain * chain;
+    void *              cpu_addr;
+    dma_addr_t          rx_addr;    // mapped for the RX instance
+    dma_addr_t          tx_addr;    // mapped for the TX instance
+    u32                 len;        // bytes received, valid while on TX
+};
+
+struct udma_chain {
+    struct udma_drvdata *   rx;
+    struct udma_drvdata *   tx;
+
+    u32                     num_bufs;
+    u32                     buf_size;
+    struct udma_chain_buf * bufs;
+
+    spinlock_t              lock;   // protects everything below, taken from callbacks
+    bool                    stopping;
+    u32                     rx_posted;
+    u32                     tx_inflight;
+    wait_queue_head_t       wq;     // woken when tx_inflight drops to 0 while stopping
+
+    /* Statistics */
+    u64                     frames;
+    u64                     bytes;
+    u64                     rx_errors;
+    u64                     tx_errors;
+    u64                     dropped;
+};
+
+/* Packet mode RX: a pool of kernel buffers kept posted to one RX channel.
+ * Completed frames queue up on done in arrival order until read().
+ */
+struct udma_pkt_buf {
+    struct list_head    node;       // on udma_pktq.done while holding a frame
+    struct udma_pktq *  pktq;
+    void *              cpu_addr;
+    dma_addr_t          dma_addr;
+    u32                 len;        // frame length, valid while on done
+};
+
+struct udma_pktq {
+    struct udma_drvdata *   rx;
+
+    u32                     num_bufs;
+    u32                     buf_size;
+    struct udma_pkt_buf *   bufs;
+
+    spinlock_t              lock;   // protects everything below, taken from callbacks
+    bool                    stopping;
+    struct list_head        done;
+    u32                     rx_posted;
+    u32                     queued;
+
+    /* Statistics */
+    u64                     frames;
+    u64                     bytes;
+    u64                     rx_errors;
+    u64                     truncated;
+    u64                     lost;
+};
+
+/* Send buffer mode TX: write() copies into a pool of kernel buffers and
+ * returns while the channel drains them. Buffers on free are available;
+ * the others are queued on the channel, in write() order.
+ */
+struct udma_sndbuf_buf {
+    struct list_head    node;       // on udma_sndbuf.free while not queued
+    struct udma_sndbuf * sb;
+    void *              cpu_addr;
+    dma_addr_t          dma_addr;
+    u32                 len;        // bytes queued, valid while on the channel
+};
+
+struct udma_sndbuf {
+    struct udma_drvdata *   tx;
+
+    u32                     num_bufs;
+    u32                     buf_size;
+    struct udma_sndbuf_buf * bufs;
+
+    spinlock_t              lock;   // protects everything below, taken from callbacks
+    bool                    stopping;
+    struct list_head        free;
+    u32                     inflight;
+    int                     err;    // first failure since it was last reported, see udma_sndbuf_write()
+
+    /* Statistics */
+    u64                     frames;
+    u64                     bytes;
+    u64                     tx_errors;
+};
+
+/* Kernel-bypass ring: descriptors are produced by the process in shared
+ * memory and consumed by a polling kthread. Lives until the owning fd and
+ * every mapping of it are gone.
+ */
+struct udma_ring_slot {
+    struct udma_ring *  ring;
+    u32                 user_data;
+    u32                 len;
+};
+
+struct udma_ring {
+    struct kref             ref;        // owner fd, each vma
+    struct udma_drvdata *   p_info;     // NULL once stopped
+    struct udma_file *      owner;
+    struct device *         dev;
+
+    void *                  cpu_addr;   // coherent: header, sq, cq, data
+    dma_addr_t              dma_addr;
+    size_t                  size;
+    struct udma_ring_hdr *  hdr;
+    struct udma_ring_sqe *  sq;
+    struct udma_ring_cqe *  cq;
+    u32                     entries;
+    size_t                  data_off;   // kernel copies of what hdr tells the process
+    size_t                  data_size;
+    struct udma_ring_slot * slots;
+
+    struct task_struct *    poller;
+    wait_queue_head_t       wq;
+    bool                    kicked;
+    u32                     idle_us;
+    u32                     sq_tail;    // private copies of the shared indices
+    u32                     cq_head;
+
+    spinlock_t              lock;       // protects cq_head and inflight, taken from callbacks
+    u32                     inflight;
+};
 
 
 /*
  * drives/uio/udma.c provides these functions:
  */
 
-#define NUM_DEVICE_NUMBERS_TO_ALLOCATE (8)
-static dev_t base_devno;
-static int devno_in_use[NUM_DEVICE_NUMBERS_TO_ALLOCATE];
-static struct class *udma_class;
-static DEFINE_SEMAPHORE(devno_lock);
-
-extern bool is_udma(void); 
+extern bool is_udma(struct device *parent);
 extern int check_udma(struct platform_device *pdev);
-extern ssize_t udma_read(struct file *filp, char __user *userbuf, size_t count, loff_t *f_pos);
-extern ssize_t udma_write(struct file *filp, const char __user *userbuf, size_t count, loff_t *f_pos);
+extern ssize_t udma_read(struct udma_file *p_file, char __user *userbuf, size_t count, loff_t *f_pos);
+extern ssize_t udma_write(struct udma_file *p_file, const char __user *userbuf, size_t count, loff_t *f_pos, unsigned int f_flags);
+extern int udma_fsync(struct udma_file *p_file);
+extern ssize_t udma_splice_read(struct udma_file *p_file, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags);
+extern ssize_t udma_splice_write(struct udma_file *p_file, struct pipe_inode_info *pipe, loff_t *ppos, size_t len, unsigned int flags);
 extern void teardown_udma( struct platform_device *pdev);
+extern struct udma_file *udma_open(struct device *parent);
+extern void udma_release(struct udma_file *p_file);
+extern long udma_ioctl(struct udma_file *p_file, unsigned int cmd, unsigned long arg);
+extern int udma_mmap(struct udma_file *p_file, struct vm_area_struct *vma);
+extern int udma_claim_chan(const char *name, unsigned int index, struct udma_kchan *kc);
+extern void udma_release_chan(struct udma_kchan *kc);
 
 
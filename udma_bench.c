@@ -0,0 +1,533 @@
+/*
+ * drivers/uio/udma_bench.c
+ *
+ * Microbenchmark for the channels of a udma device, without syscalls,
+ * pinning or wakeups in the way: coherent kernel buffers go straight to
+ * the dmaengine, at each of a range of sizes and queue depths. With a TX
+ * and an RX channel looped back in the fabric, every received buffer is
+ * checked against what was sent.
+ *
+ *   echo udma0 > /sys/module/udma_bench/parameters/device
+ *   echo 1 > /sys/kernel/debug/udma_bench/run
+ *   cat /sys/kernel/debug/udma_bench/results
+ *
+ * The difference to udma-bench or a read()/write() loop on the same
+ * channels is what the file interface costs.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+
+#include <linux/dmaengine.h>
+#include <linux/dma-mapping.h>
+
+#include <linux/udma.h>
+
+#define UDMA_BENCH_MAX_POINTS   (16)
+#define UDMA_BENCH_MAX_DEPTH    (64)
+#define UDMA_BENCH_MAX_ITERATIONS   (1 << 20)
+#define UDMA_BENCH_RESULTS_SIZE (16 << 10)
+
+static char *device = "udma0";
+module_param( device, charp, 0644 );
+MODULE_PARM_DESC( device, "udma device or device tree node name" );
+
+static int tx = 0;
+module_param( tx, int, 0644 );
+MODULE_PARM_DESC( tx, "index in dma-names of the TX channel, -1 for RX only" );
+
+static int rx = 1;
+module_param( rx, int, 0644 );
+MODULE_PARM_DESC( rx, "index in dma-names of the RX channel, -1 for TX only" );
+
+static unsigned int sizes[UDMA_BENCH_MAX_POINTS] = { 4096, 65536, 1 << 20 };
+static int num_sizes = 3;
+module_param_array( sizes, uint, &num_sizes, 0644 );
+MODULE_PARM_DESC( sizes, "transfer sizes in bytes" );
+
+static unsigned int depths[UDMA_BENCH_MAX_POINTS] = { 1, 4, 16 };
+static int num_depths = 3;
+module_param_array( depths, uint, &num_depths, 0644 );
+MODULE_PARM_DESC( depths, "transfers kept in flight" );
+
+static unsigned int iterations = 1000;
+module_param( iterations, uint, 0644 );
+MODULE_PARM_DESC( iterations, "transfers per size and depth, at most 1M" );
+
+static bool verify = true;
+module_param( verify, bool, 0644 );
+MODULE_PARM_DESC( verify, "check received data against what was sent (costs CPU time)" );
+
+static unsigned int timeout_ms = 1000;
+module_param( timeout_ms, uint, 0644 );
+MODULE_PARM_DESC( timeout_ms, "give up on a point when no transfer completes for this long" );
+
+struct udma_bench_run;
+
+// One transfer (TX, RX or a looped-back pair of both) kept in flight.
+struct udma_bench_slot {
+    struct udma_bench_run * run;
+    struct list_head        node;       // on run->done once pending drops to 0
+    void *                  tx_buf;
+    dma_addr_t              tx_dma;
+    void *                  rx_buf;
+    dma_addr_t              rx_dma;
+    u32                     seq;        // selects the pattern sent
+    u64                     start_ns;
+    u64                     end_ns;     // of the last callback
+    int                     pending;    // callbacks still to come
+    int                     status;
+};
+
+struct udma_bench_run {
+    struct udma_kchan       tx;         // chan is NULL if the side isn't used
+    struct udma_kchan       rx;
+    size_t                  size;
+    unsigned int            depth;
+    struct udma_bench_slot  slots[UDMA_BENCH_MAX_DEPTH];
+    u32                     next_seq;
+
+    spinlock_t              lock;       // protects done and the slots' pending, taken from callbacks
+    struct list_head        done;
+    wait_queue_head_t       wq;
+
+    u64 *                   lat_ns;     // of each completed transfer
+    unsigned int            completed;
+    unsigned int            errors;
+    bool                    revoked;    // the udma device is going away, see udma_bench_revoke()
+};
+
+static DEFINE_MUTEX(udma_bench_lock);   // one run at a time, protects results
+static char *results;
+static size_t results_len;
+static struct dentry *udma_bench_dir;
+
+// The udma device is going away: the point in progress stops, and the sweep with it.
+static void udma_bench_revoke( struct udma_bench_run * run )
+{
+    WRITE_ONCE( run->revoked, true );
+    wake_up( &run->wq );
+}
+
+static void udma_bench_revoke_tx( struct udma_kchan * kc )
+{
+    udma_bench_revoke( container_of( kc, struct udma_bench_run, tx ) );
+}
+
+static void udma_bench_revoke_rx( struct udma_kchan * kc )
+{
+    udma_bench_revoke( container_of( kc, struct udma_bench_run, rx ) );
+}
+
+static void udma_bench_callback( void *param, const struct dmaengine_result *result )
+{
+    struct udma_bench_slot * const slot = param;
+    struct udma_bench_run * const run = slot->run;
+    const u64 now = ktime_get_ns();
+    unsigned long flags;
+
+    spin_lock_irqsave( &run->lock, flags );
+    if ( result && result->result != DMA_TRANS_NOERROR )
+        slot->status = -EIO;
+    slot->end_ns = now;
+    if ( 0 == --slot->pending )
+    {
+        list_add_tail( &slot->node, &run->done );
+        wake_up( &run->wq );
+    }
+    spin_unlock_irqrestore( &run->lock, flags );
+}
+
+// Word i of transfer seq, so a buffer received twice or shifted shows up.
+static inline u32 udma_bench_pattern( u32 seq, size_t i )
+{
+    return seq * 0x9e3779b1 + (u32)i;
+}
+
+static void udma_bench_fill( struct udma_bench_slot * slot, size_t size )
+{
+    u32 * const p = slot->tx_buf;
+    size_t i;
+
+    for ( i = 0; i < size / 4; ++i )
+        p[i] = udma_bench_pattern( slot->seq, i );
+}
+
+static bool udma_bench_check( struct udma_bench_slot * slot, size_t size )
+{
+    const u32 * const p = slot->rx_buf;
+    size_t i;
+
+    for ( i = 0; i < size / 4; ++i )
+    {
+        if ( p[i] != udma_bench_pattern( slot->seq, i ) )
+            return false;
+    }
+
+    return true;
+}
+
+static int udma_bench_submit_one( struct udma_kchan * kc, struct udma_bench_slot * slot,
+                                  dma_addr_t addr, size_t size )
+{
+    struct dma_async_tx_descriptor * desc;
+
+    desc = dmaengine_prep_slave_single( kc->chan, addr, size,
+            kc->dir == UDMA_DEV_TO_CPU ? DMA_DEV_TO_MEM : DMA_MEM_TO_DEV,
+            DMA_PREP_INTERRUPT | DMA_CTRL_ACK );
+    if ( !desc )
+        return -ENOMEM;
+
+    desc->callback_result = udma_bench_callback;
+    desc->callback_param = slot;
+
+    if ( dmaengine_submit( desc ) < DMA_MIN_COOKIE )
+        return -EIO;
+
+    return 0;
+}
+
+// RX goes first, so it is ready when the looped back TX data arrives.
+static int udma_bench_submit( struct udma_bench_run * run, struct udma_bench_slot * slot )
+{
+    unsigned long flags;
+    int rv;
+
+    slot->seq = run->next_seq++;
+    slot->status = 0;
+    if ( verify && run->tx.chan )
+        udma_bench_fill( slot, run->size );
+    if ( verify && run->rx.chan )
+        memset( slot->rx_buf, 0, run->size );
+
+    spin_lock_irqsave( &run->lock, flags );
+    slot->pending = !!run->tx.chan + !!run->rx.chan;
+    spin_unlock_irqrestore( &run->lock, flags );
+
+    slot->start_ns = ktime_get_ns();
+
+    if ( run->rx.chan )
+    {
+        if ( (rv = udma_bench_submit_one( &run->rx, slot, slot->rx_dma, run->size )) )
+            return rv;
+        dma_async_issue_pending( run->rx.chan );
+    }
+    if ( run->tx.chan )
+    {
+        if ( (rv = udma_bench_submit_one( &run->tx, slot, slot->tx_dma, run->size )) )
+            return rv;
+        dma_async_issue_pending( run->tx.chan );
+    }
+
+    return 0;
+}
+
+static void udma_bench_free_slots( struct udma_bench_run * run )
+{
+    unsigned int i;
+
+    for ( i = 0; i < run->depth; ++i )
+    {
+        struct udma_bench_slot * const slot = &run->slots[i];
+
+        if ( slot->tx_buf )
+            dma_free_coherent( run->tx.dev, run->size, slot->tx_buf, slot->tx_dma );
+        if ( slot->rx_buf )
+            dma_free_coherent( run->rx.dev, run->size, slot->rx_buf, slot->rx_dma );
+        slot->tx_buf = NULL;
+        slot->rx_buf = NULL;
+    }
+}
+
+static int udma_bench_alloc_slots( struct udma_bench_run * run )
+{
+    unsigned int i;
+
+    for ( i = 0; i < run->depth; ++i )
+    {
+        struct udma_bench_slot * const slot = &run->slots[i];
+
+        slot->run = run;
+        if ( run->tx.chan )
+        {
+            slot->tx_buf = dma_alloc_coherent( run->tx.dev, run->size, &slot->tx_dma, GFP_KERNEL );
+            if ( !slot->tx_buf )
+                goto err_out;
+        }
+        if ( run->rx.chan )
+        {
+            slot->rx_buf = dma_alloc_coherent( run->rx.dev, run->size, &slot->rx_dma, GFP_KERNEL );
+            if ( !slot->rx_buf )
+                goto err_out;
+        }
+    }
+
+    return 0;
+
+    err_out:
+    udma_bench_free_slots( run );
+    return -ENOMEM;
+}
+
+static int udma_bench_cmp_u64( const void *a, const void *b )
+{
+    const u64 va = *(const u64 *)a;
+    const u64 vb = *(const u64 *)b;
+
+    return va < vb ? -1 : va > vb;
+}
+
+/* Runs iterations transfers of run->size bytes with run->depth of them in
+ * flight and appends one line of results.
+ */
+static int udma_bench_point( struct udma_bench_run * run )
+{
+    const unsigned int align = max( run->tx.chan ? run->tx.align : 1, run->rx.chan ? run->rx.align : 1 );
+    unsigned int issued = 0;
+    u64 start, elapsed;
+    u64 bytes;
+    int rv = 0;
+
+    if ( !run->size || run->size % max( align, 4U ) )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": size %zu is not a multiple of %u\n",
+                run->size, max( align, 4U ) );
+        return -EINVAL;
+    }
+
+    memset( run->slots, 0, sizeof(run->slots) );
+    INIT_LIST_HEAD( &run->done );
+    run->completed = 0;
+    run->errors = 0;
+
+    if ( (rv = udma_bench_alloc_slots( run )) )
+        return rv;
+
+    start = ktime_get_ns();
+    for ( ; issued < run->depth && issued < iterations; ++issued )
+    {
+        if ( (rv = udma_bench_submit( run, &run->slots[issued] )) )
+            goto out;
+    }
+
+    while ( run->completed < issued )
+    {
+        struct udma_bench_slot * slot;
+        struct udma_bench_slot * tmp;
+        unsigned long flags;
+        LIST_HEAD(done);
+
+        if ( !wait_event_timeout( run->wq, !list_empty_careful( &run->done ) || READ_ONCE( run->revoked ),
+                                  msecs_to_jiffies( timeout_ms ) ) )
+        {
+            rv = -ETIMEDOUT;
+            goto out;
+        }
+        if ( READ_ONCE( run->revoked ) )
+        {
+            rv = -ENODEV;
+            goto out;
+        }
+
+        spin_lock_irqsave( &run->lock, flags );
+        list_splice_init( &run->done, &done );
+        spin_unlock_irqrestore( &run->lock, flags );
+
+        list_for_each_entry_safe( slot, tmp, &done, node )
+        {
+            list_del( &slot->node );
+            run->lat_ns[run->completed++] = slot->end_ns - slot->start_ns;
+
+            if ( slot->status )
+                ++run->errors;
+            else if ( verify && run->tx.chan && run->rx.chan && !udma_bench_check( slot, run->size ) )
+                ++run->errors;
+
+            if ( issued < iterations )
+            {
+                if ( (rv = udma_bench_submit( run, slot )) )
+                    goto out;
+                ++issued;
+            }
+        }
+    }
+    elapsed = ktime_get_ns() - start;
+
+    sort( run->lat_ns, run->completed, sizeof(u64), udma_bench_cmp_u64, NULL );
+    bytes = (u64)run->completed * run->size;
+
+    results_len += scnprintf( results + results_len, UDMA_BENCH_RESULTS_SIZE - results_len,
+                              "%zu %u %u %llu %llu %llu %llu %u\n",
+                              run->size, run->depth, run->completed,
+                              div64_u64( bytes * 1000, max( elapsed, 1ULL ) ),
+                              run->lat_ns[(run->completed - 1) / 2],
+                              run->lat_ns[div_u64( (u64)(run->completed - 1) * 99, 100 )],
+                              run->lat_ns[run->completed - 1],
+                              run->errors );
+
+    out:
+    // Nothing may be left in flight when the buffers go.
+    if ( run->rx.chan )
+        dmaengine_terminate_sync( run->rx.chan );
+    if ( run->tx.chan )
+        dmaengine_terminate_sync( run->tx.chan );
+    udma_bench_free_slots( run );
+    return rv;
+}
+
+// Should be called with udma_bench_lock held.
+static int udma_bench_sweep( void )
+{
+    struct udma_bench_run * run;
+    unsigned int s, d;
+    int rv = 0;
+
+    // lat_ns holds one u64 per transfer, which must not overflow on 32 bit.
+    if ( !iterations || iterations > UDMA_BENCH_MAX_ITERATIONS || (tx < 0 && rx < 0) )
+        return -EINVAL;
+
+    run = kzalloc( sizeof(*run), GFP_KERNEL );
+    if ( !run )
+        return -ENOMEM;
+
+    spin_lock_init( &run->lock );
+    init_waitqueue_head( &run->wq );
+
+    run->lat_ns = vmalloc( iterations * sizeof(u64) );
+    if ( !run->lat_ns )
+    {
+        rv = -ENOMEM;
+        goto out_free;
+    }
+
+    run->tx.revoke = udma_bench_revoke_tx;
+    run->rx.revoke = udma_bench_revoke_rx;
+    if ( tx >= 0 && (rv = udma_claim_chan( device, tx, &run->tx )) )
+        goto out_free;
+    if ( rx >= 0 && (rv = udma_claim_chan( device, rx, &run->rx )) )
+        goto out_release;
+
+    if ( (run->tx.chan && run->tx.dir != UDMA_CPU_TO_DEV) ||
+         (run->rx.chan && run->rx.dir != UDMA_DEV_TO_CPU) )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: channel %d is not TX or %d not RX\n", device, tx, rx );
+        rv = -EINVAL;
+        goto out_release;
+    }
+
+    results_len = scnprintf( results, UDMA_BENCH_RESULTS_SIZE,
+                             "device %s tx %d rx %d iterations %u verify %d\n"
+                             "size depth xfers MB/s p50_ns p99_ns max_ns errors\n",
+                             device, tx, rx, iterations, verify );
+
+    for ( s = 0; s < num_sizes; ++s )
+    {
+        for ( d = 0; d < num_depths; ++d )
+        {
+            int point_rv;
+
+            run->size = sizes[s];
+            run->depth = clamp( depths[d], 1U, (unsigned int)UDMA_BENCH_MAX_DEPTH );
+
+            // A failed point is reported and the sweep goes on with the next.
+            if ( (point_rv = udma_bench_point( run )) )
+                results_len += scnprintf( results + results_len, UDMA_BENCH_RESULTS_SIZE - results_len,
+                                          "%zu %u error %d\n", run->size, run->depth, point_rv );
+            if ( READ_ONCE( run->revoked ) )
+            {
+                rv = -ENODEV;
+                goto out_release;
+            }
+        }
+    }
+
+    out_release:
+    if ( run->rx.chan )
+        udma_release_chan( &run->rx );
+    if ( run->tx.chan )
+        udma_release_chan( &run->tx );
+
+    out_free:
+    vfree( run->lat_ns );
+    kfree( run );
+    return rv;
+}
+
+// Any write runs the sweep with the current module parameters; returns when it's done.
+static ssize_t udma_bench_run_write( struct file *filp, const char __user *buf, size_t count, loff_t *ppos )
+{
+    int rv;
+
+    if ( mutex_lock_interruptible( &udma_bench_lock ) )
+        return -ERESTARTSYS;
+    rv = udma_bench_sweep();
+    mutex_unlock( &udma_bench_lock );
+
+    return rv ? rv : count;
+}
+
+static ssize_t udma_bench_results_read( struct file *filp, char __user *buf, size_t count, loff_t *ppos )
+{
+    ssize_t rv;
+
+    if ( mutex_lock_interruptible( &udma_bench_lock ) )
+        return -ERESTARTSYS;
+    rv = simple_read_from_buffer( buf, count, ppos, results, results_len );
+    mutex_unlock( &udma_bench_lock );
+
+    return rv;
+}
+
+static const struct file_operations udma_bench_run_fops = {
+    .owner      = THIS_MODULE,
+    .write      = udma_bench_run_write,
+    .llseek     = no_llseek,
+};
+
+static const struct file_operations udma_bench_results_fops = {
+    .owner      = THIS_MODULE,
+    .read       = udma_bench_results_read,
+    .llseek     = default_llseek,
+};
+
+static int __init udma_bench_init( void )
+{
+    results = kzalloc( UDMA_BENCH_RESULTS_SIZE, GFP_KERNEL );
+    if ( !results )
+        return -ENOMEM;
+
+    udma_bench_dir = debugfs_create_dir( "udma_bench", NULL );
+    if ( IS_ERR_OR_NULL(udma_bench_dir) )
+    {
+        kfree( results );
+        return -ENODEV;
+    }
+
+    debugfs_create_file( "run", S_IWUSR, udma_bench_dir, NULL, &udma_bench_run_fops );
+    debugfs_create_file( "results", S_IRUSR, udma_bench_dir, NULL, &udma_bench_results_fops );
+
+    return 0;
+}
+
+static void __exit udma_bench_exit( void )
+{
+    debugfs_remove_recursive( udma_bench_dir );
+    kfree( results );
+}
+
+module_init(udma_bench_init);
+module_exit(udma_bench_exit);
+
+MODULE_DESCRIPTION("udma channel microbenchmark");
+MODULE_LICENSE("GPL v2");
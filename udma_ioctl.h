@@ -0,0 +1,343 @@
+/*
+ * include/uapi/linux/udma_ioctl.h
+ *
+ * ioctl interface of the udma extension to /dev/uioX.
+ *
+ * This header is shared with userspace and must only use __u* types.
+ */
+
+#ifndef _UAPI_LINUX_UDMA_IOCTL_H
+#define _UAPI_LINUX_UDMA_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define UDMA_IOC_MAGIC  'u'
+
+/* UDMA_IOC_DMABUF_EXPORT: allocate a driver-owned buffer and export it as
+ * a dma-buf.  The returned fd can be handed to any dma-buf importer (V4L2,
+ * DRM, ...) and also back to UDMA_IOC_DMABUF_IMPORT of any udma device.
+ */
+struct udma_dmabuf_export {
+    __u64   size;       // in: buffer size in bytes, rounded up to PAGE_SIZE
+    __u32   flags;      // in: O_CLOEXEC is honoured, everything else is ignored
+    __s32   fd;         // out: dma-buf file descriptor
+};
+
+/* UDMA_IOC_DMABUF_IMPORT: attach a dma-buf (udmabuf, DMA heap, another
+ * driver's export, ...) to the channel of the given direction.  The buffer
+ * stays attached and mapped until UDMA_IOC_DMABUF_RELEASE or close().
+ */
+struct udma_dmabuf_import {
+    __s32   fd;         // in: dma-buf file descriptor
+    __u32   dir;        // in: 1 = RX (dev->cpu), 2 = TX (cpu->dev)
+    __u64   size;       // out: size of the dma-buf in bytes
+    __u32   handle;     // out: handle for UDMA_IOC_DMABUF_XFER/RELEASE
+    __u32   reserved;
+};
+
+/* UDMA_IOC_DMABUF_XFER: run one blocking transfer on an imported buffer.
+ * Returns the number of bytes transferred like read()/write() do.
+ */
+struct udma_dmabuf_xfer {
+    __u32   handle;
+    __u32   flags;      // UDMA_XFER_*
+    __u64   offset;     // byte offset into the dma-buf
+    __u64   length;     // bytes to transfer
+};
+
+/* UDMA_IOC_DMABUF_SYNC: cache maintenance for CPU access to part of an
+ * imported buffer, like DMA_BUF_IOCTL_SYNC but limited to [offset,
+ * offset+length) and to this device's mapping. Bracket CPU access to a
+ * cacheable mmap() of the dma-buf with UDMA_SYNC_START and UDMA_SYNC_END.
+ * The flags have the values of the DMA_BUF_SYNC_* ones.
+ *
+ * handle is an import handle. A buffer from UDMA_IOC_DMABUF_EXPORT has none
+ * of its own: pass its fd to UDMA_IOC_DMABUF_IMPORT on this fd first, for
+ * the channel that transfers it, and sync through that import.
+ */
+#define UDMA_SYNC_READ      (1U << 0)
+#define UDMA_SYNC_WRITE     (2U << 0)
+#define UDMA_SYNC_RW        (UDMA_SYNC_READ | UDMA_SYNC_WRITE)
+#define UDMA_SYNC_START     (0U << 2)
+#define UDMA_SYNC_END       (1U << 2)
+
+struct udma_dmabuf_sync {
+    __u32   handle;
+    __u32   flags;      // UDMA_SYNC_START or UDMA_SYNC_END, with READ and/or WRITE
+    __u64   offset;     // byte offset into the dma-buf
+    __u64   length;
+};
+
+/* UDMA_IOC_CHAIN_LINK: route every frame received on this device's RX
+ * channel into the TX channel of the target device through a ring of
+ * num_bufs kernel buffers of buf_size bytes. Both channels are owned by the
+ * chain (read()/write() return -EBUSY) until UDMA_IOC_CHAIN_UNLINK.
+ */
+#define UDMA_NAME_MAX   32
+
+struct udma_chain_link {
+    char    target[UDMA_NAME_MAX];  // device or device tree node name of the TX side
+    __u32   num_bufs;
+    __u32   buf_size;
+};
+
+struct udma_chain_stats {
+    __u64   frames;     // frames forwarded RX -> TX
+    __u64   bytes;
+    __u64   rx_errors;
+    __u64   tx_errors;
+    __u64   dropped;    // received but could not be queued on TX
+    __u32   rx_posted;  // buffers currently posted to RX
+    __u32   tx_inflight;// buffers currently queued on TX
+};
+
+/* UDMA_IOC_BIND: select the channels this fd uses for read()/write(),
+ * dma-buf imports and chains, by their index in "dma-names". A negative
+ * index keeps the current channel. New fds start on the first RX and the
+ * first TX channel.
+ */
+struct udma_bind {
+    __s32   rx;
+    __s32   tx;
+};
+
+/* UDMA_IOC_SET_RX_TIMEOUT: bound the time read() (and RX dma-buf transfers)
+ * on this fd may block, in milliseconds. 0 waits forever, -1 falls back to
+ * the channel's rx_timeout_ms sysfs attribute. When it expires, or a signal
+ * arrives, the transfer is stopped and the bytes received so far are
+ * returned; EAGAIN resp. EINTR only if there were none.
+ */
+/* UDMA_IOC_PKT_MODE: keep num_bufs RX buffers of buf_size bytes posted to
+ * this fd's RX channel at all times. Each read() then returns one received
+ * frame with its real length; frames longer than the read buffer are
+ * truncated. num_bufs = 0 leaves packet mode. The mode belongs to the
+ * channel and outlives the fd.
+ */
+struct udma_pkt_mode {
+    __u32   num_bufs;
+    __u32   buf_size;
+};
+
+struct udma_pkt_stats {
+    __u64   frames;     // frames received
+    __u64   bytes;
+    __u64   rx_errors;
+    __u64   truncated;  // frames cut short by a too small read()
+    __u64   lost;       // buffers that could not be reposted
+    __u32   rx_posted;  // buffers currently posted to RX
+    __u32   queued;     // frames waiting for read()
+};
+
+/* UDMA_IOC_SNDBUF_MODE: give this fd's TX channel a send buffer of
+ * num_bufs kernel buffers of buf_size bytes. write() then copies into free
+ * buffers, a write() larger than buf_size into several, and returns once
+ * the data is queued rather than sent. Only a full send buffer makes it
+ * block, or fail with EAGAIN under O_NONBLOCK; if part of the data was
+ * queued by then, that part is returned. fsync() or UDMA_IOC_SNDBUF_FLUSH
+ * waits until everything queued is sent. A transfer that fails after its
+ * write() returned is reported by the next write(), fsync() or flush, as
+ * EIO, once. num_bufs = 0 flushes and leaves the mode. Like packet mode,
+ * the mode belongs to the channel and outlives the fd.
+ */
+struct udma_sndbuf_mode {
+    __u32   num_bufs;
+    __u32   buf_size;
+};
+
+struct udma_sndbuf_stats {
+    __u64   frames;     // buffers sent
+    __u64   bytes;
+    __u64   tx_errors;
+    __u32   inflight;   // buffers queued on the channel
+    __u32   free;       // buffers write() can fill right away
+};
+
+/* UDMA_IOC_STRIPE_SETUP: spread this fd's read()/write() over several
+ * channel pairs. Member 0 is the pair the fd is bound to at setup time,
+ * members 1..num_members the ones listed, each a device (or device tree
+ * node) name and dma-names indices as for UDMA_IOC_BIND, negative for the
+ * first channel of the direction. A transfer is cut into stripes of
+ * stripe_size bytes, dealt out round robin: stripe k goes to member
+ * k % (num_members + 1). Each round runs one stripe per member in
+ * parallel. Only the data up to the first short or failed stripe is
+ * returned. num_members = 0 turns striping off.
+ */
+#define UDMA_STRIPE_MAX     8
+
+struct udma_stripe_dev {
+    char    name[UDMA_NAME_MAX];
+    __s32   rx;
+    __s32   tx;
+};
+
+struct udma_stripe_setup {
+    __u32   stripe_size;
+    __u32   num_members;    // besides the fd's own pair, up to UDMA_STRIPE_MAX - 1
+    struct udma_stripe_dev members[UDMA_STRIPE_MAX - 1];
+};
+
+struct udma_stripe_stats {
+    __u32   num_members;    // including the fd's own pair
+    __u32   stripe_size;
+    struct {
+        __u64   rx_bytes;
+        __u64   tx_bytes;
+        __u64   rx_stripes;
+        __u64   tx_stripes;
+        __u64   errors;     // stripes that failed
+    } members[UDMA_STRIPE_MAX];
+};
+
+/* UDMA_IOC_RING_SETUP: kernel-bypass mode for the fd's channel of direction
+ * dir. The driver allocates one coherent area, mmap()ed by the process at
+ * mmap_offset, holding a struct udma_ring_hdr followed by the submission
+ * array (sq_off), the completion array (cq_off) and a data area (data_off).
+ *
+ * The process fills udma_ring_sqe entries (offset/len into the data area)
+ * and bumps sq_head; a kernel thread picks them up and feeds them to the
+ * channel, and every finished transfer shows up as a udma_ring_cqe at
+ * cq_head. All indices run freely and are masked with entries - 1. When the
+ * thread has gone to sleep, because the sq ran empty or the cq full, it sets
+ * UDMA_RING_NEED_WAKEUP. Only then does the process have to call
+ * UDMA_IOC_RING_KICK, after queueing sq entries or consuming cq entries.
+ */
+struct udma_ring_setup {
+    __u32   dir;            // in: 1 = RX, 2 = TX
+    __u32   entries;        // in: power of two, sq and cq size
+    __u64   data_size;      // in: bytes, rounded up to PAGE_SIZE
+    __u32   idle_us;        // in: busy poll this long before sleeping, 0 = default, max 10000
+    __u32   reserved;
+    __u64   mmap_offset;    // out: pass to mmap() on the same fd
+    __u64   mmap_size;      // out
+};
+
+#define UDMA_RING_NEED_WAKEUP   (1U << 0)
+
+struct udma_ring_hdr {
+    __u32   sq_head;        // written by the process: next entry it fills
+    __u32   sq_tail;        // written by the kernel: next entry it takes
+    __u32   cq_head;        // written by the kernel: next completion it writes
+    __u32   cq_tail;        // written by the process: next completion it reads
+    __u32   flags;          // UDMA_RING_*, written by the kernel
+    __u32   entries;
+    __u32   sq_off;         // byte offsets from the start of the mapping
+    __u32   cq_off;
+    __u64   data_off;
+    __u64   data_size;
+};
+
+struct udma_ring_sqe {
+    __u64   offset;         // into the data area
+    __u32   len;
+    __u32   user_data;      // echoed in the completion
+};
+
+struct udma_ring_cqe {
+    __u32   user_data;
+    __u32   len;            // bytes transferred
+    __s32   status;         // 0 or -errno
+    __u32   reserved;
+};
+
+/* UDMA_IOC_SET_WEIGHT: share of this fd when several fds transfer on the
+ * same channel (1..UDMA_WEIGHT_MAX, default 1). Bandwidth is split in
+ * proportion to the weights of the fds that have transfers waiting.
+ */
+#define UDMA_WEIGHT_MAX     1024
+
+/* UDMA_IOC_SET_PRIO: priority class of this fd's transfers. Waiting
+ * UDMA_PRIO_HIGH transfers are started before any queued bulk transfer, in
+ * arrival order; the weights only apply within UDMA_PRIO_BULK. To bound how
+ * long a high priority transfer waits behind one in flight, set the
+ * channel's sched_chunk sysfs attribute so bulk TX is split into chunks.
+ * UDMA_XFER_HIGH_PRIO raises a single dma-buf transfer instead.
+ */
+#define UDMA_PRIO_BULK      0
+#define UDMA_PRIO_HIGH      1
+
+#define UDMA_XFER_HIGH_PRIO (1U << 0)
+
+/* UDMA_IOC_SET_TX_RATE: limits this fd's write(), splice and dma-buf TX to
+ * rate bytes per second, with up to burst bytes going out back to back.
+ * A transfer larger than the burst starts when the burst is there and is
+ * paid off by the next one. rate 0 lifts the limit. The channel's
+ * shape_rate_kb sysfs attribute limits all fds together.
+ */
+struct udma_rate {
+    __u64   rate;       // bytes per second, 0: unlimited
+    __u32   burst;      // bytes
+    __u32   reserved;   // must be 0
+};
+
+/* UDMA_IOC_META_XFER: one write() of buf that carries AXI-Stream sideband
+ * along: the user application words APP0..APP4 of the first AXI DMA buffer
+ * descriptor, which the engine puts out on its control stream ahead of the
+ * frame for the stream IP to take TUSER/TDEST and the like from. meta_len
+ * bytes of meta are copied to APP0 on, in CPU byte order, the rest is
+ * zero. Returns the number of bytes transferred like write().
+ *
+ * Fails with EOPNOTSUPP unless the channel is TX and its DMA controller an
+ * AXI DMA ("xlnx,axi-dma-1.00.a"). RX app words aren't handed back by the
+ * dmaengine drivers this is built against.
+ */
+#define UDMA_META_MAX       20
+
+struct udma_meta_xfer {
+    __u64   buf;        // user address of the data
+    __u32   len;        // bytes of data
+    __u32   dir;        // 2 = TX
+    __u32   flags;      // UDMA_XFER_*
+    __u32   meta_len;   // bytes of meta, at most UDMA_META_MAX
+    __u8    meta[UDMA_META_MAX];
+    __u32   reserved;   // must be 0
+};
+
+/* Transfer trace: while debugfs udma/<device>/trace_ctl holds a nonzero
+ * number of entries, every read(), write(), splice and UDMA_IOC_DMABUF_XFER
+ * call on the device leaves one record, in the order the calls return.
+ * Reading udma/<device>/trace hands them out and frees their slots; when
+ * nobody reads, the oldest are overwritten.
+ */
+#define UDMA_TRACE_USER     0   // read()/write() buffer
+#define UDMA_TRACE_SPLICE   1
+#define UDMA_TRACE_DMABUF   2
+
+struct udma_trace_rec {
+    __u64   ts_ns;      // CLOCK_MONOTONIC when the call came in
+    __u64   lat_ns;     // until it returned, waiting for the channel included
+    __u32   len;        // bytes asked for
+    __s32   result;     // bytes transferred or -errno
+    __u16   chan;       // index in "dma-names"
+    __u8    dir;        // 1 = RX, 2 = TX
+    __u8    kind;       // UDMA_TRACE_*
+    __u16   page_off;   // of the buffer start, or of the dma-buf offset
+    __u16   reserved;
+};
+
+#define UDMA_IOC_DMABUF_EXPORT  _IOWR(UDMA_IOC_MAGIC, 0x01, struct udma_dmabuf_export)
+#define UDMA_IOC_DMABUF_IMPORT  _IOWR(UDMA_IOC_MAGIC, 0x02, struct udma_dmabuf_import)
+#define UDMA_IOC_DMABUF_RELEASE _IOW(UDMA_IOC_MAGIC, 0x03, __u32)
+#define UDMA_IOC_DMABUF_XFER    _IOW(UDMA_IOC_MAGIC, 0x04, struct udma_dmabuf_xfer)
+#define UDMA_IOC_CHAIN_LINK     _IOW(UDMA_IOC_MAGIC, 0x05, struct udma_chain_link)
+#define UDMA_IOC_CHAIN_UNLINK   _IO(UDMA_IOC_MAGIC, 0x06)
+#define UDMA_IOC_CHAIN_STATS    _IOR(UDMA_IOC_MAGIC, 0x07, struct udma_chain_stats)
+#define UDMA_IOC_BIND           _IOW(UDMA_IOC_MAGIC, 0x08, struct udma_bind)
+#define UDMA_IOC_SET_RX_TIMEOUT _IOW(UDMA_IOC_MAGIC, 0x09, __s32)
+#define UDMA_IOC_PKT_MODE       _IOW(UDMA_IOC_MAGIC, 0x0a, struct udma_pkt_mode)
+#define UDMA_IOC_PKT_STATS      _IOR(UDMA_IOC_MAGIC, 0x0b, struct udma_pkt_stats)
+#define UDMA_IOC_RING_SETUP     _IOWR(UDMA_IOC_MAGIC, 0x0c, struct udma_ring_setup)
+#define UDMA_IOC_RING_TEARDOWN  _IOW(UDMA_IOC_MAGIC, 0x0d, __u32)
+#define UDMA_IOC_RING_KICK      _IOW(UDMA_IOC_MAGIC, 0x0e, __u32)
+#define UDMA_IOC_SET_WEIGHT     _IOW(UDMA_IOC_MAGIC, 0x0f, __u32)
+#define UDMA_IOC_SET_PRIO       _IOW(UDMA_IOC_MAGIC, 0x10, __u32)
+#define UDMA_IOC_DMABUF_SYNC    _IOW(UDMA_IOC_MAGIC, 0x11, struct udma_dmabuf_sync)
+#define UDMA_IOC_SNDBUF_MODE    _IOW(UDMA_IOC_MAGIC, 0x12, struct udma_sndbuf_mode)
+#define UDMA_IOC_SNDBUF_FLUSH   _IO(UDMA_IOC_MAGIC, 0x13)
+#define UDMA_IOC_SNDBUF_STATS   _IOR(UDMA_IOC_MAGIC, 0x14, struct udma_sndbuf_stats)
+#define UDMA_IOC_STRIPE_SETUP   _IOW(UDMA_IOC_MAGIC, 0x15, struct udma_stripe_setup)
+#define UDMA_IOC_STRIPE_STATS   _IOR(UDMA_IOC_MAGIC, 0x16, struct udma_stripe_stats)
+#define UDMA_IOC_SET_TX_RATE    _IOW(UDMA_IOC_MAGIC, 0x17, struct udma_rate)
+#define UDMA_IOC_META_XFER      _IOW(UDMA_IOC_MAGIC, 0x18, struct udma_meta_xfer)
+
+#endif /* _UAPI_LINUX_UDMA_IOCTL_H */
@@ -0,0 +1,578 @@
+/*
+ * drivers/uio/udma_net.c
+ *
+ * Network interface over a TX/RX channel pair of a udma device, for stream
+ * IPs that carry Ethernet frames. RX keeps a ring of skbs posted to the RX
+ * channel; TX queues each skb as one descriptor, with byte queue limits.
+ * The dmaengine callbacks only note the result and schedule NAPI, which
+ * reaps both rings in order and hands received frames to GRO.
+ *
+ *   insmod udma_net.ko device=udma0 tx=0 rx=1
+ *   ip link set udma0 up
+ *
+ * While the interface is up it owns the two channels, and read()/write()
+ * on them fail with EBUSY.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/version.h>
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_vlan.h>
+#include <linux/skbuff.h>
+#include <linux/workqueue.h>
+
+#include <linux/dmaengine.h>
+#include <linux/dma-mapping.h>
+
+#include <linux/udma.h>
+
+#define UDMA_NET_MAX_MTU    (9000)
+#define UDMA_NET_RX_RETRY   (HZ / 100)  // until the next refill of an empty RX ring
+
+#ifndef ETH_MIN_MTU
+#define ETH_MIN_MTU         (68)
+#endif
+
+static char *device = "udma0";
+module_param( device, charp, 0444 );
+MODULE_PARM_DESC( device, "udma device or device tree node name" );
+
+static int tx = 0;
+module_param( tx, int, 0444 );
+MODULE_PARM_DESC( tx, "index in dma-names of the TX channel" );
+
+static int rx = 1;
+module_param( rx, int, 0444 );
+MODULE_PARM_DESC( rx, "index in dma-names of the RX channel" );
+
+static unsigned int rx_ring = 256;
+module_param( rx_ring, uint, 0444 );
+MODULE_PARM_DESC( rx_ring, "RX buffers kept posted, a power of two" );
+
+static unsigned int tx_ring = 256;
+module_param( tx_ring, uint, 0444 );
+MODULE_PARM_DESC( tx_ring, "TX descriptors in flight at most, a power of two" );
+
+struct udma_net;
+
+struct udma_net_slot {
+    struct udma_net *   net;
+    struct sk_buff *    skb;
+    dma_addr_t          dma;
+    u32                 len;        // RX: bytes received, TX: bytes sent
+    int                 status;
+    bool                done;       // set by the callback, cleared by the poll
+};
+
+/* The rings run freely: head counts slots ever posted (RX) or queued (TX),
+ * tail slots ever reaped, both masked with the ring size. The RX ring and
+ * both tails belong to the NAPI poll, tx_head to ndo_start_xmit.
+ */
+struct udma_net {
+    struct net_device *     ndev;
+    struct napi_struct      napi;
+    struct udma_kchan       tx;
+    struct udma_kchan       rx;
+
+    unsigned int            rx_buf_size;
+    struct udma_net_slot *  rx_slots;
+    unsigned int            rx_head;
+    unsigned int            rx_tail;
+    struct delayed_work     rx_retry;   // reschedules the poll, see udma_net_rx_refill()
+
+    struct udma_net_slot *  tx_slots;
+    unsigned int            tx_head;
+    unsigned int            tx_tail;
+
+    struct work_struct      revoke;     // closes the interface, see udma_net_revoke()
+};
+
+static struct net_device *udma_net_dev;
+
+static void udma_net_done( void *param, const struct dmaengine_result *result )
+{
+    struct udma_net_slot * const slot = param;
+
+    slot->status = result && result->result != DMA_TRANS_NOERROR ? -EIO : 0;
+    if ( result && result->residue < slot->len )
+        slot->len -= result->residue;   // RX frames ending (TLAST) before the buffer
+
+    // The poll reads len and status only after it has seen done.
+    smp_wmb();
+    WRITE_ONCE( slot->done, true );
+    napi_schedule( &slot->net->napi );
+}
+
+static unsigned int udma_net_tx_free( struct udma_net * net )
+{
+    return tx_ring - (net->tx_head - READ_ONCE( net->tx_tail ));
+}
+
+/* Posts a fresh skb in every free RX slot and starts the channel on them.
+ * Stops at the first failure; the poll tries again next time. With no
+ * buffer posted at all there is no callback to schedule the poll, so the
+ * poll arms rx_retry for that.
+ */
+static void udma_net_rx_refill( struct udma_net * net, gfp_t gfp )
+{
+    const unsigned int align = net->rx.align;
+    bool posted = false;
+
+    while ( net->rx_head - net->rx_tail < rx_ring )
+    {
+        struct udma_net_slot * const slot = &net->rx_slots[net->rx_head & (rx_ring - 1)];
+        struct dma_async_tx_descriptor * desc;
+        struct sk_buff * skb;
+
+        skb = __netdev_alloc_skb( net->ndev, net->rx_buf_size + align - 1, gfp );
+        if ( !skb )
+            break;
+        skb_reserve( skb, PTR_ALIGN( skb->data, align ) - skb->data );
+
+        slot->dma = dma_map_single( net->rx.dev, skb->data, net->rx_buf_size, DMA_FROM_DEVICE );
+        if ( dma_mapping_error( net->rx.dev, slot->dma ) )
+        {
+            dev_kfree_skb_any( skb );
+            break;
+        }
+
+        slot->skb = skb;
+        slot->len = net->rx_buf_size;
+        slot->done = false;
+
+        desc = dmaengine_prep_slave_single( net->rx.chan, slot->dma, net->rx_buf_size,
+                                            DMA_DEV_TO_MEM, DMA_PREP_INTERRUPT | DMA_CTRL_ACK );
+        if ( desc )
+        {
+            desc->callback_result = udma_net_done;
+            desc->callback_param = slot;
+        }
+        if ( !desc || dmaengine_submit( desc ) < DMA_MIN_COOKIE )
+        {
+            dma_unmap_single( net->rx.dev, slot->dma, net->rx_buf_size, DMA_FROM_DEVICE );
+            dev_kfree_skb_any( skb );
+            slot->skb = NULL;
+            break;
+        }
+
+        ++net->rx_head;
+        posted = true;
+    }
+
+    if ( posted )
+        dma_async_issue_pending( net->rx.chan );
+}
+
+static void udma_net_tx_reap( struct udma_net * net, int budget )
+{
+    struct net_device * const ndev = net->ndev;
+    unsigned int pkts = 0, bytes = 0;
+    unsigned int tail = net->tx_tail;
+
+    while ( tail != READ_ONCE( net->tx_head ) )
+    {
+        struct udma_net_slot * const slot = &net->tx_slots[tail & (tx_ring - 1)];
+
+        if ( !READ_ONCE( slot->done ) )
+            break;
+        smp_rmb();
+
+        dma_unmap_single( net->tx.dev, slot->dma, slot->skb->len, DMA_TO_DEVICE );
+        if ( slot->status )
+        {
+            ++ndev->stats.tx_errors;
+        }
+        else
+        {
+            ++ndev->stats.tx_packets;
+            ndev->stats.tx_bytes += slot->skb->len;
+        }
+
+        ++pkts;
+        bytes += slot->skb->len;
+        napi_consume_skb( slot->skb, budget );
+        slot->skb = NULL;
+        ++tail;
+    }
+
+    if ( !pkts )
+        return;
+
+    // The slots must be free before ndo_start_xmit can see the new tail.
+    smp_store_release( &net->tx_tail, tail );
+    netdev_completed_queue( ndev, pkts, bytes );
+
+    smp_mb();
+    if ( netif_queue_stopped( ndev ) && udma_net_tx_free( net ) )
+        netif_wake_queue( ndev );
+}
+
+static bool udma_net_pending( struct udma_net * net )
+{
+    const unsigned int tx_tail = net->tx_tail;
+
+    return (net->rx_tail != net->rx_head &&
+            READ_ONCE( net->rx_slots[net->rx_tail & (rx_ring - 1)].done )) ||
+           (tx_tail != READ_ONCE( net->tx_head ) &&
+            READ_ONCE( net->tx_slots[tx_tail & (tx_ring - 1)].done ));
+}
+
+static int udma_net_poll( struct napi_struct *napi, int budget )
+{
+    struct udma_net * const net = container_of( napi, struct udma_net, napi );
+    struct net_device * const ndev = net->ndev;
+    int work = 0;
+
+    udma_net_tx_reap( net, budget );
+
+    while ( work < budget && net->rx_tail != net->rx_head )
+    {
+        struct udma_net_slot * const slot = &net->rx_slots[net->rx_tail & (rx_ring - 1)];
+        struct sk_buff * skb;
+
+        if ( !READ_ONCE( slot->done ) )
+            break;
+        smp_rmb();
+
+        dma_unmap_single( net->rx.dev, slot->dma, net->rx_buf_size, DMA_FROM_DEVICE );
+        skb = slot->skb;
+        slot->skb = NULL;
+        ++net->rx_tail;
+        ++work;
+
+        if ( slot->status || slot->len < ETH_HLEN )
+        {
+            ++ndev->stats.rx_errors;
+            dev_kfree_skb_any( skb );
+            continue;
+        }
+
+        skb_put( skb, slot->len );
+        skb->protocol = eth_type_trans( skb, ndev );
+        ++ndev->stats.rx_packets;
+        ndev->stats.rx_bytes += slot->len;
+        napi_gro_receive( napi, skb );
+    }
+
+    udma_net_rx_refill( net, GFP_ATOMIC );
+    if ( net->rx_head == net->rx_tail )
+        schedule_delayed_work( &net->rx_retry, UDMA_NET_RX_RETRY );
+
+    if ( work < budget )
+    {
+        napi_complete_done( napi, work );
+
+        // A callback that ran before the above saw NAPI still scheduled.
+        smp_mb();
+        if ( udma_net_pending( net ) )
+            napi_reschedule( napi );
+    }
+
+    return work;
+}
+
+static void udma_net_rx_retry( struct work_struct *work )
+{
+    struct udma_net * const net = container_of( to_delayed_work( work ), struct udma_net, rx_retry );
+
+    // napi_schedule() raises the softirq, which runs on bh enable.
+    local_bh_disable();
+    napi_schedule( &net->napi );
+    local_bh_enable();
+}
+
+static netdev_tx_t udma_net_start_xmit( struct sk_buff *skb, struct net_device *ndev )
+{
+    struct udma_net * const net = netdev_priv( ndev );
+    const unsigned int align = net->tx.align;
+    struct udma_net_slot * slot;
+    struct dma_async_tx_descriptor * desc;
+    bool more;
+
+    more = skb->xmit_more;
+
+    if ( !udma_net_tx_free( net ) )
+    {
+        netif_stop_queue( ndev );
+        return NETDEV_TX_BUSY;
+    }
+
+    // Engines without a realignment unit can't start just anywhere.
+    if ( (uintptr_t)skb->data & (align - 1) )
+    {
+        struct sk_buff * const copy = netdev_alloc_skb( ndev, skb->len + align - 1 );
+
+        if ( !copy )
+            goto drop;
+        skb_reserve( copy, PTR_ALIGN( copy->data, align ) - copy->data );
+        skb_copy_bits( skb, 0, skb_put( copy, skb->len ), skb->len );
+        dev_consume_skb_any( skb );
+        skb = copy;
+    }
+
+    slot = &net->tx_slots[net->tx_head & (tx_ring - 1)];
+    slot->dma = dma_map_single( net->tx.dev, skb->data, skb->len, DMA_TO_DEVICE );
+    if ( dma_mapping_error( net->tx.dev, slot->dma ) )
+        goto drop;
+
+    slot->skb = skb;
+    slot->len = skb->len;
+    slot->done = false;
+
+    desc = dmaengine_prep_slave_single( net->tx.chan, slot->dma, skb->len,
+                                        DMA_MEM_TO_DEV, DMA_PREP_INTERRUPT | DMA_CTRL_ACK );
+    if ( desc )
+    {
+        desc->callback_result = udma_net_done;
+        desc->callback_param = slot;
+    }
+    if ( !desc || dmaengine_submit( desc ) < DMA_MIN_COOKIE )
+    {
+        dma_unmap_single( net->tx.dev, slot->dma, skb->len, DMA_TO_DEVICE );
+        slot->skb = NULL;
+        goto drop;
+    }
+
+    netdev_sent_queue( ndev, skb->len );
+    smp_store_release( &net->tx_head, net->tx_head + 1 );
+
+    if ( !udma_net_tx_free( net ) )
+    {
+        netif_stop_queue( ndev );
+        // The poll may have freed slots before it could see the queue stopped.
+        smp_mb();
+        if ( udma_net_tx_free( net ) )
+            netif_start_queue( ndev );
+    }
+
+    if ( !more || netif_queue_stopped( ndev ) )
+        dma_async_issue_pending( net->tx.chan );
+
+    return NETDEV_TX_OK;
+
+    drop:
+    ++ndev->stats.tx_dropped;
+    dev_kfree_skb_any( skb );
+    return NETDEV_TX_OK;
+}
+
+// Frees the skbs left in both rings; the channels must have been terminated.
+static void udma_net_free_rings( struct udma_net * net )
+{
+    unsigned int i;
+
+    for ( i = 0; i < rx_ring; ++i )
+    {
+        struct udma_net_slot * const slot = &net->rx_slots[i];
+
+        if ( !slot->skb )
+            continue;
+        dma_unmap_single( net->rx.dev, slot->dma, net->rx_buf_size, DMA_FROM_DEVICE );
+        dev_kfree_skb_any( slot->skb );
+        slot->skb = NULL;
+    }
+
+    for ( i = 0; i < tx_ring; ++i )
+    {
+        struct udma_net_slot * const slot = &net->tx_slots[i];
+
+        if ( !slot->skb )
+            continue;
+        dma_unmap_single( net->tx.dev, slot->dma, slot->skb->len, DMA_TO_DEVICE );
+        dev_kfree_skb_any( slot->skb );
+        slot->skb = NULL;
+    }
+
+    net->rx_head = net->rx_tail = 0;
+    net->tx_head = net->tx_tail = 0;
+}
+
+static int udma_net_open( struct net_device *ndev )
+{
+    struct udma_net * const net = netdev_priv( ndev );
+    int rv;
+
+    if ( (rv = udma_claim_chan( device, tx, &net->tx )) )
+        return rv;
+    if ( (rv = udma_claim_chan( device, rx, &net->rx )) )
+        goto err_release_tx;
+
+    if ( net->tx.dir != UDMA_CPU_TO_DEV || net->rx.dir != UDMA_DEV_TO_CPU )
+    {
+        netdev_err( ndev, "%s: channel %d is not TX or %d not RX\n", device, tx, rx );
+        rv = -EINVAL;
+        goto err_release_rx;
+    }
+
+    net->rx_buf_size = ALIGN( ndev->mtu + ETH_HLEN + VLAN_HLEN, net->rx.align );
+
+    napi_enable( &net->napi );
+    udma_net_rx_refill( net, GFP_KERNEL );
+    if ( net->rx_head == net->rx_tail )
+    {
+        rv = -ENOMEM;
+        goto err_disable;
+    }
+
+    netdev_reset_queue( ndev );
+    netif_start_queue( ndev );
+    return 0;
+
+    err_disable:
+    napi_disable( &net->napi );
+    cancel_delayed_work_sync( &net->rx_retry );
+    dmaengine_terminate_sync( net->rx.chan );
+    udma_net_free_rings( net );
+
+    err_release_rx:
+    udma_release_chan( &net->rx );
+
+    err_release_tx:
+    udma_release_chan( &net->tx );
+    return rv;
+}
+
+static int udma_net_stop( struct net_device *ndev )
+{
+    struct udma_net * const net = netdev_priv( ndev );
+
+    netif_stop_queue( ndev );
+    napi_disable( &net->napi );
+    cancel_delayed_work_sync( &net->rx_retry );    // a disabled NAPI ignores it meanwhile
+
+    // No callback runs after these, so the rings are ours.
+    dmaengine_terminate_sync( net->rx.chan );
+    dmaengine_terminate_sync( net->tx.chan );
+    udma_net_free_rings( net );
+    netdev_reset_queue( ndev );
+
+    udma_release_chan( &net->rx );
+    udma_release_chan( &net->tx );
+    return 0;
+}
+
+/* The udma device is going away while the interface is up: closing it
+ * releases the channels, which the device's teardown waits for.
+ */
+static void udma_net_revoke( struct work_struct *work )
+{
+    struct udma_net * const net = container_of( work, struct udma_net, revoke );
+
+    rtnl_lock();
+    dev_close( net->ndev );
+    rtnl_unlock();
+}
+
+static void udma_net_revoke_tx( struct udma_kchan * kc )
+{
+    schedule_work( &container_of( kc, struct udma_net, tx )->revoke );
+}
+
+static void udma_net_revoke_rx( struct udma_kchan * kc )
+{
+    schedule_work( &container_of( kc, struct udma_net, rx )->revoke );
+}
+
+// The RX buffers are sized at open.
+static int udma_net_change_mtu( struct net_device *ndev, int new_mtu )
+{
+    if ( netif_running( ndev ) )
+        return -EBUSY;
+    if ( new_mtu < ETH_MIN_MTU || new_mtu > UDMA_NET_MAX_MTU )
+        return -EINVAL;
+
+    ndev->mtu = new_mtu;
+    return 0;
+}
+
+static const struct net_device_ops udma_net_ops = {
+    .ndo_open           = udma_net_open,
+    .ndo_stop           = udma_net_stop,
+    .ndo_start_xmit     = udma_net_start_xmit,
+    .ndo_change_mtu     = udma_net_change_mtu,
+    .ndo_set_mac_address = eth_mac_addr,
+    .ndo_validate_addr  = eth_validate_addr,
+};
+
+static int __init udma_net_init( void )
+{
+    struct net_device * ndev;
+    struct udma_net * net;
+    unsigned int i;
+    int rv;
+
+    if ( !is_power_of_2( rx_ring ) || rx_ring < 16 || rx_ring > 4096 ||
+         !is_power_of_2( tx_ring ) || tx_ring < 16 || tx_ring > 4096 )
+        return -EINVAL;
+
+    ndev = alloc_netdev( sizeof(*net), "udma%d", NET_NAME_UNKNOWN, ether_setup );
+    if ( !ndev )
+        return -ENOMEM;
+
+    net = netdev_priv( ndev );
+    net->ndev = ndev;
+    net->rx_slots = kcalloc( rx_ring, sizeof(*net->rx_slots), GFP_KERNEL );
+    net->tx_slots = kcalloc( tx_ring, sizeof(*net->tx_slots), GFP_KERNEL );
+    if ( !net->rx_slots || !net->tx_slots )
+    {
+        rv = -ENOMEM;
+        goto err_free;
+    }
+    for ( i = 0; i < rx_ring; ++i )
+        net->rx_slots[i].net = net;
+    for ( i = 0; i < tx_ring; ++i )
+        net->tx_slots[i].net = net;
+    INIT_DELAYED_WORK( &net->rx_retry, udma_net_rx_retry );
+    INIT_WORK( &net->revoke, udma_net_revoke );
+    net->tx.revoke = udma_net_revoke_tx;
+    net->rx.revoke = udma_net_revoke_rx;
+
+    ndev->netdev_ops = &udma_net_ops;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+    ndev->min_mtu = ETH_MIN_MTU;
+    ndev->max_mtu = UDMA_NET_MAX_MTU;
+#endif
+    eth_hw_addr_random( ndev );
+
+    netif_napi_add( ndev, &net->napi, udma_net_poll, NAPI_POLL_WEIGHT );
+
+    if ( (rv = register_netdev( ndev )) )
+        goto err_napi;
+
+    netdev_info( ndev, "on %s, TX channel %d, RX channel %d\n", device, tx, rx );
+    udma_net_dev = ndev;
+    return 0;
+
+    err_napi:
+    netif_napi_del( &net->napi );
+
+    err_free:
+    kfree( net->rx_slots );
+    kfree( net->tx_slots );
+    free_netdev( ndev );
+    return rv;
+}
+
+static void __exit udma_net_exit( void )
+{
+    struct udma_net * const net = netdev_priv( udma_net_dev );
+
+    unregister_netdev( udma_net_dev );
+    cancel_work_sync( &net->revoke );
+    netif_napi_del( &net->napi );
+    kfree( net->rx_slots );
+    kfree( net->tx_slots );
+    free_netdev( udma_net_dev );
+}
+
+module_init(udma_net_init);
+module_exit(udma_net_exit);
+
+MODULE_DESCRIPTION("network interface over udma channels");
+MODULE_LICENSE("GPL v2");
@@ -428,6 +428,7 @@ static irqreturn_t uio_interrupt(int irq, void *dev_id)
 struct uio_listener {
 	struct uio_device *dev;
 	s32 event_count;
+	struct udma_file *udma;	/* NULL unless this is a udma device */
 };
 
 static int uio_open(struct inode *inode, struct file *filep)
@@ -457,8 +458,17 @@ static int uio_open(struct inode *inode, struct file *filep)
 
 	listener->dev = idev;
 	listener->event_count = atomic_read(&idev->event);
+	listener->udma = NULL;
 	filep->private_data = listener;
 
+	if (is_udma(idev->dev->parent)) {
+		listener->udma = udma_open(idev->dev->parent);
+		if (IS_ERR(listener->udma)) {
+			ret = PTR_ERR(listener->udma);
+			goto err_udma_open;
+		}
+	}
+
 	if (idev->info->open) {
 		ret = idev->info->open(idev->info, inode);
 		if (ret)
@@ -467,6 +477,10 @@ static int uio_open(struct inode *inode, struct file *filep)
 	return 0;
 
 err_infoopen:
+	if (listener->udma)
+		udma_release(listener->udma);
+
+err_udma_open:
 	kfree(listener);
 
 err_alloc_listener:
@@ -493,6 +507,9 @@ static int uio_release(struct inode *inode, struct file *filep)
 	if (idev->info->release)
 		ret = idev->info->release(idev->info, inode);
 
+	if (listener->udma)
+		udma_release(listener->udma);
+
 	module_put(idev->owner);
 	kfree(listener);
 	return ret;
@@ -521,8 +538,8 @@ static ssize_t uio_read(struct file *filep, char __user *buf,
 	ssize_t retval;
 	s32 event_count;
 
-	if (is_udma()) // for uio dma transaction.
-		return udma_read( filep , buf, count, ppos);
+	if (listener->udma) // for uio dma transaction.
+		return udma_read(listener->udma, buf, count, ppos);
 
 	if (!idev->info->irq)
 		return -EIO;
@@ -573,8 +590,8 @@ static ssize_t uio_write(struct file *filep, const char __user *buf,
 	ssize_t retval;
 	s32 irq_on;
 
-	if (is_udma())  // for uio dma transaction
-		return udma_write( filep , buf, count, ppos);
+	if (listener->udma)  // for uio dma transaction
+		return udma_write(listener->udma, buf, count, ppos, filep->f_flags);
 
 	if (!idev->info->irq)
 		return -EIO;   
@@ -595,6 +612,48 @@ static ssize_t uio_write(struct file *filep, const char __user *buf,
 
 }
 
+static int uio_fsync(struct file *filep, loff_t start, loff_t end, int datasync)
+{
+	struct uio_listener *listener = filep->private_data;
+
+	if (!listener->udma)
+		return -EINVAL;
+
+	return udma_fsync(listener->udma);
+}
+
+static ssize_t uio_splice_read(struct file *filep, loff_t *ppos,
+			struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct uio_listener *listener = filep->private_data;
+
+	if (!listener->udma)
+		return -EINVAL;
+
+	return udma_splice_read(listener->udma, ppos, pipe, len, flags);
+}
+
+static ssize_t uio_splice_write(struct pipe_inode_info *pipe, struct file *filep,
+			loff_t *ppos, size_t len, unsigned int flags)
+{
+	struct uio_listener *listener = filep->private_data;
+
+	if (!listener->udma)
+		return -EINVAL;
+
+	return udma_splice_write(listener->udma, pipe, ppos, len, flags);
+}
+
+static long uio_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+	struct uio_listener *listener = filep->private_data;
+
+	if (listener->udma)
+		return udma_ioctl(listener->udma, cmd, arg);
+
+	return -ENOTTY;
+}
+
 static int uio_find_mem_index(struct vm_area_struct *vma)
 {
 	struct uio_device *idev = vma->vm_private_data;
@@ -695,6 +754,9 @@ static int uio_mmap(struct file *filep, struct vm_area_struct *vma)
 	if (vma->vm_end < vma->vm_start)
 		return -EINVAL;
 
+	if (listener->udma && vma->vm_pgoff >= MAX_UIO_MAPS)
+		return udma_mmap(listener->udma, vma);
+
 	vma->vm_private_data = idev;
 
 	mi = uio_find_mem_index(vma);
@@ -729,6 +791,11 @@ static const struct file_operations uio_fops = {
 	.release	= uio_release,
 	.read		= uio_read,
 	.write		= uio_write,
+	.fsync		= uio_fsync,
+	.splice_read	= uio_splice_read,
+	.splice_write	= uio_splice_write,
+	.unlocked_ioctl	= uio_ioctl,
+	.compat_ioctl	= uio_ioctl,
 	.mmap		= uio_mmap,
 	.poll		= uio_poll,
 	.fasync		= uio_fasync,
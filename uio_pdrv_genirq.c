@@ -110,6 +110,7 @@ static int uio_pdrv_genirq_probe(struct platform_device *pdev)
 	struct uio_pdrv_genirq_platdata *priv;
 	struct uio_mem *uiomem;
 	int ret = -EINVAL;
+	int dma_num;
 	int i;
 
 	if (pdev->dev.of_node) {
@@ -200,6 +201,19 @@ static int uio_pdrv_genirq_probe(struct platform_device *pdev)
 	uioinfo->release = uio_pdrv_genirq_release;
 	uioinfo->priv = priv;
 
+	/* The DMA channels come first, so that a DMA controller that probes
+	 * after us only defers this probe instead of leaving a uio device
+	 * without them behind.
+	 */
+	dma_num = check_udma(pdev);
+	if (dma_num == -EPROBE_DEFER)
+		return dma_num;
+	else if (dma_num < 0)
+		dev_err(&pdev->dev, "udma init failed (%d), continuing without DMA\n",
+			dma_num);
+	else if (dma_num > 0)
+		dev_info(&pdev->dev, "%d dma channel(s) available\n", dma_num);
+
 	/* Enable Runtime PM for this device:
 	 * The device starts in suspended state to allow the hardware to be
 	 * turned off by default. The Runtime PM bus code should power on the
@@ -211,21 +225,9 @@ static int uio_pdrv_genirq_probe(struct platform_device *pdev)
 	if (ret) {
 		dev_err(&pdev->dev, "unable to register uio device\n");
 		pm_runtime_disable(&pdev->dev);
+		teardown_udma(pdev);
 		return ret;
 	}
- 
-    int dma_num = check_udma(pdev);
-
-	if (dma_num>0){
-        printk( KERN_ALERT KBUILD_MODNAME ": %d dma channel(s) is(are) available\n",  dma_num );
-	}
-	else if (dma_num < 0) {
-        printk( KERN_ERR KBUILD_MODNAME ":have udma informations ,but fail to init!\n");
-	}
-    else  {  
-    	printk( KERN_ALERT KBUILD_MODNAME ": no udma need to be init.\n" );
-
-	}
 
 	platform_set_drvdata(pdev, priv);
 
@@ -286,6 +288,7 @@ static struct platform_driver uio_pdrv_genirq = {
 	.driver = {
 		.name = DRIVER_NAME,
 		.pm = &uio_pdrv_genirq_dev_pm_ops,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 		.of_match_table = of_match_ptr(uio_of_genirq_match),
 	},
 };